@@ -1,21 +1,68 @@
 /**
 * @file       log.c
 * @brief      打印输出
-* @details    将结果打印输出到文件或者标准设备
+* @details    将结果打印输出到文件或者标准设备；服务器的日志可以异步写：处理线程只把一行格式化到环形缓冲区，
+*             由写日志的线程合并写到文件中，处理线程不用排队等磁盘
 * @author     项斌
 * @date       2018/08/05
 * @version    1.0
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <sched.h>
 #include "log.h"
 
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/** 每个线程缓存的日志时间：同一秒内不再调用localtime_r、strftime */
+typedef struct log_clock
+{
+	long long offset;                   ///< 墙上时间减去单调时钟（纳秒），每秒重新对一次
+	time_t sec;                         ///< 缓存的是哪一秒，0表示还没有
+	int len;                            ///< 缓存的年月日时分秒的长度
+	char text[20];                      ///< 缓存的"YYYY-MM-DD HH:MM:SS"
+}log_clock_t;
+
+static __thread log_clock_t logclock;  ///< 本线程的日志时间
+static int logprec;                    ///< 日志时间秒后面的位数：0，3，6
+
+/** 异步日志环形缓冲区的一项 */
+typedef struct log_entry
+{
+	unsigned long seq;                  ///< 序号：等于入队位置表示空闲，等于入队位置+1表示已经写好了
+	int len;                            ///< 这一行的长度
+	char *big;                          ///< 超过LOG_LINE的一行（malloc），否则为NULL
+	char line[LOG_LINE];                ///< 格式化好的一行
+}log_entry_t;
+
+/** 异步日志 */
+static struct
+{
+	FILE *fp;                           ///< 日志文件（只由写日志的线程写）
+	log_entry_t *ring;                  ///< 环形缓冲区
+	unsigned long mask;                 ///< 项数-1
+	int policy;                         ///< 缓冲区满了的时候：LOG_DROP，LOG_BLOCK
+	unsigned long head;                 ///< 下一个入队的位置（生产者CAS）
+	unsigned long tail;                 ///< 下一个出队的位置（只有写日志的线程用）
+	int running;                        ///< 1表示异步写日志
+	int inflight;                       ///< 正在放进缓冲区的生产者数量
+	int stopping;                       ///< 1表示写完缓冲区中的日志以后退出
+	int sleeping;                       ///< 1表示写日志的线程在等待新的日志
+	int blocked;                        ///< LOG_BLOCK：等待空位的生产者数量
+	unsigned long dropped;              ///< LOG_DROP：丢弃的行数
+	pthread_t tid;                      ///< 写日志的线程
+	pthread_mutex_t lock;               ///< 和下面两个条件变量一起用，只在等待、唤醒的时候用
+	pthread_cond_t more;                ///< 有新的日志
+	pthread_cond_t space;               ///< 缓冲区有空位了
+	char batch[LOG_BATCH];              ///< 合并写的缓存
+}alog = {.lock = PTHREAD_MUTEX_INITIALIZER, .more = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER};
+
 /**
  * @brief 输出结果到标准设备
  * @param _Format 类似printf的格式字符串
@@ -40,6 +87,350 @@ FILE* open_log(const char *filename)
 	return fp;
 }
 
+/**
+ * @brief 设置日志时间的精度
+ * @param digits 秒后面的位数：0（默认），3（毫秒），6（微秒）；其它的值按0处理
+ */
+void log_set_precision(int digits)
+{
+	logprec = (digits == 3 || digits == 6) ? digits : 0;
+}
+
+/**
+ * @brief 格式化当前时间（线程安全）：年月日时分秒每个线程每秒只转换一次时区，
+ *        同一秒内只追加毫秒、微秒；秒内的时间由单调时钟推算，每秒和墙上时间对一次
+ * @param out 传出参数，至少LOG_TIME_LEN字节
+ * @return 时间的长度
+ */
+int log_time(char *out)
+{
+	log_clock_t *lc = &logclock;
+	struct timespec mono, real;
+	struct tm ltime;
+	long long ns;
+	time_t sec;
+	long frac;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	ns = (long long)mono.tv_sec * 1000000000LL + mono.tv_nsec + lc->offset;
+	sec = (time_t)(ns / 1000000000LL);
+	if(lc->sec == 0 || sec != lc->sec)
+	{
+		/* 进入新的一秒（或者第一次）：和墙上时间重新对一次，再转换时区 */
+		clock_gettime(CLOCK_REALTIME, &real);
+		lc->offset = ((long long)real.tv_sec * 1000000000LL + real.tv_nsec) -
+				((long long)mono.tv_sec * 1000000000LL + mono.tv_nsec);
+		ns = (long long)real.tv_sec * 1000000000LL + real.tv_nsec;
+		sec = real.tv_sec;
+		/* 推算的和墙上时间差一点，还是缓存的那一秒：不用再转换 */
+		if(sec != lc->sec)
+		{
+			localtime_r(&sec, &ltime);
+			lc->len = (int)strftime(lc->text, sizeof(lc->text), "%Y-%m-%d %H:%M:%S", &ltime);
+			lc->sec = sec;
+		}
+	}
+
+	memcpy(out, lc->text, lc->len);
+	n = lc->len;
+	if(logprec > 0)
+	{
+		/* 毫秒、微秒：逐位写，不用snprintf */
+		frac = (long)(ns % 1000000000LL) / (logprec == 3 ? 1000000L : 1000L);
+		out[n++] = '.';
+		for(i = logprec - 1; i >= 0; i--)
+		{
+			out[n + i] = (char)('0' + frac % 10);
+			frac /= 10;
+		}
+		n += logprec;
+	}
+	out[n] = '\0';
+
+	return n;
+}
+
+/**
+ * @brief 等待一段时间（条件变量，调用者持有alog.lock）
+ * @param cond 条件变量
+ * @param ms 最多等待的毫秒数
+ */
+static void log_wait(pthread_cond_t *cond, int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += (long)ms * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	pthread_cond_timedwait(cond, &alog.lock, &ts);
+}
+
+/**
+ * @brief 在环形缓冲区中占一项（Vyukov的有界队列：CAS入队位置，不加锁）
+ * @param ppos 传出参数，这一项的入队位置
+ * @return 成功，返回这一项；缓冲区满了并且是LOG_DROP，返回NULL
+ */
+static log_entry_t *log_claim(unsigned long *ppos)
+{
+	log_entry_t *e;
+	unsigned long pos, seq;
+
+	for(;;)
+	{
+		pos = __atomic_load_n(&alog.head, __ATOMIC_RELAXED);
+		e = &alog.ring[pos & alog.mask];
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&alog.head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*ppos = pos;
+				return e;
+			}
+		}
+		else if((long)(seq - pos) < 0)
+		{
+			/* 缓冲区满了：这一项还没有被写日志的线程取走 */
+			if(alog.policy == LOG_DROP)
+			{
+				__atomic_add_fetch(&alog.dropped, 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			pthread_mutex_lock(&alog.lock);
+			alog.blocked++;
+			log_wait(&alog.space, 10);
+			alog.blocked--;
+			pthread_mutex_unlock(&alog.lock);
+		}
+		/* 其它情况是别的生产者刚占了这个位置，重新读入队位置 */
+	}
+}
+
+/**
+ * @brief 异步写一行日志：格式化到环形缓冲区的一项中，需要的时候唤醒写日志的线程
+ * @param nowtime 时间
+ * @param fmt 格式字符串
+ * @param args 参数
+ * @return 成功返回0，失败（丢弃了）返回-1
+ */
+static int log_push(const char *nowtime, const char *fmt, va_list args)
+{
+	unsigned long pos;
+	log_entry_t *e = log_claim(&pos);
+	va_list again;
+	int n, m;
+
+	if(e == NULL) return -1;
+
+	n = snprintf(e->line, LOG_LINE, "%s: ", nowtime);
+	va_copy(again, args);
+	m = vsnprintf(e->line + n, LOG_LINE - n, fmt, args);
+	if(m < 0) m = 0;
+	e->len = n + m;
+	e->big = NULL;
+	if(e->len >= LOG_LINE)
+	{
+		/* 很长的一行（比如数据包的内容）：另外分配，没有内存的话截断 */
+		e->big = (char *)malloc(e->len + 1);
+		if(e->big)
+		{
+			memcpy(e->big, e->line, n);
+			vsnprintf(e->big + n, m + 1, fmt, again);
+		}
+		else e->len = LOG_LINE - 1;
+	}
+	va_end(again);
+
+	/* 写好了，交给写日志的线程 */
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&alog.sleeping, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&alog.lock);
+		pthread_cond_signal(&alog.more);
+		pthread_mutex_unlock(&alog.lock);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 把合并的日志写到文件中：一次fwrite、一次fflush，只有一次write系统调用
+ * @param len 合并的长度
+ */
+static void log_flush_batch(size_t len)
+{
+	if(len == 0) return;
+	fwrite(alog.batch, 1, len, alog.fp);
+	fflush(alog.fp);
+}
+
+/**
+ * @brief 取出环形缓冲区中所有写好的日志，合并写到文件中
+ * @return 取出的行数
+ */
+static int log_drain(void)
+{
+	log_entry_t *e;
+	size_t len = 0;
+	unsigned long dropped;
+	int n = 0;
+	char nowtime[LOG_TIME_LEN];
+
+	for(;;)
+	{
+		e = &alog.ring[alog.tail & alog.mask];
+		if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != alog.tail + 1) break;
+
+		if(e->big)
+		{
+			/* 很长的一行直接写，不经过合并的缓存 */
+			log_flush_batch(len);
+			len = 0;
+			fwrite(e->big, 1, e->len, alog.fp);
+			free(e->big);
+			e->big = NULL;
+		}
+		else
+		{
+			if(len + e->len > LOG_BATCH)
+			{
+				log_flush_batch(len);
+				len = 0;
+			}
+			memcpy(alog.batch + len, e->line, e->len);
+			len += e->len;
+		}
+
+		/* 这一项空出来了，给下一轮（入队位置+项数）用 */
+		__atomic_store_n(&e->seq, alog.tail + alog.mask + 1, __ATOMIC_RELEASE);
+		alog.tail++;
+		n++;
+	}
+	log_flush_batch(len);
+
+	if(n > 0 && __atomic_load_n(&alog.blocked, __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&alog.lock);
+		pthread_cond_broadcast(&alog.space);
+		pthread_mutex_unlock(&alog.lock);
+	}
+
+	/* 丢弃的日志也记一笔 */
+	dropped = __atomic_exchange_n(&alog.dropped, 0, __ATOMIC_RELAXED);
+	if(dropped > 0)
+	{
+		log_time(nowtime);
+		fprintf(alog.fp, "%s: %lu log lines are dropped: the log ring is full\n", nowtime, dropped);
+		fflush(alog.fp);
+	}
+
+	return n;
+}
+
+/**
+ * @brief 写日志的线程：缓冲区空了就等待，停止的时候写完所有的日志再退出
+ * @param arg 没有用
+ * @return NULL值
+ */
+static void *log_writer(void *arg)
+{
+	(void)arg;
+
+	for(;;)
+	{
+		if(log_drain() > 0) continue;
+		if(__atomic_load_n(&alog.stopping, __ATOMIC_ACQUIRE))
+		{
+			log_drain();
+			break;
+		}
+
+		pthread_mutex_lock(&alog.lock);
+		__atomic_store_n(&alog.sleeping, 1, __ATOMIC_SEQ_CST);
+		/* 先声明在等待再检查一次，和log_push的检查配对，不会错过唤醒；超时只是保险 */
+		if(__atomic_load_n(&alog.ring[alog.tail & alog.mask].seq, __ATOMIC_SEQ_CST) != alog.tail + 1 &&
+				!__atomic_load_n(&alog.stopping, __ATOMIC_ACQUIRE))
+			log_wait(&alog.more, 100);
+		__atomic_store_n(&alog.sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&alog.lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief 启动异步日志：之后写到fp的日志先格式化到无锁的环形缓冲区（多个生产者、一个消费者），
+ *        由一个写日志的线程合并成大块写到文件中；写到其它文件句柄的日志不受影响
+ * @param fp 日志文件的句柄（之后只由写日志的线程写）
+ * @param entries 环形缓冲区的项数（向上取2的幂次）
+ * @param policy 缓冲区满了的时候：LOG_DROP，LOG_BLOCK
+ * @return 成功，返回0；失败（还是同步写日志），返回-1
+ */
+int log_async_start(FILE *fp, int entries, int policy)
+{
+	unsigned long n = 2, i;
+
+	if(fp == NULL || entries <= 0 || alog.running) return -1;
+
+	while(n < (unsigned long)entries) n <<= 1;
+	alog.ring = (log_entry_t *)malloc(sizeof(log_entry_t) * n);
+	if(alog.ring == NULL) return -1;
+	for(i = 0; i < n; i++)
+	{
+		alog.ring[i].seq = i;
+		alog.ring[i].big = NULL;
+	}
+	alog.fp = fp;
+	alog.mask = n - 1;
+	alog.policy = policy;
+	alog.head = alog.tail = 0;
+	alog.stopping = 0;
+
+	if(pthread_create(&alog.tid, NULL, log_writer, NULL) != 0)
+	{
+		free(alog.ring);
+		alog.ring = NULL;
+		return -1;
+	}
+	__atomic_store_n(&alog.running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief 停止异步日志：等正在写的日志放进缓冲区，写日志的线程把缓冲区中所有的日志写到文件以后退出；
+ *        之后的日志同步写。可以用atexit注册，exit的时候不丢日志
+ */
+void log_async_stop(void)
+{
+	if(!__atomic_exchange_n(&alog.running, 0, __ATOMIC_SEQ_CST)) return;
+
+	/* 新的日志改成同步写；已经开始放进缓冲区的，等它们放完 */
+	while(__atomic_load_n(&alog.inflight, __ATOMIC_SEQ_CST) > 0) sched_yield();
+
+	pthread_mutex_lock(&alog.lock);
+	__atomic_store_n(&alog.stopping, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&alog.more);
+	pthread_mutex_unlock(&alog.lock);
+	pthread_join(alog.tid, NULL);
+
+	free(alog.ring);
+	alog.ring = NULL;
+	fflush(alog.fp);
+}
+
+/**
+ * @brief 异步日志因为缓冲区满了丢弃的行数
+ * @return 丢弃的行数
+ */
+unsigned long log_dropped(void)
+{
+	return __atomic_load_n(&alog.dropped, __ATOMIC_RELAXED);
+}
+
 /**
  * @brief 输出结果到文件句柄
  * @param fp 文件的句柄
@@ -51,13 +442,25 @@ int write_log(FILE *fp,const char *fmt,...)
 	if(NULL==fp) return -1;
 	int ret;
 
-	/* 获取当前的时间并且转化为字符串 */
-	char nowtime[20]={0};
-	time_t rawtime;
-	struct tm* ltime;
-	time(&rawtime);
-	ltime = localtime(&rawtime);
-	strftime(nowtime, 20, "%Y-%m-%d %H:%M:%S", ltime);
+	/* 获取当前的时间并且转化为字符串（每个线程每秒只转换一次） */
+	char nowtime[LOG_TIME_LEN];
+	log_time(nowtime);
+
+	/* 异步日志：放进环形缓冲区就返回，不等待磁盘 */
+	if(fp == alog.fp)
+	{
+		__atomic_add_fetch(&alog.inflight, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&alog.running, __ATOMIC_SEQ_CST))
+		{
+			va_list args;
+			va_start(args,fmt);
+			ret = log_push(nowtime, fmt, args);
+			va_end(args);
+			__atomic_sub_fetch(&alog.inflight, 1, __ATOMIC_RELEASE);
+			return ret;
+		}
+		__atomic_sub_fetch(&alog.inflight, 1, __ATOMIC_RELEASE);
+	}
 
 	pthread_mutex_lock(&mutex);
 	do
@@ -94,13 +497,9 @@ int write_log1(FILE *fp,const char *s,...)
 	if(NULL==fp) return -1;
 	int ret;
 
-	/* 获取当前的时间并且转化为字符串 */
-	char nowtime[20]={0};
-	time_t rawtime;
-	struct tm* ltime;
-	time(&rawtime);
-	ltime = localtime(&rawtime);
-	strftime(nowtime, 20, "%Y-%m-%d %H:%M:%S", ltime);
+	/* 获取当前的时间并且转化为字符串（每个线程每秒只转换一次） */
+	char nowtime[LOG_TIME_LEN];
+	log_time(nowtime);
 
 	do
 	{
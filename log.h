@@ -1,7 +1,8 @@
 /**
 * @file       log.h
 * @brief      打印输出
-* @details    将结果打印输出到文件或者标准设备
+* @details    将结果打印输出到文件或者标准设备；服务器的日志可以异步写：处理线程只把一行格式化到环形缓冲区，
+*             由写日志的线程合并写到文件中，处理线程不用排队等磁盘
 * @author     项斌
 * @date       2018/08/05
 * @version    1.0
@@ -9,6 +10,23 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <stdio.h>
+
+/** 异步日志的环形缓冲区满了：丢弃这一行并计数（不阻塞处理线程） */
+#define LOG_DROP 0
+
+/** 异步日志的环形缓冲区满了：等待写日志的线程腾出位置 */
+#define LOG_BLOCK 1
+
+/** 环形缓冲区每一项内嵌的长度（字节），更长的一行另外分配内存 */
+#define LOG_LINE 256
+
+/** 写日志的线程每次最多合并这么多字节写到文件中 */
+#define LOG_BATCH (64 * 1024)
+
+/** 日志时间的长度上限（含'\0'）："YYYY-MM-DD HH:MM:SS.uuuuuu" */
+#define LOG_TIME_LEN 27
+
 /**
  * @brief 输出结果到标准设备
  * @param _Format 类似printf的格式字符串
@@ -37,6 +55,42 @@ int write_log(FILE *fp,const char *fmt,...);
 int write_log1(FILE *fp,const char *s,...);
 
 
+/**
+ * @brief 设置日志时间的精度
+ * @param digits 秒后面的位数：0（默认），3（毫秒），6（微秒）；其它的值按0处理
+ */
+void log_set_precision(int digits);
+
+/**
+ * @brief 格式化当前时间（线程安全）：年月日时分秒每个线程每秒只转换一次时区，
+ *        同一秒内只追加毫秒、微秒；秒内的时间由单调时钟推算，每秒和墙上时间对一次
+ * @param out 传出参数，至少LOG_TIME_LEN字节
+ * @return 时间的长度
+ */
+int log_time(char *out);
+
+/**
+ * @brief 启动异步日志：之后写到fp的日志先格式化到无锁的环形缓冲区（多个生产者、一个消费者），
+ *        由一个写日志的线程合并成大块写到文件中；写到其它文件句柄的日志不受影响
+ * @param fp 日志文件的句柄（之后只由写日志的线程写）
+ * @param entries 环形缓冲区的项数（向上取2的幂次）
+ * @param policy 缓冲区满了的时候：LOG_DROP，LOG_BLOCK
+ * @return 成功，返回0；失败（还是同步写日志），返回-1
+ */
+int log_async_start(FILE *fp, int entries, int policy);
+
+/**
+ * @brief 停止异步日志：等正在写的日志放进缓冲区，写日志的线程把缓冲区中所有的日志写到文件以后退出；
+ *        之后的日志同步写。可以用atexit注册，exit的时候不丢日志
+ */
+void log_async_stop(void);
+
+/**
+ * @brief 异步日志因为缓冲区满了丢弃的行数
+ * @return 丢弃的行数
+ */
+unsigned long log_dropped(void);
+
 /**
  * @brief 关闭文件句柄
  * @param fp 文件的句柄
@@ -0,0 +1,707 @@
+/**
+* @file       tmis_bench.c
+* @brief      tmis服务器的压力测试客户端
+* @details    多个线程，每个线程用poll管理自己的多个连接，按照真正的协议发送请求：
+*             密钥协商（flag==1，和服务器一样用a.param、PBC、AES计算）和获取医疗记录（flag==2），
+*             两种请求的比例可以设置，医疗记录也可以用流式请求（flag==4）获取。
+*             闭环：每个连接连续发送depth个请求，收到全部回复、思考一段时间以后再发送下一批；
+*             开环：按照设定的速率定时发送，不等回复，延迟从计划发送的时间开始算。
+*             统计每秒完成的密钥协商数、请求数和两种请求的延迟分布；
+*             闭环时可以每一批请求重新连接一次（可选TCP Fast Open），用来比较连接相关的TCP选项
+* @author     项斌
+* @date       2018/08/23
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "tmis_proto.h"
+#include "tmis_io.h"
+#include "tmis_client.h"
+#include "tmis_keys.h"
+
+/** 每个连接最多同时等待回复的请求数（开环时超过的请求算作丢弃） */
+#define BENCH_QMAX 1024
+
+/** 回复的最大长度，超过的认为协议出错 */
+#define BENCH_MAX_REPLY (16 * 1024 * 1024)
+
+/** 一个请求这么长时间（微秒）没有回复，认为服务器丢弃了它（例如密钥协商验证失败不回复），重新连接 */
+#define BENCH_REPLY_TIMEOUT 5000000ULL
+
+/** 连接失败以后过这么长时间（微秒）再试 */
+#define BENCH_RETRY 100000ULL
+
+/** 压力测试的参数 */
+typedef struct bench_conf
+{
+	const char *host;                  ///< 服务器地址
+	const char *port;                  ///< 服务器端口
+	int threads;                       ///< 线程数
+	int conns;                         ///< 每个线程的连接数
+	int depth;                         ///< 闭环时每个连接一次连续发送的请求数
+	int seconds;                       ///< 测试时长（秒）
+	const char *uid;                   ///< 请求的用户id
+	int reconnect;                     ///< 1表示每一批请求都重新连接（延迟包括建立连接）
+	int fastopen;                      ///< 1表示重新连接的时候用TCP Fast Open，请求放在SYN中
+	int keyed;                         ///< 1表示每个连接建立以后先做一次密钥协商
+	int mix;                           ///< 请求中密钥协商的百分比
+	int think;                         ///< 闭环时每一批请求之间的思考时间（毫秒）
+	int rate;                          ///< 大于0表示开环，所有连接合计每秒发送的请求数
+	int verify;                        ///< 1表示解密医疗记录的回复，检查会话密钥是否正确
+	int stream;                        ///< 1表示用流式请求获取医疗记录（回复若干块，最后一个结束的数据包）
+	const char *param;                 ///< 配对参数文件
+}bench_conf_t;
+
+/** 延迟直方图：1毫秒以内精确到1微秒，100毫秒以内精确到100微秒，更大的放在最后一个桶 */
+#define HIST_FINE   1000
+#define HIST_STEP   100
+#define HIST_MAX    100000
+#define HIST_BUCKETS (HIST_FINE + (HIST_MAX - HIST_FINE) / HIST_STEP + 1)
+
+/** 一种请求的延迟统计 */
+typedef struct bench_hist
+{
+	unsigned long long cnt;            ///< 完成的请求数
+	unsigned long long sum;            ///< 延迟的总和（微秒）
+	unsigned long long max;            ///< 最大的延迟（微秒）
+	unsigned long long bucket[HIST_BUCKETS];   ///< 延迟直方图
+}bench_hist_t;
+
+/** 每个线程的统计 */
+typedef struct bench_stat
+{
+	pthread_t tid;                     ///< 线程
+	unsigned long long errs;           ///< 出错的连接数
+	unsigned long long ka_fail;        ///< 失败的密钥协商数（没有回复或者回复不正确）
+	unsigned long long bad;            ///< 解密结果不正确的医疗记录回复数
+	unsigned long long drops;          ///< 开环时因为等待回复的请求太多而没有发送的请求数
+	bench_hist_t rec;                  ///< 获取医疗记录的延迟
+	bench_hist_t ka;                   ///< 密钥协商的延迟
+}bench_stat_t;
+
+/** 一个等待回复的请求 */
+typedef struct bench_req
+{
+	unsigned long long t;              ///< 开始的时间（开环时是计划发送的时间）
+	char flag;                         ///< 请求的类型
+}bench_req_t;
+
+/** 一个连接 */
+typedef struct bench_conn
+{
+	int fd;                            ///< 套接字，-1表示没有连接
+	char *in;                          ///< 接收缓存
+	size_t inlen;                      ///< 接收缓存中数据的长度
+	size_t incap;                      ///< 接收缓存的大小
+	bench_req_t q[BENCH_QMAX];         ///< 等待回复的请求（按发送的顺序）
+	int qhead;                         ///< 最早的请求的位置
+	int qcnt;                          ///< 等待回复的请求数
+	unsigned long long next;           ///< 下一次发送的时间：开环是计划的时间，闭环是思考结束的时间
+	int ka_pending;                    ///< 有正在进行的密钥协商（同一时刻一个连接只有一个）
+	tmis_client_ka_t ka;               ///< 正在进行的密钥协商的状态
+	char skey[CLIENT_SKEY_LEN + 4];    ///< 会话密钥，没有协商的时候全0（和服务器一样）
+}bench_conn_t;
+
+static bench_conf_t bconf = {"127.0.0.1", "8888", 4, 4, 1, 10, "123", 0, 0, 0, 0, 0, 0, 0, 0, TMIS_PARAM_FILE};
+static volatile int stop;               ///< 测试结束
+static struct addrinfo *baddr;          ///< 服务器地址，启动时解析一次
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 当前时间（微秒）
+ * @return 当前时间
+ */
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 记录一个请求的延迟
+ * @param h 延迟统计
+ * @param us 延迟（微秒）
+ */
+static void hist_add(bench_hist_t *h, unsigned long long us)
+{
+	size_t idx;
+
+	if(us < HIST_FINE) idx = us;
+	else if(us < HIST_MAX) idx = HIST_FINE + (us - HIST_FINE) / HIST_STEP;
+	else idx = HIST_BUCKETS - 1;
+
+	h->bucket[idx]++;
+	h->cnt++;
+	h->sum += us;
+	if(us > h->max) h->max = us;
+}
+
+/**
+ * @brief 合并一个线程的延迟统计
+ * @param to 合并到这里
+ * @param from 线程的统计
+ */
+static void hist_merge(bench_hist_t *to, const bench_hist_t *from)
+{
+	size_t i;
+
+	to->cnt += from->cnt;
+	to->sum += from->sum;
+	if(from->max > to->max) to->max = from->max;
+	for(i=0;i<HIST_BUCKETS;i++) to->bucket[i] += from->bucket[i];
+}
+
+/**
+ * @brief 直方图中的百分位数
+ * @param h 延迟统计
+ * @param pct 百分位（例如99.9）
+ * @return 延迟（微秒，桶的上界）
+ */
+static unsigned long long hist_percentile(const bench_hist_t *h, double pct)
+{
+	unsigned long long want = (unsigned long long)(h->cnt * pct / 100.0), cnt = 0;
+	size_t i;
+
+	for(i=0;i<HIST_BUCKETS;i++)
+	{
+		cnt += h->bucket[i];
+		if(cnt > want) break;
+	}
+	if(i < HIST_FINE) return i;
+	if(i < HIST_BUCKETS - 1) return HIST_FINE + (i - HIST_FINE + 1) * HIST_STEP;
+	return HIST_MAX;
+}
+
+/**
+ * @brief 打印一种请求的延迟分布
+ * @param name 名字
+ * @param h 延迟统计
+ */
+static void hist_print(const char *name, const bench_hist_t *h)
+{
+	if(h->cnt == 0) return;
+
+	printf("%s(us): avg %llu  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n", name,
+			h->sum / h->cnt, hist_percentile(h, 50), hist_percentile(h, 90),
+			hist_percentile(h, 99), hist_percentile(h, 99.9), h->max);
+}
+
+/**
+ * @brief 连接服务器
+ * @param req 用TCP Fast Open的时候随SYN发送的请求，否则为NULL
+ * @param len 请求的长度
+ * @return 成功，返回套接字；失败，返回-1
+ */
+static int bench_connect(const char *req, size_t len)
+{
+	int fd, on = 1;
+
+	fd = socket(baddr->ai_family, baddr->ai_socktype, 0);
+	if(fd < 0) return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	/* 有服务器的cookie的时候请求直接放在SYN中，否则内核先正常连接 */
+	if(req != NULL)
+	{
+		if(sendto(fd, req, len, MSG_FASTOPEN, baddr->ai_addr, baddr->ai_addrlen) != (ssize_t)len)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	if(connect(fd, baddr->ai_addr, baddr->ai_addrlen) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * @brief 关闭连接，还没有回复的请求不再等待
+ * @param st 线程的统计
+ * @param bc 连接
+ * @param err 1表示因为出错而关闭
+ */
+static void bench_close(bench_stat_t *st, bench_conn_t *bc, int err)
+{
+	if(bc->fd >= 0) close(bc->fd);
+	bc->fd = -1;
+	bc->inlen = 0;
+	bc->qhead = 0;
+	bc->qcnt = 0;
+	bc->ka_pending = 0;
+	memset(bc->skey, 0, sizeof(bc->skey));
+	if(err) st->errs++;
+}
+
+/**
+ * @brief 在发送缓存中加入一个请求，并记入等待回复的队列
+ * @param bc 连接
+ * @param flag 请求的类型
+ * @param t 请求开始的时间
+ * @param out 发送缓存
+ * @param olen 发送缓存中已有数据的长度
+ * @return 加入以后发送缓存中数据的长度；生成请求失败，返回-1
+ */
+static int bench_add_req(bench_conn_t *bc, char flag, unsigned long long t, char *out, int olen)
+{
+	unsigned int nlen;
+	int len;
+
+	if(flag == FLAG_KEY_AGREEMENT)
+	{
+		len = client_ka_request(&bc->ka, bconf.uid, out + olen + PKT_HEADLEN, BUFLEN);
+		if(len < 0) return -1;
+		bc->ka_pending = 1;
+	}
+	else
+	{
+		len = (int)strlen(bconf.uid);
+		memcpy(out + olen + PKT_HEADLEN, bconf.uid, len);
+	}
+	nlen = htonl((unsigned int)len);
+	memcpy(out + olen, &nlen, 4);
+	out[olen + 4] = flag;
+
+	bc->q[(bc->qhead + bc->qcnt) % BENCH_QMAX].t = t;
+	bc->q[(bc->qhead + bc->qcnt) % BENCH_QMAX].flag = flag;
+	bc->qcnt++;
+
+	return olen + PKT_HEADLEN + len;
+}
+
+/**
+ * @brief 选择下一个请求的类型：按比例选择密钥协商，一个连接同时只有一个密钥协商
+ * @param bc 连接
+ * @param seed 线程的随机数种子
+ * @return 请求的类型
+ */
+static char bench_pick(bench_conn_t *bc, unsigned int *seed)
+{
+	char rec = bconf.stream ? FLAG_RECORD_STREAM : FLAG_RECORD;
+
+	if(bc->ka_pending || bconf.mix <= 0) return rec;
+	if((int)(rand_r(seed) % 100) < bconf.mix) return FLAG_KEY_AGREEMENT;
+	return rec;
+}
+
+/**
+ * @brief 发送一批请求，还没有连接的话先连接（需要的话这一批以密钥协商开始）
+ * @param st 线程的统计
+ * @param bc 连接
+ * @param n 请求数
+ * @param t 请求开始的时间
+ * @param seed 线程的随机数种子
+ * @param out 发送缓存（至少n+1个最大的请求）
+ * @return 成功，返回0；失败，返回-1（连接已关闭）
+ */
+static int bench_send(bench_stat_t *st, bench_conn_t *bc, int n, unsigned long long t, unsigned int *seed, char *out)
+{
+	int olen = 0, i, fresh = (bc->fd < 0);
+
+	if(fresh && bconf.keyed) olen = bench_add_req(bc, FLAG_KEY_AGREEMENT, t, out, olen);
+	for(i=0;i<n && olen>=0;i++) olen = bench_add_req(bc, bench_pick(bc, seed), t, out, olen);
+	if(olen < 0)
+	{
+		st->ka_fail++;
+		bench_close(st, bc, 1);
+		return -1;
+	}
+
+	if(fresh)
+	{
+		bc->fd = bench_connect(bconf.fastopen ? out : NULL, olen);
+		if(bc->fd < 0)
+		{
+			bench_close(st, bc, 1);
+			return -1;
+		}
+		if(bconf.fastopen) return 0;
+	}
+
+	if(writen(bc->fd, out, olen) != olen)
+	{
+		bench_close(st, bc, 1);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 处理一个回复：记录延迟，密钥协商的回复算出会话密钥，需要的话检查医疗记录
+ * @param st 线程的统计
+ * @param bc 连接
+ * @param flag 回复的类型
+ * @param data 回复的数据
+ * @param len 回复的长度
+ * @param now 当前时间
+ * @return 成功，返回0；回复和请求对不上，返回-1
+ */
+static int bench_reply(bench_stat_t *st, bench_conn_t *bc, char flag, const char *data, size_t len, unsigned long long now)
+{
+	bench_req_t *rq;
+
+	if(bc->qcnt == 0) return -1;
+	rq = &bc->q[bc->qhead];
+
+	/* 流式回复的一块：每一块单独加密，请求到结束的数据包才算完成 */
+	if(flag == FLAG_RECORD_CHUNK)
+	{
+		if(rq->flag != FLAG_RECORD_STREAM) return -1;
+		if(bconf.verify && client_check_record(bc->skey, data, len) != 0) st->bad++;
+		return 0;
+	}
+	if(flag == FLAG_RECORD_END && rq->flag == FLAG_RECORD_STREAM) flag = FLAG_RECORD_STREAM;
+	if(rq->flag != flag) return -1;
+	bc->qhead = (bc->qhead + 1) % BENCH_QMAX;
+	bc->qcnt--;
+
+	if(flag == FLAG_KEY_AGREEMENT)
+	{
+		bc->ka_pending = 0;
+		if(client_ka_finish(&bc->ka, data, len, bc->skey) != 0) st->ka_fail++;
+		else hist_add(&st->ka, now - rq->t);
+		return 0;
+	}
+
+	hist_add(&st->rec, now - rq->t);
+	if(flag == FLAG_RECORD_STREAM)
+	{
+		/* 结束的数据包中是记录的条数，服务器中途出错为-1 */
+		if(len > 0 && data[0] == '-') st->bad++;
+	}
+	else if(bconf.verify && client_check_record(bc->skey, data, len) != 0) st->bad++;
+
+	return 0;
+}
+
+/**
+ * @brief 连接可读：读取数据，处理其中所有完整的回复
+ * @param st 线程的统计
+ * @param bc 连接
+ * @return 成功，返回0；失败，返回-1（连接已关闭）
+ */
+static int bench_read(bench_stat_t *st, bench_conn_t *bc)
+{
+	unsigned long long now;
+	unsigned int len;
+	size_t off = 0;
+	ssize_t n;
+
+	if(bc->incap - bc->inlen < BUFLEN)
+	{
+		size_t cap = bc->incap ? bc->incap * 2 : 4 * BUFLEN;
+		char *p = (char *)realloc(bc->in, cap);
+		if(p == NULL)
+		{
+			bench_close(st, bc, 1);
+			return -1;
+		}
+		bc->in = p;
+		bc->incap = cap;
+	}
+
+	n = recv(bc->fd, bc->in + bc->inlen, bc->incap - bc->inlen, MSG_DONTWAIT);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+	if(n <= 0)
+	{
+		bench_close(st, bc, 1);
+		return -1;
+	}
+	bc->inlen += n;
+
+	now = now_us();
+	while(bc->inlen - off >= PKT_HEADLEN)
+	{
+		memcpy(&len, bc->in + off, 4);
+		len = ntohl(len);
+		if(len > BENCH_MAX_REPLY)
+		{
+			bench_close(st, bc, 1);
+			return -1;
+		}
+		if(bc->inlen - off < PKT_HEADLEN + len) break;
+		if(bench_reply(st, bc, bc->in[off + 4], bc->in + off + PKT_HEADLEN, len, now) != 0)
+		{
+			bench_close(st, bc, 1);
+			return -1;
+		}
+		off += PKT_HEADLEN + len;
+	}
+	if(off > 0)
+	{
+		memmove(bc->in, bc->in + off, bc->inlen - off);
+		bc->inlen -= off;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 压力测试线程：按开环或者闭环的方式在自己的每个连接上发送请求，用poll等待回复
+ * @param arg 线程的统计
+ * @return NULL值
+ */
+static void *bench_run(void *arg)
+{
+	bench_stat_t *st = (bench_stat_t *)arg;
+	bench_conn_t *bcs = (bench_conn_t *)calloc(bconf.conns, sizeof(bench_conn_t));
+	struct pollfd *pfds = (struct pollfd *)calloc(bconf.conns, sizeof(struct pollfd));
+	int *idx = (int *)calloc(bconf.conns, sizeof(int));
+	char *out = (char *)malloc((size_t)(bconf.depth + 1) * (PKT_HEADLEN + BUFLEN));
+	unsigned int seed = (unsigned int)(unsigned long)st ^ (unsigned int)time(NULL);
+	unsigned long long now, wake, interval = 0;
+	int i, n, npoll, timeout;
+
+	if(!bcs || !pfds || !idx || !out) return NULL;
+
+	/* 开环：每个连接按同样的间隔发送，各个连接的起点错开 */
+	now = now_us();
+	if(bconf.rate > 0) interval = 1000000ULL * bconf.threads * bconf.conns / bconf.rate;
+	for(i=0;i<bconf.conns;i++)
+	{
+		bcs[i].fd = -1;
+		bcs[i].next = now + interval * i / bconf.conns;
+	}
+
+	while(!stop)
+	{
+		/* 1.发送到时间的请求 */
+		now = now_us();
+		wake = now + BENCH_RETRY;
+		for(i=0;i<bconf.conns;i++)
+		{
+			bench_conn_t *bc = &bcs[i];
+
+			/* 服务器丢弃了请求（不回复），重新连接 */
+			if(bc->qcnt > 0 && now > bc->q[bc->qhead].t + BENCH_REPLY_TIMEOUT)
+			{
+				if(bc->q[bc->qhead].flag == FLAG_KEY_AGREEMENT) st->ka_fail++;
+				bench_close(st, bc, 1);
+			}
+
+			if(bconf.rate > 0)
+			{
+				while(bc->next <= now)
+				{
+					if(bc->qcnt >= BENCH_QMAX) st->drops++;
+					else if(bench_send(st, bc, 1, bc->next, &seed, out) != 0)
+					{
+						bc->next = now + BENCH_RETRY;
+						break;
+					}
+					bc->next += interval;
+				}
+			}
+			else if(bc->qcnt == 0 && bc->next <= now)
+			{
+				if(bench_send(st, bc, bconf.depth, now, &seed, out) != 0) bc->next = now + BENCH_RETRY;
+			}
+			if((bconf.rate > 0 || bc->qcnt == 0) && bc->next < wake) wake = bc->next;
+		}
+
+		/* 2.等待回复 */
+		for(i=0,npoll=0;i<bconf.conns;i++)
+		{
+			if(bcs[i].fd < 0 || bcs[i].qcnt == 0) continue;
+			pfds[npoll].fd = bcs[i].fd;
+			pfds[npoll].events = POLLIN;
+			idx[npoll++] = i;
+		}
+		now = now_us();
+		timeout = (wake > now) ? (int)((wake - now + 999) / 1000) : 0;
+		n = poll(pfds, npoll, timeout);
+		if(n <= 0) continue;
+
+		/* 3.处理回复；闭环时一批请求都回复了，思考以后再发送下一批 */
+		for(i=0;i<npoll;i++)
+		{
+			bench_conn_t *bc = &bcs[idx[i]];
+
+			if(!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+			if(bench_read(st, bc) != 0 || bconf.rate > 0 || bc->qcnt > 0) continue;
+
+			bc->next = now_us() + (unsigned long long)bconf.think * 1000;
+			if(bconf.reconnect) bench_close(st, bc, 0);
+		}
+	}
+
+	for(i=0;i<bconf.conns;i++)
+	{
+		if(bcs[i].fd >= 0) close(bcs[i].fd);
+		free(bcs[i].in);
+	}
+	free(bcs);
+	free(pfds);
+	free(idx);
+	free(out);
+
+	return NULL;
+}
+
+/**
+ * @brief 打印使用方法
+ * @param prog 程序的名字
+ */
+static void bench_usage(const char *prog)
+{
+	printf("使用方法：%s [选项]\n", prog);
+	printf("  -H, --host=ADDR         服务器地址（默认%s）\n", bconf.host);
+	printf("  -p, --port=PORT         服务器端口（默认%s）\n", bconf.port);
+	printf("  -t, --threads=N         线程数（默认%d）\n", bconf.threads);
+	printf("  -c, --conns=N           每个线程的连接数（默认%d）\n", bconf.conns);
+	printf("  -d, --depth=N           闭环时每个连接连续发送的请求数（默认%d）\n", bconf.depth);
+	printf("  -s, --seconds=N         测试时长（默认%d秒）\n", bconf.seconds);
+	printf("  -u, --uid=ID            请求的用户id（默认%s）\n", bconf.uid);
+	printf("  -k, --keyed             每个连接建立以后先做一次密钥协商\n");
+	printf("  -m, --mix=PCT           请求中密钥协商的百分比（默认%d）\n", bconf.mix);
+	printf("  -T, --think=MS          闭环时每一批请求之间的思考时间（默认%d毫秒）\n", bconf.think);
+	printf("  -R, --rate=N            开环：所有连接合计每秒发送N个请求，不等回复（默认闭环）\n");
+	printf("  -v, --verify            解密医疗记录的回复，检查会话密钥\n");
+	printf("  -S, --stream            流式获取医疗记录，每一块回复单独解密检查\n");
+	printf("  -a, --param=FILE        配对参数文件（默认%s）\n", bconf.param);
+	printf("  -r, --reconnect         闭环时每一批请求都重新连接\n");
+	printf("  -f, --fastopen          连接的时候使用TCP Fast Open\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] =
+	{
+		{"host",    required_argument, NULL, 'H'},
+		{"port",    required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"conns",   required_argument, NULL, 'c'},
+		{"depth",   required_argument, NULL, 'd'},
+		{"seconds", required_argument, NULL, 's'},
+		{"uid",     required_argument, NULL, 'u'},
+		{"keyed",   no_argument,       NULL, 'k'},
+		{"mix",     required_argument, NULL, 'm'},
+		{"think",   required_argument, NULL, 'T'},
+		{"rate",    required_argument, NULL, 'R'},
+		{"verify",  no_argument,       NULL, 'v'},
+		{"stream",  no_argument,       NULL, 'S'},
+		{"param",   required_argument, NULL, 'a'},
+		{"reconnect", no_argument,     NULL, 'r'},
+		{"fastopen", no_argument,      NULL, 'f'},
+		{"help",    no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct addrinfo hints;
+	struct timespec t0, t1;
+	unsigned long long errs = 0, ka_fail = 0, bad = 0, drops = 0;
+	bench_hist_t *rec, *ka;
+	double secs;
+	bench_stat_t *st;
+	int c, i;
+
+	while((c = getopt_long(argc, argv, "H:p:t:c:d:s:u:km:T:R:vSa:rfh", opts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'H': bconf.host = optarg; break;
+		case 'p': bconf.port = optarg; break;
+		case 't': bconf.threads = atoi(optarg); break;
+		case 'c': bconf.conns = atoi(optarg); break;
+		case 'd': bconf.depth = atoi(optarg); break;
+		case 's': bconf.seconds = atoi(optarg); break;
+		case 'u': bconf.uid = optarg; break;
+		case 'k': bconf.keyed = 1; break;
+		case 'm': bconf.mix = atoi(optarg); break;
+		case 'T': bconf.think = atoi(optarg); break;
+		case 'R': bconf.rate = atoi(optarg); break;
+		case 'v': bconf.verify = 1; break;
+		case 'S': bconf.stream = 1; break;
+		case 'a': bconf.param = optarg; break;
+		case 'r': bconf.reconnect = 1; break;
+		case 'f': bconf.fastopen = 1; break;
+		default:
+			bench_usage(argv[0]);
+			return c == 'h' ? 0 : -1;
+		}
+	}
+	if(bconf.threads <= 0 || bconf.conns <= 0 || bconf.depth <= 0 || bconf.depth >= BENCH_QMAX
+			|| bconf.seconds <= 0 || strlen(bconf.uid) >= BUFLEN || bconf.mix < 0 || bconf.mix > 100
+			|| bconf.think < 0 || bconf.rate < 0 || (bconf.rate > 0 && bconf.reconnect))
+	{
+		bench_usage(argv[0]);
+		return -1;
+	}
+
+	/* 只有用到密钥协商的时候才需要配对参数 */
+	if((bconf.keyed || bconf.mix > 0) && client_init(bconf.param) != 0)
+	{
+		printf("无法读取配对参数文件：%s\n", bconf.param);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(bconf.host, bconf.port, &hints, &baddr) != 0)
+	{
+		printf("无法解析服务器地址：%s:%s\n", bconf.host, bconf.port);
+		return -1;
+	}
+
+	st = (bench_stat_t *)calloc(bconf.threads, sizeof(bench_stat_t));
+	rec = (bench_hist_t *)calloc(1, sizeof(bench_hist_t));
+	ka = (bench_hist_t *)calloc(1, sizeof(bench_hist_t));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0;i<bconf.threads;i++) pthread_create(&st[i].tid, NULL, bench_run, &st[i]);
+	sleep(bconf.seconds);
+	stop = 1;
+	for(i=0;i<bconf.threads;i++)
+	{
+		pthread_join(st[i].tid, NULL);
+		errs += st[i].errs;
+		ka_fail += st[i].ka_fail;
+		bad += st[i].bad;
+		drops += st[i].drops;
+		hist_merge(rec, &st[i].rec);
+		hist_merge(ka, &st[i].ka);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	if(bconf.rate > 0)
+		printf("connections: %d  rate: %d/s (open loop)  seconds: %.2f\n", bconf.threads * bconf.conns, bconf.rate, secs);
+	else
+		printf("connections: %d  depth: %d  seconds: %.2f\n", bconf.threads * bconf.conns, bconf.depth, secs);
+	printf("requests: %llu  errors: %llu  req/s: %.0f\n", rec->cnt, errs, rec->cnt / secs);
+	hist_print("latency", rec);
+	if(bconf.keyed || bconf.mix > 0)
+	{
+		printf("handshakes: %llu  failed: %llu  handshakes/s: %.0f\n", ka->cnt, ka_fail, ka->cnt / secs);
+		hist_print("handshake latency", ka);
+	}
+	if(bconf.verify) printf("verify failures: %llu\n", bad);
+	if(drops > 0) printf("dropped (too many outstanding): %llu\n", drops);
+	free(rec);
+	free(ka);
+	free(st);
+	freeaddrinfo(baddr);
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#!/bin/bash
+
+#######################################################
+# tmis服务器压力测试的脚本代码：分别用epoll和io_uring启动服务器，
+# 用同样的负载测试，对比每秒处理的请求数和每个请求的系统调用数
+# 使用方法：
+#		./tmis_bench.sh [tmis_bench的参数]
+# 例如：
+#		./tmis_bench.sh -t 4 -c 16 -d 8 -s 10
+# 说明：
+#		tmis_bench默认不做密钥协商（-k、-m打开），所以关闭了密钥协商超时；
+#		需要先make和make bench；统计系统调用需要perf（优先）或者strace，
+#		都没有的时候只统计每秒处理的请求数；服务器的其它参数由TMIS_OPTS传入
+#######################################################
+
+if [ ! -x ./tmis_server ] || [ ! -x ./tmis_bench ]; then
+	echo -e "\033[32m请先执行 make && make bench\033[0m"
+	exit -1
+fi
+
+#### 找到服务器进程（后台运行的tmis_server）
+server_pid()
+{
+	pgrep -n -x tmis_server
+}
+
+#### 用一种I/O方式测试一次
+run_one()
+{
+	io=$1
+	shift
+
+	pkill -x tmis_server
+	sleep 1
+	./tmis_server -q --io=$io --handshake-timeout=0 $TMIS_OPTS
+	sleep 1
+	pid=`server_pid`
+	if [ -z "$pid" ]; then
+		echo "tmis服务器启动失败..."
+		return
+	fi
+
+	out=/tmp/tmis_bench.$io.$$
+	tracer=""
+	if command -v perf > /dev/null 2>&1; then
+		perf stat -e raw_syscalls:sys_enter -p $pid -o $out.sys &
+		tracer=$!
+	elif command -v strace > /dev/null 2>&1; then
+		strace -c -f -p $pid -o $out.sys &
+		tracer=$!
+	fi
+
+	./tmis_bench "$@" | tee $out
+
+	if [ -n "$tracer" ]; then
+		kill -INT $tracer 2> /dev/null
+		wait $tracer 2> /dev/null
+	fi
+	pkill -x tmis_server
+
+	reqs=`sed -n 's/^requests: \([0-9]*\).*/\1/p' $out`
+	rps=`sed -n 's/.*req\/s: \([0-9]*\).*/\1/p' $out`
+	sys=""
+	if [ -f $out.sys ]; then
+		# perf：raw_syscalls:sys_enter那一行的计数；strace：total那一行的calls
+		sys=`awk '/raw_syscalls:sys_enter/ {gsub(",","",$1); print $1} /total$/ {print $3}' $out.sys`
+	fi
+	if [ -n "$sys" ] && [ "$reqs" -gt 0 ]; then
+		per=`awk -v s=$sys -v r=$reqs 'BEGIN {printf "%.2f", s / r}'`
+	else
+		per="-"
+	fi
+	result="$result`printf '%-10s %12s %12s %14s' $io $rps ${sys:--} $per`\n"
+	rm -f $out $out.sys
+}
+
+result=""
+run_one epoll "$@"
+run_one uring "$@"
+
+echo -e "\033[32m===========================================================================\033[1m"
+printf '%-10s %12s %12s %14s\n' "io" "req/s" "syscalls" "syscalls/req"
+echo -e "$result"
+echo -e "\033[32m===========================================================================\033[0m"
@@ -0,0 +1,132 @@
+/**
+* @file       tmis_buf.c
+* @brief      tmis服务器的可增长字节缓存
+* @details    拼接回复用的缓存：每次追加都知道长度（不用strlen、strcat从头扫描），空间不够的时候按倍数扩大；
+*             每个处理线程一个，每个请求开始的时候清空重用，处理过特别大的请求以后缩回初始大小
+* @author     项斌
+* @date       2018/08/27
+* @version    1.0
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "tmis_buf.h"
+
+static pthread_key_t buf_key;                          ///< 线程退出的时候释放本线程的缓存
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;    ///< 只创建一次buf_key
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 线程退出的时候释放本线程的缓存
+ * @param arg 缓存
+ */
+static void buf_thread_free(void *arg)
+{
+	buf_free((tmis_buf_t *)arg);
+	free(arg);
+}
+
+/**
+ * @brief 创建buf_key
+ */
+static void buf_key_create(void)
+{
+	pthread_key_create(&buf_key, buf_thread_free);
+}
+
+/**
+ * @brief 取得本线程的缓存并清空（线程退出的时候自动释放）
+ * @return 成功，返回缓存；没有内存，返回NULL
+ */
+tmis_buf_t *buf_thread(void)
+{
+	tmis_buf_t *b;
+
+	pthread_once(&buf_once, buf_key_create);
+	b = (tmis_buf_t *)pthread_getspecific(buf_key);
+	if(b == NULL)
+	{
+		b = (tmis_buf_t *)calloc(1, sizeof(tmis_buf_t));
+		if(b == NULL) return NULL;
+		pthread_setspecific(buf_key, b);
+	}
+
+	buf_reset(b);
+	if(buf_reserve(b, 0) != 0) return NULL;
+
+	return b;
+}
+
+/**
+ * @brief 清空缓存，太大的缩回初始大小
+ * @param b 缓存
+ */
+void buf_reset(tmis_buf_t *b)
+{
+	if(b->cap > BUF_KEEP_SIZE)
+	{
+		free(b->data);
+		b->data = NULL;
+		b->cap = 0;
+	}
+	b->len = 0;
+	if(b->data) b->data[0] = '\0';
+}
+
+/**
+ * @brief 保证缓存还能再放下n个字节
+ * @param b 缓存
+ * @param n 字节数
+ * @return 成功，返回0；没有内存，返回-1
+ */
+int buf_reserve(tmis_buf_t *b, size_t n)
+{
+	size_t cap;
+	char *p;
+
+	if(b->data && b->len + n <= b->cap) return 0;
+
+	cap = b->cap ? b->cap : BUF_INIT_SIZE;
+	while(cap < b->len + n) cap *= 2;
+
+	/* 多分配1个字节放结尾的'\0' */
+	p = (char *)realloc(b->data, cap + 1);
+	if(p == NULL) return -1;
+	if(b->data == NULL) p[0] = '\0';
+	b->data = p;
+	b->cap = cap;
+
+	return 0;
+}
+
+/**
+ * @brief 追加数据
+ * @param b 缓存
+ * @param p 数据
+ * @param n 数据的长度
+ * @return 成功，返回0；没有内存，返回-1（缓存中原来的数据不变）
+ */
+int buf_append(tmis_buf_t *b, const char *p, size_t n)
+{
+	if(buf_reserve(b, n) != 0) return -1;
+
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief 释放缓存的内存
+ * @param b 缓存
+ */
+void buf_free(tmis_buf_t *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = 0;
+	b->cap = 0;
+}
@@ -0,0 +1,69 @@
+/**
+* @file       tmis_buf.h
+* @brief      tmis服务器的可增长字节缓存
+* @details    拼接回复用的缓存：每次追加都知道长度（不用strlen、strcat从头扫描），空间不够的时候按倍数扩大；
+*             每个处理线程一个，每个请求开始的时候清空重用，处理过特别大的请求以后缩回初始大小
+* @author     项斌
+* @date       2018/08/27
+* @version    1.0
+*/
+
+#ifndef __TMIS_BUF_H__
+#define __TMIS_BUF_H__
+
+#include <stddef.h>
+
+/** 缓存的初始大小 */
+#define BUF_INIT_SIZE 4096
+
+/** 清空的时候超过这么大的缓存缩回初始大小，线程不会一直占着大块内存 */
+#define BUF_KEEP_SIZE (256 * 1024)
+
+/** 可增长的字节缓存，数据后面总是有一个'\0' */
+typedef struct tmis_buf
+{
+	char *data;                         ///< 数据
+	size_t len;                         ///< 数据的长度
+	size_t cap;                         ///< 缓存的大小（不包括结尾的'\0'）
+}tmis_buf_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 取得本线程的缓存并清空（线程退出的时候自动释放）
+ * @return 成功，返回缓存；没有内存，返回NULL
+ */
+tmis_buf_t *buf_thread(void);
+
+/**
+ * @brief 清空缓存，太大的缩回初始大小
+ * @param b 缓存
+ */
+void buf_reset(tmis_buf_t *b);
+
+/**
+ * @brief 保证缓存还能再放下n个字节
+ * @param b 缓存
+ * @param n 字节数
+ * @return 成功，返回0；没有内存，返回-1
+ */
+int buf_reserve(tmis_buf_t *b, size_t n);
+
+/**
+ * @brief 追加数据
+ * @param b 缓存
+ * @param p 数据
+ * @param n 数据的长度
+ * @return 成功，返回0；没有内存，返回-1（缓存中原来的数据不变）
+ */
+int buf_append(tmis_buf_t *b, const char *p, size_t n);
+
+/**
+ * @brief 释放缓存的内存
+ * @param b 缓存
+ */
+void buf_free(tmis_buf_t *b);
+
+
+#endif
@@ -0,0 +1,425 @@
+/**
+* @file       tmis_cache.c
+* @brief      tmis服务器的医疗记录缓存
+* @details    按uid缓存查询出来的医疗记录（加密以前的明文，加密用的是每个连接的会话密钥），
+*             分成多个分片，每个分片一把锁、一个哈希表和一个LRU链表；每条缓存有过期时间，
+*             所有缓存占用的内存不超过设定的上限，超过了从最久没用的开始淘汰；
+*             病人的记录改变以后调用cache_invalidate删除缓存
+* @author     项斌
+* @date       2018/08/27
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "log.h"
+#include "tmis_cache.h"
+#include "tmis_pool.h"
+#include "tmis_timer.h"
+
+/** 一条缓存：uid和记录跟在结构后面 */
+typedef struct cache_entry
+{
+	struct cache_entry *hnext;          ///< 哈希桶中的下一条
+	struct cache_entry *prev;           ///< LRU链表中的上一条（更近使用的）
+	struct cache_entry *next;           ///< LRU链表中的下一条（更久没用的）
+	unsigned int hash;                  ///< uid的哈希值
+	long expire;                        ///< 过期时间（秒，单调时钟）
+	size_t klen;                        ///< uid的长度
+	size_t vlen;                        ///< 记录的长度
+	char data[];                        ///< uid + '\0' + 记录 + '\0'
+}cache_entry_t;
+
+/** 一个分片 */
+typedef struct cache_shard
+{
+	pthread_mutex_t lock;               ///< 分片的锁
+	cache_entry_t **buckets;            ///< 哈希表
+	unsigned int nbuckets;              ///< 桶数
+	cache_entry_t *head;                ///< LRU链表的表头（最近使用的）
+	cache_entry_t *tail;                ///< LRU链表的表尾（最久没用的，先淘汰）
+	size_t bytes;                       ///< 占用的内存
+	unsigned long gen;                  ///< 版本号，每次cache_invalidate加1
+	tmis_cache_stats_t st;              ///< 本分片的统计信息
+}cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];   ///< 所有的分片
+static size_t shard_budget;                   ///< 每个分片最多占用的内存，0表示不使用缓存
+static int cache_ttl;                         ///< 每条缓存的有效时间（秒）
+static FILE *cachelog;                        ///< 日志文件句柄
+static long cache_last_log;                   ///< 上一次记录统计信息的时间
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief uid的哈希值（FNV-1a），低位选分片，高位选桶
+ * @param uid 用户id
+ * @param len 传出参数，uid的长度
+ * @return 哈希值
+ */
+static unsigned int cache_hash(const char *uid, size_t *len)
+{
+	unsigned int h = 2166136261u;
+	const unsigned char *p = (const unsigned char *)uid;
+
+	while(*p)
+	{
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	*len = (size_t)(p - (const unsigned char *)uid);
+
+	return h;
+}
+
+/**
+ * @brief 一条缓存占用的内存
+ * @param e 缓存
+ * @return 字节数
+ */
+static size_t cache_cost(const cache_entry_t *e)
+{
+	return sizeof(cache_entry_t) + e->klen + e->vlen + 2;
+}
+
+/**
+ * @brief 在分片的哈希表中查找（调用者持有分片的锁）
+ * @param s 分片
+ * @param uid 用户id
+ * @param klen uid的长度
+ * @param hash uid的哈希值
+ * @return 找到，返回哈希桶中指向它的指针；没有找到，返回NULL
+ */
+static cache_entry_t **cache_find(cache_shard_t *s, const char *uid, size_t klen, unsigned int hash)
+{
+	cache_entry_t **pp = &s->buckets[(hash / CACHE_SHARDS) & (s->nbuckets - 1)];
+
+	for(; *pp; pp = &(*pp)->hnext)
+	{
+		if((*pp)->hash == hash && (*pp)->klen == klen && memcmp((*pp)->data, uid, klen) == 0) return pp;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief 从LRU链表中摘下（调用者持有分片的锁）
+ * @param s 分片
+ * @param e 缓存
+ */
+static void lru_unlink(cache_shard_t *s, cache_entry_t *e)
+{
+	if(e->prev) e->prev->next = e->next;
+	else s->head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else s->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+/**
+ * @brief 放到LRU链表的表头（调用者持有分片的锁）
+ * @param s 分片
+ * @param e 缓存
+ */
+static void lru_push(cache_shard_t *s, cache_entry_t *e)
+{
+	e->prev = NULL;
+	e->next = s->head;
+	if(s->head) s->head->prev = e;
+	else s->tail = e;
+	s->head = e;
+}
+
+/**
+ * @brief 删除一条缓存（调用者持有分片的锁）
+ * @param s 分片
+ * @param pp 哈希桶中指向它的指针
+ */
+static void cache_remove(cache_shard_t *s, cache_entry_t **pp)
+{
+	cache_entry_t *e = *pp;
+
+	*pp = e->hnext;
+	lru_unlink(s, e);
+	s->bytes -= cache_cost(e);
+	s->st.entries--;
+	free(e);
+}
+
+/**
+ * @brief 删除一条已经知道地址的缓存（淘汰的时候用，调用者持有分片的锁）
+ * @param s 分片
+ * @param e 缓存
+ */
+static void cache_drop(cache_shard_t *s, cache_entry_t *e)
+{
+	cache_entry_t **pp = &s->buckets[(e->hash / CACHE_SHARDS) & (s->nbuckets - 1)];
+
+	while(*pp != e) pp = &(*pp)->hnext;
+	cache_remove(s, pp);
+}
+
+/**
+ * @brief 缓存太多的时候把哈希表扩大一倍（调用者持有分片的锁，内存不够就不扩大）
+ * @param s 分片
+ */
+static void cache_grow(cache_shard_t *s)
+{
+	unsigned int n = s->nbuckets * 2, i;
+	cache_entry_t **nb, *e, *next;
+
+	nb = (cache_entry_t **)calloc(n, sizeof(cache_entry_t *));
+	if(!nb) return;
+
+	for(i = 0; i < s->nbuckets; i++)
+	{
+		for(e = s->buckets[i]; e; e = next)
+		{
+			next = e->hnext;
+			e->hnext = nb[(e->hash / CACHE_SHARDS) & (n - 1)];
+			nb[(e->hash / CACHE_SHARDS) & (n - 1)] = e;
+		}
+	}
+	free(s->buckets);
+	s->buckets = nb;
+	s->nbuckets = n;
+}
+
+/**
+ * @brief 每隔CACHE_STATS_INTERVAL秒在日志中记录一次统计信息（只有一个线程会记录）
+ * @param now 当前时间
+ */
+static void cache_log_stats(long now)
+{
+	long last = cache_last_log;
+	tmis_cache_stats_t st;
+
+	if(now - last < CACHE_STATS_INTERVAL) return;
+	if(!__sync_bool_compare_and_swap(&cache_last_log, last, now)) return;
+
+	cache_stats(&st);
+	write_log(cachelog,"record cache: entries %lu, bytes %lu, hits %lu, misses %lu, expired %lu, evictions %lu, invalidations %lu\n",
+			st.entries,(unsigned long)st.bytes,st.hits,st.misses,st.expired,st.evictions,st.invalidations);
+}
+
+/**
+ * @brief 初始化缓存
+ * @param budget 所有缓存最多占用的内存（字节），0表示不使用缓存
+ * @param ttl 每条缓存的有效时间（秒）
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+int cache_init(size_t budget, int ttl, FILE *log)
+{
+	int i;
+
+	cachelog = log;
+	cache_ttl = ttl;
+	cache_last_log = timer_now();
+	if(budget == 0 || ttl <= 0) return 0;
+
+	for(i = 0; i < CACHE_SHARDS; i++)
+	{
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].buckets = (cache_entry_t **)calloc(CACHE_BUCKETS, sizeof(cache_entry_t *));
+		if(!shards[i].buckets) return -1;
+		shards[i].nbuckets = CACHE_BUCKETS;
+	}
+	shard_budget = budget / CACHE_SHARDS;
+
+	write_log(cachelog,"record cache: %lu bytes in %d shards, ttl %d seconds\n",(unsigned long)budget,CACHE_SHARDS,ttl);
+
+	return 0;
+}
+
+/**
+ * @brief 查找一个用户的医疗记录
+ * @param uid 用户id
+ * @param len 传出参数，记录的长度
+ * @param gen 传出参数，没有命中的时候返回当前的版本号，查询数据库以后交给cache_put
+ * @return 命中，返回记录的拷贝（缓存池的缓存，以'\0'结尾，调用者pool_free）；没有命中，返回NULL
+ */
+char *cache_get(const char *uid, size_t *len, unsigned long *gen)
+{
+	cache_shard_t *s;
+	cache_entry_t **pp, *e;
+	unsigned int hash;
+	size_t klen;
+	long now;
+	char *out = NULL;
+
+	*gen = 0;
+	if(shard_budget == 0) return NULL;
+
+	now = timer_now();
+	hash = cache_hash(uid, &klen);
+	s = &shards[hash & (CACHE_SHARDS - 1)];
+
+	pthread_mutex_lock(&s->lock);
+	pp = cache_find(s, uid, klen, hash);
+	if(pp && (*pp)->expire <= now)
+	{
+		cache_remove(s, pp);
+		s->st.expired++;
+		pp = NULL;
+	}
+
+	if(pp)
+	{
+		/* 拷贝在锁里做：记录只有几KB，比每个命中都加引用计数简单 */
+		e = *pp;
+		out = pool_alloc(e->vlen + 1);
+		if(out)
+		{
+			memcpy(out, e->data + e->klen + 1, e->vlen + 1);
+			*len = e->vlen;
+			lru_unlink(s, e);
+			lru_push(s, e);
+			s->st.hits++;
+		}
+	}
+	if(!out)
+	{
+		*gen = s->gen;
+		s->st.misses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	cache_log_stats(now);
+
+	return out;
+}
+
+/**
+ * @brief 保存一个用户的医疗记录（已经有的替换掉）
+ * @param uid 用户id
+ * @param data 记录
+ * @param len 记录的长度
+ * @param gen cache_get返回的版本号，这期间被cache_invalidate过的话不保存（数据库查出来的可能是旧的记录）
+ */
+void cache_put(const char *uid, const char *data, size_t len, unsigned long gen)
+{
+	cache_shard_t *s;
+	cache_entry_t **pp, *e;
+	unsigned int hash;
+	size_t klen;
+
+	if(shard_budget == 0) return;
+
+	hash = cache_hash(uid, &klen);
+	s = &shards[hash & (CACHE_SHARDS - 1)];
+
+	/* 一条记录超过分片内存的1/4就不缓存了，免得把整个分片都淘汰掉 */
+	if(sizeof(cache_entry_t) + klen + len + 2 > shard_budget / 4) return;
+
+	/* 在锁外面分配、拷贝 */
+	e = (cache_entry_t *)malloc(sizeof(cache_entry_t) + klen + len + 2);
+	if(!e) return;
+	e->hnext = e->prev = e->next = NULL;
+	e->hash = hash;
+	e->expire = timer_now() + cache_ttl;
+	e->klen = klen;
+	e->vlen = len;
+	memcpy(e->data, uid, klen + 1);
+	memcpy(e->data + klen + 1, data, len);
+	e->data[klen + 1 + len] = '\0';
+
+	pthread_mutex_lock(&s->lock);
+	if(s->gen != gen)
+	{
+		pthread_mutex_unlock(&s->lock);
+		free(e);
+		return;
+	}
+
+	pp = cache_find(s, uid, klen, hash);
+	if(pp) cache_remove(s, pp);
+
+	/* 超过内存上限，从最久没用的开始淘汰 */
+	while(s->tail && s->bytes + cache_cost(e) > shard_budget)
+	{
+		cache_drop(s, s->tail);
+		s->st.evictions++;
+	}
+
+	e->hnext = s->buckets[(hash / CACHE_SHARDS) & (s->nbuckets - 1)];
+	s->buckets[(hash / CACHE_SHARDS) & (s->nbuckets - 1)] = e;
+	lru_push(s, e);
+	s->bytes += cache_cost(e);
+	s->st.entries++;
+	if(s->st.entries > 2UL * s->nbuckets) cache_grow(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief 医疗记录改变了，删除缓存
+ * @param uid 用户id，NULL表示删除所有的缓存
+ */
+void cache_invalidate(const char *uid)
+{
+	cache_shard_t *s;
+	cache_entry_t **pp;
+	unsigned int hash;
+	size_t klen;
+	int i;
+
+	if(shard_budget == 0) return;
+
+	if(uid == NULL)
+	{
+		for(i = 0; i < CACHE_SHARDS; i++)
+		{
+			s = &shards[i];
+			pthread_mutex_lock(&s->lock);
+			s->gen++;
+			while(s->tail)
+			{
+				cache_drop(s, s->tail);
+				s->st.invalidations++;
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		return;
+	}
+
+	hash = cache_hash(uid, &klen);
+	s = &shards[hash & (CACHE_SHARDS - 1)];
+
+	/* 版本号加1：正在查询数据库的请求查出来的可能是改变以前的记录，不能再放进缓存 */
+	pthread_mutex_lock(&s->lock);
+	s->gen++;
+	pp = cache_find(s, uid, klen, hash);
+	if(pp)
+	{
+		cache_remove(s, pp);
+		s->st.invalidations++;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief 取得缓存的统计信息
+ * @param st 传出参数，统计信息
+ */
+void cache_stats(tmis_cache_stats_t *st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	if(shard_budget == 0) return;
+
+	for(i = 0; i < CACHE_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].lock);
+		st->hits += shards[i].st.hits;
+		st->misses += shards[i].st.misses;
+		st->expired += shards[i].st.expired;
+		st->evictions += shards[i].st.evictions;
+		st->invalidations += shards[i].st.invalidations;
+		st->entries += shards[i].st.entries;
+		st->bytes += shards[i].bytes;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
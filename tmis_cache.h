@@ -0,0 +1,83 @@
+/**
+* @file       tmis_cache.h
+* @brief      tmis服务器的医疗记录缓存
+* @details    按uid缓存查询出来的医疗记录（加密以前的明文，加密用的是每个连接的会话密钥），
+*             分成多个分片，每个分片一把锁、一个哈希表和一个LRU链表；每条缓存有过期时间，
+*             所有缓存占用的内存不超过设定的上限，超过了从最久没用的开始淘汰；
+*             病人的记录改变以后调用cache_invalidate删除缓存
+* @author     项斌
+* @date       2018/08/27
+* @version    1.0
+*/
+
+#ifndef __TMIS_CACHE_H__
+#define __TMIS_CACHE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/** 分片的数量（2的幂），不同uid的请求大多落在不同的分片上，不会互相等锁 */
+#define CACHE_SHARDS 16
+
+/** 每个分片哈希表的初始桶数（2的幂），缓存数量超过桶数的2倍时扩大一倍 */
+#define CACHE_BUCKETS 256
+
+/** 每隔多少秒在日志中记录一次缓存的统计信息 */
+#define CACHE_STATS_INTERVAL 60
+
+/** 缓存的统计信息 */
+typedef struct tmis_cache_stats
+{
+	unsigned long hits;                 ///< 命中的次数
+	unsigned long misses;               ///< 没有命中的次数（包括过期的）
+	unsigned long expired;              ///< 过期的次数
+	unsigned long evictions;            ///< 内存超过上限被淘汰的缓存数量
+	unsigned long invalidations;        ///< 被cache_invalidate删除的缓存数量
+	unsigned long entries;              ///< 当前缓存的数量
+	size_t bytes;                       ///< 当前占用的内存
+}tmis_cache_stats_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 初始化缓存
+ * @param budget 所有缓存最多占用的内存（字节），0表示不使用缓存
+ * @param ttl 每条缓存的有效时间（秒）
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+int cache_init(size_t budget, int ttl, FILE *log);
+
+/**
+ * @brief 查找一个用户的医疗记录
+ * @param uid 用户id
+ * @param len 传出参数，记录的长度
+ * @param gen 传出参数，没有命中的时候返回当前的版本号，查询数据库以后交给cache_put
+ * @return 命中，返回记录的拷贝（缓存池的缓存，以'\0'结尾，调用者pool_free）；没有命中，返回NULL
+ */
+char *cache_get(const char *uid, size_t *len, unsigned long *gen);
+
+/**
+ * @brief 保存一个用户的医疗记录（已经有的替换掉）
+ * @param uid 用户id
+ * @param data 记录
+ * @param len 记录的长度
+ * @param gen cache_get返回的版本号，这期间被cache_invalidate过的话不保存（数据库查出来的可能是旧的记录）
+ */
+void cache_put(const char *uid, const char *data, size_t len, unsigned long gen);
+
+/**
+ * @brief 医疗记录改变了，删除缓存
+ * @param uid 用户id，NULL表示删除所有的缓存
+ */
+void cache_invalidate(const char *uid);
+
+/**
+ * @brief 取得缓存的统计信息
+ * @param st 传出参数，统计信息
+ */
+void cache_stats(tmis_cache_stats_t *st);
+
+
+#endif
@@ -0,0 +1,212 @@
+/**
+* @file       tmis_client.c
+* @brief      tmis客户端的密钥协商和医疗记录的解密（压力测试客户端使用）
+* @details    每一步的计算都和服务器端（key_agreement_server_do）一致，包括用strlen、get_length取长度的地方，
+*             这样服务器按原来的方法就能验证客户端的请求；客户端用服务器的密钥对算出共享点
+*             （注册、客户端的实现不在这个仓库中）
+* @author     项斌
+* @date       2018/08/24
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/aes.h>
+#include "tmis_client.h"
+#include "tmis_enc_denc.h"
+#include "tmis_proto.h"
+#include "tmis_keys.h"
+#include "/usr/local/include/pbc/pbc.h"
+
+static pairing_t pairing;               ///< 配对，client_init初始化以后只读
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 读取配对参数文件，初始化客户端（整个进程一次，之后多个线程可以同时使用）
+ * @param param_file 配对参数文件（a.param）
+ * @return 成功，返回0；失败，返回-1
+ */
+int client_init(const char *param_file)
+{
+	char s[16384];
+	size_t count;
+	FILE *fp = fopen(param_file, "r");
+	if(!fp) return -1;
+
+	count = fread(s, 1, sizeof(s), fp);
+	fclose(fp);
+	if(!count) return -1;
+	if(pairing_init_set_buf(pairing, s, count)) return -1;
+
+	return 0;
+}
+
+/**
+ * @brief 计算注册时得到的Ai：sha1(IDi || 服务器私钥)的十进制
+ * @param uid 用户id
+ * @param out 传出参数，Ai（至少1024字节）
+ */
+static void client_ai(const char *uid, char *out)
+{
+	char constr[BUFLEN + 1024] = {0};
+	unsigned char bytes_Ai[100] = {0};
+	char str_hex[1024] = {0};
+	mpz_t mpz_Ai;
+
+	snprintf(constr, sizeof(constr), "%s%s", uid, TMIS_SECRET_KEY);
+	sha1((unsigned char *)constr, bytes_Ai);
+	bytes2hex(bytes_Ai, strlen((char *)bytes_Ai), str_hex);
+	mpz_init_set_str(mpz_Ai, str_hex, 16);
+	mpz_get_str(out, 10, mpz_Ai);
+	mpz_clear(mpz_Ai);
+}
+
+/**
+ * @brief 生成一个密钥协商请求的数据：Hi的十六进制 + 分隔符 + Rc的十六进制
+ * @param ka 传出参数，这次密钥协商的状态
+ * @param uid 用户id
+ * @param out 传出参数，请求的数据
+ * @param size out的大小
+ * @return 成功，返回数据的长度；失败，返回-1
+ */
+int client_ka_request(tmis_client_ka_t *ka, const char *uid, char *out, size_t size)
+{
+	element_t element_P, element_sk, element_rc, element_Rc, element_k;
+	char str_k[1024] = {0};
+	unsigned char bytes_md5[50] = {0};
+	char str_md5[50] = {0};
+	char str_Ai[1024] = {0};
+	char str_Hi[2048] = {0};
+	unsigned char bytes_Hi[4096] = {0};
+	unsigned char bytes_Rc[1024] = {0};
+	int len_Hi, len_Rc;
+
+	if(strlen(uid) >= sizeof(ka->uid)) return -1;
+	memset(ka, 0, sizeof(*ka));
+	strcpy(ka->uid, uid);
+
+	element_init_G1(element_P, pairing);
+	element_init_G1(element_sk, pairing);
+	element_init_G1(element_rc, pairing);
+	element_init_G1(element_Rc, pairing);
+	element_init_G1(element_k, pairing);
+
+	//// 1.Rc = rc * P，共享点k = 服务器私钥 * Rc（服务器算的k2）
+	element_from_hash(element_P, TMIS_HASH_P, strlen(TMIS_HASH_P));
+	element_set_str(element_sk, TMIS_SECRET_KEY, 10);
+	element_random(element_rc);
+	element_mul(element_Rc, element_rc, element_P);
+	element_mul(element_k, element_sk, element_Rc);
+
+	//// 2.加密Hi的密钥：md5(k)的十六进制的前16个字符
+	element_snprint(str_k, sizeof(str_k), element_k);
+	md5((unsigned char *)str_k, bytes_md5);
+	bytes2hex(bytes_md5, strlen((char *)bytes_md5), str_md5);
+	memcpy(ka->k2key, str_md5, CLIENT_SKEY_LEN);
+
+	//// 3.Hi = AES(IDi || Ai || t1)
+	time2string(time(NULL), ka->t1, sizeof(ka->t1));
+	client_ai(uid, str_Ai);
+	snprintf(str_Hi, sizeof(str_Hi), "%s%s%s%s%s", uid, SPLIT_KEY_AGREEMENT, str_Ai, SPLIT_KEY_AGREEMENT, ka->t1);
+	aes_encrypt((unsigned char *)str_Hi, (unsigned char *)ka->k2key, bytes_Hi);
+	len_Hi = get_length(bytes_Hi);
+
+	len_Rc = element_length_in_bytes(element_Rc);
+	if(len_Rc > (int)sizeof(bytes_Rc)) len_Rc = -1;
+	else element_to_bytes(bytes_Rc, element_Rc);
+
+	element_clear(element_P);
+	element_clear(element_sk);
+	element_clear(element_rc);
+	element_clear(element_Rc);
+	element_clear(element_k);
+
+	//// 4.Hi的十六进制 + 分隔符 + Rc的十六进制
+	if(len_Rc < 0 || (size_t)(2 * len_Hi + 2 * len_Rc) + strlen(SPLIT_KEY_AGREEMENT) >= size) return -1;
+	bytes2hex(bytes_Hi, len_Hi, out);
+	memcpy(out + 2 * len_Hi, SPLIT_KEY_AGREEMENT, strlen(SPLIT_KEY_AGREEMENT));
+	bytes2hex(bytes_Rc, len_Rc, out + 2 * len_Hi + strlen(SPLIT_KEY_AGREEMENT));
+
+	return 2 * len_Hi + (int)strlen(SPLIT_KEY_AGREEMENT) + 2 * len_Rc;
+}
+
+/**
+ * @brief 处理服务器的密钥协商回复（Li的十六进制），算出会话密钥
+ * @param ka 发送请求时的状态
+ * @param reply 回复的数据
+ * @param len 回复的长度
+ * @param skey 传出参数，会话密钥（至少CLIENT_SKEY_LEN+1字节）
+ * @return 成功，返回0；回复不正确，返回-1
+ */
+int client_ka_finish(const tmis_client_ka_t *ka, const char *reply, size_t len, char *skey)
+{
+	unsigned char bytes_Li[4096] = {0};
+	char str_Li[4096] = {0};
+	char constr[4096] = {0};
+	unsigned char bytes_sk[50] = {0};
+	char str_sk[50] = {0};
+	char *save = NULL, *idi, *rs, *ji, *t2;
+
+	/* 后面至少留3个0给get_length判断结尾 */
+	if(len == 0 || len % 2 != 0 || len / 2 + 3 > sizeof(bytes_Li)) return -1;
+
+	//// 1.解密Li = AES(IDi || Rs || Ji || t2)
+	hex2bytes(reply, (int)len, bytes_Li);
+	aes_decrypt(bytes_Li, (unsigned char *)ka->k2key, (unsigned char *)str_Li);
+
+	idi = strtok_r(str_Li, SPLIT_KEY_AGREEMENT, &save);
+	rs = strtok_r(NULL, SPLIT_KEY_AGREEMENT, &save);
+	ji = strtok_r(NULL, SPLIT_KEY_AGREEMENT, &save);
+	t2 = strtok_r(NULL, SPLIT_KEY_AGREEMENT, &save);
+	if(!idi || !rs || !ji || !t2 || strcmp(idi, ka->uid) != 0) return -1;
+
+	//// 2.会话密钥：md5(Ji || t1 || t2)的十六进制的前16个字符
+	snprintf(constr, sizeof(constr), "%s%s%s", ji, ka->t1, t2);
+	md5((unsigned char *)constr, bytes_sk);
+	bytes2hex(bytes_sk, get_length(bytes_sk), str_sk);
+	memset(skey, 0, CLIENT_SKEY_LEN + 1);
+	memcpy(skey, str_sk, CLIENT_SKEY_LEN);
+
+	return 0;
+}
+
+/**
+ * @brief 用会话密钥解密医疗记录的回复，检查格式（每一条记录以分隔符结尾）
+ * @param skey 会话密钥（没有协商的时候服务器用全0的密钥）
+ * @param reply 回复的数据（十六进制）
+ * @param len 回复的长度
+ * @return 正确，返回0；解密的结果不正确，返回-1
+ */
+int client_check_record(const char *skey, const char *reply, size_t len)
+{
+	size_t n = len / 2, plen;
+	unsigned char *bytes;
+	char *plain;
+	int ret = -1;
+
+	/* 没有记录的用户回复为空 */
+	if(len == 0) return 0;
+	if(len % 2 != 0) return -1;
+
+	bytes = (unsigned char *)calloc(n + 3, 1);
+	plain = (char *)calloc(n + AES_BLOCK_SIZE + 1, 1);
+	do
+	{
+		if(!bytes || !plain) break;
+
+		hex2bytes(reply, (int)len, bytes);
+		aes_decrypt(bytes, (const unsigned char *)skey, (unsigned char *)plain);
+		plen = strlen(plain);
+		if(plen < strlen(SPLIT_RECORD) || strcmp(plain + plen - strlen(SPLIT_RECORD), SPLIT_RECORD) != 0) break;
+
+		ret = 0;
+	}while(0);
+
+	free(bytes);
+	free(plain);
+
+	return ret;
+}
@@ -0,0 +1,68 @@
+/**
+* @file       tmis_client.h
+* @brief      tmis客户端的密钥协商和医疗记录的解密（压力测试客户端使用）
+* @details    和服务器的key_agreement_server_do、handle_user_record_requset对应：
+*             客户端生成Rc和加密的Hi发给服务器（flag==1），用服务器回复的Li算出会话密钥，
+*             之后用会话密钥解密医疗记录的回复（flag==2）
+* @author     项斌
+* @date       2018/08/24
+* @version    1.0
+*/
+
+#ifndef __TMIS_CLIENT_H__
+#define __TMIS_CLIENT_H__
+
+#include <stddef.h>
+
+/** 会话密钥的长度（字节，十六进制字符串的前16个字符） */
+#define CLIENT_SKEY_LEN 16
+
+/** 一次密钥协商的客户端状态：发送请求的时候填好，收到服务器的回复以后计算会话密钥 */
+typedef struct tmis_client_ka
+{
+	char uid[64];                       ///< 用户id（IDi）
+	char k2key[20];                     ///< 由共享点算出的AES密钥，加密Hi、解密Li
+	char t1[30];                        ///< 发送请求的时间
+}tmis_client_ka_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 读取配对参数文件，初始化客户端（整个进程一次，之后多个线程可以同时使用）
+ * @param param_file 配对参数文件（a.param）
+ * @return 成功，返回0；失败，返回-1
+ */
+int client_init(const char *param_file);
+
+/**
+ * @brief 生成一个密钥协商请求的数据：Hi的十六进制 + 分隔符 + Rc的十六进制
+ * @param ka 传出参数，这次密钥协商的状态
+ * @param uid 用户id
+ * @param out 传出参数，请求的数据
+ * @param size out的大小
+ * @return 成功，返回数据的长度；失败，返回-1
+ */
+int client_ka_request(tmis_client_ka_t *ka, const char *uid, char *out, size_t size);
+
+/**
+ * @brief 处理服务器的密钥协商回复（Li的十六进制），算出会话密钥
+ * @param ka 发送请求时的状态
+ * @param reply 回复的数据
+ * @param len 回复的长度
+ * @param skey 传出参数，会话密钥（至少CLIENT_SKEY_LEN+1字节）
+ * @return 成功，返回0；回复不正确，返回-1
+ */
+int client_ka_finish(const tmis_client_ka_t *ka, const char *reply, size_t len, char *skey);
+
+/**
+ * @brief 用会话密钥解密医疗记录的回复，检查格式（每一条记录以分隔符结尾）
+ * @param skey 会话密钥（没有协商的时候服务器用全0的密钥）
+ * @param reply 回复的数据（十六进制）
+ * @param len 回复的长度
+ * @return 正确，返回0；解密的结果不正确，返回-1
+ */
+int client_check_record(const char *skey, const char *reply, size_t len);
+
+
+#endif
@@ -0,0 +1,284 @@
+/**
+* @file       tmis_conf.c
+* @brief      tmis服务器的配置
+* @details    tmis服务器启动时的配置参数，由命令行传入，没有传入的使用默认值
+* @author     项斌
+* @date       2018/08/20
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include "log.h"
+#include "tmis_conf.h"
+#include "tmis_store.h"
+
+/** 只有长格式的选项 */
+#define OPT_RCVBUF 256
+#define OPT_SNDBUF 257
+#define OPT_DB_WAIT 258
+#define OPT_CACHE_MEM 259
+#define OPT_CACHE_TTL 260
+#define OPT_STORE_PATH 261
+#define OPT_LOG_RING 262
+#define OPT_LOG_BLOCK 263
+#define OPT_LOG_PRECISION 264
+
+/** 全局变量，服务器的配置，这里是默认值 */
+tmis_conf_t tmisconf =
+{
+	.loops = DEFAULT_LOOPS,
+	.accept_batch = DEFAULT_ACCEPT_BATCH,
+	.max_conns = DEFAULT_MAX_CONNS,
+	.backlog = DEFAULT_BACKLOG,
+	.events = DEFAULT_EVENTS,
+	.nodelay = DEFAULT_NODELAY,
+	.defer_accept = DEFAULT_DEFER_ACCEPT,
+	.fastopen = DEFAULT_FASTOPEN,
+	.rcvbuf = 0,
+	.sndbuf = 0,
+	.keepalive = DEFAULT_KEEPALIVE,
+	.quiet = 0,
+	.out_hwm = DEFAULT_OUT_HWM,
+	.io = IO_EPOLL,
+	.max_frame = DEFAULT_MAX_FRAME,
+	.idle_timeout = DEFAULT_IDLE_TIMEOUT,
+	.handshake_timeout = DEFAULT_HANDSHAKE_TIMEOUT,
+	.read_timeout = DEFAULT_READ_TIMEOUT,
+	.zerocopy = DEFAULT_ZEROCOPY,
+	.unix_path = NULL,
+	.db_pool = DEFAULT_DB_POOL,
+	.db_wait = DEFAULT_DB_WAIT,
+	.cache_mem = DEFAULT_CACHE_MEM,
+	.cache_ttl = DEFAULT_CACHE_TTL,
+	.store = STORE_MYSQL,
+	.store_path = DEFAULT_STORE_PATH,
+	.log_ring = DEFAULT_LOG_RING,
+	.log_block = LOG_DROP,
+	.log_precision = 0,
+};
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 打印使用方法
+ * @param prog 程序的名字
+ */
+void conf_usage(const char *prog)
+{
+	printf("使用方法：%s [选项]\n", prog);
+	printf("  -n, --loops=N           事件循环的数量，0表示与CPU核数相同（默认%d）\n", DEFAULT_LOOPS);
+	printf("  -b, --accept-batch=N    每次最多accept的连接数量（默认%d）\n", DEFAULT_ACCEPT_BATCH);
+	printf("  -c, --max-conns=N       最多同时服务的连接数量，超过的连接被拒绝（默认%d）\n", DEFAULT_MAX_CONNS);
+	printf("  -B, --backlog=N         监听套接字的backlog（默认%d）\n", DEFAULT_BACKLOG);
+	printf("  -e, --events=N          每次epoll_wait最多返回的事件数量（默认%d）\n", DEFAULT_EVENTS);
+	printf("  -N, --nodelay=0|1       是否打开TCP_NODELAY（默认%d）\n", DEFAULT_NODELAY);
+	printf("  -D, --defer-accept=SEC  TCP_DEFER_ACCEPT，客户端发来数据以后才唤醒accept，0表示不使用（默认%d）\n", DEFAULT_DEFER_ACCEPT);
+	printf("  -F, --fastopen=QLEN     TCP_FASTOPEN的队列长度，0表示不使用（默认%d）\n", DEFAULT_FASTOPEN);
+	printf("      --rcvbuf=BYTES      套接字的接收缓冲区大小，0表示由内核自动调整（默认0）\n");
+	printf("      --sndbuf=BYTES      套接字的发送缓冲区大小，0表示由内核自动调整（默认0）\n");
+	printf("  -k, --keepalive=SEC     TCP keepalive，空闲SEC秒以后开始探测，0表示不使用（默认%d）\n", DEFAULT_KEEPALIVE);
+	printf("  -w, --out-hwm=BYTES     每个连接发送队列的高水位，超过以后暂停读取请求（默认%d）\n", DEFAULT_OUT_HWM);
+	printf("  -i, --io=epoll|uring    事件循环的I/O方式，io_uring不可用时使用epoll（默认epoll）\n");
+	printf("  -m, --max-frame=BYTES   数据包中数据的最大长度，超过的直接拒绝（默认%d）\n", DEFAULT_MAX_FRAME);
+	printf("  -I, --idle-timeout=SEC  没有收发数据的连接多长时间以后关闭，0表示不检查（默认%d）\n", DEFAULT_IDLE_TIMEOUT);
+	printf("  -K, --handshake-timeout=SEC\n");
+	printf("                          连接以后多长时间没有完成密钥协商就关闭，0表示不检查（默认%d）\n", DEFAULT_HANDSHAKE_TIMEOUT);
+	printf("  -R, --read-timeout=SEC  一个数据包多长时间没有收完就关闭连接，0表示不检查（默认%d）\n", DEFAULT_READ_TIMEOUT);
+	printf("  -z, --zerocopy=BYTES    数据不小于BYTES的回复用MSG_ZEROCOPY发送，0表示不使用（默认%d）\n", DEFAULT_ZEROCOPY);
+	printf("  -U, --unix=PATH         同时在本地套接字PATH上监听，同一台机器上的客户端不经过TCP（默认不监听）\n");
+	printf("  -P, --db-pool=N         数据库连接池的连接数量，和线程池的大小无关（默认%d）\n", DEFAULT_DB_POOL);
+	printf("      --db-wait=MS        数据库连接用完的时候最多等待多少毫秒，0表示一直等待（默认%d）\n", DEFAULT_DB_WAIT);
+	printf("      --cache-mem=BYTES   医疗记录缓存最多占用的内存，0表示不使用缓存（默认%d）\n", DEFAULT_CACHE_MEM);
+	printf("      --cache-ttl=SEC     医疗记录缓存的有效时间（默认%d）\n", DEFAULT_CACHE_TTL);
+	printf("  -S, --store=mysql|sqlite\n");
+	printf("                          医疗记录的存储：MySQL数据库，或者本机的SQLite数据库文件（默认mysql）\n");
+	printf("      --store-path=FILE   SQLite存储的数据库文件，不存在的时候创建（默认%s）\n", DEFAULT_STORE_PATH);
+	printf("      --log-ring=N        异步日志环形缓冲区的项数，0表示同步写日志（默认%d）\n", DEFAULT_LOG_RING);
+	printf("      --log-block         异步日志缓冲区满了的时候等待，不丢弃（默认丢弃并计数）\n");
+	printf("      --log-precision=0|3|6\n");
+	printf("                          日志时间秒后面的位数：0，3（毫秒），6（微秒）（默认0）\n");
+	printf("  -q, --quiet             不记录每个连接、每个请求的日志\n");
+	printf("  -h, --help              查看帮助\n");
+}
+
+/**
+ * @brief 解析命令行参数，填充全局配置tmisconf
+ * @param argc 参数个数
+ * @param argv 参数数组
+ * @return 成功，返回0；参数错误，返回-1
+ */
+int conf_parse(int argc, char **argv)
+{
+	static const struct option opts[] =
+	{
+		{"loops", required_argument, NULL, 'n'},
+		{"accept-batch", required_argument, NULL, 'b'},
+		{"max-conns", required_argument, NULL, 'c'},
+		{"backlog", required_argument, NULL, 'B'},
+		{"events", required_argument, NULL, 'e'},
+		{"nodelay", required_argument, NULL, 'N'},
+		{"defer-accept", required_argument, NULL, 'D'},
+		{"fastopen", required_argument, NULL, 'F'},
+		{"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+		{"sndbuf", required_argument, NULL, OPT_SNDBUF},
+		{"keepalive", required_argument, NULL, 'k'},
+		{"out-hwm", required_argument, NULL, 'w'},
+		{"io", required_argument,    NULL, 'i'},
+		{"max-frame", required_argument, NULL, 'm'},
+		{"idle-timeout", required_argument, NULL, 'I'},
+		{"handshake-timeout", required_argument, NULL, 'K'},
+		{"read-timeout", required_argument, NULL, 'R'},
+		{"zerocopy", required_argument, NULL, 'z'},
+		{"unix", required_argument,  NULL, 'U'},
+		{"db-pool", required_argument, NULL, 'P'},
+		{"db-wait", required_argument, NULL, OPT_DB_WAIT},
+		{"cache-mem", required_argument, NULL, OPT_CACHE_MEM},
+		{"cache-ttl", required_argument, NULL, OPT_CACHE_TTL},
+		{"store", required_argument, NULL, 'S'},
+		{"store-path", required_argument, NULL, OPT_STORE_PATH},
+		{"log-ring", required_argument, NULL, OPT_LOG_RING},
+		{"log-block", no_argument,   NULL, OPT_LOG_BLOCK},
+		{"log-precision", required_argument, NULL, OPT_LOG_PRECISION},
+		{"quiet", no_argument,       NULL, 'q'},
+		{"help",  no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+
+	while((c = getopt_long(argc, argv, "n:b:c:B:e:N:D:F:k:w:i:m:I:K:R:z:U:P:S:qh", opts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'n':
+			tmisconf.loops = atoi(optarg);
+			if(tmisconf.loops < 0) return -1;
+			break;
+		case 'b':
+			tmisconf.accept_batch = atoi(optarg);
+			if(tmisconf.accept_batch <= 0) return -1;
+			break;
+		case 'c':
+			tmisconf.max_conns = atoi(optarg);
+			if(tmisconf.max_conns <= 0) return -1;
+			break;
+		case 'B':
+			tmisconf.backlog = atoi(optarg);
+			if(tmisconf.backlog <= 0) return -1;
+			break;
+		case 'e':
+			tmisconf.events = atoi(optarg);
+			if(tmisconf.events <= 0) return -1;
+			break;
+		case 'N':
+			tmisconf.nodelay = atoi(optarg) ? 1 : 0;
+			break;
+		case 'D':
+			tmisconf.defer_accept = atoi(optarg);
+			if(tmisconf.defer_accept < 0) return -1;
+			break;
+		case 'F':
+			tmisconf.fastopen = atoi(optarg);
+			if(tmisconf.fastopen < 0) return -1;
+			break;
+		case OPT_RCVBUF:
+			tmisconf.rcvbuf = atoi(optarg);
+			if(tmisconf.rcvbuf < 0) return -1;
+			break;
+		case OPT_SNDBUF:
+			tmisconf.sndbuf = atoi(optarg);
+			if(tmisconf.sndbuf < 0) return -1;
+			break;
+		case 'k':
+			tmisconf.keepalive = atoi(optarg);
+			if(tmisconf.keepalive < 0) return -1;
+			break;
+		case 'w':
+			tmisconf.out_hwm = atoi(optarg);
+			if(tmisconf.out_hwm <= 0) return -1;
+			break;
+		case 'i':
+			if(strcmp(optarg, "epoll") == 0) tmisconf.io = IO_EPOLL;
+			else if(strcmp(optarg, "uring") == 0) tmisconf.io = IO_URING;
+			else return -1;
+			break;
+		case 'm':
+			tmisconf.max_frame = atoi(optarg);
+			if(tmisconf.max_frame <= 0) return -1;
+			break;
+		case 'I':
+			tmisconf.idle_timeout = atoi(optarg);
+			if(tmisconf.idle_timeout < 0) return -1;
+			break;
+		case 'K':
+			tmisconf.handshake_timeout = atoi(optarg);
+			if(tmisconf.handshake_timeout < 0) return -1;
+			break;
+		case 'R':
+			tmisconf.read_timeout = atoi(optarg);
+			if(tmisconf.read_timeout < 0) return -1;
+			break;
+		case 'z':
+			tmisconf.zerocopy = atoi(optarg);
+			if(tmisconf.zerocopy < 0) return -1;
+			break;
+		case 'U':
+			if(optarg[0] == '\0' || strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) return -1;
+			tmisconf.unix_path = optarg;
+			break;
+		case 'P':
+			tmisconf.db_pool = atoi(optarg);
+			if(tmisconf.db_pool <= 0) return -1;
+			break;
+		case OPT_DB_WAIT:
+			tmisconf.db_wait = atoi(optarg);
+			if(tmisconf.db_wait < 0) return -1;
+			break;
+		case OPT_CACHE_MEM:
+			tmisconf.cache_mem = atol(optarg);
+			if(tmisconf.cache_mem < 0) return -1;
+			break;
+		case OPT_CACHE_TTL:
+			tmisconf.cache_ttl = atoi(optarg);
+			if(tmisconf.cache_ttl <= 0) return -1;
+			break;
+		case 'S':
+			tmisconf.store = store_type(optarg);
+			if(tmisconf.store < 0) return -1;
+			break;
+		case OPT_STORE_PATH:
+			if(optarg[0] == '\0') return -1;
+			tmisconf.store_path = optarg;
+			break;
+		case OPT_LOG_RING:
+			tmisconf.log_ring = atoi(optarg);
+			if(tmisconf.log_ring < 0) return -1;
+			break;
+		case OPT_LOG_BLOCK:
+			tmisconf.log_block = LOG_BLOCK;
+			break;
+		case OPT_LOG_PRECISION:
+			tmisconf.log_precision = atoi(optarg);
+			if(tmisconf.log_precision != 0 && tmisconf.log_precision != 3 && tmisconf.log_precision != 6) return -1;
+			break;
+		case 'q':
+			tmisconf.quiet = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* 0表示每个CPU核一个事件循环 */
+	if(tmisconf.loops == 0)
+	{
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		tmisconf.loops = (ncpu > 0) ? (int)ncpu : 1;
+	}
+
+	return 0;
+}
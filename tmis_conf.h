@@ -0,0 +1,137 @@
+/**
+* @file       tmis_conf.h
+* @brief      tmis服务器的配置
+* @details    tmis服务器启动时的配置参数，由命令行传入，没有传入的使用默认值
+* @author     项斌
+* @date       2018/08/20
+* @version    1.0
+*/
+
+#ifndef __TMIS_CONF_H__
+#define __TMIS_CONF_H__
+
+/** 默认事件循环（reactor）的数量 */
+#define DEFAULT_LOOPS 1
+
+/** 默认每次监听套接字可读时最多accept的连接数量 */
+#define DEFAULT_ACCEPT_BATCH 64
+
+/** 默认最多同时服务的连接数量，达到以后新的连接被拒绝（accept以后马上关闭） */
+#define DEFAULT_MAX_CONNS 10000
+
+/** 默认监听套接字的backlog（受内核的net.core.somaxconn限制） */
+#define DEFAULT_BACKLOG 1024
+
+/** 默认每次epoll_wait最多返回的事件数量 */
+#define DEFAULT_EVENTS 1024
+
+/** 默认打开TCP_NODELAY：回复已经合并成一次发送，Nagle算法只会增加延迟 */
+#define DEFAULT_NODELAY 1
+
+/** 默认不使用TCP_DEFER_ACCEPT（秒） */
+#define DEFAULT_DEFER_ACCEPT 0
+
+/** 默认不使用TCP_FASTOPEN（队列长度） */
+#define DEFAULT_FASTOPEN 0
+
+/** 默认不使用TCP keepalive（空闲多少秒以后开始探测） */
+#define DEFAULT_KEEPALIVE 0
+
+/** 默认每个连接发送队列的高水位（字节），超过以后暂停处理这个客户端的请求 */
+#define DEFAULT_OUT_HWM (256 * 1024)
+
+/** 默认数据包中数据的最大长度（字节），超过的数据包直接拒绝并关闭连接 */
+#define DEFAULT_MAX_FRAME (64 * 1024)
+
+/** 默认的空闲超时（秒）：这么长时间没有收发数据的连接被关闭，0表示不检查 */
+#define DEFAULT_IDLE_TIMEOUT 300
+
+/** 默认的密钥协商超时（秒）：连接以后这么长时间还没有完成密钥协商的连接被关闭，0表示不检查 */
+#define DEFAULT_HANDSHAKE_TIMEOUT 30
+
+/** 默认的接收超时（秒）：一个数据包这么长时间还没有收完的连接被关闭，0表示不检查 */
+#define DEFAULT_READ_TIMEOUT 30
+
+/** 默认不使用MSG_ZEROCOPY发送回复 */
+#define DEFAULT_ZEROCOPY 0
+
+/** 默认数据库连接池的连接数量（和线程池的大小无关，同时访问数据库的请求最多这么多） */
+#define DEFAULT_DB_POOL 8
+
+/** 默认数据库连接用完的时候最多等待的时间（毫秒），超过以后这个请求失败 */
+#define DEFAULT_DB_WAIT 3000
+
+/** 默认医疗记录缓存最多占用的内存（字节），0表示不使用缓存 */
+#define DEFAULT_CACHE_MEM (32 * 1024 * 1024)
+
+/** 默认医疗记录缓存的有效时间（秒） */
+#define DEFAULT_CACHE_TTL 30
+
+/** 默认SQLite存储的数据库文件 */
+#define DEFAULT_STORE_PATH "tmis_record.db"
+
+/** 默认异步日志环形缓冲区的项数（每项LOG_LINE字节） */
+#define DEFAULT_LOG_RING 8192
+
+/** 事件循环的I/O方式：epoll */
+#define IO_EPOLL 0
+
+/** 事件循环的I/O方式：io_uring（multishot accept、provided buffer接收、批量提交发送） */
+#define IO_URING 1
+
+/** 服务器的配置信息 */
+typedef struct tmis_conf
+{
+	int loops;                          ///< 事件循环的数量，每个循环一个线程、一个epoll、一个监听套接字；0表示与CPU核数相同
+	int accept_batch;                   ///< 每次监听套接字可读时最多accept的连接数量
+	int max_conns;                      ///< 最多同时服务的连接数量，启动时按它提高RLIMIT_NOFILE
+	int backlog;                        ///< 监听套接字的backlog
+	int events;                         ///< 每次epoll_wait最多返回的事件数量
+	int nodelay;                        ///< 1表示打开TCP_NODELAY
+	int defer_accept;                   ///< TCP_DEFER_ACCEPT：客户端发来数据（或者超过这么多秒）以后才accept，0表示不使用
+	int fastopen;                       ///< TCP_FASTOPEN的队列长度，0表示不使用
+	int rcvbuf;                         ///< SO_RCVBUF（字节），0表示使用内核的默认值（自动调整）
+	int sndbuf;                         ///< SO_SNDBUF（字节），0表示使用内核的默认值（自动调整）
+	int keepalive;                      ///< TCP keepalive：空闲多少秒以后开始探测，0表示不使用
+	int quiet;                          ///< 1表示不记录每个连接、每个请求的日志
+	int out_hwm;                        ///< 每个连接发送队列的高水位（字节）
+	int io;                             ///< 事件循环的I/O方式：IO_EPOLL，IO_URING
+	int max_frame;                      ///< 数据包中数据的最大长度（字节）
+	int idle_timeout;                   ///< 空闲超时（秒），0表示不检查
+	int handshake_timeout;              ///< 密钥协商超时（秒），0表示不检查
+	int read_timeout;                   ///< 接收超时（秒），0表示不检查
+	int zerocopy;                       ///< 数据不小于这个字节数的回复用MSG_ZEROCOPY发送，0表示不使用（只用于epoll）
+	const char *unix_path;              ///< 本地（AF_UNIX）监听套接字的路径，NULL表示不监听
+	int db_pool;                        ///< 数据库连接池的连接数量
+	int db_wait;                        ///< 数据库连接用完的时候最多等待的时间（毫秒），0表示一直等待
+	long cache_mem;                     ///< 医疗记录缓存最多占用的内存（字节），0表示不使用缓存
+	int cache_ttl;                      ///< 医疗记录缓存的有效时间（秒）
+	int store;                          ///< 医疗记录的存储：STORE_MYSQL，STORE_SQLITE
+	const char *store_path;             ///< SQLite存储的数据库文件
+	int log_ring;                       ///< 异步日志环形缓冲区的项数，0表示同步写日志
+	int log_block;                      ///< 异步日志缓冲区满了的时候：LOG_DROP（丢弃并计数），LOG_BLOCK（等待）
+	int log_precision;                  ///< 日志时间秒后面的位数：0，3（毫秒），6（微秒）
+}tmis_conf_t;
+
+/** 全局变量，服务器的配置 */
+extern tmis_conf_t tmisconf;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 解析命令行参数，填充全局配置tmisconf
+ * @param argc 参数个数
+ * @param argv 参数数组
+ * @return 成功，返回0；参数错误，返回-1
+ */
+int conf_parse(int argc, char **argv);
+
+/**
+ * @brief 打印使用方法
+ * @param prog 程序的名字
+ */
+void conf_usage(const char *prog);
+
+
+#endif
@@ -0,0 +1,992 @@
+/**
+* @file       tmis_conn.c
+* @brief      tmis服务器的客户端连接
+* @details    每个客户端连接的状态，按照套接字fd为下标保存在连接表中，accept的时候填好，之后各个处理函数直接使用
+* @author     项斌
+* @date       2018/08/20
+* @version    1.0
+*/
+
+#define _GNU_SOURCE             /* struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "tmis_conf.h"
+#include "tmis_conn.h"
+#include "tmis_pool.h"
+
+/* 旧的头文件中没有MSG_ZEROCOPY相关的定义（Linux 4.14以后支持） */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+static tmis_conn_t *conns = NULL;    ///< 连接表，下标为fd
+static int conns_size = 0;           ///< 连接表的大小
+static int conns_open = 0;           ///< 当前打开的连接数量
+
+/** 关闭的时候MSG_ZEROCOPY发送还没有完成的套接字，留着接收完成通知 */
+typedef struct tmis_zlinger
+{
+	struct tmis_zlinger *next;          ///< 下一个
+	int fd;                             ///< 套接字，全部完成以后关闭
+	int loop;                           ///< 事件循环编号，由这个事件循环的定时器处理
+	long since;                         ///< 开始等待的时间（秒，单调时钟）
+	tmis_obuf_t *zhead;                 ///< 等待完成的回复
+	tmis_obuf_t *ztail;                 ///< 等待完成的回复的队尾
+}tmis_zlinger_t;
+
+static tmis_zlinger_t *zlingers = NULL;                     ///< 推迟关闭的套接字
+static pthread_mutex_t zlock = PTHREAD_MUTEX_INITIALIZER;   ///< 推迟关闭的套接字的锁
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 初始化连接表
+ * @param max_fd 连接表的大小，fd必须小于它
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_table_init(int max_fd)
+{
+	pthread_condattr_t attr;
+	int i;
+
+	if(max_fd <= 0) return -1;
+
+	conns = (tmis_conn_t *)calloc(max_fd, sizeof(tmis_conn_t));
+	if(NULL==conns) return -1;
+
+	/* 等待发送完成用单调时钟，不受系统时间调整影响 */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for(i=0;i<max_fd;i++)
+	{
+		conns[i].fd = -1;
+		pthread_mutex_init(&conns[i].lock, NULL);
+		pthread_cond_init(&conns[i].drained, &attr);
+	}
+	pthread_condattr_destroy(&attr);
+	conns_size = max_fd;
+
+	return 0;
+}
+
+/**
+ * @brief 根据套接字取得连接
+ * @param fd 客户端套接字
+ * @return 成功，返回连接；fd超出连接表的范围，返回NULL
+ */
+tmis_conn_t *conn_get(int fd)
+{
+	if(fd < 0 || fd >= conns_size) return NULL;
+	return &conns[fd];
+}
+
+/**
+ * @brief 当前打开的连接数量
+ * @return 连接数量
+ */
+int conn_count(void)
+{
+	return __sync_add_and_fetch(&conns_open, 0);
+}
+
+/**
+ * @brief 新的连接：记录事件循环编号和客户端地址
+ * @param fd 客户端套接字
+ * @param loop 事件循环编号
+ * @param efd 事件循环的红黑树树根
+ * @param addr accept传出的客户端地址
+ * @return 成功，返回连接；fd超出连接表的范围，返回NULL
+ */
+tmis_conn_t *conn_open(int fd, int loop, int efd, const struct sockaddr *addr)
+{
+	tmis_conn_t *c = conn_get(fd);
+	if(NULL==c) return NULL;
+
+	c->fd = fd;
+	c->loop = loop;
+	c->efd = efd;
+	c->port = 0;
+	c->local = 0;
+	c->peer[0] = '\0';
+	c->inpos = 0;
+	c->inlen = 0;
+	c->ohead = NULL;
+	c->otail = NULL;
+	c->opending = 0;
+	c->zpending = 0;
+	c->gen++;
+	c->busy = 0;
+	c->sending = 0;
+	c->scnt = 0;
+	c->recving = 0;
+	c->rpaused = 0;
+	c->closing = 0;
+	c->dbwait = 0;
+	c->zcopy = 0;
+	c->zcnext = 0;
+	c->zhead = NULL;
+	c->ztail = NULL;
+	c->opened = timer_now();
+	c->active = c->opened;
+	c->rstart = 0;
+	c->keyed = 0;
+	memset(c->skey, 0, sizeof(c->skey));
+	__sync_fetch_and_add(&conns_open, 1);
+
+	/* 客户端地址只在这里转换一次 */
+	if(addr->sa_family == AF_INET)
+	{
+		const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+		inet_ntop(AF_INET, &in4->sin_addr, c->peer, sizeof(c->peer));
+		c->port = ntohs(in4->sin_port);
+	}
+	else if(addr->sa_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		inet_ntop(AF_INET6, &in6->sin6_addr, c->peer, sizeof(c->peer));
+		c->port = ntohs(in6->sin6_port);
+	}
+	/* 本地套接字没有地址和端口，记录对方的进程号（取不到的时候只记录"unix"） */
+	else if(addr->sa_family == AF_UNIX)
+	{
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		c->local = 1;
+		if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+			snprintf(c->peer, sizeof(c->peer), "unix:pid %d", (int)cred.pid);
+		else
+			snprintf(c->peer, sizeof(c->peer), "unix");
+	}
+	else snprintf(c->peer, sizeof(c->peer), "unknown");
+
+	return c;
+}
+
+/**
+ * @brief 从套接字读取数据，追加到接收缓存中（只调用一次read）
+ * @param c 连接
+ * @return 同read：大于0，读取的字节数；0，客户端已关闭；-1，出错（errno为EAGAIN表示暂时没有数据）
+ */
+ssize_t conn_read(tmis_conn_t *c)
+{
+	ssize_t n;
+
+	/* 大数据包处理完以后，扩大的接收缓存换回正常大小 */
+	if(c->inbuf && c->incap > CONN_INBUF_SIZE && c->inpos == c->inlen)
+	{
+		free(c->inbuf);
+		c->inbuf = NULL;
+		c->inpos = 0;
+		c->inlen = 0;
+	}
+
+	/* 接收缓存第一次使用的时候再申请，连接关闭的时候释放 */
+	if(NULL==c->inbuf)
+	{
+		c->inbuf = (char *)malloc(CONN_INBUF_SIZE);
+		if(NULL==c->inbuf)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		c->incap = CONN_INBUF_SIZE;
+	}
+
+	/* 已经处理过的数据移走，腾出空间 */
+	if(c->inpos > 0)
+	{
+		memmove(c->inbuf, c->inbuf + c->inpos, c->inlen - c->inpos);
+		c->inlen -= c->inpos;
+		c->inpos = 0;
+	}
+
+	/* 满了说明剩下的是一个还没收完的大数据包（长度已经检查过），扩大接收缓存 */
+	if(c->inlen == c->incap)
+	{
+		char *p = (char *)realloc(c->inbuf, c->incap * 2);
+		if(NULL==p)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		c->inbuf = p;
+		c->incap *= 2;
+	}
+
+	do
+	{
+		n = read(c->fd, c->inbuf + c->inlen, c->incap - c->inlen);
+	}while(n < 0 && errno == EINTR);
+
+	if(n > 0)
+	{
+		c->inlen += n;
+		c->active = timer_now();
+	}
+	return n;
+}
+
+/**
+ * @brief 从接收缓存中取出下一个完整的数据包
+ * @param c 连接
+ * @param pkt 传出参数，数据包（数据在缓存池的缓存中，以'\0'结尾，调用者处理完以后pool_free）
+ * @return 1，取出了一个数据包；0，还没有完整的数据包；-1，数据包太长或者没有内存
+ * @note 头部一到就检查长度，太长的数据包不用等数据收完、也不申请缓存
+ */
+int conn_frame(tmis_conn_t *c, tmis_packet_t *pkt)
+{
+	size_t avail = c->inlen - c->inpos;
+	unsigned int len;
+
+	/* 不完整的数据包开始等待，超过接收超时还没有收完就关闭连接 */
+	if(avail < PKT_HEADLEN)
+	{
+		if(avail == 0) c->rstart = 0;
+		else if(c->rstart == 0) c->rstart = timer_now();
+		return 0;
+	}
+
+	memcpy(&len, c->inbuf + c->inpos, sizeof(len));
+	len = ntohl(len);
+	if(len > (unsigned int)tmisconf.max_frame) return -1;
+	if(avail < PKT_HEADLEN + len)
+	{
+		if(c->rstart == 0) c->rstart = timer_now();
+		return 0;
+	}
+	c->rstart = 0;
+
+	/* 留一个字节放'\0' */
+	pkt->buf = pool_alloc(len + 1);
+	if(NULL==pkt->buf) return -1;
+	pkt->len = len;
+	pkt->flag = c->inbuf[c->inpos + 4];
+	memcpy(pkt->buf, c->inbuf + c->inpos + PKT_HEADLEN, len);
+	pkt->buf[len] = '\0';
+	c->inpos += PKT_HEADLEN + len;
+
+	return 1;
+}
+
+/**
+ * @brief 回复客户端：数据已经在缓存池的缓存中，直接把这块缓存加入发送队列，不再拷贝
+ * @param c 连接
+ * @param flag 数据包类型
+ * @param buf pool_alloc取得的缓存，之后由连接负责还给缓存池（失败的时候也是）
+ * @param len 数据长度
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_reply_buf(tmis_conn_t *c, char flag, char *buf, size_t len)
+{
+	unsigned int nlen = htonl((unsigned int)len);
+
+	tmis_obuf_t *ob = (tmis_obuf_t *)malloc(sizeof(tmis_obuf_t));
+	if(NULL==ob)
+	{
+		pool_free(buf);
+		return -1;
+	}
+	memcpy(ob->head, &nlen, sizeof(nlen));
+	ob->head[4] = flag;
+	ob->data = buf;
+	ob->len = PKT_HEADLEN + len;
+	ob->off = 0;
+	ob->zc = 0;
+	ob->zcid = 0;
+	ob->next = NULL;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->otail) c->otail->next = ob;
+	else c->ohead = ob;
+	c->otail = ob;
+	c->opending += ob->len;
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+/**
+ * @brief 回复客户端：把一个数据包加入连接的发送队列，由conn_flush发送（数据拷贝一次，用于短的回复）
+ * @param c 连接
+ * @param flag 数据包类型
+ * @param data 数据
+ * @param len 数据长度
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_reply(tmis_conn_t *c, char flag, const char *data, size_t len)
+{
+	char *buf = NULL;
+
+	if(len > 0)
+	{
+		buf = pool_alloc(len);
+		if(NULL==buf) return -1;
+		memcpy(buf, data, len);
+	}
+
+	return conn_reply_buf(c, flag, buf, len);
+}
+
+/**
+ * @brief 打开套接字的SO_ZEROCOPY，之后数据不小于tmisconf.zerocopy的回复用MSG_ZEROCOPY发送
+ * @param c 连接
+ * @return 成功，返回0；内核不支持，返回-1（仍然用普通的发送）
+ */
+int conn_zerocopy(tmis_conn_t *c)
+{
+	int on = 1;
+
+	if(setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) return -1;
+	c->zcopy = 1;
+
+	return 0;
+}
+
+/**
+ * @brief 释放一个回复，数据还给缓存池
+ * @param ob 回复
+ */
+static void obuf_free(tmis_obuf_t *ob)
+{
+	pool_free(ob->data);
+	free(ob);
+}
+
+/**
+ * @brief 回复中还没有发送的部分：头部和数据各一块
+ * @param ob 回复
+ * @param iov 传出参数，数据块数组，至少2个元素
+ * @return 数据块的数量
+ */
+static int obuf_iov(tmis_obuf_t *ob, struct iovec *iov)
+{
+	int cnt = 0;
+	size_t doff = 0;
+
+	if(ob->off < PKT_HEADLEN)
+	{
+		iov[cnt].iov_base = ob->head + ob->off;
+		iov[cnt].iov_len = PKT_HEADLEN - ob->off;
+		cnt++;
+	}
+	else doff = ob->off - PKT_HEADLEN;
+
+	if(ob->len > PKT_HEADLEN + doff)
+	{
+		iov[cnt].iov_base = ob->data + doff;
+		iov[cnt].iov_len = ob->len - PKT_HEADLEN - doff;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+/**
+ * @brief 释放已经发送完的回复，发送了一半的记下位置（调用者持有c->lock）
+ * @param c 连接
+ * @param n 发送的字节数
+ * @param zc 是不是MSG_ZEROCOPY发送的
+ * @param zcid MSG_ZEROCOPY发送的编号
+ * @note MSG_ZEROCOPY发送的回复，内核还在使用数据，放到等待队列中，等完成通知以后再释放
+ */
+static void out_consume(tmis_conn_t *c, size_t n, int zc, unsigned zcid)
+{
+	tmis_obuf_t *ob;
+
+	if(n > 0) c->active = timer_now();
+	c->opending -= n;
+	while(n > 0)
+	{
+		ob = c->ohead;
+		if(zc)
+		{
+			ob->zc = 1;
+			ob->zcid = zcid;
+		}
+		if(n < ob->len - ob->off)
+		{
+			ob->off += n;
+			break;
+		}
+		n -= ob->len - ob->off;
+		c->ohead = ob->next;
+		if(ob->zc)
+		{
+			ob->next = NULL;
+			if(c->ztail) c->ztail->next = ob;
+			else c->zhead = ob;
+			c->ztail = ob;
+			c->zpending += ob->len;
+		}
+		else obuf_free(ob);
+	}
+	if(NULL==c->ohead) c->otail = NULL;
+}
+
+/**
+ * @brief 处理错误队列中MSG_ZEROCOPY的完成通知，释放等待队列中编号在[lo, hi]之间的回复
+ * @param fd 套接字
+ * @param head 等待完成的回复的队首
+ * @param tail 等待完成的回复的队尾
+ * @param pending 等待完成的字节数，释放的回复从中减掉，可以为NULL
+ * @return 内核最后还是拷贝了数据，返回1；否则，返回0
+ */
+static int zc_reap_list(int fd, tmis_obuf_t **head, tmis_obuf_t **tail, size_t *pending)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	tmis_obuf_t *ob, **pp;
+	unsigned lo, hi;
+	int copied = 0;
+
+	while(*head)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+			if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) copied = 1;
+
+			lo = serr->ee_info;
+			hi = serr->ee_data;
+			*tail = NULL;
+			for(pp = head; (ob = *pp) != NULL; )
+			{
+				if(ob->zcid - lo <= hi - lo)
+				{
+					*pp = ob->next;
+					if(pending) *pending -= ob->len;
+					obuf_free(ob);
+				}
+				else
+				{
+					*tail = ob;
+					pp = &ob->next;
+				}
+			}
+		}
+	}
+
+	return copied;
+}
+
+/**
+ * @brief 处理连接的MSG_ZEROCOPY完成通知，释放已经完成的回复（调用者持有c->lock）
+ * @param c 连接
+ */
+static void zc_reap(tmis_conn_t *c)
+{
+	/* 内核最后还是拷贝了（例如本机回环），以后这个连接不再用MSG_ZEROCOPY */
+	if(zc_reap_list(c->fd, &c->zhead, &c->ztail, &c->zpending)) c->zcopy = 0;
+}
+
+/**
+ * @brief 关闭连接的时候还有MSG_ZEROCOPY发送没有完成：推迟关闭套接字，等内核通知完成以后再释放回复
+ * @param fd 套接字
+ * @param loop 事件循环编号
+ * @param head 等待完成的回复的队首
+ * @param tail 等待完成的回复的队尾
+ * @return 成功，返回0；失败（内存不够），返回-1
+ * @note 完成通知只能从这个套接字的错误队列读到，所以套接字要留着；
+ *       它没有关闭，fd也就不会被新的连接用上，连接表中原来的位置可以马上给别的连接使用
+ */
+static int zc_linger_add(int fd, int loop, tmis_obuf_t *head, tmis_obuf_t *tail)
+{
+	tmis_zlinger_t *zl = (tmis_zlinger_t *)malloc(sizeof(tmis_zlinger_t));
+	if(NULL==zl) return -1;
+
+	zl->fd = fd;
+	zl->loop = loop;
+	zl->since = timer_now();
+	zl->zhead = head;
+	zl->ztail = tail;
+	pthread_mutex_lock(&zlock);
+	zl->next = zlingers;
+	zlingers = zl;
+	pthread_mutex_unlock(&zlock);
+
+	return 0;
+}
+
+/**
+ * @brief 每秒一次：处理推迟关闭的套接字的完成通知，全部完成的套接字关闭
+ * @param loop 事件循环编号，只处理这个事件循环的连接
+ * @return 等了CONN_ZC_LINGER秒还没有完成、放弃等待的套接字数量
+ * @note 放弃等待的套接字直接关闭，数据页可能还被内核引用，它们的数据不还给缓存池（泄漏掉，不会被覆盖）
+ */
+int conn_zc_linger(int loop)
+{
+	tmis_zlinger_t *zl, **pp;
+	tmis_obuf_t *ob;
+	long now = timer_now();
+	int n = 0;
+
+	pthread_mutex_lock(&zlock);
+	for(pp = &zlingers; (zl = *pp) != NULL; )
+	{
+		if(zl->loop != loop)
+		{
+			pp = &zl->next;
+			continue;
+		}
+
+		zc_reap_list(zl->fd, &zl->zhead, &zl->ztail, NULL);
+		if(zl->zhead && now - zl->since < CONN_ZC_LINGER)
+		{
+			pp = &zl->next;
+			continue;
+		}
+
+		if(zl->zhead) n++;
+		while(zl->zhead)
+		{
+			ob = zl->zhead;
+			zl->zhead = ob->next;
+			free(ob);
+		}
+		close(zl->fd);
+		*pp = zl->next;
+		free(zl);
+	}
+	pthread_mutex_unlock(&zlock);
+
+	return n;
+}
+
+/**
+ * @brief 尽量发送发送队列中的数据（非阻塞，多个回复合并成一次sendmsg），发送缓冲区满了就停下；
+ *        同时处理错误队列中MSG_ZEROCOPY的完成通知，释放已经完成的回复
+ * @param c 连接
+ * @return 成功（包括没有发送完的情况），返回0；出错，返回-1
+ */
+int conn_flush(tmis_conn_t *c)
+{
+	struct iovec iov[CONN_IOV_MAX];
+	struct msghdr msg;
+	tmis_obuf_t *ob;
+	ssize_t n;
+	int cnt, zc, ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->zhead) zc_reap(c);
+	while(c->ohead)
+	{
+		/* 队首开始的若干个回复合并成一次sendmsg；其中有数据大的回复就用MSG_ZEROCOPY */
+		zc = 0;
+		for(cnt=0,ob=c->ohead; ob && cnt+2<=CONN_IOV_MAX; ob=ob->next)
+		{
+			cnt += obuf_iov(ob, iov + cnt);
+			if(c->zcopy && tmisconf.zerocopy > 0 && ob->len - PKT_HEADLEN >= (size_t)tmisconf.zerocopy) zc = 1;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = cnt;
+		n = sendmsg(c->fd, &msg, zc ? MSG_ZEROCOPY : 0);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			/* 锁定的内存超过了限制，这个连接改用普通的发送 */
+			if(zc && errno == ENOBUFS)
+			{
+				c->zcopy = 0;
+				continue;
+			}
+			/* 发送缓冲区满了，等可写事件 */
+			if(errno != EAGAIN && errno != EWOULDBLOCK) ret = -1;
+			break;
+		}
+		out_consume(c, n, zc, c->zcnext);
+		if(zc) c->zcnext++;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief 发送队列是否超过了高水位，超过了就暂时不再处理这个客户端的请求
+ * @param c 连接
+ * @return 超过了，返回1；否则，返回0
+ * @note MSG_ZEROCOPY发送以后等待完成的回复还占着内存，也算在里面
+ */
+int conn_out_full(tmis_conn_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	int full = (c->opending + c->zpending >= (size_t)tmisconf.out_hwm);
+	pthread_mutex_unlock(&c->lock);
+
+	return full;
+}
+
+/**
+ * @brief 计算单调时钟上timeout_ms毫秒以后的时间
+ * @param t 传出参数，到期的时间
+ * @param timeout_ms 毫秒数
+ */
+static void deadline_after(struct timespec *t, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+	t->tv_sec += timeout_ms / 1000;
+	t->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if(t->tv_nsec >= 1000000000L)
+	{
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * @brief 离到期还剩多少毫秒
+ * @param t 到期的时间（单调时钟）
+ * @return 毫秒数，已经到期返回0
+ */
+static int deadline_left(const struct timespec *t)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (long long)(t->tv_sec - now.tv_sec) * 1000LL + (t->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+	return ms > 0 ? (int)ms : 0;
+}
+
+/**
+ * @brief 流式回复：处理线程等待发送队列降到高水位以下，回复再多，发送队列占用的内存也不会一直增长；
+ *        epoll模式由处理线程自己发送（连接在处理线程中的时候事件循环不会碰它），
+ *        io_uring模式由事件循环发送（调用者先通知事件循环），这里等待发送完成
+ * @param c 连接
+ * @param timeout_ms 最多等待多少毫秒
+ * @return 降下来了，返回0；超时、出错或者连接要关闭了，返回-1
+ */
+int conn_wait_drain(tmis_conn_t *c, int timeout_ms)
+{
+	struct timespec deadline;
+	struct pollfd pfd;
+	socklen_t len;
+	int n, left, ret, err, rc = 0;
+
+	if(tmisconf.io != IO_URING)
+	{
+		pfd.fd = c->fd;
+		pfd.events = POLLOUT;
+		while(1)
+		{
+			if(conn_flush(c) != 0) return -1;
+			if(!conn_out_full(c)) return 0;
+			/* 被信号打断（SIGUSR1、SIGTERM等）不算出错，用剩下的时间接着等 */
+			deadline_after(&deadline, timeout_ms);
+			left = timeout_ms;
+			while((n = poll(&pfd, 1, left)) < 0 && errno == EINTR)
+				left = deadline_left(&deadline);
+			if(n <= 0 || (pfd.revents & POLLHUP)) return -1;
+			if(pfd.revents & POLLERR)
+			{
+				/* MSG_ZEROCOPY的完成通知也会产生POLLERR：先处理完成通知，套接字真的出错了才返回 */
+				pthread_mutex_lock(&c->lock);
+				zc_reap(c);
+				pthread_mutex_unlock(&c->lock);
+				err = 0;
+				len = sizeof(err);
+				if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) return -1;
+			}
+		}
+	}
+
+	deadline_after(&deadline, timeout_ms);
+	pthread_mutex_lock(&c->lock);
+	while(c->opending >= (size_t)tmisconf.out_hwm && !c->closing && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&c->drained, &c->lock, &deadline);
+	ret = (c->opending < (size_t)tmisconf.out_hwm && !c->closing) ? 0 : -1;
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief io_uring模式：接收缓存中没有处理的数据是否太多了，太多了就暂停接收
+ * @param c 连接
+ * @return 太多了，返回1；否则，返回0
+ * @note 界限不小于一个最大的数据包，暂停的时候接收缓存中至少有一个完整的数据包，处理线程一定能处理掉一些
+ */
+int conn_in_full(tmis_conn_t *c)
+{
+	size_t limit = PKT_HEADLEN + (size_t)tmisconf.max_frame;
+
+	if(limit < CONN_INBUF_SIZE) limit = CONN_INBUF_SIZE;
+	pthread_mutex_lock(&c->lock);
+	int full = (c->inlen - c->inpos > limit);
+	pthread_mutex_unlock(&c->lock);
+
+	return full;
+}
+
+/**
+ * @brief 接收缓存中是否还有没有处理的数据
+ * @param c 连接
+ * @return 有，返回1；否则，返回0
+ */
+int conn_has_input(tmis_conn_t *c)
+{
+	return c->inpos < c->inlen;
+}
+
+/**
+ * @brief 重新注册连接的事件（EPOLLONESHOT）：发送队列没有超过高水位时注册读事件，
+ *        发送队列不为空时注册写事件
+ * @param c 连接
+ * @return 成功，返回0；失败，返回-1
+ * @note 如果在这之前又来了数据或者已经可写，EPOLL_CTL_MOD会马上再产生一个事件，不会丢失；
+ *       只是MSG_ZEROCOPY等待完成的回复超过高水位的话，完成通知产生的EPOLLERR（总是会报告）再交给线程池
+ */
+int conn_rearm(tmis_conn_t *c)
+{
+	struct epoll_event tep;
+
+	tep.events = EPOLLET | EPOLLONESHOT;
+	pthread_mutex_lock(&c->lock);
+	if(c->opending + c->zpending < (size_t)tmisconf.out_hwm) tep.events |= EPOLLIN;
+	if(c->opending > 0) tep.events |= EPOLLOUT;
+	pthread_mutex_unlock(&c->lock);
+
+	tep.data.fd = c->fd;
+	return epoll_ctl(c->efd, EPOLL_CTL_MOD, c->fd, &tep);
+}
+
+/**
+ * @brief io_uring模式：事件循环收到的数据追加到接收缓存中
+ * @param c 连接
+ * @param data 数据
+ * @param len 数据长度
+ * @return 需要交给线程池处理，返回1；正在处理中，返回0；出错，返回-1
+ */
+int conn_append(tmis_conn_t *c, const char *data, size_t len)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	do
+	{
+		/* 已经处理过的数据移走，腾出空间 */
+		if(c->inpos > 0)
+		{
+			memmove(c->inbuf, c->inbuf + c->inpos, c->inlen - c->inpos);
+			c->inlen -= c->inpos;
+			c->inpos = 0;
+		}
+
+		/* 放不下就扩大接收缓存，接收缓存太多的时候事件循环会暂停接收 */
+		if(c->inlen + len > c->incap)
+		{
+			size_t cap = c->incap ? c->incap : CONN_INBUF_SIZE;
+			while(cap < c->inlen + len) cap *= 2;
+			char *p = (char *)realloc(c->inbuf, cap);
+			if(NULL==p)
+			{
+				ret = -1;
+				break;
+			}
+			c->inbuf = p;
+			c->incap = cap;
+		}
+
+		memcpy(c->inbuf + c->inlen, data, len);
+		c->inlen += len;
+		c->active = timer_now();
+
+		if(!c->busy && !c->closing && c->opending < (size_t)tmisconf.out_hwm)
+		{
+			c->busy = 1;
+			ret = 1;
+		}
+	}while(0);
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief io_uring模式：处理线程取出下一个完整的数据包，没有了（或者发送队列超过高水位）就结束处理
+ * @param c 连接
+ * @param pkt 传出参数，数据包
+ * @return 1，取出了一个数据包；0，处理结束；-1，数据包太长或者没有内存，连接将被关闭
+ */
+int conn_next_frame(tmis_conn_t *c, tmis_packet_t *pkt)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->opending < (size_t)tmisconf.out_hwm && !c->closing) ret = conn_frame(c, pkt);
+	if(ret < 0) c->closing = 1;
+	/* 在锁里面结束处理，事件循环之后收到的数据会重新交给线程池 */
+	if(ret != 1) c->busy = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief io_uring模式：准备发送发送队列中的数据
+ * @param c 连接
+ * @param iov 传出参数，数据块数组（发送完成以前保持不变）
+ * @return 数据块的数量；没有数据或者已经在发送，返回0；出错，返回-1
+ */
+int conn_send_prepare(tmis_conn_t *c, struct iovec **iov)
+{
+	tmis_obuf_t *ob;
+	int cnt = 0;
+
+	pthread_mutex_lock(&c->lock);
+	do
+	{
+		if(c->sending || NULL==c->ohead) break;
+
+		if(NULL==c->siov)
+		{
+			c->siov = (struct iovec *)malloc(sizeof(struct iovec) * CONN_IOV_MAX);
+			if(NULL==c->siov)
+			{
+				cnt = -1;
+				break;
+			}
+		}
+
+		for(ob=c->ohead; ob && cnt+2<=CONN_IOV_MAX; ob=ob->next)
+			cnt += obuf_iov(ob, c->siov + cnt);
+		c->sending = 1;
+		c->scnt = cnt;
+		*iov = c->siov;
+	}while(0);
+	pthread_mutex_unlock(&c->lock);
+
+	return cnt;
+}
+
+/**
+ * @brief io_uring模式：发送完成，释放已经发送的回复
+ * @param c 连接
+ * @param n 发送的字节数
+ * @return 因为高水位暂停的请求需要交给线程池继续处理，返回1；否则，返回0
+ */
+int conn_send_done(tmis_conn_t *c, size_t n)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	out_consume(c, n, 0, 0);
+	c->sending = 0;
+	c->scnt = 0;
+	if(c->opending < (size_t)tmisconf.out_hwm || c->closing) pthread_cond_broadcast(&c->drained);
+	if(!c->busy && !c->closing && c->opending < (size_t)tmisconf.out_hwm && c->inpos < c->inlen)
+	{
+		c->busy = 1;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief io_uring模式：连接是否可以关闭了（要求关闭，并且没有在处理、没有在发送、发送队列已空）
+ * @param c 连接
+ * @return 可以，返回1；否则，返回0
+ */
+int conn_can_close(tmis_conn_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	int ret = c->closing && !c->busy && !c->sending && NULL==c->ohead;
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+/**
+ * @brief 关闭连接，清空连接的状态并关闭套接字
+ * @param c 连接
+ */
+void conn_close(tmis_conn_t *c)
+{
+	if(NULL==c || c->fd < 0) return;
+
+	/* 先从时间轮中删除，之后时间轮不会再访问这个连接 */
+	wheel_del(c);
+
+	int fd = c->fd;
+	free(c->inbuf);
+	c->inbuf = NULL;
+	c->inpos = 0;
+	c->inlen = 0;
+	c->incap = 0;
+
+	/* 没有发送的回复直接丢弃 */
+	pthread_mutex_lock(&c->lock);
+	while(c->ohead)
+	{
+		tmis_obuf_t *ob = c->ohead;
+		c->ohead = ob->next;
+		obuf_free(ob);
+	}
+	c->otail = NULL;
+	/* MSG_ZEROCOPY发送的回复：内核完成以前数据页一直被引用（可能还要重传），不能还给缓存池。
+	   先处理已经到达的完成通知，还有没完成的，套接字推迟到全部完成以后再关闭 */
+	if(c->zhead) zc_reap(c);
+	tmis_obuf_t *zhead = c->zhead, *ztail = c->ztail;
+	c->zhead = NULL;
+	c->ztail = NULL;
+	c->opending = 0;
+	c->zpending = 0;
+	free(c->siov);
+	c->siov = NULL;
+	pthread_mutex_unlock(&c->lock);
+
+	c->fd = -1;
+	__sync_fetch_and_sub(&conns_open, 1);
+	if(zhead)
+	{
+		/* 不再接收事件，对方照常收到连接关闭；已经在发送缓冲区中的数据继续发送 */
+		epoll_ctl(c->efd, EPOLL_CTL_DEL, fd, NULL);
+		shutdown(fd, SHUT_RDWR);
+		if(zc_linger_add(fd, c->loop, zhead, ztail) == 0) return;
+
+		/* 内存不够：只能直接关闭，数据页不还给缓存池 */
+		while(zhead)
+		{
+			tmis_obuf_t *ob = zhead;
+			zhead = ob->next;
+			free(ob);
+		}
+	}
+	close(fd);
+}
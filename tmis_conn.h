@@ -0,0 +1,269 @@
+/**
+* @file       tmis_conn.h
+* @brief      tmis服务器的客户端连接
+* @details    每个客户端连接的状态，按照套接字fd为下标保存在连接表中，accept的时候填好，之后各个处理函数直接使用
+* @author     项斌
+* @date       2018/08/20
+* @version    1.0
+*/
+
+#ifndef __TMIS_CONN_H__
+#define __TMIS_CONN_H__
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "tmis_proto.h"
+#include "tmis_timer.h"
+
+/** 客户端地址字符串的长度 */
+#define PEER_STRLEN INET6_ADDRSTRLEN
+
+/** 接收缓存的大小，能放下几个普通的数据包（客户端连续发送的），更大的数据包到的时候再扩大 */
+#define CONN_INBUF_SIZE (4 * (PKT_HEADLEN + BUFLEN))
+
+/** 一次发送最多合并的数据块数量（每个回复的头部、数据各一块） */
+#define CONN_IOV_MAX 64
+
+/** 关闭的时候MSG_ZEROCOPY发送还没有完成，最多再等多少秒 */
+#define CONN_ZC_LINGER 120
+
+/** 发送队列中的一个回复：头部和数据分开放，用writev一起发送，数据不用拷贝到一个完整的数据包中 */
+typedef struct tmis_obuf
+{
+	struct tmis_obuf *next;             ///< 队列中的下一个回复
+	char head[PKT_HEADLEN];             ///< 数据包头部：长度 + 类型
+	char *data;                         ///< 数据，缓存池中的缓存，回复释放的时候还给缓存池
+	size_t len;                         ///< 数据包的长度（头部 + 数据）
+	size_t off;                         ///< 已经发送的长度
+	int zc;                             ///< 用MSG_ZEROCOPY发送过，内核通知发送完成以前不能释放
+	unsigned zcid;                      ///< 最后一次MSG_ZEROCOPY发送的编号
+}tmis_obuf_t;
+
+/** 客户端连接相关信息 */
+typedef struct tmis_conn
+{
+	int fd;                             ///< 客户端套接字，-1表示没有使用
+	int loop;                           ///< 接受这个连接的事件循环编号
+	unsigned short port;                ///< 客户端端口号（主机字节序），本地套接字为0
+	char peer[PEER_STRLEN];             ///< 客户端地址，accept的时候取得，不用再调用getpeername；本地套接字为"unix:pid 进程号"
+	int efd;                            ///< 所在事件循环的红黑树树根，处理完数据以后重新注册事件
+	int local;                          ///< 本地（AF_UNIX）套接字的连接，同一台机器上的前端，可以做管理操作
+
+	char *inbuf;                        ///< 接收缓存，可能包含多个数据包
+	size_t inpos;                       ///< 接收缓存中还没有处理的数据的起始位置
+	size_t inlen;                       ///< 接收缓存中数据的结束位置
+	size_t incap;                       ///< 接收缓存的大小
+
+	pthread_mutex_t lock;               ///< 发送队列的锁（io_uring模式下也保护接收缓存和下面的状态）
+	tmis_obuf_t *ohead;                 ///< 发送队列的队首
+	tmis_obuf_t *otail;                 ///< 发送队列的队尾
+	size_t opending;                    ///< 发送队列中还没有发送的字节数
+
+	/* io_uring模式：数据由事件循环接收、发送，处理线程只处理接收缓存中的数据包 */
+	unsigned gen;                       ///< 连接的代数，每次打开加1，用来识别已经关闭的旧连接的完成事件
+	int busy;                           ///< 已经交给线程池处理
+	int sending;                        ///< 有正在进行的发送，发送完成以前siov引用的回复不能释放
+	int scnt;                           ///< 正在发送的数据块数量
+	int recving;                        ///< 多次接收（multishot recv）还在进行
+	int rpaused;                        ///< 接收缓存太多，暂停了接收
+	int closing;                        ///< 客户端已关闭或者出错，空闲以后关闭连接
+	int dbwait;                         ///< 医疗记录的查询交给了数据库事件循环，查询完成以前不处理后面的数据包
+	unsigned long long queued;          ///< 交给线程池的时间（纳秒，单调时钟），统计排队的时间，0表示没有
+	struct iovec *siov;                 ///< 正在发送的数据块数组
+	pthread_cond_t drained;             ///< 发送完成以后发送队列降到高水位以下（流式回复的处理线程在等）
+
+	/* MSG_ZEROCOPY：数据大的回复不拷贝到内核，发送完成由内核通过套接字的错误队列通知 */
+	int zcopy;                          ///< 套接字已经打开SO_ZEROCOPY
+	unsigned zcnext;                    ///< 下一次MSG_ZEROCOPY发送的编号（内核从0开始按顺序编号）
+	tmis_obuf_t *zhead;                 ///< 已经发送、等待内核通知完成的回复
+	tmis_obuf_t *ztail;                 ///< 等待完成的回复的队尾
+	size_t zpending;                    ///< 等待完成的回复的字节数，和opending一起算高水位
+
+	/* 超时：时间戳由收发数据的线程直接更新，时间轮转到的时候再检查 */
+	tmis_timer_t timer;                 ///< 在事件循环的时间轮中的节点
+	long opened;                        ///< 连接的时间（秒，单调时钟）
+	long active;                        ///< 最后一次收发数据的时间
+	long rstart;                        ///< 接收缓存中不完整的数据包开始等待的时间，0表示没有
+	int keyed;                          ///< 已经完成密钥协商
+	char skey[20];                      ///< 密钥协商得到的会话密钥
+}tmis_conn_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 初始化连接表
+ * @param max_fd 连接表的大小，fd必须小于它
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_table_init(int max_fd);
+
+/**
+ * @brief 根据套接字取得连接
+ * @param fd 客户端套接字
+ * @return 成功，返回连接；fd超出连接表的范围，返回NULL
+ */
+tmis_conn_t *conn_get(int fd);
+
+/**
+ * @brief 当前打开的连接数量
+ * @return 连接数量
+ */
+int conn_count(void);
+
+/**
+ * @brief 新的连接：记录事件循环编号和客户端地址
+ * @param fd 客户端套接字
+ * @param loop 事件循环编号
+ * @param efd 事件循环的红黑树树根
+ * @param addr accept传出的客户端地址
+ * @return 成功，返回连接；fd超出连接表的范围，返回NULL
+ */
+tmis_conn_t *conn_open(int fd, int loop, int efd, const struct sockaddr *addr);
+
+/**
+ * @brief 从套接字读取数据，追加到接收缓存中（只调用一次read）
+ * @param c 连接
+ * @return 同read：大于0，读取的字节数；0，客户端已关闭；-1，出错（errno为EAGAIN表示暂时没有数据）
+ */
+ssize_t conn_read(tmis_conn_t *c);
+
+/**
+ * @brief 从接收缓存中取出下一个完整的数据包
+ * @param c 连接
+ * @param pkt 传出参数，数据包（数据在缓存池的缓存中，以'\0'结尾，调用者处理完以后pool_free）
+ * @return 1，取出了一个数据包；0，还没有完整的数据包；-1，数据包太长或者没有内存
+ */
+int conn_frame(tmis_conn_t *c, tmis_packet_t *pkt);
+
+/**
+ * @brief 回复客户端：把一个数据包加入连接的发送队列，由conn_flush发送（数据拷贝一次，用于短的回复）
+ * @param c 连接
+ * @param flag 数据包类型
+ * @param data 数据
+ * @param len 数据长度
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_reply(tmis_conn_t *c, char flag, const char *data, size_t len);
+
+/**
+ * @brief 回复客户端：数据已经在缓存池的缓存中，直接把这块缓存加入发送队列，不再拷贝
+ * @param c 连接
+ * @param flag 数据包类型
+ * @param buf pool_alloc取得的缓存，之后由连接负责还给缓存池（失败的时候也是）
+ * @param len 数据长度
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_reply_buf(tmis_conn_t *c, char flag, char *buf, size_t len);
+
+/**
+ * @brief 打开套接字的SO_ZEROCOPY，之后数据不小于tmisconf.zerocopy的回复用MSG_ZEROCOPY发送
+ * @param c 连接
+ * @return 成功，返回0；内核不支持，返回-1（仍然用普通的发送）
+ */
+int conn_zerocopy(tmis_conn_t *c);
+
+/**
+ * @brief 尽量发送发送队列中的数据（非阻塞，多个回复合并成一次sendmsg），发送缓冲区满了就停下；
+ *        同时处理错误队列中MSG_ZEROCOPY的完成通知，释放已经完成的回复
+ * @param c 连接
+ * @return 成功（包括没有发送完的情况），返回0；出错，返回-1
+ */
+int conn_flush(tmis_conn_t *c);
+
+/**
+ * @brief 发送队列是否超过了高水位，超过了就暂时不再处理这个客户端的请求
+ * @param c 连接
+ * @return 超过了，返回1；否则，返回0
+ */
+int conn_out_full(tmis_conn_t *c);
+
+/**
+ * @brief 流式回复：处理线程等待发送队列降到高水位以下，回复再多，发送队列占用的内存也不会一直增长；
+ *        epoll模式由处理线程自己发送（连接在处理线程中的时候事件循环不会碰它），
+ *        io_uring模式由事件循环发送（调用者先通知事件循环），这里等待发送完成
+ * @param c 连接
+ * @param timeout_ms 最多等待多少毫秒
+ * @return 降下来了，返回0；超时、出错或者连接要关闭了，返回-1
+ */
+int conn_wait_drain(tmis_conn_t *c, int timeout_ms);
+
+/**
+ * @brief io_uring模式：接收缓存中没有处理的数据是否太多了，太多了就暂停接收
+ * @param c 连接
+ * @return 太多了，返回1；否则，返回0
+ */
+int conn_in_full(tmis_conn_t *c);
+
+/**
+ * @brief 接收缓存中是否还有没有处理的数据
+ * @param c 连接
+ * @return 有，返回1；否则，返回0
+ */
+int conn_has_input(tmis_conn_t *c);
+
+/**
+ * @brief 重新注册连接的事件（EPOLLONESHOT）：发送队列没有超过高水位时注册读事件，
+ *        发送队列不为空时注册写事件
+ * @param c 连接
+ * @return 成功，返回0；失败，返回-1
+ */
+int conn_rearm(tmis_conn_t *c);
+
+/**
+ * @brief io_uring模式：事件循环收到的数据追加到接收缓存中
+ * @param c 连接
+ * @param data 数据
+ * @param len 数据长度
+ * @return 需要交给线程池处理，返回1；正在处理中，返回0；出错，返回-1
+ */
+int conn_append(tmis_conn_t *c, const char *data, size_t len);
+
+/**
+ * @brief io_uring模式：处理线程取出下一个完整的数据包，没有了（或者发送队列超过高水位）就结束处理
+ * @param c 连接
+ * @param pkt 传出参数，数据包
+ * @return 1，取出了一个数据包；0，处理结束；-1，数据包太长或者没有内存，连接将被关闭
+ */
+int conn_next_frame(tmis_conn_t *c, tmis_packet_t *pkt);
+
+/**
+ * @brief io_uring模式：准备发送发送队列中的数据
+ * @param c 连接
+ * @param iov 传出参数，数据块数组（发送完成以前保持不变）
+ * @return 数据块的数量；没有数据或者已经在发送，返回0；出错，返回-1
+ */
+int conn_send_prepare(tmis_conn_t *c, struct iovec **iov);
+
+/**
+ * @brief io_uring模式：发送完成，释放已经发送的回复
+ * @param c 连接
+ * @param n 发送的字节数
+ * @return 因为高水位暂停的请求需要交给线程池继续处理，返回1；否则，返回0
+ */
+int conn_send_done(tmis_conn_t *c, size_t n);
+
+/**
+ * @brief io_uring模式：连接是否可以关闭了（要求关闭，并且没有在处理、没有在发送、发送队列已空）
+ * @param c 连接
+ * @return 可以，返回1；否则，返回0
+ */
+int conn_can_close(tmis_conn_t *c);
+
+/**
+ * @brief 关闭连接，清空连接的状态并关闭套接字
+ * @param c 连接
+ */
+void conn_close(tmis_conn_t *c);
+
+/**
+ * @brief 每秒一次：处理推迟关闭的套接字的完成通知，全部完成的套接字关闭
+ * @param loop 事件循环编号，只处理这个事件循环的连接
+ * @return 等了CONN_ZC_LINGER秒还没有完成、放弃等待的套接字数量
+ */
+int conn_zc_linger(int loop);
+
+
+#endif
@@ -0,0 +1,1266 @@
+/**
+* @file       tmis_db.c
+* @brief      tmis服务器的数据库连接池
+* @details    启动时建立固定数量的MySQL长连接，处理线程每个请求取一个连接、用完还回来；
+*             连接池的大小和线程池无关，连接用完的时候处理线程等待（有超时）；
+*             长时间没用或者上次出过错的连接在取出时先mysql_ping，断了就重新连接；
+*             每个连接建立以后准备好查询医疗记录的预处理语句，之后每个请求只发送参数，结果用二进制协议取回；
+*             编译时定义TMIS_DB_ASYNC的话，医疗记录的查询由数据库事件循环用MariaDB客户端库的非阻塞接口执行，
+*             处理线程提交查询以后马上返回，同时进行的查询数量只受连接池大小的限制
+* @author     项斌
+* @date       2018/08/26
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef TMIS_DB_ASYNC
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include "log.h"
+#include "tmis_db.h"
+#include "tmis_timer.h"
+
+static tmis_dbconn_t *dbconns;         ///< 所有的连接
+static tmis_dbconn_t **dbfree;         ///< 空闲连接的栈（最近还回来的先用，保持连接热）
+static int dbsize;                     ///< 连接的数量
+static int nfree;                      ///< 空闲连接的数量
+static int dbwait_ms;                  ///< 连接用完的时候最多等待多少毫秒，0表示一直等待
+static FILE *dblog;                    ///< 日志文件句柄
+static long dblast_log;                ///< 上一次记录统计信息的时间
+static tmis_db_stats_t dbst;           ///< 统计信息（在dblock保护下更新）
+static pthread_mutex_t dblock = PTHREAD_MUTEX_INITIALIZER;   ///< 连接池的锁
+static pthread_cond_t dbcond;          ///< 有连接还回来（单调时钟，等待不受系统时间调整影响）
+static pthread_key_t dbkey;            ///< 线程退出的时候调用mysql_thread_end
+
+#ifdef TMIS_DB_ASYNC
+/** 异步查询的步骤 */
+enum db_step
+{
+	DBQ_PING,                           ///< 连接空闲太久或者上次出错了，先ping
+	DBQ_EXEC,                           ///< 执行预处理语句
+	DBQ_FETCH,                          ///< 逐行取出结果
+	DBQ_FREE                            ///< 丢弃没有取出的结果
+};
+
+/** 一个异步查询 */
+typedef struct tmis_dbreq
+{
+	struct tmis_dbreq *next;            ///< 排队或者执行中的下一个查询
+	char *uid;                          ///< 用户id
+	char from[DB_RTIME_LEN + 1];        ///< 分页查询：最早的记录时间
+	char to[DB_RTIME_LEN + 1];          ///< 分页查询：最晚的记录时间
+	unsigned int skip;                  ///< 分页查询：跳过最新的多少条
+	unsigned int limit;                 ///< 分页查询：最多取出多少条，0表示不分页
+	db_row_cb row;                      ///< 取出一条记录的回调
+	db_done_cb done;                    ///< 查询结束的回调
+	void *arg;                          ///< 回调的参数
+	tmis_dbconn_t *db;                  ///< 执行查询的连接，排队的时候为NULL
+	int step;                           ///< 当前的步骤
+	int status;                         ///< 查询的结果，0表示成功
+	int error;                          ///< 连接出错了，还回连接池的时候标记
+	int waited;                         ///< 提交的时候没有空闲的连接，要排队等待
+	unsigned long long since;           ///< 开始排队的时间（微秒）
+	unsigned long long deadline;        ///< 客户端库要求的等待超时时间（微秒），0表示没有
+}tmis_dbreq_t;
+
+static int dbafd = -1;                 ///< 数据库事件循环的红黑树树根
+static int dbaevfd = -1;               ///< 提交查询、连接还回来的时候通知数据库事件循环
+static pthread_t dbatid;               ///< 数据库事件循环的线程
+static volatile int dbastop;           ///< 停止数据库事件循环
+static tmis_dbreq_t *dbq_head;         ///< 等待空闲连接的查询（先进先出，在dblock保护下）
+static tmis_dbreq_t *dbq_tail;         ///< 等待空闲连接的查询的队尾
+static tmis_dbreq_t *dbq_run;          ///< 执行中的查询（只在数据库事件循环中使用）
+#endif
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 处理线程退出的时候释放MySQL客户端库的线程状态
+ * @param arg 没有使用
+ */
+static void db_thread_end(void *arg)
+{
+	(void)arg;
+	mysql_thread_end();
+}
+
+/**
+ * @brief 每个线程第一次使用连接池的时候初始化MySQL客户端库的线程状态
+ *        （连接不是这个线程mysql_init的，客户端库不会自动初始化）
+ */
+static void db_thread_init(void)
+{
+	if(pthread_getspecific(dbkey) != NULL) return;
+
+	mysql_thread_init();
+	pthread_setspecific(dbkey, (void *)1);
+}
+
+/**
+ * @brief 当前时间（单调时钟，微秒），统计等待时间用
+ * @return 当前时间
+ */
+static unsigned long long db_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief 准备一条查询医疗记录的预处理语句，绑定连接的结果缓存
+ * @param d 连接
+ * @param sql 语句
+ * @return 成功，返回语句；失败，返回NULL
+ */
+static MYSQL_STMT *db_prepare_stmt(tmis_dbconn_t *d, const char *sql)
+{
+	MYSQL_STMT *stmt = mysql_stmt_init(&d->mysql);
+	if(stmt == NULL)
+	{
+		write_log(dblog,"func mysql_stmt_init error:%d %s\n",mysql_errno(&d->mysql),mysql_error(&d->mysql));
+		return NULL;
+	}
+	if(mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0)
+	{
+		write_log(dblog,"func mysql_stmt_prepare error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+	if(mysql_stmt_bind_result(stmt, d->rec_bind) != 0)
+	{
+		write_log(dblog,"func mysql_stmt_bind_result error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+
+	return stmt;
+}
+
+/**
+ * @brief 准备查询医疗记录的预处理语句（全部的和分页的），绑定结果缓存（缓存在第一次连接的时候分配，重新连接以后继续使用）
+ * @param d 连接
+ * @return 成功，返回0；失败，返回-1
+ */
+static int db_prepare(tmis_dbconn_t *d)
+{
+	char sql[sizeof(DB_SQL_RECORD_BATCH_HEAD) + sizeof(DB_SQL_RECORD_BATCH_TAIL) + 2 * DB_BATCH_MAX];
+	int i, n;
+
+	for(i = 0; i < DB_BATCH_FIELDS; i++)
+	{
+		if(d->rec_buf[i]) continue;
+		d->rec_buf[i] = (char *)malloc(DB_FIELD_LEN + 1);
+		if(!d->rec_buf[i])
+		{
+			write_log(dblog,"malloc the record buffer is failed\n");
+			return -1;
+		}
+		d->rec_bind[i].buffer_length = DB_FIELD_LEN;
+	}
+
+	/* 所有字段都按字符串取回（日期由服务器转换成字符串），和原来文本协议的格式一样 */
+	for(i = 0; i < DB_BATCH_FIELDS; i++)
+	{
+		d->rec_bind[i].buffer_type = MYSQL_TYPE_STRING;
+		d->rec_bind[i].buffer = d->rec_buf[i];
+		d->rec_bind[i].length = &d->rec_len[i];
+		d->rec_bind[i].is_null = &d->rec_null[i];
+		d->rec_bind[i].error = &d->rec_trunc[i];
+	}
+
+	memset(&d->rec_param, 0, sizeof(d->rec_param));
+	d->rec_param.buffer_type = MYSQL_TYPE_STRING;
+	d->rec_param.length = &d->rec_plen;
+
+	/* 分页查询的参数：uid和时间范围是字符串（服务器转换成日期比较），跳过的条数和每页的条数是整数 */
+	memset(d->page_param, 0, sizeof(d->page_param));
+	for(i = 0; i < 3; i++)
+	{
+		d->page_param[i].buffer_type = MYSQL_TYPE_STRING;
+		d->page_param[i].length = &d->page_plen[i];
+	}
+	for(i = 0; i < 2; i++)
+	{
+		d->page_param[3 + i].buffer_type = MYSQL_TYPE_LONG;
+		d->page_param[3 + i].buffer = &d->page_int[i];
+		d->page_param[3 + i].is_unsigned = 1;
+	}
+
+	d->rec_stmt = db_prepare_stmt(d, DB_SQL_RECORD);
+	if(d->rec_stmt == NULL) return -1;
+	d->page_stmt = db_prepare_stmt(d, DB_SQL_RECORD_PAGE);
+	if(d->page_stmt == NULL) return -1;
+
+	/* 批量查询：in中DB_BATCH_MAX个参数，都是uid */
+	memset(d->batch_param, 0, sizeof(d->batch_param));
+	for(i = 0; i < DB_BATCH_MAX; i++)
+	{
+		d->batch_param[i].buffer_type = MYSQL_TYPE_STRING;
+		d->batch_param[i].length = &d->batch_plen[i];
+	}
+	n = snprintf(sql, sizeof(sql), "%s", DB_SQL_RECORD_BATCH_HEAD);
+	for(i = 0; i < DB_BATCH_MAX; i++) n += snprintf(sql + n, sizeof(sql) - n, i ? ",?" : "?");
+	snprintf(sql + n, sizeof(sql) - n, "%s", DB_SQL_RECORD_BATCH_TAIL);
+	d->batch_stmt = db_prepare_stmt(d, sql);
+	if(d->batch_stmt == NULL) return -1;
+	d->cur = d->rec_stmt;
+
+	return 0;
+}
+
+/**
+ * @brief 断开一个连接，先关闭连接上的预处理语句
+ * @param d 连接
+ * @note 异步模式下套接字先从数据库事件循环中注销，重新连接以后可能拿到同样的fd
+ */
+static void db_disconnect(tmis_dbconn_t *d)
+{
+#ifdef TMIS_DB_ASYNC
+	if(d->afd >= 0)
+	{
+		epoll_ctl(dbafd, EPOLL_CTL_DEL, d->afd, NULL);
+		d->afd = -1;
+	}
+#endif
+	if(d->rec_stmt)
+	{
+		mysql_stmt_close(d->rec_stmt);
+		d->rec_stmt = NULL;
+	}
+	if(d->page_stmt)
+	{
+		mysql_stmt_close(d->page_stmt);
+		d->page_stmt = NULL;
+	}
+	if(d->batch_stmt)
+	{
+		mysql_stmt_close(d->batch_stmt);
+		d->batch_stmt = NULL;
+	}
+	d->cur = NULL;
+	mysql_close(&d->mysql);
+	d->connected = 0;
+}
+
+/**
+ * @brief 建立一个连接：设置超时、字符集，准备预处理语句
+ * @param d 连接
+ * @return 成功，返回0；失败，返回-1
+ */
+static int db_connect(tmis_dbconn_t *d)
+{
+	unsigned int timeout = DB_CONNECT_TIMEOUT;
+	int ret = -1;
+
+	d->connected = 0;
+	d->rec_stmt = NULL;
+	d->page_stmt = NULL;
+	d->batch_stmt = NULL;
+	d->cur = NULL;
+	if(mysql_init(&d->mysql) == NULL)
+	{
+		write_log(dblog,"func mysql_init error\n");
+		return -1;
+	}
+
+	do
+	{
+		mysql_options(&d->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+#ifdef TMIS_DB_ASYNC
+		/* 连接以前打开，之后的查询才能用非阻塞接口（阻塞的接口照样可以用） */
+		mysql_options(&d->mysql, MYSQL_OPT_NONBLOCK, 0);
+#endif
+		if(mysql_real_connect(&d->mysql,DB_HOST,DB_USER,DB_PASS,DB_NAME,0,NULL,0) == NULL)
+		{
+			write_log(dblog,"func mysql_real_connect error:%d %s\n",mysql_errno(&d->mysql),mysql_error(&d->mysql));
+			break;
+		}
+		if(mysql_set_character_set(&d->mysql, DB_CHARSET) != 0)
+		{
+			write_log(dblog,"func mysql_set_character_set error:%d %s\n",mysql_errno(&d->mysql),mysql_error(&d->mysql));
+			break;
+		}
+		if(db_prepare(d) != 0) break;
+
+		ret = 0;
+	}while(0);
+
+	if(ret != 0)
+	{
+		db_disconnect(d);
+		return -1;
+	}
+
+	d->connected = 1;
+	d->suspect = 0;
+	d->used = timer_now();
+	return 0;
+}
+
+/**
+ * @brief 取出的连接在使用以前检查：空闲太久或者上次出错的先ping，断了（或者本来就没连上）就重新连接
+ * @param d 连接
+ * @return 可以使用，返回0；连接不上数据库，返回-1
+ */
+static int db_check(tmis_dbconn_t *d)
+{
+	if(d->connected && (d->suspect || timer_now() - d->used >= DB_PING_IDLE))
+	{
+		__sync_fetch_and_add(&dbst.pings, 1);
+		if(mysql_ping(&d->mysql) != 0)
+		{
+			write_log(dblog,"the database connection is broken:%d %s\n",mysql_errno(&d->mysql),mysql_error(&d->mysql));
+			db_disconnect(d);
+		}
+	}
+	d->suspect = 0;
+
+	if(d->connected) return 0;
+
+	if(db_connect(d) != 0)
+	{
+		__sync_fetch_and_add(&dbst.failures, 1);
+		return -1;
+	}
+	__sync_fetch_and_add(&dbst.reconnects, 1);
+
+	return 0;
+}
+
+/**
+ * @brief 在日志中记录连接池的统计信息（调用者持有dblock）
+ */
+static void db_log_stats(void)
+{
+	write_log(dblog,"db pool: size %d, idle %d, gets %lu, waits %lu, avg wait %lluus, max wait %lluus, "
+			"timeouts %lu, pings %lu, reconnects %lu, failures %lu\n",
+			dbsize,nfree,dbst.gets,dbst.waits,dbst.waits ? dbst.wait_us / dbst.waits : 0ULL,dbst.wait_max_us,
+			dbst.timeouts,dbst.pings,dbst.reconnects,dbst.failures);
+#ifdef TMIS_DB_ASYNC
+	write_log(dblog,"db pool: async queries in flight %lu, queued %lu\n",dbst.inflight,dbst.queued);
+#endif
+}
+
+/**
+ * @brief 初始化连接池，建立所有的连接（连接失败的在取出的时候再连接，数据库晚于服务器启动也可以）
+ * @param size 连接的数量
+ * @param wait_ms 连接用完的时候最多等待多少毫秒，0表示一直等待
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败（没有内存等），返回-1
+ */
+int db_pool_init(int size, int wait_ms, FILE *log)
+{
+	pthread_condattr_t attr;
+	int i, ok = 0;
+
+	if(size <= 0) return -1;
+	dblog = log;
+	dbwait_ms = wait_ms;
+
+	/* 客户端库的全局初始化不是线程安全的，在处理线程使用以前做 */
+	if(mysql_library_init(0, NULL, NULL) != 0)
+	{
+		write_log(dblog,"func mysql_library_init error\n");
+		return -1;
+	}
+
+	if(pthread_key_create(&dbkey, db_thread_end) != 0) return -1;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	i = pthread_cond_init(&dbcond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(i != 0) return -1;
+
+	dbconns = (tmis_dbconn_t *)calloc(size, sizeof(tmis_dbconn_t));
+	dbfree = (tmis_dbconn_t **)calloc(size, sizeof(tmis_dbconn_t *));
+	if(!dbconns || !dbfree)
+	{
+		free(dbconns);
+		free(dbfree);
+		dbconns = NULL;
+		dbfree = NULL;
+		return -1;
+	}
+
+	for(i = 0; i < size; i++)
+	{
+		dbconns[i].afd = -1;
+		if(db_connect(&dbconns[i]) == 0) ok++;
+		dbfree[i] = &dbconns[i];
+	}
+	dbsize = size;
+	nfree = size;
+	dbst.size = size;
+	dblast_log = timer_now();
+
+	write_log(dblog,"db pool: %d of %d connections to %s/%s established\n",ok,size,DB_HOST,DB_NAME);
+
+	return 0;
+}
+
+/**
+ * @brief 从连接池中取一个可用的连接，没有空闲的连接就等待
+ * @return 成功，返回连接；等待超时或者连接不上数据库，返回NULL
+ */
+tmis_dbconn_t *db_get(void)
+{
+	tmis_dbconn_t *d = NULL;
+	unsigned long long start, us;
+	struct timespec deadline;
+	int rc = 0;
+
+	if(!dbconns) return NULL;
+	db_thread_init();
+
+	pthread_mutex_lock(&dblock);
+	dbst.gets++;
+	if(nfree == 0)
+	{
+		dbst.waits++;
+		start = db_now_us();
+		if(dbwait_ms > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += dbwait_ms / 1000;
+			deadline.tv_nsec += (long)(dbwait_ms % 1000) * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+		}
+
+		while(nfree == 0 && rc != ETIMEDOUT)
+		{
+			if(dbwait_ms > 0) rc = pthread_cond_timedwait(&dbcond, &dblock, &deadline);
+			else pthread_cond_wait(&dbcond, &dblock);
+		}
+
+		us = db_now_us() - start;
+		dbst.wait_us += us;
+		if(us > dbst.wait_max_us) dbst.wait_max_us = us;
+	}
+
+	if(nfree == 0)
+	{
+		dbst.timeouts++;
+		pthread_mutex_unlock(&dblock);
+		write_log(dblog,"no database connection is available in %d ms\n",dbwait_ms);
+		return NULL;
+	}
+	d = dbfree[--nfree];
+	pthread_mutex_unlock(&dblock);
+
+	/* 检查、重新连接都不持有锁，不影响其它线程取连接 */
+	if(db_check(d) != 0)
+	{
+		db_put(d, 0);
+		return NULL;
+	}
+
+	return d;
+}
+
+/**
+ * @brief 把连接还给连接池
+ * @param db db_get取得的连接
+ * @param error 使用的时候出错了（可能是连接断了），下次取出时先检查
+ */
+void db_put(tmis_dbconn_t *db, int error)
+{
+	long now = timer_now();
+
+	if(!db) return;
+	if(error) db->suspect = 1;
+	db->used = now;
+
+#ifdef TMIS_DB_ASYNC
+	unsigned long long one = 1;
+	int wake;
+#endif
+
+	pthread_mutex_lock(&dblock);
+	dbfree[nfree++] = db;
+	if(now - dblast_log >= DB_STATS_INTERVAL)
+	{
+		dblast_log = now;
+		db_log_stats();
+	}
+#ifdef TMIS_DB_ASYNC
+	/* 有排队的异步查询，通知数据库事件循环取这个连接 */
+	wake = (dbq_head != NULL);
+#endif
+	pthread_mutex_unlock(&dblock);
+	pthread_cond_signal(&dbcond);
+#ifdef TMIS_DB_ASYNC
+	if(wake && write(dbaevfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		write_log(dblog,"function write eventfd is err:%s\n",strerror(errno));
+#endif
+}
+
+/**
+ * @brief 选择查询医疗记录的语句，绑定参数（db->cur为选择的语句）
+ * @param db 连接
+ * @param uid 用户id（作为参数绑定，不需要转义）
+ * @param from 分页查询：最早的记录时间
+ * @param to 分页查询：最晚的记录时间
+ * @param skip 分页查询：跳过最新的多少条
+ * @param limit 分页查询：最多取出多少条；0表示不分页
+ * @return 成功，返回0；失败，返回-1
+ */
+static int db_record_bind(tmis_dbconn_t *db, const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit)
+{
+	if(limit == 0)
+	{
+		db->cur = db->rec_stmt;
+		db->rec_param.buffer = (void *)uid;
+		db->rec_param.buffer_length = strlen(uid);
+		db->rec_plen = db->rec_param.buffer_length;
+		return mysql_stmt_bind_param(db->cur, &db->rec_param) != 0 ? -1 : 0;
+	}
+
+	db->cur = db->page_stmt;
+	db->page_param[0].buffer = (void *)uid;
+	db->page_param[1].buffer = (void *)from;
+	db->page_param[2].buffer = (void *)to;
+	db->page_param[0].buffer_length = db->page_plen[0] = strlen(uid);
+	db->page_param[1].buffer_length = db->page_plen[1] = strlen(from);
+	db->page_param[2].buffer_length = db->page_plen[2] = strlen(to);
+	db->page_int[0] = skip;
+	db->page_int[1] = limit;
+
+	return mysql_stmt_bind_param(db->cur, db->page_param) != 0 ? -1 : 0;
+}
+
+/**
+ * @brief 执行查询医疗记录的预处理语句（db_record_query、db_record_page）
+ * @param db 连接
+ * @param uid 用户id
+ * @param from 分页查询：最早的记录时间
+ * @param to 分页查询：最晚的记录时间
+ * @param skip 分页查询：跳过最新的多少条
+ * @param limit 分页查询：最多取出多少条；0表示不分页
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+static int db_record_exec(tmis_dbconn_t *db, const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit)
+{
+	MYSQL_STMT *stmt;
+
+	if(db_record_bind(db, uid, from, to, skip, limit) != 0 || mysql_stmt_execute(db->cur) != 0)
+	{
+		stmt = db->cur;
+		write_log(dblog,"func mysql_stmt_execute error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+		return mysql_stmt_errno(stmt) ? (int)mysql_stmt_errno(stmt) : -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 执行查询医疗记录的预处理语句，之后用db_record_next逐行取出结果，最后db_record_end
+ * @param db db_get取得的连接
+ * @param uid 用户id（作为参数绑定，不需要转义）
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_query(tmis_dbconn_t *db, const char *uid)
+{
+	return db_record_exec(db, uid, NULL, NULL, 0, 0);
+}
+
+/**
+ * @brief 按时间倒序分页查询一个用户的医疗记录，之后同样用db_record_next逐行取出结果，最后db_record_end
+ * @param db db_get取得的连接
+ * @param uid 用户id
+ * @param from 最早的记录时间（包括），格式为"YYYY-MM-DD HH:MM:SS"
+ * @param to 最晚的记录时间（包括）
+ * @param skip 跳过最新的多少条
+ * @param limit 最多取出多少条
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_page(tmis_dbconn_t *db, const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit)
+{
+	return db_record_exec(db, uid, from, to, skip, limit);
+}
+
+/**
+ * @brief 一次查询多个用户的医疗记录，之后同样用db_record_next逐行取出结果（多一个字段uid），最后db_record_end
+ * @param db db_get取得的连接
+ * @param uids 各个用户id
+ * @param n 用户的数量，1到DB_BATCH_MAX
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_batch(tmis_dbconn_t *db, const char **uids, int n)
+{
+	MYSQL_STMT *stmt = db->batch_stmt;
+	const char *uid;
+	int i;
+
+	if(n <= 0 || n > DB_BATCH_MAX) return -1;
+
+	db->cur = stmt;
+	for(i = 0; i < DB_BATCH_MAX; i++)
+	{
+		/* 用不完的参数重复第一个uid，不影响结果 */
+		uid = uids[i < n ? i : 0];
+		db->batch_param[i].buffer = (void *)uid;
+		db->batch_param[i].buffer_length = db->batch_plen[i] = strlen(uid);
+	}
+	if(mysql_stmt_bind_param(stmt, db->batch_param) != 0 || mysql_stmt_execute(stmt) != 0)
+	{
+		write_log(dblog,"func mysql_stmt_execute error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+		return mysql_stmt_errno(stmt) ? (int)mysql_stmt_errno(stmt) : -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 处理取出的一行：字段比缓存长的时候扩大缓存再取一次这个字段
+ * @param db 连接
+ * @param ret mysql_stmt_fetch（异步模式是mysql_stmt_fetch_cont）的结果
+ * @param fields 传出参数，每个字段（以'\0'结尾，NULL为空字符串，下一次调用以前有效）
+ * @param lens 传出参数，每个字段的长度，可以是NULL
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+static int db_record_row(tmis_dbconn_t *db, int ret, char **fields, unsigned long *lens)
+{
+	MYSQL_STMT *stmt = db->cur;
+	int nf = (stmt == db->batch_stmt) ? DB_BATCH_FIELDS : DB_RECORD_FIELDS;
+	char *nbuf;
+	int i, rebind = 0;
+
+	if(ret == MYSQL_NO_DATA) return 0;
+	if(ret != 0 && ret != MYSQL_DATA_TRUNCATED)
+	{
+		write_log(dblog,"func mysql_stmt_fetch error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+		return -1;
+	}
+
+	for(i = 0; i < nf; i++)
+	{
+		if(db->rec_null[i]) db->rec_len[i] = 0;
+		else if(db->rec_trunc[i])
+		{
+			/* 缓存不够：扩大到字段的长度，再单独取一次这个字段 */
+			nbuf = (char *)realloc(db->rec_buf[i], db->rec_len[i] + 1);
+			if(!nbuf)
+			{
+				write_log(dblog,"realloc the record buffer is failed\n");
+				return -1;
+			}
+			db->rec_buf[i] = nbuf;
+			db->rec_bind[i].buffer = nbuf;
+			db->rec_bind[i].buffer_length = db->rec_len[i];
+			if(mysql_stmt_fetch_column(stmt, &db->rec_bind[i], i, 0) != 0)
+			{
+				write_log(dblog,"func mysql_stmt_fetch_column error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+				return -1;
+			}
+			rebind = 1;
+		}
+		db->rec_buf[i][db->rec_len[i]] = '\0';
+		fields[i] = db->rec_buf[i];
+		if(lens) lens[i] = db->rec_len[i];
+	}
+
+	/* 扩大以后的缓存重新绑定（三条语句共用缓存），下一行直接取到新的缓存中 */
+	if(rebind && (mysql_stmt_bind_result(db->rec_stmt, db->rec_bind) != 0 ||
+				mysql_stmt_bind_result(db->page_stmt, db->rec_bind) != 0 ||
+				mysql_stmt_bind_result(db->batch_stmt, db->rec_bind) != 0)) return -1;
+
+	return 1;
+}
+
+/**
+ * @brief 取出下一条医疗记录，字段比缓存长的时候扩大缓存再取一次这个字段
+ * @param db 连接
+ * @param fields 传出参数，每个字段（db_record_batch的查询多一个uid，以'\0'结尾，NULL为空字符串，下一次调用以前有效）
+ * @param lens 传出参数，每个字段的长度，可以是NULL
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+int db_record_next(tmis_dbconn_t *db, char **fields, unsigned long *lens)
+{
+	return db_record_row(db, mysql_stmt_fetch(db->cur), fields, lens);
+}
+
+/**
+ * @brief 结束这次查询，丢弃没有取出的结果（连接还给连接池以前调用）
+ * @param db 连接
+ */
+void db_record_end(tmis_dbconn_t *db)
+{
+	if(db->cur) mysql_stmt_free_result(db->cur);
+}
+
+#ifdef TMIS_DB_ASYNC
+/////////////////////////////////    异步查询     ///////////////////////////////
+
+/**
+ * @brief 注销查询的连接在数据库事件循环中的套接字
+ * @param q 查询
+ */
+static void dbq_unwatch(tmis_dbreq_t *q)
+{
+	if(q->db->afd < 0) return;
+	epoll_ctl(dbafd, EPOLL_CTL_DEL, q->db->afd, NULL);
+	q->db->afd = -1;
+}
+
+/**
+ * @brief 查询结束：连接还给连接池，调用结束的回调
+ * @param q 查询（执行中的，之后释放）
+ */
+static void dbq_finish(tmis_dbreq_t *q)
+{
+	tmis_dbreq_t **pp;
+
+	for(pp = &dbq_run; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == q)
+		{
+			*pp = q->next;
+			break;
+		}
+	}
+	pthread_mutex_lock(&dblock);
+	dbst.inflight--;
+	pthread_mutex_unlock(&dblock);
+
+	dbq_unwatch(q);
+	db_put(q->db, q->error);
+	q->done(q->arg, q->status);
+	free(q->uid);
+	free(q);
+}
+
+/**
+ * @brief 非阻塞接口要等待的时候，把连接的套接字注册到数据库事件循环中
+ * @param q 查询
+ * @param wait 非阻塞接口返回的等待条件（MYSQL_WAIT_*）
+ * @return 成功，返回0；失败，返回-1
+ */
+static int dbq_watch(tmis_dbreq_t *q, int wait)
+{
+	struct epoll_event ev;
+	int ret, fd = mysql_get_socket(&q->db->mysql);
+
+	q->deadline = 0;
+	if(wait & MYSQL_WAIT_TIMEOUT)
+		q->deadline = db_now_us() + (unsigned long long)mysql_get_timeout_value_ms(&q->db->mysql) * 1000ULL;
+
+	/* 重新连接以后套接字可能变了 */
+	if(q->db->afd >= 0 && q->db->afd != fd) dbq_unwatch(q);
+
+	ev.events = EPOLLONESHOT;
+	if(wait & MYSQL_WAIT_READ) ev.events |= EPOLLIN;
+	if(wait & MYSQL_WAIT_WRITE) ev.events |= EPOLLOUT;
+	if(wait & MYSQL_WAIT_EXCEPT) ev.events |= EPOLLPRI;
+	ev.data.ptr = q;
+	ret = epoll_ctl(dbafd, q->db->afd < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+	/* 套接字已经被关掉了（注册自动取消），同样的fd是新的套接字，重新注册 */
+	if(ret != 0 && errno == ENOENT && q->db->afd >= 0) ret = epoll_ctl(dbafd, EPOLL_CTL_ADD, fd, &ev);
+	if(ret != 0)
+	{
+		write_log(dblog,"function epoll_ctl is err:%s\n",strerror(errno));
+		q->db->afd = -1;
+		return -1;
+	}
+	q->db->afd = fd;
+
+	return 0;
+}
+
+/**
+ * @brief 注册不上数据库事件循环的时候，阻塞等待连接的套接字
+ * @param q 查询
+ * @param wait 非阻塞接口返回的等待条件（MYSQL_WAIT_*）
+ * @return 满足的条件（MYSQL_WAIT_*）
+ */
+static int dbq_poll(tmis_dbreq_t *q, int wait)
+{
+	struct pollfd pfd;
+	int n, ready = 0;
+	int timeout = (wait & MYSQL_WAIT_TIMEOUT) ? (int)mysql_get_timeout_value_ms(&q->db->mysql) : -1;
+
+	pfd.fd = mysql_get_socket(&q->db->mysql);
+	pfd.events = 0;
+	if(wait & MYSQL_WAIT_READ) pfd.events |= POLLIN;
+	if(wait & MYSQL_WAIT_WRITE) pfd.events |= POLLOUT;
+	if(wait & MYSQL_WAIT_EXCEPT) pfd.events |= POLLPRI;
+	pfd.revents = 0;
+
+	while((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+	if(n == 0) return MYSQL_WAIT_TIMEOUT;
+	if(n < 0)
+	{
+		/* poll本身出错：让客户端库自己去读写套接字 */
+		ready = wait & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE | MYSQL_WAIT_EXCEPT);
+		return ready ? ready : MYSQL_WAIT_TIMEOUT;
+	}
+
+	if(pfd.revents & POLLIN) ready |= MYSQL_WAIT_READ;
+	if(pfd.revents & POLLOUT) ready |= MYSQL_WAIT_WRITE;
+	if(pfd.revents & POLLPRI) ready |= MYSQL_WAIT_EXCEPT;
+	/* 出错、断开的时候由客户端库读写套接字得到错误 */
+	if(pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ready |= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+
+	return ready;
+}
+
+/**
+ * @brief 执行查询的下一步，直到非阻塞接口需要等待或者查询结束
+ * @param q 查询
+ * @param ready 等待的条件满足了（MYSQL_WAIT_*），0表示开始当前的步骤
+ */
+static void dbq_step(tmis_dbreq_t *q, int ready)
+{
+	tmis_dbconn_t *d = q->db;
+	MYSQL_STMT *stmt = d->cur;
+	char *fields[DB_RECORD_FIELDS];
+	unsigned long lens[DB_RECORD_FIELDS];
+	db_bool_t bret;
+	int wait, ret = 0;
+
+	while(1)
+	{
+		switch(q->step)
+		{
+		case DBQ_PING:
+			wait = ready ? mysql_ping_cont(&ret, &d->mysql, ready) : mysql_ping_start(&ret, &d->mysql);
+			if(wait) break;
+			d->suspect = 0;
+			if(ret != 0)
+			{
+				/* 重新连接是阻塞的（连接超时DB_CONNECT_TIMEOUT），只在数据库断开以后发生 */
+				write_log(dblog,"the database connection is broken:%d %s\n",mysql_errno(&d->mysql),mysql_error(&d->mysql));
+				db_disconnect(d);
+				if(db_connect(d) != 0)
+				{
+					__sync_fetch_and_add(&dbst.failures, 1);
+					q->status = -1;
+					dbq_finish(q);
+					return;
+				}
+				__sync_fetch_and_add(&dbst.reconnects, 1);
+			}
+			q->step = DBQ_EXEC;
+			break;
+
+		case DBQ_EXEC:
+			if(!ready)
+			{
+				ret = db_record_bind(d, q->uid, q->from, q->to, q->skip, q->limit);
+				stmt = d->cur;
+				if(ret != 0)
+				{
+					wait = 0;
+					ret = 1;
+					goto exec_done;
+				}
+			}
+			wait = ready ? mysql_stmt_execute_cont(&ret, stmt, ready) : mysql_stmt_execute_start(&ret, stmt);
+			if(wait) break;
+		exec_done:
+			if(ret != 0)
+			{
+				write_log(dblog,"func mysql_stmt_execute error:%d %s\n",mysql_stmt_errno(stmt),mysql_stmt_error(stmt));
+				q->status = mysql_stmt_errno(stmt) ? (int)mysql_stmt_errno(stmt) : -1;
+				q->error = 1;
+				q->step = DBQ_FREE;
+			}
+			else q->step = DBQ_FETCH;
+			break;
+
+		case DBQ_FETCH:
+			wait = ready ? mysql_stmt_fetch_cont(&ret, stmt, ready) : mysql_stmt_fetch_start(&ret, stmt);
+			if(wait) break;
+			ret = db_record_row(d, ret, fields, lens);
+			if(ret == 0) q->step = DBQ_FREE;
+			else if(ret < 0)
+			{
+				q->status = -1;
+				q->error = 1;
+				q->step = DBQ_FREE;
+			}
+			else if(q->row(q->arg, fields, lens) != 0)
+			{
+				q->status = -1;
+				q->step = DBQ_FREE;
+			}
+			break;
+
+		default:    // DBQ_FREE
+			wait = ready ? mysql_stmt_free_result_cont(&bret, stmt, ready) : mysql_stmt_free_result_start(&bret, stmt);
+			if(wait) break;
+			dbq_finish(q);
+			return;
+		}
+
+		/* 需要等待的时候回到事件循环，条件满足了再从这一步继续 */
+		if(wait)
+		{
+			if(dbq_watch(q, wait) != 0)
+			{
+				/* 注册不上的话只能阻塞等待这一次 */
+				ready = dbq_poll(q, wait);
+				continue;
+			}
+			return;
+		}
+		ready = 0;
+	}
+}
+
+/**
+ * @brief 用空闲的连接开始排队的查询，连接用完了就停下；排队超过dbwait_ms的算失败
+ */
+static void dbq_pump(void)
+{
+	tmis_dbreq_t *q, *expired = NULL, **ep = &expired;
+	tmis_dbconn_t *d;
+	unsigned long long now = db_now_us(), us;
+
+	while(1)
+	{
+		pthread_mutex_lock(&dblock);
+		q = dbq_head;
+		if(q == NULL)
+		{
+			pthread_mutex_unlock(&dblock);
+			break;
+		}
+		d = NULL;
+		if(nfree > 0)
+		{
+			d = dbfree[--nfree];
+			dbst.gets++;
+			dbst.inflight++;
+		}
+		else if(dbwait_ms > 0 && now - q->since >= (unsigned long long)dbwait_ms * 1000ULL)
+		{
+			dbst.gets++;
+			dbst.timeouts++;
+		}
+		else
+		{
+			pthread_mutex_unlock(&dblock);
+			break;
+		}
+		dbq_head = q->next;
+		if(dbq_head == NULL) dbq_tail = NULL;
+		dbst.queued--;
+		if(q->waited)
+		{
+			us = now - q->since;
+			dbst.waits++;
+			dbst.wait_us += us;
+			if(us > dbst.wait_max_us) dbst.wait_max_us = us;
+		}
+		pthread_mutex_unlock(&dblock);
+
+		q->next = NULL;
+		if(d == NULL)
+		{
+			*ep = q;
+			ep = &q->next;
+			continue;
+		}
+
+		q->db = d;
+		q->next = dbq_run;
+		dbq_run = q;
+		q->step = DBQ_EXEC;
+		if(!d->connected)
+		{
+			/* 重新连接是阻塞的（连接超时DB_CONNECT_TIMEOUT），只在数据库断开以后发生 */
+			if(db_connect(d) != 0)
+			{
+				__sync_fetch_and_add(&dbst.failures, 1);
+				q->status = -1;
+				dbq_finish(q);
+				continue;
+			}
+			__sync_fetch_and_add(&dbst.reconnects, 1);
+		}
+		else if(d->suspect || timer_now() - d->used >= DB_PING_IDLE)
+		{
+			__sync_fetch_and_add(&dbst.pings, 1);
+			q->step = DBQ_PING;
+		}
+		dbq_step(q, 0);
+	}
+
+	while((q = expired) != NULL)
+	{
+		expired = q->next;
+		write_log(dblog,"no database connection is available in %d ms\n",dbwait_ms);
+		q->done(q->arg, -1);
+		free(q->uid);
+		free(q);
+	}
+}
+
+/**
+ * @brief 数据库事件循环下一次最多等待多少毫秒：执行中的查询的超时、排队的查询的超时
+ * @return 毫秒数，-1表示一直等待
+ */
+static int dbq_timeout(void)
+{
+	unsigned long long now = db_now_us(), next = 0, t;
+	tmis_dbreq_t *q;
+
+	for(q = dbq_run; q; q = q->next)
+		if(q->deadline && (next == 0 || q->deadline < next)) next = q->deadline;
+
+	pthread_mutex_lock(&dblock);
+	if(dbq_head && dbwait_ms > 0)
+	{
+		t = dbq_head->since + (unsigned long long)dbwait_ms * 1000ULL;
+		if(next == 0 || t < next) next = t;
+	}
+	pthread_mutex_unlock(&dblock);
+
+	if(next == 0) return -1;
+	if(next <= now) return 0;
+	return (int)((next - now + 999) / 1000);
+}
+
+/**
+ * @brief 数据库事件循环线程：等待连接的套接字，条件满足了继续执行查询
+ * @param arg 没有使用
+ * @return NULL值
+ */
+static void *db_async_run(void *arg)
+{
+	struct epoll_event ev[64];
+	unsigned long long val, now;
+	tmis_dbreq_t *q, *next;
+	int n, i, ready;
+
+	(void)arg;
+	db_thread_init();
+
+	while(!dbastop)
+	{
+		n = epoll_wait(dbafd, ev, 64, dbq_timeout());
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			write_log(dblog,"function epoll_wait is err:%s\n",strerror(errno));
+			break;
+		}
+
+		for(i = 0; i < n; i++)
+		{
+			/* 提交了新的查询，或者有连接还回来了 */
+			if(ev[i].data.ptr == NULL)
+			{
+				if(read(dbaevfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+					write_log(dblog,"function read eventfd is err:%s\n",strerror(errno));
+				continue;
+			}
+
+			q = (tmis_dbreq_t *)ev[i].data.ptr;
+			ready = 0;
+			if(ev[i].events & EPOLLIN) ready |= MYSQL_WAIT_READ;
+			if(ev[i].events & EPOLLOUT) ready |= MYSQL_WAIT_WRITE;
+			if(ev[i].events & EPOLLPRI) ready |= MYSQL_WAIT_EXCEPT;
+			/* 出错、断开的时候由客户端库读写套接字得到错误 */
+			if(ev[i].events & (EPOLLERR | EPOLLHUP)) ready |= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+			q->deadline = 0;
+			dbq_step(q, ready);
+		}
+
+		/* 超时的查询 */
+		now = db_now_us();
+		for(q = dbq_run; q; q = next)
+		{
+			next = q->next;
+			if(q->deadline && q->deadline <= now)
+			{
+				q->deadline = 0;
+				dbq_step(q, MYSQL_WAIT_TIMEOUT);
+			}
+		}
+
+		dbq_pump();
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief 启动数据库事件循环（在db_pool_init以后调用）
+ * @return 成功，返回0；失败，返回-1
+ */
+int db_async_init(void)
+{
+	struct epoll_event ev;
+
+	if(!dbconns) return -1;
+
+	dbafd = epoll_create1(EPOLL_CLOEXEC);
+	dbaevfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(dbafd < 0 || dbaevfd < 0)
+	{
+		write_log(dblog,"the database event loop is create failed:%s\n",strerror(errno));
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(dbafd, EPOLL_CTL_ADD, dbaevfd, &ev) != 0)
+	{
+		write_log(dblog,"function epoll_ctl is err:%s\n",strerror(errno));
+		return -1;
+	}
+
+	dbastop = 0;
+	if(pthread_create(&dbatid, NULL, db_async_run, NULL) != 0)
+	{
+		write_log(dblog,"the database event loop thread is create failed\n");
+		return -1;
+	}
+
+	write_log(dblog,"db pool: the records are queried asynchronously\n");
+
+	return 0;
+}
+
+/**
+ * @brief 异步查询一个用户的医疗记录：有空闲连接的话马上开始，否则排队等待连接还回来
+ *        （等待超过db_pool_init的wait_ms算失败）；每取出一条记录调用一次row，最后调用一次done
+ * @param uid 用户id（复制一份，调用者不用保留）
+ * @param from 分页查询：最早的记录时间（包括，复制一份）
+ * @param to 分页查询：最晚的记录时间（包括，复制一份）
+ * @param skip 分页查询：跳过最新的多少条
+ * @param limit 分页查询：最多取出多少条；0表示不分页，取出所有的记录（from和to不使用）
+ * @param row 取出一条记录的回调
+ * @param done 查询结束的回调，提交成功以后一定会调用一次
+ * @param arg 回调的参数
+ * @return 提交成功，返回0；失败（没有内存等，不会调用回调），返回-1
+ */
+int db_async_record(const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit,
+		db_row_cb row, db_done_cb done, void *arg)
+{
+	unsigned long long one = 1;
+	tmis_dbreq_t *q;
+
+	if(dbaevfd < 0) return -1;
+
+	q = (tmis_dbreq_t *)calloc(1, sizeof(tmis_dbreq_t));
+	if(q == NULL) return -1;
+	q->uid = strdup(uid);
+	if(q->uid == NULL)
+	{
+		free(q);
+		return -1;
+	}
+	if(limit > 0)
+	{
+		snprintf(q->from, sizeof(q->from), "%s", from);
+		snprintf(q->to, sizeof(q->to), "%s", to);
+		q->skip = skip;
+		q->limit = limit;
+	}
+	q->row = row;
+	q->done = done;
+	q->arg = arg;
+	q->since = db_now_us();
+
+	/* 都交给数据库事件循环开始，连接池的连接只在那里取 */
+	pthread_mutex_lock(&dblock);
+	q->waited = (nfree <= (int)dbst.queued);
+	if(dbq_tail) dbq_tail->next = q;
+	else dbq_head = q;
+	dbq_tail = q;
+	dbst.queued++;
+	pthread_mutex_unlock(&dblock);
+
+	if(write(dbaevfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		write_log(dblog,"function write eventfd is err:%s\n",strerror(errno));
+
+	return 0;
+}
+
+/**
+ * @brief 停止数据库事件循环，丢弃还在排队的查询
+ */
+static void db_async_destroy(void)
+{
+	unsigned long long one = 1;
+	tmis_dbreq_t *q;
+
+	if(dbaevfd < 0) return;
+
+	dbastop = 1;
+	if(write(dbaevfd, &one, sizeof(one)) < 0) {}
+	pthread_join(dbatid, NULL);
+
+	while((q = dbq_head) != NULL)
+	{
+		dbq_head = q->next;
+		free(q->uid);
+		free(q);
+	}
+	dbq_tail = NULL;
+	close(dbafd);
+	close(dbaevfd);
+	dbafd = -1;
+	dbaevfd = -1;
+}
+#endif
+
+/**
+ * @brief 取得连接池的统计信息
+ * @param st 传出参数，统计信息
+ */
+void db_stats(tmis_db_stats_t *st)
+{
+	pthread_mutex_lock(&dblock);
+	*st = dbst;
+	st->idle = nfree;
+	pthread_mutex_unlock(&dblock);
+}
+
+/**
+ * @brief 关闭所有的连接，释放连接池
+ */
+void db_pool_destroy(void)
+{
+	int i, j;
+
+	if(!dbconns) return;
+#ifdef TMIS_DB_ASYNC
+	db_async_destroy();
+#endif
+
+	pthread_mutex_lock(&dblock);
+	db_log_stats();
+	for(i = 0; i < dbsize; i++)
+	{
+		if(dbconns[i].connected) db_disconnect(&dbconns[i]);
+		for(j = 0; j < DB_BATCH_FIELDS; j++) free(dbconns[i].rec_buf[j]);
+	}
+	free(dbconns);
+	free(dbfree);
+	dbconns = NULL;
+	dbfree = NULL;
+	dbsize = 0;
+	nfree = 0;
+	pthread_mutex_unlock(&dblock);
+
+	pthread_cond_destroy(&dbcond);
+	mysql_library_end();
+}
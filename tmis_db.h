@@ -0,0 +1,245 @@
+/**
+* @file       tmis_db.h
+* @brief      tmis服务器的数据库连接池
+* @details    启动时建立固定数量的MySQL长连接，处理线程每个请求取一个连接、用完还回来；
+*             连接池的大小和线程池无关，连接用完的时候处理线程等待（有超时）；
+*             长时间没用或者上次出过错的连接在取出时先mysql_ping，断了就重新连接；
+*             每个连接建立以后准备好查询医疗记录的预处理语句，之后每个请求只发送参数，结果用二进制协议取回；
+*             编译时定义TMIS_DB_ASYNC的话，医疗记录的查询由数据库事件循环用MariaDB客户端库的非阻塞接口执行，
+*             处理线程提交查询以后马上返回，同时进行的查询数量只受连接池大小的限制
+* @author     项斌
+* @date       2018/08/26
+* @version    1.0
+*/
+
+#ifndef __TMIS_DB_H__
+#define __TMIS_DB_H__
+
+#include <stdio.h>
+#include "/usr/include/mysql/mysql.h"
+
+/** 数据库服务器的地址、用户、密码和数据库名 */
+#define DB_HOST "localhost"
+#define DB_USER "root"
+#define DB_PASS "123"
+#define DB_NAME "db_tmis"
+
+/** 连接使用的字符集，连接时设置好，不用每个请求执行set names */
+#define DB_CHARSET "utf8"
+
+/** 连接数据库的超时（秒） */
+#define DB_CONNECT_TIMEOUT 3
+
+/** 连接空闲超过这么多秒，取出的时候先mysql_ping检查（MySQL默认8小时断开空闲连接） */
+#define DB_PING_IDLE 30
+
+/** 每隔多少秒在日志中记录一次连接池的统计信息 */
+#define DB_STATS_INTERVAL 60
+
+/** 查询一个用户的医疗记录的预处理语句，每个连接准备一次，uid作为参数绑定（不拼接SQL） */
+#define DB_SQL_RECORD "select rtime,rdoctor,rsymptom,rfeedback from tmis_record where uid=?"
+
+/** 按时间倒序分页查询一个用户的医疗记录：uid、时间范围[from,to]、跳过的条数、每页的条数，用(uid,rtime)索引（见tmis_db.sql） */
+#define DB_SQL_RECORD_PAGE "select rtime,rdoctor,rsymptom,rfeedback from tmis_record where uid=? and rtime>=? and rtime<=? order by rtime desc limit ?,?"
+
+/** 一次查询多个用户的医疗记录的预处理语句：每条记录后面多取出uid，按uid、记录时间排序，同一个用户的记录连在一起；
+ *  in中固定DB_BATCH_MAX个参数（每个连接只准备一次），用户不够的时候用第一个uid补齐 */
+#define DB_SQL_RECORD_BATCH_HEAD "select rtime,rdoctor,rsymptom,rfeedback,uid from tmis_record where uid in ("
+#define DB_SQL_RECORD_BATCH_TAIL ") order by uid,rtime"
+
+/** 一次查询最多的用户数量 */
+#define DB_BATCH_MAX 64
+
+/** 记录时间的长度："YYYY-MM-DD HH:MM:SS" */
+#define DB_RTIME_LEN 19
+
+/** 分页查询的参数个数 */
+#define DB_PAGE_PARAMS 5
+
+/** 医疗记录的字段数 */
+#define DB_RECORD_FIELDS 4
+
+/** 一次查询多个用户的时候每条记录的字段数：多一个uid */
+#define DB_BATCH_FIELDS (DB_RECORD_FIELDS + 1)
+
+/** 每个字段结果缓存的初始大小，字段更长的时候按需要扩大 */
+#define DB_FIELD_LEN 256
+
+/** 结果缓存的标志位类型：MySQL 8.0把my_bool换成了bool */
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80001 && !defined(MARIADB_BASE_VERSION)
+#include <stdbool.h>
+typedef bool db_bool_t;
+#else
+typedef my_bool db_bool_t;
+#endif
+
+/** 异步模式需要MariaDB客户端库（Connector/C）的非阻塞接口（mysql_*_start、mysql_*_cont） */
+#if defined(TMIS_DB_ASYNC) && !defined(MYSQL_WAIT_READ)
+#error "TMIS_DB_ASYNC needs the non-blocking API of the MariaDB client library"
+#endif
+
+/** 连接池中的一个连接 */
+typedef struct tmis_dbconn
+{
+	MYSQL mysql;                        ///< MySQL连接
+	MYSQL_STMT *rec_stmt;               ///< 查询医疗记录的预处理语句（二进制协议），连接以后准备一次
+	MYSQL_BIND rec_param;               ///< 参数：uid
+	unsigned long rec_plen;             ///< 参数的长度
+	MYSQL_STMT *page_stmt;              ///< 分页查询医疗记录的预处理语句，和rec_stmt共用结果缓存
+	MYSQL_BIND page_param[DB_PAGE_PARAMS];        ///< 参数：uid、from、to、跳过的条数、每页的条数
+	unsigned long page_plen[3];         ///< 字符串参数的长度
+	unsigned int page_int[2];           ///< 整数参数：跳过的条数、每页的条数
+	MYSQL_STMT *batch_stmt;             ///< 一次查询多个用户的医疗记录的预处理语句，和rec_stmt共用结果缓存
+	MYSQL_BIND batch_param[DB_BATCH_MAX];         ///< 参数：各个uid
+	unsigned long batch_plen[DB_BATCH_MAX];       ///< 参数的长度
+	MYSQL_STMT *cur;                    ///< 当前查询执行的语句（rec_stmt、page_stmt或者batch_stmt）
+	MYSQL_BIND rec_bind[DB_BATCH_FIELDS];         ///< 结果：每个字段一块缓存，按字符串取回（最后一个只有batch_stmt用）
+	char *rec_buf[DB_BATCH_FIELDS];               ///< 字段的缓存（多留1个字节放'\0'）
+	unsigned long rec_len[DB_BATCH_FIELDS];       ///< 字段的实际长度
+	db_bool_t rec_null[DB_BATCH_FIELDS];          ///< 字段是NULL
+	db_bool_t rec_trunc[DB_BATCH_FIELDS];         ///< 字段比缓存长，被截断了
+	int connected;                      ///< 已经连接上
+	int suspect;                        ///< 上次使用的时候出错了，下次取出时先检查
+	long used;                          ///< 最后一次还回连接池的时间（秒，单调时钟）
+	int afd;                            ///< 异步模式：注册在数据库事件循环中的套接字，-1表示没有注册
+}tmis_dbconn_t;
+
+/** 连接池的统计信息 */
+typedef struct tmis_db_stats
+{
+	int size;                           ///< 连接池的大小
+	int idle;                           ///< 当前空闲的连接数量
+	unsigned long gets;                 ///< 取连接的次数
+	unsigned long waits;                ///< 连接用完、需要等待的次数
+	unsigned long timeouts;             ///< 等待超时、没有取到连接的次数
+	unsigned long long wait_us;         ///< 等待的总时间（微秒）
+	unsigned long long wait_max_us;     ///< 最长的一次等待（微秒）
+	unsigned long pings;                ///< 取出时检查连接的次数
+	unsigned long reconnects;           ///< 重新连接成功的次数
+	unsigned long failures;             ///< 连接失败的次数
+	unsigned long inflight;             ///< 异步模式：正在执行的查询数量
+	unsigned long queued;               ///< 异步模式：等待空闲连接的查询数量
+}tmis_db_stats_t;
+
+/**
+ * @brief 异步查询取出一条记录的回调（在数据库事件循环中调用）
+ * @param arg db_async_record的参数
+ * @param fields 每个字段（以'\0'结尾，下一次调用以前有效）
+ * @param lens 每个字段的长度
+ * @return 返回0，继续；否则，结束这次查询（查询的结果为失败）
+ */
+typedef int (*db_row_cb)(void *arg, char **fields, unsigned long *lens);
+
+/**
+ * @brief 异步查询结束的回调（在数据库事件循环中调用，不能阻塞，耗时的处理交给线程池）
+ * @param arg db_async_record的参数
+ * @param status 返回0，成功；否则，失败
+ */
+typedef void (*db_done_cb)(void *arg, int status);
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 初始化连接池，建立所有的连接（连接失败的在取出的时候再连接，数据库晚于服务器启动也可以）
+ * @param size 连接的数量
+ * @param wait_ms 连接用完的时候最多等待多少毫秒，0表示一直等待
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败（没有内存等），返回-1
+ */
+int db_pool_init(int size, int wait_ms, FILE *log);
+
+/**
+ * @brief 从连接池中取一个可用的连接，没有空闲的连接就等待
+ * @return 成功，返回连接；等待超时或者连接不上数据库，返回NULL
+ */
+tmis_dbconn_t *db_get(void);
+
+/**
+ * @brief 把连接还给连接池
+ * @param db db_get取得的连接
+ * @param error 使用的时候出错了（可能是连接断了），下次取出时先检查
+ */
+void db_put(tmis_dbconn_t *db, int error);
+
+/**
+ * @brief 执行查询医疗记录的预处理语句，之后用db_record_next逐行取出结果，最后db_record_end
+ * @param db db_get取得的连接
+ * @param uid 用户id（作为参数绑定，不需要转义）
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_query(tmis_dbconn_t *db, const char *uid);
+
+/**
+ * @brief 按时间倒序分页查询一个用户的医疗记录，之后同样用db_record_next逐行取出结果，最后db_record_end
+ * @param db db_get取得的连接
+ * @param uid 用户id
+ * @param from 最早的记录时间（包括），格式为"YYYY-MM-DD HH:MM:SS"
+ * @param to 最晚的记录时间（包括）
+ * @param skip 跳过最新的多少条
+ * @param limit 最多取出多少条
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_page(tmis_dbconn_t *db, const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit);
+
+/**
+ * @brief 一次查询多个用户的医疗记录，之后同样用db_record_next逐行取出结果（多一个字段uid），最后db_record_end
+ * @param db db_get取得的连接
+ * @param uids 各个用户id
+ * @param n 用户的数量，1到DB_BATCH_MAX
+ * @return 成功，返回0；失败，返回MySQL的错误码
+ */
+int db_record_batch(tmis_dbconn_t *db, const char **uids, int n);
+
+/**
+ * @brief 取出下一条医疗记录，字段比缓存长的时候扩大缓存再取一次这个字段
+ * @param db 连接
+ * @param fields 传出参数，每个字段（db_record_batch的查询多一个uid，以'\0'结尾，NULL为空字符串，下一次调用以前有效）
+ * @param lens 传出参数，每个字段的长度，可以是NULL
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+int db_record_next(tmis_dbconn_t *db, char **fields, unsigned long *lens);
+
+/**
+ * @brief 结束这次查询，丢弃没有取出的结果（连接还给连接池以前调用）
+ * @param db 连接
+ */
+void db_record_end(tmis_dbconn_t *db);
+
+/**
+ * @brief 取得连接池的统计信息
+ * @param st 传出参数，统计信息
+ */
+void db_stats(tmis_db_stats_t *st);
+
+#ifdef TMIS_DB_ASYNC
+/**
+ * @brief 启动数据库事件循环（在db_pool_init以后调用）
+ * @return 成功，返回0；失败，返回-1
+ */
+int db_async_init(void);
+
+/**
+ * @brief 异步查询一个用户的医疗记录：有空闲连接的话马上开始，否则排队等待连接还回来
+ *        （等待超过db_pool_init的wait_ms算失败）；每取出一条记录调用一次row，最后调用一次done
+ * @param uid 用户id（复制一份，调用者不用保留）
+ * @param from 分页查询：最早的记录时间（包括，复制一份）
+ * @param to 分页查询：最晚的记录时间（包括，复制一份）
+ * @param skip 分页查询：跳过最新的多少条
+ * @param limit 分页查询：最多取出多少条；0表示不分页，取出所有的记录（from和to不使用）
+ * @param row 取出一条记录的回调
+ * @param done 查询结束的回调，提交成功以后一定会调用一次
+ * @param arg 回调的参数
+ * @return 提交成功，返回0；失败（没有内存等，不会调用回调），返回-1
+ */
+int db_async_record(const char *uid, const char *from, const char *to, unsigned int skip, unsigned int limit,
+		db_row_cb row, db_done_cb done, void *arg);
+#endif
+
+/**
+ * @brief 关闭所有的连接，释放连接池
+ */
+void db_pool_destroy(void);
+
+
+#endif
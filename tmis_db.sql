@@ -0,0 +1,12 @@
+-- @file       tmis_db.sql
+-- @brief      tmis服务器使用的MySQL数据库db_tmis的索引
+-- @details    医疗记录按(uid,rtime)建立联合索引：按uid查询全部记录（FLAG_RECORD）、
+--             按时间倒序分页（FLAG_RECORD_PAGE，见tmis_db.h的DB_SQL_RECORD_PAGE）都只扫描一个用户的那一段索引，
+--             分页的时候直接按索引倒序读出，不用排序；原来只有uid的索引是它的前缀，可以删除
+-- @author     项斌
+-- @date       2018/08/29
+-- @version    1.0
+
+use db_tmis;
+
+alter table tmis_record add index idx_uid_rtime (uid, rtime);
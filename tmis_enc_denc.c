@@ -18,15 +18,16 @@
 #include "tmis_enc_denc.h"
 
 /**
- * @brief aes加密--aes128
- * @param in  传入参数，带加密的字符串
+ * @brief aes加密--aes128，明文的长度由调用者给出（不用strlen，明文中间可以有'\0'）
+ * @param in  传入参数，待加密的数据
+ * @param len 数据的长度
  * @param key 传入参数，密钥
- * @param out 传出参数，加密后的结果
- * @return    返回0，表示加密成功；否则，加密失败
+ * @param out 传出参数，加密后的结果（大小至少是len按16字节向上取整）
+ * @return    成功，返回加密结果的长度（len按16字节向上取整，最后一块不足的部分补0）；失败，返回-1
  */
-int aes_encrypt(const unsigned char* in, const unsigned char* key, unsigned char* out)
+int aes_encrypt_len(const unsigned char* in, size_t len, const unsigned char* key, unsigned char* out)
 {
-	if (!in || !key || !out) return -1;  
+	if (!in || !key || !out) return -1;
 
 	int i;
 	unsigned char iv[AES_BLOCK_SIZE]; //加密的初始化向量
@@ -36,17 +37,29 @@ int aes_encrypt(const unsigned char* in, const unsigned char* key, unsigned char
 	AES_KEY aes;
 	if (AES_set_encrypt_key(key, 128, &aes) < 0)
 	{
-		return 0;
+		return -1;
 	}
-	int len = strlen((char *)in); //这里的长度是char*in的长度，但是如果in中间包含'\0'字符的话
-
-	//那么就只会加密前面'\0'前面的一段，所以，这个len可以作为参数传进来，记录in的长度
 
-	//至于解密也是一个道理，光以'\0'来判断字符串长度，确有不妥，后面都是一个道理。
 	AES_cbc_encrypt(in, out, len, &aes, iv,AES_ENCRYPT);
-	//AES_ecb_encrypt(in,out,&aes,AES_ENCRYPT);
 
-			
+	return (int)((len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE);
+}
+
+/**
+ * @brief aes加密--aes128
+ * @param in  传入参数，带加密的字符串
+ * @param key 传入参数，密钥
+ * @param out 传出参数，加密后的结果
+ * @return    返回0，表示加密成功；否则，加密失败
+ */
+int aes_encrypt(const unsigned char* in, const unsigned char* key, unsigned char* out)
+{
+	if (!in || !key || !out) return -1;  
+
+	//这里的长度是char*in的长度，但是如果in中间包含'\0'字符的话
+	//那么就只会加密前面'\0'前面的一段，知道长度的调用者用aes_encrypt_len
+	aes_encrypt_len(in, strlen((char *)in), key, out);
+
 	return 0;
 }
 
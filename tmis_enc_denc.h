@@ -10,6 +10,9 @@
 #ifndef __TMIS_ENC_DEC_H__
 #define __TMIS_ENC_DEC_H__
 
+#include <stddef.h>
+#include <time.h>
+
 
 #ifdef  __cplusplus
 extern "C" {
@@ -26,6 +29,16 @@ extern "C" {
  */
 int aes_encrypt(const unsigned char* in, const unsigned char* key, unsigned char* out);
 
+/**
+ * @brief aes加密--aes128，明文的长度由调用者给出（不用strlen，明文中间可以有'\0'）
+ * @param in  传入参数，待加密的数据
+ * @param len 数据的长度
+ * @param key 传入参数，密钥
+ * @param out 传出参数，加密后的结果（大小至少是len按16字节向上取整）
+ * @return    成功，返回加密结果的长度（len按16字节向上取整，最后一块不足的部分补0）；失败，返回-1
+ */
+int aes_encrypt_len(const unsigned char* in, size_t len, const unsigned char* key, unsigned char* out);
+
 /**
  * @brief 将时间戳转化为字符串
  * @param t 时间戳
@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include "tmis_io.h"
 
 /**
@@ -45,6 +47,27 @@ ssize_t readn(int fd, void *buf, size_t count)
 }
 
 
+/**
+ * @brief 非阻塞的套接字暂时写不进去的时候，等待它可写
+ * @param fd 套接字
+ * @return 可写了，返回0；出错，返回-1
+ */
+static int wait_writable(int fd)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	do
+	{
+		ret = poll(&pfd, 1, -1);
+	}while(ret < 0 && errno == EINTR);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+
 /**
  * @brief 往套接字fd中写count字节大小数据，数据来源于buf数组
  * @param fd 套接字
@@ -64,10 +87,11 @@ ssize_t writen(int fd, const void *buf, size_t count)
 		{
 			if (errno == EINTR)
 				continue;
+			/* 非阻塞的套接字发送缓冲区满了，等可写以后继续，不能把数据丢掉 */
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd) == 0)
+				continue;
 			return -1;
 		}
-		else if (nwritten == 0)
-			continue;
 
 		bufp += nwritten;
 		nleft -= nwritten;
@@ -77,3 +101,43 @@ ssize_t writen(int fd, const void *buf, size_t count)
 }
 
 
+/**
+ * @brief 用一次writev把多块数据写入套接字fd，没有写完的部分继续写
+ * @param fd 套接字
+ * @param iov 数据块数组（写了一部分的时候会被修改）
+ * @param iovcnt 数据块的数量
+ * @return 写入出错，返回-1；否则，返回写入的字节大小
+ */
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t total = 0;
+	ssize_t nwritten;
+
+	while (iovcnt > 0)
+	{
+		if ((nwritten = writev(fd, iov, iovcnt)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd) == 0)
+				continue;
+			return -1;
+		}
+		total += nwritten;
+
+		/* 跳过已经写完的数据块，写了一半的数据块调整起始位置 */
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len)
+		{
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+
+	return total;
+}
@@ -11,6 +11,7 @@
 #ifndef __TMIS_IO_H__
 #define __TMIS_IO_H__
 
+#include <sys/uio.h>
 
 
 /**
@@ -29,8 +30,19 @@ ssize_t readn(int fd, void *buf, size_t count);
  * @param buf 数据来源数组
  * @param count 此次写入数据的大小
  * @return 读取出错，返回-1；否则，返回读取的字节大小
+ * @note 非阻塞的套接字发送缓冲区满了会等待可写，会阻塞调用的线程；服务器回复客户端使用发送队列（conn_flush）
  */
 ssize_t writen(int fd, const void *buf, size_t count);
 
 
+/**
+ * @brief 用一次writev把多块数据写入套接字fd，没有写完的部分继续写
+ * @param fd 套接字
+ * @param iov 数据块数组（写了一部分的时候会被修改）
+ * @param iovcnt 数据块的数量
+ * @return 写入出错，返回-1；否则，返回写入的字节大小
+ */
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt);
+
+
 #endif
@@ -0,0 +1,27 @@
+/**
+* @file       tmis_keys.h
+* @brief      tmis密钥协商的公共参数和服务器的密钥对
+* @details    服务器和压力测试客户端共用：客户端按照服务器的计算方法算出同一个共享点，
+*             这样不需要另外的客户端就可以在本机完整地测试密钥协商
+* @author     项斌
+* @date       2018/08/24
+* @version    1.0
+*/
+
+#ifndef __TMIS_KEYS_H__
+#define __TMIS_KEYS_H__
+
+/** 服务器的私钥（G1上的点，十进制） */
+#define TMIS_SECRET_KEY "[1431701601476568613993916354570581999234296492200903722689435064403093647543786410908775082711468637043556899660242354405958838182001143332963964057164995, 2090155367049341967001403718508984758041491186470976194749112114432660174858545929700501744055058603817941671083836419094294404012587185432039026958345540]"
+
+/** 服务器的公钥（G1上的点，十进制） */
+#define TMIS_PUBLIC_KEY "[8779246804865256595845410635551148521227644044548861627285453536743878386166265446937141101008408588690674901331738586548621281816777149434943936565852561, 5462710688655103662240594520449922001027729122965123487994410536107298056563228514615559984791707466524546778752823276552092115399599325705605166751646997]"
+
+/** 公共参数P由这个字符串哈希到G1上得到 */
+#define TMIS_HASH_P "xiangbin is a good boy!"
+
+/** 配对参数文件 */
+#define TMIS_PARAM_FILE "a.param"
+
+
+#endif
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+#######################################################
+# tmis服务器TCP选项的延迟测试脚本：用不同的TCP选项启动服务器，
+# 用同样的负载测试，对比每秒处理的请求数和延迟的百分位数
+# 使用方法：
+#		./tmis_latency.sh [tmis_bench的参数]
+# 例如：
+#		./tmis_latency.sh -t 2 -c 4 -d 1 -s 5
+#		./tmis_latency.sh -t 2 -c 4 -s 5 -r       （每一批请求重新连接，比较defer-accept和fastopen）
+# 说明：
+#		tmis_bench默认不做密钥协商（-k、-m打开），所以关闭了密钥协商超时；需要先make和make bench；
+#		服务器端的TCP Fast Open需要 sysctl -w net.ipv4.tcp_fastopen=3，
+#		--fastopen的那一次测试客户端也会使用TCP Fast Open；服务器的其它参数由TMIS_OPTS传入
+#######################################################
+
+if [ ! -x ./tmis_server ] || [ ! -x ./tmis_bench ]; then
+	echo -e "\033[32m请先执行 make && make bench\033[0m"
+	exit -1
+fi
+
+#### 用一组TCP选项测试一次
+run_one()
+{
+	name=$1
+	opts=$2
+	shift 2
+
+	pkill -x tmis_server
+	sleep 1
+	./tmis_server -q --handshake-timeout=0 $opts $TMIS_OPTS
+	sleep 1
+	if [ -z "`pgrep -n -x tmis_server`" ]; then
+		echo "tmis服务器启动失败..."
+		return
+	fi
+
+	out=/tmp/tmis_latency.$$
+	./tmis_bench "$@" | tee $out
+	pkill -x tmis_server
+
+	rps=`sed -n 's/.*req\/s: \([0-9]*\).*/\1/p' $out`
+	lat=`sed -n 's/^latency(us): avg \([0-9]*\)  p50 \([0-9]*\)  p90 \([0-9]*\)  p99 \([0-9]*\)  p99.9 \([0-9]*\)  max \([0-9]*\)/\1 \2 \3 \4 \5 \6/p' $out`
+	result="$result`printf '%-16s %10s %8s %8s %8s %8s %8s %8s' $name ${rps:--} ${lat:-- - - - - -}`\n"
+	rm -f $out
+}
+
+result=""
+run_one nodelay-off  "--nodelay=0" "$@"
+run_one baseline     "" "$@"
+run_one defer-accept "--defer-accept=5" "$@"
+run_one fastopen     "--fastopen=256" "$@" -f
+run_one buffers      "--rcvbuf=262144 --sndbuf=262144" "$@"
+run_one keepalive    "--keepalive=60" "$@"
+
+echo -e "\033[32m===========================================================================\033[1m"
+printf '%-16s %10s %8s %8s %8s %8s %8s %8s\n' "options" "req/s" "avg(us)" "p50" "p90" "p99" "p99.9" "max"
+echo -e "$result"
+echo -e "\033[32m===========================================================================\033[0m"
@@ -0,0 +1,164 @@
+/**
+* @file       tmis_pool.c
+* @brief      tmis服务器的缓存池
+* @details    按大小分级的缓存池：收到的数据包、回复客户端的数据都放在池中的缓存里，用完以后还给缓存池；
+*             每个线程先用自己的空闲缓存（不用加锁），不够或者太多的时候再和全局的空闲链表交换
+* @author     项斌
+* @date       2018/08/24
+* @version    1.0
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "tmis_pool.h"
+
+/** 缓存的头部，放在返回给调用者的地址前面 */
+typedef union pool_head
+{
+	struct
+	{
+		union pool_head *next;          ///< 空闲链表中的下一块缓存
+		size_t size;                    ///< 缓存的大小（不包括头部）
+		int cls;                        ///< 所属的级别，POOL_CLASSES表示直接malloc的
+	}h;
+	long double align;                  ///< 保证返回的地址和malloc一样对齐
+}pool_head_t;
+
+/** 一级缓存的空闲链表 */
+typedef struct pool_class
+{
+	pthread_mutex_t lock;               ///< 空闲链表的锁
+	pool_head_t *free;                  ///< 空闲链表
+	int nfree;                          ///< 空闲缓存的数量
+}pool_class_t;
+
+/** 一个线程一级缓存的空闲链表 */
+typedef struct pool_cache
+{
+	pool_head_t *free;                  ///< 空闲链表
+	int nfree;                          ///< 空闲缓存的数量
+}pool_cache_t;
+
+static pool_class_t classes[POOL_CLASSES] =
+{
+	[0 ... POOL_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static __thread pool_cache_t caches[POOL_CLASSES];   ///< 本线程的空闲缓存
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 计算需要的大小对应的级别
+ * @param size 需要的大小
+ * @return 级别；太大的返回POOL_CLASSES
+ */
+static int pool_class(size_t size)
+{
+	int cls = 0;
+	size_t csize = POOL_MIN_SIZE;
+
+	while(csize < size && cls < POOL_CLASSES)
+	{
+		csize <<= 1;
+		cls++;
+	}
+
+	return cls;
+}
+
+/**
+ * @brief 从缓存池中取一块缓存
+ * @param size 需要的大小
+ * @return 成功，返回缓存（大小不小于size）；失败，返回NULL
+ */
+char *pool_alloc(size_t size)
+{
+	int cls = pool_class(size);
+	pool_head_t *ph = NULL;
+
+	if(cls < POOL_CLASSES)
+	{
+		pool_cache_t *cc = &caches[cls];
+		pool_class_t *pc = &classes[cls];
+
+		/* 先用本线程的，没有了再从全局的取 */
+		ph = cc->free;
+		if(ph)
+		{
+			cc->free = ph->h.next;
+			cc->nfree--;
+		}
+		else
+		{
+			pthread_mutex_lock(&pc->lock);
+			ph = pc->free;
+			if(ph)
+			{
+				pc->free = ph->h.next;
+				pc->nfree--;
+			}
+			pthread_mutex_unlock(&pc->lock);
+		}
+
+		size = (size_t)POOL_MIN_SIZE << cls;
+	}
+
+	if(NULL==ph)
+	{
+		ph = (pool_head_t *)malloc(sizeof(pool_head_t) + size);
+		if(NULL==ph) return NULL;
+		ph->h.size = size;
+		ph->h.cls = cls;
+	}
+	ph->h.next = NULL;
+
+	return (char *)(ph + 1);
+}
+
+/**
+ * @brief 把缓存还给缓存池
+ * @param buf pool_alloc取得的缓存，可以是NULL
+ */
+void pool_free(char *buf)
+{
+	if(NULL==buf) return;
+
+	pool_head_t *ph = (pool_head_t *)buf - 1;
+	if(ph->h.cls < POOL_CLASSES)
+	{
+		pool_cache_t *cc = &caches[ph->h.cls];
+		pool_class_t *pc = &classes[ph->h.cls];
+
+		/* 先还给本线程，本线程的太多了再还给全局的（例如一个线程申请、另一个线程释放） */
+		if(cc->nfree < POOL_CACHE_FREE)
+		{
+			ph->h.next = cc->free;
+			cc->free = ph;
+			cc->nfree++;
+			return;
+		}
+
+		pthread_mutex_lock(&pc->lock);
+		if(pc->nfree < POOL_MAX_FREE)
+		{
+			ph->h.next = pc->free;
+			pc->free = ph;
+			pc->nfree++;
+			ph = NULL;
+		}
+		pthread_mutex_unlock(&pc->lock);
+	}
+
+	free(ph);
+}
+
+/**
+ * @brief 缓存的实际大小
+ * @param buf pool_alloc取得的缓存
+ * @return 缓存的大小
+ */
+size_t pool_size(const char *buf)
+{
+	return ((const pool_head_t *)buf - 1)->h.size;
+}
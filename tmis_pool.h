@@ -0,0 +1,52 @@
+/**
+* @file       tmis_pool.h
+* @brief      tmis服务器的缓存池
+* @details    按大小分级的缓存池：收到的数据包、回复客户端的数据都放在池中的缓存里，用完以后还给缓存池；
+*             每个线程先用自己的空闲缓存（不用加锁），不够或者太多的时候再和全局的空闲链表交换
+* @author     项斌
+* @date       2018/08/24
+* @version    1.0
+*/
+
+#ifndef __TMIS_POOL_H__
+#define __TMIS_POOL_H__
+
+#include <stddef.h>
+
+/** 最小一级缓存的大小 */
+#define POOL_MIN_SIZE 256
+
+/** 缓存的级数：256B, 512B, ... , 256KB，更大的直接malloc */
+#define POOL_CLASSES 11
+
+/** 每一级全局最多保留的空闲缓存数量 */
+#define POOL_MAX_FREE 64
+
+/** 每个线程每一级最多保留的空闲缓存数量 */
+#define POOL_CACHE_FREE 16
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 从缓存池中取一块缓存
+ * @param size 需要的大小
+ * @return 成功，返回缓存（大小不小于size）；失败，返回NULL
+ */
+char *pool_alloc(size_t size);
+
+/**
+ * @brief 把缓存还给缓存池
+ * @param buf pool_alloc取得的缓存，可以是NULL
+ */
+void pool_free(char *buf);
+
+/**
+ * @brief 缓存的实际大小
+ * @param buf pool_alloc取得的缓存
+ * @return 缓存的大小
+ */
+size_t pool_size(const char *buf);
+
+
+#endif
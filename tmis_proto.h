@@ -0,0 +1,100 @@
+/**
+* @file       tmis_proto.h
+* @brief      tmis通信协议
+* @details    客户端和服务器之间数据包的格式：4字节长度（网络字节序）+ 1字节类型 + 数据，数据的长度不超过tmisconf.max_frame；
+*             一个连接上客户端可以连续发送多个数据包，服务器按顺序处理、按顺序回复
+* @author     项斌
+* @date       2018/08/21
+* @version    1.0
+*/
+
+#ifndef __TMIS_PROTO_H__
+#define __TMIS_PROTO_H__
+
+/** 接受数据的数组大小（密钥协商的数据包不能超过它） */
+#define BUFLEN 2048
+
+/** 数据包头部的长度：len + flag */
+#define PKT_HEADLEN 5
+
+/** 数据包类型：密钥协商 */
+#define FLAG_KEY_AGREEMENT 1
+
+/** 数据包类型：获取医疗记录 */
+#define FLAG_RECORD 2
+
+/** 数据包类型：病人的医疗记录改变了，删除缓存（数据为uid，空表示全部删除）；只接受本地套接字上的，回复一个空的同类型数据包 */
+#define FLAG_INVALIDATE 3
+
+/** 数据包类型：流式获取医疗记录（数据为uid），回复若干个FLAG_RECORD_CHUNK，最后一个FLAG_RECORD_END */
+#define FLAG_RECORD_STREAM 4
+
+/** 数据包类型：流式回复的一块，若干条完整的医疗记录，单独用会话密钥加密（十六进制），可以单独解密 */
+#define FLAG_RECORD_CHUNK 5
+
+/** 数据包类型：流式回复结束，数据为记录的条数（十进制），中途出错的时候为-1 */
+#define FLAG_RECORD_END 6
+
+/** 数据包类型：按时间倒序分页获取医疗记录，数据为"uid|from|to|limit|cursor"（后面的参数可以为空或者省略）；
+ *  回复同类型的数据包：这一页的记录（格式和FLAG_RECORD一样，最新的在前）后面接着下一页的游标，
+ *  没有下一页的时候游标为空，用会话密钥加密（十六进制） */
+#define FLAG_RECORD_PAGE 7
+
+/** 数据包类型：一次获取多个用户的医疗记录，数据为用SPLIT_PARAM分隔的uid（最多BATCH_MAX个）；
+ *  回复同类型的一个数据包：按请求的顺序每个用户一组，uid、SPLIT_RECORD、这个用户的记录（格式和FLAG_RECORD一样）、SPLIT_GROUP，
+ *  查询出错的用户记录为BATCH_ERROR；用会话密钥加密（十六进制） */
+#define FLAG_RECORD_BATCH 8
+
+/** 数据包类型：增量获取医疗记录，数据为"uid|rtime,n"（rtime为客户端已经有的最新一条记录的时间，空表示没有；
+ *  n为客户端已有的时间等于rtime的记录条数，",n"省略的时候为1）；
+ *  回复同类型的数据包：时间不早于rtime的记录（格式和FLAG_RECORD一样），用会话密钥加密（十六进制），
+ *  客户端用其中时间等于rtime的记录替换它那一秒的记录（同一秒可能后来又插入了记录）；
+ *  没有更新的记录、那一秒也还是n条的时候回复FLAG_NOT_MODIFIED */
+#define FLAG_RECORD_SINCE 9
+
+/** 数据包类型：增量获取的回复，客户端的记录已经是最新的了（数据为空，不加密） */
+#define FLAG_NOT_MODIFIED 10
+
+/** 流式回复每一块明文的最大长度（一条记录比它还长的时候单独一块） */
+#define STREAM_CHUNK 4096
+
+/** 密钥协商的数据中各个参数之间的分隔符 */
+#define SPLIT_KEY_AGREEMENT "我"
+
+/** 医疗记录的回复中每一条记录之间的分隔符 */
+#define SPLIT_RECORD "AAAA"
+
+/** 医疗记录的回复中一条记录的各个域之间的分隔符 */
+#define SPLIT_FIELD "AA"
+
+/** 批量获取的回复中每个用户的一组记录之间的分隔符 */
+#define SPLIT_GROUP "BBBB"
+
+/** 分页、增量请求的各个参数之间，批量请求的各个uid之间的分隔符 */
+#define SPLIT_PARAM "|"
+
+/** 分页的游标中最后一条记录的时间和跳过的条数之间的分隔符："YYYY-MM-DD HH:MM:SS,3" */
+#define SPLIT_CURSOR ","
+
+/** 分页请求没有给出每页的条数时的默认值 */
+#define PAGE_DEFAULT 20
+
+/** 每页最多的条数 */
+#define PAGE_MAX 100
+
+/** 一次批量获取最多的用户数量 */
+#define BATCH_MAX 64
+
+/** 批量获取的回复中查询出错的用户的记录（正常的记录为空或者以SPLIT_RECORD结尾，不会和它混淆） */
+#define BATCH_ERROR "-1"
+
+/** 发送的数据包相关信息 */
+typedef struct tmis_packet
+{
+	unsigned int len;                   ///< 此次发送数据的长度
+	char flag;                         ///< 此次发送数据的类型 ，协商密钥的，安全通信的
+	char *buf;                         ///< 此次发送的数据，缓存池中len+1字节的缓存（以'\0'结尾），处理完以后pool_free
+}tmis_packet_t;
+
+
+#endif
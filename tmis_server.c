@@ -7,6 +7,7 @@
 * @version    1.0
 */
 
+#define _GNU_SOURCE             /* accept4 */
 #include <sys/epoll.h>
 #include <string.h>
 #include <time.h>
@@ -16,65 +17,171 @@
 #include <stdio.h>
 #include <sys/types.h>          /* See NOTES */
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <openssl/aes.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include "log.h"
 #include "threadpool.h"
 #include "tmis_io.h"
 #include "tmis_enc_denc.h"
+#include "tmis_conf.h"
+#include "tmis_proto.h"
+#include "tmis_conn.h"
+#include "tmis_uring.h"
+#include "tmis_pool.h"
+#include "tmis_timer.h"
+#include "tmis_keys.h"
+#include "tmis_store.h"
+#include "tmis_cache.h"
+#include "tmis_buf.h"
+#include "tmis_stat.h"
 #include "/usr/local/include/pbc/pbc.h"  //必须包含头文件pbc.h
 #include "/usr/local/include/pbc/pbc_test.h"
 #include "/usr/include/mysql/mysql.h"
 
-/** 接受数据的数组大小 */
-#define BUFLEN 2048
+/** 除了客户端连接以外，进程自己要用的文件描述符（日志、标准输入输出、数据库等） */
+#define RESERVED_FDS 64
 
-/** 并发数量 */
-#define OPEN_MAX  1024
+/** 每个事件循环自己要用的文件描述符（监听套接字、本地监听套接字、epoll或io_uring、eventfd、timerfd、预留的） */
+#define REACTOR_FDS 8
+
+/** TCP keepalive：开始探测以后每次探测的间隔（秒）和探测的次数 */
+#define KEEPALIVE_INTVL 10
+#define KEEPALIVE_CNT   3
+
+/** 流式回复：客户端这么长时间（毫秒）还没有把发送队列读到高水位以下，就放弃这次回复 */
+#define STREAM_SEND_TIMEOUT 30000
 
 /** 服务器监听端口 */
 #define SERV_PORT   8888
 
-/** 发送的数据包相关信息 */
-typedef struct tmis_packet
+/** io_uring模式：提交队列的长度 */
+#define URING_ENTRIES 4096
+
+/** io_uring模式：接收数据的缓存块数（2的幂）和每块的大小 */
+#define URING_NBUFS 1024
+#define URING_BUFSZ 4096
+
+/** io_uring模式：完成事件的类型，和连接的代数、fd一起放在user_data中 */
+#define UD_ACCEPT 1
+#define UD_RECV   2
+#define UD_SEND   3
+#define UD_WAKE   4
+#define UD_CANCEL 5
+#define UD_TIMER  6
+#define UD_MAKE(type, gen, fd) (((unsigned long long)(type) << 56) | ((unsigned long long)((gen) & 0xffffff) << 32) | (unsigned int)(fd))
+#define UD_TYPE(ud) ((int)((ud) >> 56))
+#define UD_GEN(ud)  ((unsigned)(((ud) >> 32) & 0xffffff))
+#define UD_FD(ud)   ((int)((ud) & 0xffffffff))
+
+/** 事件循环（reactor）相关信息，每个事件循环一个线程 */
+typedef struct tmis_reactor
 {
-	unsigned int len;                   ///< 此次发送数据的长度
-	char flag;                         ///< 此次发送数据的类型 ，协商密钥的，安全通信的
-	char buf[BUFLEN];                  ///< 此次发送的数据
-}tmis_packet_t;
+	int id;                            ///< 事件循环的编号
+	int efd;                           ///< 本事件循环的红黑树树根
+	int lfd;                           ///< 本事件循环的监听套接字（SO_REUSEPORT，由内核分配连接）
+	int ufd;                           ///< 本地（AF_UNIX）监听套接字，只在第0个事件循环中，-1表示没有
+	pthread_t tid;                     ///< 运行本事件循环的线程
+	struct epoll_event *ep;            ///< epoll_wait的传出数组，tmisconf.events个
+	int rfd;                           ///< 预留的文件描述符，文件描述符用完的时候用它accept再关闭
+	long refuse_log;                   ///< 上一次记录拒绝连接的时间
+	tmis_wheel_t wheel;                ///< 本事件循环的连接的超时时间轮
+
+	/* io_uring模式 */
+	tmis_uring_t ring;                 ///< 本事件循环的io_uring
+	int evfd;                          ///< 处理线程处理完数据以后通知事件循环的eventfd
+	unsigned long long evval;          ///< 读eventfd的缓存
+	unsigned long long tval;           ///< 读timerfd的缓存
+	pthread_mutex_t mlock;             ///< 通知队列的锁
+	int *mbox;                         ///< 通知队列：处理线程处理完的连接（fd）
+	int mcnt;                          ///< 通知队列的长度
+	int mcap;                          ///< 通知队列的容量
+}tmis_reactor_t;
 
 
-struct epoll_event ep[OPEN_MAX];     ///< 全局变量, epoll_ctl的传出数组
 FILE *fp;      						 ///< 全局变量，日志文件句柄
 threadpool_t *tmispool; 			 ///< 全局变量，线程池
-int efd;							///< 全局变量，红黑树树根
+tmis_reactor_t *reactors;			 ///< 全局变量，事件循环数组
+int nreactors;						 ///< 全局变量，事件循环的数量
+unsigned long conns_refused;		 ///< 全局变量，被拒绝的连接数量
+volatile sig_atomic_t tmis_stopping; ///< 全局变量，收到了SIGTERM、SIGINT，第0个事件循环让服务器退出
 
 /** 公钥和私钥 */
-char secret_key[1024] = "[1431701601476568613993916354570581999234296492200903722689435064403093647543786410908775082711468637043556899660242354405958838182001143332963964057164995, 2090155367049341967001403718508984758041491186470976194749112114432660174858545929700501744055058603817941671083836419094294404012587185432039026958345540]";
-char public_key[1024] = "[8779246804865256595845410635551148521227644044548861627285453536743878386166265446937141101008408588690674901331738586548621281816777149434943936565852561, 5462710688655103662240594520449922001027729122965123487994410536107298056563228514615559984791707466524546778752823276552092115399599325705605166751646997]";
+char secret_key[1024] = TMIS_SECRET_KEY;
+char public_key[1024] = TMIS_PUBLIC_KEY;
 
 /** 分隔符 */
-const char split_char_key_agreement[10]="我";    // "BB";//
-const char split_char_communication[10]="AAAA";  ///< 每一条医疗记录之间的分割符号
-const char split_char_communication_in[10]="AA"; ///< 一条医疗记录之间每个域的分割符号
+const char split_char_key_agreement[10]=SPLIT_KEY_AGREEMENT;    // "BB";//
+const char split_char_communication[10]=SPLIT_RECORD;  ///< 每一条医疗记录之间的分割符号
+const char split_char_communication_in[10]=SPLIT_FIELD; ///< 一条医疗记录之间每个域的分割符号
 #define len_split_char_key_agreement strlen(split_char_key_agreement)
 #define len_split_char_communication strlen(split_char_communication)
 #define len_split_char_communication_in strlen(split_char_communication_in)
 
-/** 各个客户端的会话密钥 */
-char session_keys[BUFLEN][20];
-
 /////////////////////////////    函数实现     //////////////////////////////////
 
+/**
+ * @brief 设置一个套接字选项，失败只记录日志（例如内核不支持TCP_FASTOPEN），服务器照常运行
+ * @param fd 套接字
+ * @param level 选项的层
+ * @param name 选项
+ * @param value 选项的值
+ * @param desc 选项的名字，写日志用
+ */
+void set_sockopt_int(int fd, int level, int name, int value, const char *desc)
+{
+	if(setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+		write_log(fp,"function setsockopt %s is err:%s\n",desc,strerror(errno));
+}
+
+/**
+ * @brief 按配置设置监听套接字的TCP选项。accept得到的套接字会继承监听套接字的
+ *        TCP_NODELAY、keepalive和缓冲区大小，不用每个连接再设置一次
+ * @param fd 监听套接字（listen之前）
+ */
+void set_tcp_options(int fd)
+{
+	if(tmisconf.nodelay)
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+	/* 只有连接、还没有数据的客户端不唤醒accept，密钥协商的请求和连接一起到达 */
+	if(tmisconf.defer_accept > 0)
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, tmisconf.defer_accept, "TCP_DEFER_ACCEPT");
+
+	/* 客户端可以在SYN中带上请求，省掉一个往返（还需要net.ipv4.tcp_fastopen打开服务器端） */
+	if(tmisconf.fastopen > 0)
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN, tmisconf.fastopen, "TCP_FASTOPEN");
+
+	/* 接收缓冲区要在listen之前设置，才能影响窗口扩大因子 */
+	if(tmisconf.rcvbuf > 0)
+		set_sockopt_int(fd, SOL_SOCKET, SO_RCVBUF, tmisconf.rcvbuf, "SO_RCVBUF");
+	if(tmisconf.sndbuf > 0)
+		set_sockopt_int(fd, SOL_SOCKET, SO_SNDBUF, tmisconf.sndbuf, "SO_SNDBUF");
+
+	if(tmisconf.keepalive > 0)
+	{
+		set_sockopt_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, tmisconf.keepalive, "TCP_KEEPIDLE");
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, KEEPALIVE_INTVL, "TCP_KEEPINTVL");
+		set_sockopt_int(fd, IPPROTO_TCP, TCP_KEEPCNT, KEEPALIVE_CNT, "TCP_KEEPCNT");
+	}
+}
+
 /**
  * @brief 初始化套接字
  * @param lfd 传出参数，监听套接字
+ * @param reuseport 是否设置SO_REUSEPORT，多个事件循环各自监听同一个端口时使用
  */
-void initlistensocket(int *lfd)
+void initlistensocket(int *lfd, int reuseport)
 {
 	unsigned short port = SERV_PORT;		// 服务器端口号
 
@@ -98,6 +205,20 @@ void initlistensocket(int *lfd)
 		exit(-1);
 	}
 
+	/* 端口复用，内核把新连接分散到各个监听套接字上 */
+	if(reuseport)
+	{
+		ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,sizeof(optval));
+		if (ret == -1)
+		{
+			write_log(fp,"function setsockopt SO_REUSEPORT is err:%s\n",strerror(errno));
+			exit(-1);
+		}
+	}
+
+	/* TCP选项 */
+	set_tcp_options(listenfd);
+
 	/* bind */
 	struct sockaddr_in addr;
 	addr.sin_family = AF_INET;
@@ -111,283 +232,1380 @@ void initlistensocket(int *lfd)
 	}
 
 	/* listen */
-	ret = listen(listenfd, 128);
+	ret = listen(listenfd, tmisconf.backlog);
 	if (ret == -1)
 	{
 		write_log(fp,"function listen is err:%s\n",strerror(errno));
 		exit(-1);
 	}
 
-	write_log(fp,"TMIS服务器启动成功，这在%d端口监听客户端的连接.....\n",port);
-
 	*lfd = listenfd;
 	return;
 }
 
 
+/**
+ * @brief 初始化本地（AF_UNIX）监听套接字：同一台机器上的前端不经过TCP协议栈，协议和TCP连接相同
+ * @param ufd 传出参数，监听套接字
+ * @param path 套接字文件的路径
+ */
+void initunixsocket(int *ufd, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenfd==-1)
+	{
+		write_log(fp,"function socket AF_UNIX is err:%s\n",strerror(errno));
+		exit(-1);
+	}
+
+	/* 上一次运行留下的套接字文件要先删掉才能bind，不是套接字的文件不动 */
+	if(lstat(path, &st) == 0)
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			write_log(fp,"the unix socket path %s exists and is not a socket\n",path);
+			exit(-1);
+		}
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		write_log(fp,"function bind %s is err:%s\n",path,strerror(errno));
+		exit(-1);
+	}
+
+	if(listen(listenfd, tmisconf.backlog) == -1)
+	{
+		write_log(fp,"function listen %s is err:%s\n",path,strerror(errno));
+		exit(-1);
+	}
+
+	*ufd = listenfd;
+	return;
+}
+
+/**
+ * @brief 拒绝一个新连接：直接关闭，客户端马上知道服务器忙，而不是一直等在backlog中
+ * @param r 事件循环
+ * @param confd 新连接，-1表示没有accept到（连接已经不在了，不算拒绝）
+ * @param why 拒绝的原因
+ */
+void refuse_connection(tmis_reactor_t *r, int confd, const char *why)
+{
+	long now = timer_now();
+
+	if(confd < 0) return;
+	close(confd);
+	__sync_fetch_and_add(&conns_refused, 1);
+
+	/* 大量拒绝的时候每秒最多记录一次 */
+	if(now != r->refuse_log)
+	{
+		r->refuse_log = now;
+		write_log(fp,"refuse new connections: %s (%d connections, %lu refused)\n",why,conn_count(),conns_refused);
+	}
+}
+
+/**
+ * @brief 文件描述符用完了：关掉预留的文件描述符，accept一个连接再马上关闭，然后重新预留。
+ *        不这样的话连接一直留在backlog中，水平触发的监听套接字会让事件循环空转
+ * @param r 事件循环
+ * @param lfd 监听套接字（TCP或者本地）
+ */
+void accept_with_reserve(tmis_reactor_t *r, int lfd)
+{
+	int fd;
+
+	if(r->rfd >= 0) close(r->rfd);
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	refuse_connection(r, fd, strerror(EMFILE));
+	r->rfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
 
 /**
- * @brief 服务器处理客户端连接请求
- * @param lfd 服务器监听套接字
+ * @brief 服务器处理客户端连接请求，连接留在接受它的事件循环中
+ * @param r 事件循环
+ * @param lfd 可读的监听套接字（TCP或者本地），两种连接之后的处理完全相同
+ * @note 监听套接字是水平触发的，每次最多accept tmisconf.accept_batch个连接，
+ *       剩下的下一次epoll_wait还会返回，这样大量的连接请求不会饿死已有的客户端
  */
-void handle_connection(int lfd)
+void handle_connection(tmis_reactor_t *r, int lfd)
 {
-	struct sockaddr_in cliaddr;
+	struct sockaddr_storage cliaddr;
 	socklen_t len;
-	int confd,ret;
+	int confd,ret,n;
 	struct epoll_event tep;
-	char str[30];
+	tmis_conn_t *c;
 
-	/* lfd设置的是边沿触发，while循环是为了防止同时来n个客户端请求 */
-	while(1)
+	for(n=0;n<tmisconf.accept_batch;n++)
 	{
+		/* accept4直接设置非阻塞和close-on-exec，省掉一次fcntl */
 		len = sizeof(cliaddr);
-		confd = accept(lfd,(struct sockaddr *)&cliaddr,&len);
-		/* 被信号打断*/
+		confd = accept4(lfd,(struct sockaddr *)&cliaddr,&len,SOCK_NONBLOCK|SOCK_CLOEXEC);
 		if(confd==-1)
 		{
-			if(errno==EINTR) continue;
+			/* 被信号打断，或者连接在accept之前就被客户端重置了 */
+			if(errno==EINTR || errno==ECONNABORTED) continue;
+			/* 文件描述符用完了 */
+			if(errno==EMFILE || errno==ENFILE)
+			{
+				accept_with_reserve(r, lfd);
+				continue;
+			}
+			if(errno!=EAGAIN && errno!=EWOULDBLOCK)
+				write_log(fp,"function accept4 is err:%s\n",strerror(errno));
 			break;
 		}
 
-		//将confd也设置为非阻塞
-		fcntl(confd, F_SETFL, O_NONBLOCK);
-		tep.events = EPOLLIN | EPOLLET;  // 边沿触发模式
+		/* 连接数量达到上限 */
+		if(conn_count() >= tmisconf.max_conns)
+		{
+			refuse_connection(r, confd, "too many connections");
+			continue;
+		}
+
+		/* 客户端地址只在这里取一次，之后直接使用连接中保存的 */
+		c = conn_open(confd, r->id, r->efd, (struct sockaddr *)&cliaddr);
+		if(c==NULL)
+		{
+			write_log(fp,"the fd %d is out of the connection table\n",confd);
+			close(confd);
+			continue;
+		}
+
+		/* 数据大的回复用MSG_ZEROCOPY发送，内核不支持就用普通的发送 */
+		if(tmisconf.zerocopy > 0) conn_zerocopy(c);
+
+		/* 加入时间轮，之后有数据的时候只更新时间戳 */
+		wheel_add(&r->wheel, c);
+
+		/* 边沿触发 + ONESHOT：同一时刻一个连接只有一个线程在处理，回复的顺序和请求的顺序一致 */
+		tep.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
 		tep.data.fd = confd;
-		ret = epoll_ctl(efd,EPOLL_CTL_ADD,confd,&tep);
+		ret = epoll_ctl(r->efd,EPOLL_CTL_ADD,confd,&tep);
 		if (ret == -1)
 		{
 			write_log(fp,"function epoll_ctl in while accept is err:%s\n",strerror(errno));
 			exit(-1);
 		}
 
-		memset(str,0,sizeof(str));
-		write_log(fp,"connection from %s at PORT %u\n",
-                inet_ntop(AF_INET, &cliaddr.sin_addr, str, sizeof(str)),
-                ntohs(cliaddr.sin_port));
-	} // end for: while(1)
+		if(!tmisconf.quiet)
+			write_log(fp,"connection from %s at PORT %u\n",c->peer,c->port);
+	} // end for: for(n=0;n<tmisconf.accept_batch;n++)
 
 	return;
 }
 
 
 /**
- * @brief 获得医疗记录
- * @param user_id 客户端的用户名
- * @param fd  客户端socket
+ * @brief 用连接的会话密钥加密一段明文，十六进制的结果作为数据包加入发送队列
+ * @param c  客户端连接
+ * @param flag 数据包类型
+ * @param plain 明文（以'\0'结尾）
+ * @param rlen 明文的长度
  * @param fp  输出日志句柄
  * @return 返回0，成功；否则，失败
  */
-int handle_user_record_requset(char *user_id,int fd,FILE* fp)
+static int reply_encrypted(tmis_conn_t *c,char flag,const char *plain,size_t rlen,FILE* fp)
 {
-	if(!user_id || !fp) return -1;
-////////// 连接数据库，取得数据
-//	printf("handle_user_record_requset\n");
-	int ret = 0;
-	// 1. init
-	MYSQL mysql;
-	if(mysql_init(&mysql) == NULL)
+	/* 加密的结果按16字节对齐，长度直接由明文的长度算出来，不用再strlen、get_length扫描 */
+	unsigned char *bytes_record_back = (unsigned char *)pool_alloc(rlen + AES_BLOCK_SIZE);
+	if(bytes_record_back == NULL)
 	{
-		ret = mysql_errno(&mysql);
-//		printf("func mysql_init error:%d\n",ret);
-		write_log(fp,"func mysql_init error:%d\n",ret);
-		return ret;
+		write_log(fp,"pool_alloc is failed\n");
+		return -1;
+	}
+//	int aes_encrypt_len(const unsigned char* in, size_t len, const unsigned char* key, unsigned char* out);
+	unsigned long long t = stat_now();
+	int len1 = aes_encrypt_len((const unsigned char*)plain,rlen,(unsigned char*)c->skey,bytes_record_back);
+	if(len1 < 0)
+	{
+		pool_free((char *)bytes_record_back);
+		write_log(fp,"func aes_encrypt_len error\n");
+		return -1;
 	}
+	t = stat_add(STAGE_ENCRYPT,t);
 
-	// 2. connect
-	if(mysql_real_connect(&mysql,"localhost","root","123","db_tmis",0,NULL,0) == NULL)
+	/* 十六进制的结果直接作为回复的数据，加入发送队列的时候不再拷贝 */
+	char *str_record_back = pool_alloc(2 * len1 + 1);
+	if(str_record_back == NULL)
 	{
-		ret = mysql_errno(&mysql);
-//		printf("func mysql_real_connect error:%d\n",ret);
-		write_log(fp,"func mysql_real_connect error:%d\n",ret);
-		return ret;
+		pool_free((char *)bytes_record_back);
+		write_log(fp,"pool_alloc is failed\n");
+		return -1;
 	}
+//	int bytes2hex(const unsigned char* in, const int len, char *out);
+	bytes2hex(bytes_record_back,len1,str_record_back);
+	stat_add(STAGE_HEX,t);
+	pool_free((char *)bytes_record_back);
+
+////////// 返回给用户
+	/* 回复客户端，和同一批的其它回复一起发送 */
+	return conn_reply_buf(c,flag,str_record_back,2 * len1);
+}
+
+/**
+ * @brief 把一条医疗记录按回复的格式追加到缓存（字段之间split_char_communication_in，记录结尾split_char_communication）
+ * @param b 缓存
+ * @param row 记录的字段
+ * @param lens 字段的长度
+ * @return 返回0，成功；没有内存，返回-1
+ */
+static int append_record(tmis_buf_t *b,char **row,unsigned long *lens)
+{
+	size_t need = 3 * len_split_char_communication_in + len_split_char_communication;
+	int i;
+
+	for(i = 0; i < STORE_FIELDS; i++) need += lens[i];
+	/* 一次预留整条记录的空间，后面的追加不会再扩大 */
+	if(buf_reserve(b,need) != 0) return -1;
 
-	// 3. select
-	char sql[100] ={0};
-	sprintf(sql,"select rtime,rdoctor,rsymptom,rfeedback from tmis_record where uid=\'%s\'",user_id);
-//	printf("sql = %s\n",sql);
-	mysql_query(&mysql,"set names utf8");
-	ret = mysql_query(&mysql,sql);
-	if(ret!=0)
+	for(i = 0; i < STORE_FIELDS; i++)
 	{
-		ret = mysql_errno(&mysql);
-//		printf("func mysql_query error:%d\n",ret);
-		write_log(fp,"func mysql_query error:%d\n",ret);
-		return ret;
+		buf_append(b,row[i],lens[i]);
+		if(i + 1 < STORE_FIELDS)
+			buf_append(b,split_char_communication_in,len_split_char_communication_in);
 	}
+	buf_append(b,split_char_communication,len_split_char_communication);
+
+	return 0;
+}
 
-	MYSQL_RES *result = mysql_store_result(&mysql);
-	if(result==NULL)
+/** 分页查询的状态：多取一条判断还有没有下一页，记下这一页最后一条记录的时间作为下一页的游标；
+ *  增量获取也用它：按索引查询since以后的记录，不分页 */
+typedef struct tmis_pager
+{
+	char flag;                          ///< 回复的数据包类型：FLAG_RECORD_PAGE，FLAG_RECORD_SINCE
+	int delta;                          ///< 增量获取：只要不比since旧的记录
+	char since[STORE_RTIME_LEN + 1];    ///< 增量获取：客户端已经有的最新一条记录的时间
+	tmis_store_page_t q;                ///< 查询的条件（limit比每页的条数多1）
+	unsigned int limit;                 ///< 每页的条数
+	unsigned int rows;                  ///< 这一页已经取出的条数
+	int more;                           ///< 还有下一页
+	char ctime[STORE_RTIME_LEN + 1];    ///< 请求的游标中的时间，没有游标的时候为空
+	unsigned int cskip;                 ///< 请求的游标中跳过的条数；增量获取：客户端已有的时间等于since的记录条数
+	char last[STORE_RTIME_LEN + 1];     ///< 这一页最后一条记录的时间
+	unsigned int ties;                  ///< 时间等于last的记录一共取出了多少条（包括以前的页）；增量获取：时间等于since的记录条数
+}tmis_pager_t;
+
+/**
+ * @brief 解析分页请求"uid|from|to|limit|cursor"，算出这一页的查询条件
+ * @param data 请求的数据（分隔符被改成'\0'）
+ * @param pg 传出参数，分页查询的状态
+ * @return 成功，返回uid；参数不对，返回NULL
+ * @note 游标"time,skip"表示上一页最后一条记录的时间，和时间等于它的已经取出了几条：
+ *       下一页从这个时间（包括）往前查，跳过这几条。不用偏移量分页，翻得再深也只扫描一页多一点的索引，
+ *       翻页期间插入的新记录也不会让后面的页重复或者漏掉记录（同一时间的记录按索引的顺序）
+ */
+static char *parse_page_request(char *data,tmis_pager_t *pg)
+{
+	char *param[5] = {NULL};
+	char *p = data, *sep, *end;
+	unsigned long n;
+	int i, np = 0;
+
+	memset(pg,0,sizeof(tmis_pager_t));
+	pg->flag = FLAG_RECORD_PAGE;
+
+	/* 不用strtok：中间的参数可以为空 */
+	while(np < 5)
 	{
-		ret = mysql_errno(&mysql);
-//		printf("func mysql_store_result error:%d\n",ret);
-		write_log(fp,"func mysql_store_result error:%d\n",ret);
-		return ret;
+		param[np++] = p;
+		sep = strstr(p,SPLIT_PARAM);
+		if(sep == NULL) break;
+		*sep = '\0';
+		p = sep + strlen(SPLIT_PARAM);
 	}
+	for(i = np; i < 5; i++) param[i] = "";
+	if(param[0][0] == '\0') return NULL;
 
-	// 这里应该根据具体的记录条数来malloc内存，这里简单实现下
-	MYSQL_ROW row = NULL;
-	char str_record[4096*5]={0};
-	char str_temp[1024]={0};
-	while(row = mysql_fetch_row(result))
+	// 1. 时间范围，没有给出的一边不限制
+	if(strlen(param[1]) > STORE_RTIME_LEN || strlen(param[2]) > STORE_RTIME_LEN) return NULL;
+	strcpy(pg->q.from,param[1][0] ? param[1] : STORE_RTIME_MIN);
+	strcpy(pg->q.to,param[2][0] ? param[2] : STORE_RTIME_MAX);
+
+	// 2. 每页的条数
+	pg->limit = PAGE_DEFAULT;
+	if(param[3][0])
 	{
-//		printf("%s\t%s\t%s\t\n",row[0],row[1],row[2]);
-		memset(str_temp,0,sizeof(str_temp));
-		sprintf(str_temp,"%sAA%sAA%sAA%sAAAA",row[0],row[1],row[2],row[3]);
-		strcat(str_record,str_temp);
+		n = strtoul(param[3],&end,10);
+		if(*end != '\0') return NULL;
+		if(n > 0) pg->limit = n > PAGE_MAX ? PAGE_MAX : (unsigned int)n;
 	}
-//	printf("str_record = %s\n",str_record);
+	pg->q.limit = pg->limit + 1;
 
-	// 4. close
-	mysql_close(&mysql);
+	// 3. 游标：从上一页最后一条记录的时间接着往前查
+	if(param[4][0])
+	{
+		sep = strstr(param[4],SPLIT_CURSOR);
+		if(sep == NULL || sep - param[4] > STORE_RTIME_LEN) return NULL;
+		*sep = '\0';
+		n = strtoul(sep + strlen(SPLIT_CURSOR),&end,10);
+		if(*end != '\0' || n > 0xffffffffUL) return NULL;
+		/* 游标不在时间范围内（客户端改了范围）的话从头开始 */
+		if(strcmp(param[4],pg->q.to) <= 0)
+		{
+			strcpy(pg->ctime,param[4]);
+			pg->cskip = (unsigned int)n;
+			strcpy(pg->q.to,pg->ctime);
+			pg->q.skip = pg->cskip;
+		}
+	}
 
-////////// 加密所得的数据，然后返回给用户
-//	int aes_encrypt(const unsigned char* in, const unsigned char* key, unsigned char* out);
-	unsigned char bytes_record_back[4096*5]={0};
-	aes_encrypt((unsigned char*)str_record,(unsigned char*)session_keys[fd],bytes_record_back);
-//	int bytes2hex(const unsigned char* in, const int len, char *out);
-	char str_record_back[4096*5]={0};
-	int len1 = get_length(bytes_record_back);
-	bytes2hex(bytes_record_back,len1,str_record_back);
+	return param[0];
+}
 
-////////// 返回给用户
-	tmis_packet_t sendata;
-	/* 3.回复客户端 */
-	memset(&sendata,0,sizeof(sendata));
-	sendata.flag = 2;
-	int pktlen = strlen(str_record_back);
-	sendata.len = htonl(pktlen);
-	strcpy(sendata.buf,str_record_back);
-	writen(fd,&sendata,pktlen+5);
-
-	char str[30];
-	struct sockaddr_in cliaddr;
-	socklen_t clilen = sizeof(cliaddr);
-	getpeername(fd, (struct sockaddr *)&cliaddr, &clilen);
-	write_log(fp,"get the record request from the client %s\n",inet_ntop(AF_INET, &cliaddr.sin_addr, str, sizeof(str)));
+/**
+ * @brief 分页查询取出了一条记录：这一页还没满就追加，多出来的一条只说明还有下一页
+ * @param pg 分页查询的状态
+ * @param b 缓存
+ * @param row 记录的字段
+ * @param lens 字段的长度
+ * @return 返回0，成功；没有内存，返回-1
+ */
+static int page_row(tmis_pager_t *pg,tmis_buf_t *b,char **row,unsigned long *lens)
+{
+	if(pg->delta)
+	{
+		/* 增量获取：和since同一秒的也要回复（可能是客户端取过以后才插入的），由客户端替换它那一秒的记录 */
+		if(strcmp(row[0],pg->since) == 0) pg->ties++;
+		pg->rows++;
+		return append_record(b,row,lens);
+	}
+	if(pg->rows == pg->limit)
+	{
+		pg->more = 1;
+		return 0;
+	}
+	if(append_record(b,row,lens) != 0) return -1;
+
+	if(pg->rows++ > 0 && strcmp(pg->last,row[0]) == 0) pg->ties++;
+	else
+	{
+		snprintf(pg->last,sizeof(pg->last),"%s",row[0]);
+		/* 和游标的时间一样的话，以前的页已经取出了cskip条 */
+		pg->ties = strcmp(pg->last,pg->ctime) == 0 ? pg->cskip + 1 : 1;
+	}
 
 	return 0;
 }
 
 /**
- * @brief 密钥协商过程中服务器端的步骤
- * @param constr 客户端发送的参数
- * @param fd  客户端
- * @param fp  输出日志句柄
- * @return 返回0，成功；否则，失败
+ * @brief 分页查询结束：还有下一页的话，在这一页的记录后面追加下一页的游标
+ * @param pg 分页查询的状态
+ * @param b 缓存
+ * @return 返回0，成功；没有内存，返回-1
  */
-int key_agreement_server_do(char *constr,int fd,FILE* fp)
+static int page_end(tmis_pager_t *pg,tmis_buf_t *b)
 {
-	if(!constr) return -1;
-
-	//// 分割字符串
-	char str_constr_Hi[2048]={0};
-	char str_constr_Rc[2048]={0};
-	char *split = strtok(constr,split_char_key_agreement);
-	if(split) strcpy(str_constr_Hi,split);
-	split = strtok(NULL,split_char_key_agreement);
-	if(split) strcpy(str_constr_Rc,split);
-	//// 转化成数组
-	unsigned char bytes_Hi[4096]={0};
-	unsigned char bytes_Rc[4096]={0};
-//	int hex2bytes(const char* in, int len,unsigned char* out);
-	hex2bytes(str_constr_Hi,strlen(str_constr_Hi),bytes_Hi);
-	hex2bytes(str_constr_Rc,strlen(str_constr_Rc),bytes_Rc);
+	char cursor[STORE_RTIME_LEN + 16];
+	int n;
 
-	pairing_t pairing;
-	char s[16384];
-	FILE *fp2 = stdin;
-	fp2 = fopen("a.param", "r");
-//	if (!fp) pbc_die("error opening a.param");
-	if (!fp2) { write_log(fp,"error opening a.param\n"); return -1;}
+	/* 没有下一页的时候游标为空（空的一页缓存可能还没有分配） */
+	if(!pg->more) return buf_reserve(b,0);
 
-	size_t count = fread(s, 1, 16384, fp2);
-//	if (!count) pbc_die("input error");
-	if (!count) { write_log(fp,"error opening a.param\n"); fclose(fp2);return -1;}
+	n = snprintf(cursor,sizeof(cursor),"%s%s%u",pg->last,SPLIT_CURSOR,pg->ties);
 
-	fclose(fp2);
-//	if (pairing_init_set_buf(pairing, s, count)) pbc_die("pairing init failed");
-	if (pairing_init_set_buf(pairing, s, count)) { write_log(fp,"pairing init failed\n"); fclose(fp2); return -1;}
-	// ======> pairing 初始化完成
-	element_t element_P,elemetn_secret_key,element_public_key,element_rs;  // 这些要定义成全局的
-	element_t element_Rs,element_Rc,element_k2,element_Ji;
+	return buf_append(b,cursor,n);
+}
 
-	element_init_G1(element_P,pairing);
-	element_init_G1(elemetn_secret_key,pairing);
-	element_init_G1(element_public_key,pairing);
-	element_init_G1(element_Rs,pairing);
-	element_init_G1(element_Rc,pairing);
-	element_init_G1(element_rs,pairing);
-	element_init_G1(element_k2,pairing);
-	element_init_G1(element_Ji,pairing);
+/**
+ * @brief 分页查询、增量获取查询完了，回复客户端
+ * @param pg 分页查询的状态
+ * @param b 这一页的记录
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+static int page_reply(tmis_pager_t *pg,tmis_buf_t *b,tmis_conn_t *c,FILE* fp)
+{
+	int ret;
 
-	// 参数初始化
-	char hash_str[30] = "xiangbin is a good boy!";
-    element_from_hash(element_P, hash_str, strlen(hash_str));
-//    element_printf("element_P = %B\n", element_P);  // 赋值：element_P
+	/* 没有新的记录（只有客户端已有的since那一秒的几条）：回复一个空的数据包，不用加密、转换成十六进制 */
+	if(pg->delta && pg->rows == pg->ties && pg->ties == pg->cskip)
+	{
+		ret = conn_reply(c,FLAG_NOT_MODIFIED,"",0);
+		if(ret == 0) write_log(fp,"the records of the client %s are not modified\n",c->peer);
+		return ret;
+	}
 
-	element_random(element_rs);    // element_rs
-	element_set_str(element_public_key,public_key,10); // element_public_key
-	element_set_str(elemetn_secret_key,secret_key,10);// elemetn_secret_key
+	if(page_end(pg,b) != 0)
+	{
+		write_log(fp,"no memory for the page request from %s\n",c->peer);
+		return -1;
+	}
 
-//// 1.计算k2
-	element_from_bytes(element_Rc,bytes_Rc);
-	element_mul(element_k2,elemetn_secret_key,element_Rc);
+////////// 加密这一页的记录和下一页的游标，然后返回给用户
+	ret = reply_encrypted(c,pg->flag,b->data,b->len,fp);
+	if(ret != 0) return ret;
 
-//// 2.解密Hi
-	char str_k2[1024]={0};
-	element_snprint(str_k2,sizeof(str_k2),element_k2);
-	unsigned char bytes_md5_k2[50]={0};
-	md5((unsigned char *)str_k2,bytes_md5_k2); // 得到解密密钥 bytes_k2
+	write_log(fp,"get the %s request from the client %s: %u records\n",pg->delta ? "delta" : "page",c->peer,pg->rows);
 
-	char str_md5_k2[50]={0};
-	char str_temp[50]={0};
-//	int bytes2hex(const unsigned char* in, const int len, char *out);
-	bytes2hex(bytes_md5_k2,strlen((char *)bytes_md5_k2),str_temp);
-	strncpy(str_md5_k2,str_temp,16);
+	return 0;
+}
 
-	char str_Hi[4096]={0};
-//	int aes_decrypt(const unsigned char* in, const unsigned char* key, unsigned char* out);
-	aes_decrypt(bytes_Hi,(unsigned char *)str_md5_k2,(unsigned char *)str_Hi);
-//	printf("str_Hi = %s\n",str_Hi);
+/**
+ * @brief 解析增量获取的请求"uid|rtime,n"
+ * @param data 请求的数据（分隔符被改成'\0'）
+ * @param pg 传出参数，查询的状态
+ * @return 成功，返回uid；参数不对，返回NULL
+ * @note n是客户端已有的时间等于rtime的记录条数，省略的时候为1。同一秒可能有多条记录，
+ *       只比较时间的话，客户端取过以后在同一秒插入的记录就永远取不到了，所以那一秒的记录总是回复，
+ *       只有那一秒还是n条、也没有更新的记录的时候才回复FLAG_NOT_MODIFIED
+ */
+static char *parse_since_request(char *data,tmis_pager_t *pg)
+{
+	char *sep = strstr(data,SPLIT_PARAM), *cnt, *end;
+	unsigned long n = 1;
 
+	memset(pg,0,sizeof(tmis_pager_t));
+	pg->flag = FLAG_RECORD_SINCE;
+	pg->delta = 1;
+	if(sep)
+	{
+		*sep = '\0';
+		sep += strlen(SPLIT_PARAM);
+		cnt = strstr(sep,SPLIT_CURSOR);
+		if(cnt)
+		{
+			*cnt = '\0';
+			n = strtoul(cnt + strlen(SPLIT_CURSOR),&end,10);
+			if(*end != '\0' || n > 0xffffffffUL) return NULL;
+		}
+		if(strlen(sep) > STORE_RTIME_LEN) return NULL;
+		strcpy(pg->since,sep);
+		if(pg->since[0]) pg->cskip = (unsigned int)n;
+	}
+	if(data[0] == '\0') return NULL;
 
-//// 3.分割字符串
-	char str_IDi[1024]={0}; // 和注册的时候str_id一样
-	char str_Ai[1024]={0};
-	char str_t1[1024]={0};
+	/* 从since（包括）开始按(uid,rtime)索引查询；没有新记录的时候只读到索引的几项 */
+	strcpy(pg->q.from,pg->since[0] ? pg->since : STORE_RTIME_MIN);
+	strcpy(pg->q.to,STORE_RTIME_MAX);
+	pg->q.limit = UINT_MAX;
 
-	char *p = strtok(str_Hi,split_char_key_agreement);
-	if(p) strcpy(str_IDi,p);
-	p=strtok(NULL,split_char_key_agreement);
-	if(p) strcpy(str_Ai,p);
-	p=strtok(NULL,split_char_key_agreement);
-	if(p) strcpy(str_t1,p);
+	return data;
+}
 
-//	printf("str_IDi = %s\n",str_IDi);
-//	printf("str_Ai = %s\n",str_Ai);
-//	printf("str_t1 = %s\n",str_t1);
+/**
+ * @brief 从存储中查询一个用户的医疗记录，拼接成回复的格式
+ * @param user_id 客户端的用户名
+ * @param pg 分页查询的状态，NULL表示查询全部的记录
+ * @param c  客户端连接
+ * @param out 传出参数，拼接好的记录（本线程的缓存，长度不限）
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+static int fetch_user_record(char *user_id,tmis_pager_t *pg,tmis_conn_t *c,tmis_buf_t *out,FILE* fp)
+{
+////////// 从存储（MySQL连接池或者SQLite）取得数据
+	int ret = 0;
+	unsigned long long t = stat_now();
+	// 1. 开始查询：uid作为参数绑定，不拼接SQL
+	void *cur = store_query(user_id,pg ? &pg->q : NULL);
+	if(cur == NULL)
+	{
+		write_log(fp,"the record request from %s is failed\n",c->peer);
+		return -1;
+	}
 
-///// 4.比较时间是否超时
-	time_t t1;
-	time_t t1_2 = time(NULL);
-	string2time(str_t1, &t1);
-	/*
-	if(t1_2-t1>120)
+	// 2. 字段的长度由存储直接给出，按长度追加，不用strlen、strcat从头扫描
+	char *row[STORE_FIELDS];
+	unsigned long lens[STORE_FIELDS];
+	while((ret = store_next(cur,row,lens)) > 0)
 	{
-		printf("超时了。。。\n");
+		if((pg ? page_row(pg,out,row,lens) : append_record(out,row,lens)) != 0)
+		{
+			write_log(fp,"no memory for the records of the user %s\n",user_id);
+			store_end(cur,0);
+			return -1;
+		}
+	}
+	if(ret < 0)
+	{
+		store_end(cur,1);
 		return -1;
 	}
-	else printf("没有超时。。。\n");
-	*/
+//	printf("str_record = %s\n",out->data);
 
-///// 5.计算Ai2
-	int len1 = strlen(str_IDi);
-	int len2 = strlen(secret_key);
-	char *CONSTR1 =(char *)malloc(sizeof(char) * (len1+len2)+1); // ID || KS
-	memset(CONSTR1,0,len1+len2+1);
-	strncpy(CONSTR1,str_IDi,len1);
+	// 3. 结束查询（MySQL的连接还给连接池）
+	store_end(cur,0);
+	stat_add(STAGE_QUERY,t);
+
+	return 0;
+}
+
+void *handle_data(void *arg);
+void *handle_data_uring(void *arg);
+
+/** 异步查询医疗记录的请求：数据库事件循环逐行追加记录，查询完成以后交给线程池加密、回复 */
+typedef struct tmis_recreq
+{
+	int fd;                             ///< 客户端
+	char *uid;                          ///< 用户id
+	unsigned long gen;                  ///< cache_get返回的版本号
+	int status;                         ///< 查询的结果，0表示成功
+	tmis_buf_t buf;                     ///< 拼接好的记录
+	int paged;                          ///< 分页查询（FLAG_RECORD_PAGE），增量获取（FLAG_RECORD_SINCE）
+	tmis_pager_t pg;                    ///< 分页查询的状态
+	int stype;                          ///< 请求的种类（耗时统计用）
+	unsigned long long t0;              ///< 请求开始处理的时间
+	unsigned long long tsubmit;         ///< 提交查询的时间
+}tmis_recreq_t;
+
+/**
+ * @brief 异步查询取出了一条记录（在数据库事件循环中）：按回复的格式追加
+ * @param arg 请求
+ * @param row 记录的字段
+ * @param lens 字段的长度
+ * @return 返回0，继续；没有内存，返回-1
+ */
+static int record_async_row(void *arg,char **row,unsigned long *lens)
+{
+	tmis_recreq_t *q = (tmis_recreq_t *)arg;
+
+	if(q->paged) return page_row(&q->pg,&q->buf,row,lens);
+
+	return append_record(&q->buf,row,lens);
+}
+
+/**
+ * @brief 异步查询完成、回复以后，接着处理这个连接接收缓存中后面的数据包
+ *        （查询期间连接一直在查询的请求手里：没有重新注册事件、busy没有清除）
+ * @param c  客户端连接
+ */
+static void record_resume(tmis_conn_t *c)
+{
+	int fd = c->fd;
+
+	c->dbwait = 0;
+	if(tmisconf.io == IO_URING) handle_data_uring((void *)(long)fd);
+	else handle_data((void *)(long)fd);
+}
+
+/**
+ * @brief 异步查询完成以后在处理线程中回复客户端，然后接着处理这个连接后面的数据包
+ * @param arg 请求
+ * @return NULL值
+ */
+void *handle_record_done(void *arg)
+{
+	tmis_recreq_t *q = (tmis_recreq_t *)arg;
+	tmis_conn_t *c = conn_get(q->fd);
+
+	/* 接着统计提交查询的那个请求 */
+	stat_resume(q->stype);
+	stat_add(STAGE_QUERY,q->tsubmit);
+	if(q->status == 0 && q->paged)
+	{
+		/* 分页、增量获取的结果不放进缓存 */
+		page_reply(&q->pg,&q->buf,c,fp);
+	}
+	else if(q->status == 0)
+	{
+		cache_put(q->uid,q->buf.data ? q->buf.data : "",q->buf.len,q->gen);
+		if(reply_encrypted(c,FLAG_RECORD,q->buf.data ? q->buf.data : "",q->buf.len,fp) == 0)
+			write_log(fp,"get the record request from the client %s\n",c->peer);
+	}
+	else write_log(fp,"query the records of the user %s error:%d\n",q->uid,q->status);
+	stat_add(STAGE_TOTAL,q->t0);
+
+	buf_free(&q->buf);
+	free(q->uid);
+	free(q);
+
+	record_resume(c);
+
+	return NULL;
+}
+
+/**
+ * @brief 异步查询结束（在数据库事件循环中）：加密、回复交给线程池，不占用数据库事件循环
+ * @param arg 请求
+ * @param status 查询的结果
+ */
+static void record_async_done(void *arg,int status)
+{
+	tmis_recreq_t *q = (tmis_recreq_t *)arg;
+
+	q->status = status;
+	if(threadpool_add_task(tmispool,handle_record_done,q) != 0)
+		write_log(fp,"the record reply of %d is dropped: the threadpool is shutdown\n",q->fd);
+}
+
+/**
+ * @brief 把医疗记录的查询交给数据库事件循环，处理线程马上返回；
+ *        查询完成以前这个连接后面的数据包不处理，保证回复的顺序
+ * @param user_id 客户端的用户名
+ * @param pg 分页查询的状态，NULL表示查询全部的记录
+ * @param c  客户端连接
+ * @param gen cache_get返回的版本号
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+static int record_query_async(char *user_id,tmis_pager_t *pg,tmis_conn_t *c,unsigned long gen,FILE* fp)
+{
+	tmis_recreq_t *q = (tmis_recreq_t *)calloc(1,sizeof(tmis_recreq_t));
+	if(q == NULL || (q->uid = strdup(user_id)) == NULL)
+	{
+		free(q);
+		write_log(fp,"no memory for the record request from %s\n",c->peer);
+		return -1;
+	}
+	q->fd = c->fd;
+	q->gen = gen;
+	q->stype = stat_current();
+	q->t0 = stat_started();
+	q->tsubmit = stat_now();
+	if(pg)
+	{
+		q->paged = 1;
+		q->pg = *pg;
+	}
+
+	/* 先标记，查询可能在store_async返回以前就完成了 */
+	c->dbwait = 1;
+	if(store_async(user_id,pg ? &q->pg.q : NULL,record_async_row,record_async_done,q) != 0)
+	{
+		c->dbwait = 0;
+		free(q->uid);
+		free(q);
+		write_log(fp,"the record query of %s is failed to submit\n",c->peer);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 获得医疗记录
+ * @param user_id 客户端的用户名
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+int handle_user_record_requset(char *user_id,tmis_conn_t *c,FILE* fp)
+{
+	if(!user_id || !fp) return -1;
+////////// 先查缓存，没有命中再查数据库
+//	printf("handle_user_record_requset\n");
+	int ret = 0;
+	unsigned long gen = 0;
+	size_t rlen = 0;
+	unsigned long long t = stat_now();
+	char *cached = cache_get(user_id,&rlen,&gen);
+	stat_add(STAGE_CACHE,t);
+	const char *plain = cached;
+	if(cached == NULL)
+	{
+		/* 存储支持异步查询（MySQL，TMIS_DB_ASYNC）的话，查询完成以后由handle_record_done回复 */
+		if(store_can_async()) return record_query_async(user_id,NULL,c,gen,fp);
+
+		/* 本线程的缓存，每个请求清空重用 */
+		tmis_buf_t *b = buf_thread();
+		if(b == NULL)
+		{
+			write_log(fp,"no memory for the record request from %s\n",c->peer);
+			return -1;
+		}
+		ret = fetch_user_record(user_id,NULL,c,b,fp);
+		if(ret != 0) return ret;
+		cache_put(user_id,b->data,b->len,gen);
+		plain = b->data;
+		rlen = b->len;
+	}
+
+////////// 加密所得的数据，然后返回给用户
+	ret = reply_encrypted(c,FLAG_RECORD,plain,rlen,fp);
+	pool_free(cached);
+	if(ret != 0) return ret;
+
+	write_log(fp,"get the record request from the client %s\n",c->peer);
+
+	return 0;
+}
+
+/**
+ * @brief 按时间倒序分页获得医疗记录（不经过缓存）
+ * @param data 请求的数据"uid|from|to|limit|cursor"
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+int handle_user_record_page(char *data,tmis_conn_t *c,FILE* fp)
+{
+	if(!data || !fp) return -1;
+
+	int ret = 0;
+	tmis_pager_t pg;
+	char *user_id = parse_page_request(data,&pg);
+	if(user_id == NULL)
+	{
+		write_log(fp,"ERROR: the page request from %s is invalid\n",c->peer);
+		return -1;
+	}
+
+	/* 缓存按uid保存全部的记录，一页只是其中的一部分，分页的结果直接从存储查询 */
+	if(store_can_async()) return record_query_async(user_id,&pg,c,0,fp);
+
+	tmis_buf_t *b = buf_thread();
+	if(b == NULL)
+	{
+		write_log(fp,"no memory for the page request from %s\n",c->peer);
+		return -1;
+	}
+	ret = fetch_user_record(user_id,&pg,c,b,fp);
+	if(ret != 0) return ret;
+
+	return page_reply(&pg,b,c,fp);
+}
+
+/**
+ * @brief 增量获取医疗记录：只回复不比客户端已有的最新一条旧的记录，没有新的记录回复FLAG_NOT_MODIFIED
+ * @param data 请求的数据"uid|rtime,n"
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+int handle_user_record_since(char *data,tmis_conn_t *c,FILE* fp)
+{
+	if(!data || !fp) return -1;
+
+	int ret = 0;
+	tmis_pager_t pg;
+	char *user_id = parse_since_request(data,&pg);
+	if(user_id == NULL)
+	{
+		write_log(fp,"ERROR: the delta request from %s is invalid\n",c->peer);
+		return -1;
+	}
+
+	tmis_buf_t *b = buf_thread();
+	if(b == NULL)
+	{
+		write_log(fp,"no memory for the delta request from %s\n",c->peer);
+		return -1;
+	}
+
+	/* 不从缓存的全部记录中挑：缓存的是回复的格式，域里面可能有分隔符，切不准记录；
+	 * 按(uid,rtime)索引只读since以后的几项，比解析整个用户的记录还快 */
+	if(store_can_async()) return record_query_async(user_id,&pg,c,0,fp);
+	ret = fetch_user_record(user_id,&pg,c,b,fp);
+	if(ret != 0) return ret;
+
+	return page_reply(&pg,b,c,fp);
+}
+
+/** 批量获取中一个用户的记录 */
+typedef struct tmis_batch_item
+{
+	struct tmis_batchreq *batch;        ///< 所属的批量请求
+	char *uid;                          ///< 用户id（指向请求数据的拷贝）
+	unsigned long gen;                  ///< cache_get返回的版本号
+	char *cached;                       ///< 缓存命中的记录（缓存池的缓存），没有命中为NULL
+	size_t clen;                        ///< 缓存命中的记录的长度
+	int status;                         ///< 查询的结果，0表示成功
+	tmis_buf_t buf;                     ///< 查询到的记录
+}tmis_batch_item_t;
+
+/** 批量获取医疗记录的请求：先查缓存，没有命中的用户一起查询，全部结束以后拼接成一个回复 */
+typedef struct tmis_batchreq
+{
+	int fd;                             ///< 客户端
+	char *data;                         ///< 请求数据的拷贝（各个uid指向这里）
+	int n;                              ///< 用户的数量
+	int misses;                         ///< 没有命中缓存的用户数量
+	int pending;                        ///< 异步模式：还没有结束的查询数量，加上提交的时候占的1个（原子操作）
+	int stype;                          ///< 请求的种类（耗时统计用）
+	unsigned long long t0;              ///< 请求开始处理的时间
+	unsigned long long tsubmit;         ///< 提交查询的时间
+	tmis_batch_item_t items[BATCH_MAX]; ///< 每个用户，按请求的顺序
+}tmis_batchreq_t;
+
+/**
+ * @brief 释放批量请求
+ * @param q 请求
+ */
+static void batch_free(tmis_batchreq_t *q)
+{
+	int i;
+
+	for(i = 0; i < q->n; i++)
+	{
+		pool_free(q->items[i].cached);
+		buf_free(&q->items[i].buf);
+	}
+	free(q->data);
+	free(q);
+}
+
+/**
+ * @brief 解析批量请求（用SPLIT_PARAM分隔的uid），每个用户先查缓存
+ * @param data 请求的数据
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 成功，返回请求；参数不对或者没有内存，返回NULL
+ */
+static tmis_batchreq_t *batch_open(const char *data,tmis_conn_t *c,FILE* fp)
+{
+	tmis_batchreq_t *q = (tmis_batchreq_t *)calloc(1,sizeof(tmis_batchreq_t));
+	tmis_batch_item_t *it;
+	char *p, *sep;
+	unsigned long long t;
+	int i;
+
+	if(q == NULL || (q->data = strdup(data)) == NULL)
+	{
+		free(q);
+		write_log(fp,"no memory for the batch request from %s\n",c->peer);
+		return NULL;
+	}
+	q->fd = c->fd;
+
+	/* 空的uid（例如结尾多了一个分隔符）跳过 */
+	for(p = q->data; p; p = sep)
+	{
+		sep = strstr(p,SPLIT_PARAM);
+		if(sep)
+		{
+			*sep = '\0';
+			sep += strlen(SPLIT_PARAM);
+		}
+		if(*p == '\0') continue;
+		if(q->n == BATCH_MAX)
+		{
+			write_log(fp,"ERROR: the batch request from %s has more than %d users\n",c->peer,BATCH_MAX);
+			batch_free(q);
+			return NULL;
+		}
+		q->items[q->n].batch = q;
+		q->items[q->n++].uid = p;
+	}
+	if(q->n == 0)
+	{
+		write_log(fp,"ERROR: the batch request from %s is empty\n",c->peer);
+		batch_free(q);
+		return NULL;
+	}
+
+	t = stat_now();
+	for(i = 0; i < q->n; i++)
+	{
+		it = &q->items[i];
+		it->cached = cache_get(it->uid,&it->clen,&it->gen);
+		if(it->cached == NULL) q->misses++;
+	}
+	stat_add(STAGE_CACHE,t);
+
+	return q;
+}
+
+/**
+ * @brief 所有用户的记录都有了：查询到的放进缓存，按请求的顺序拼接成一个回复，加密以后发送
+ * @param q 请求
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ * @note 查询出错的用户这一组的记录为BATCH_ERROR，其它用户的记录照常回复
+ */
+static int batch_reply(tmis_batchreq_t *q,tmis_conn_t *c,FILE* fp)
+{
+	tmis_batch_item_t *it;
+	const char *plain;
+	size_t len, need = 0;
+	int i, ret = 0, failed = 0;
+
+	for(i = 0; i < q->n; i++)
+	{
+		it = &q->items[i];
+		if(it->cached) continue;
+		if(it->status != 0)
+		{
+			write_log(fp,"query the records of the user %s error:%d\n",it->uid,it->status);
+			failed++;
+		}
+		else cache_put(it->uid,it->buf.data ? it->buf.data : "",it->buf.len,it->gen);
+	}
+
+	/* 本线程的缓存，先算出总长度一次预留，后面的追加不会再扩大 */
+	tmis_buf_t *b = buf_thread();
+	for(i = 0; i < q->n; i++)
+	{
+		it = &q->items[i];
+		need += strlen(it->uid) + len_split_char_communication + strlen(SPLIT_GROUP);
+		need += it->cached ? it->clen : it->status != 0 ? strlen(BATCH_ERROR) : it->buf.len;
+	}
+	if(b == NULL || buf_reserve(b,need) != 0)
+	{
+		write_log(fp,"no memory for the batch request from %s\n",c->peer);
+		return -1;
+	}
+
+	for(i = 0; i < q->n; i++)
+	{
+		it = &q->items[i];
+		plain = it->cached ? it->cached : it->status != 0 ? BATCH_ERROR : it->buf.data;
+		len = it->cached ? it->clen : it->status != 0 ? strlen(BATCH_ERROR) : it->buf.len;
+		buf_append(b,it->uid,strlen(it->uid));
+		buf_append(b,split_char_communication,len_split_char_communication);
+		if(len > 0) buf_append(b,plain,len);
+		buf_append(b,SPLIT_GROUP,strlen(SPLIT_GROUP));
+	}
+
+////////// 加密所有用户的记录，一个数据包返回给用户
+	ret = reply_encrypted(c,FLAG_RECORD_BATCH,b->data,b->len,fp);
+	if(ret != 0) return ret;
+
+	write_log(fp,"get the batch request from the client %s: %d users, %d from the store, %d failed\n",c->peer,q->n,q->misses,failed);
+
+	return 0;
+}
+
+/**
+ * @brief 异步批量获取的所有查询都结束以后在处理线程中回复客户端，然后接着处理这个连接后面的数据包
+ * @param arg 请求
+ * @return NULL值
+ */
+void *handle_batch_done(void *arg)
+{
+	tmis_batchreq_t *q = (tmis_batchreq_t *)arg;
+	tmis_conn_t *c = conn_get(q->fd);
+
+	/* 接着统计提交查询的那个请求：查询阶段是从提交到最后一个查询结束 */
+	stat_resume(q->stype);
+	stat_add(STAGE_QUERY,q->tsubmit);
+	batch_reply(q,c,fp);
+	stat_add(STAGE_TOTAL,q->t0);
+	batch_free(q);
+
+	record_resume(c);
+
+	return NULL;
+}
+
+/**
+ * @brief 异步批量获取的一个查询结束了（或者提交完了），最后一个把回复交给线程池
+ * @param q 请求
+ */
+static void batch_release(tmis_batchreq_t *q)
+{
+	if(__sync_sub_and_fetch(&q->pending,1) != 0) return;
+
+	if(threadpool_add_task(tmispool,handle_batch_done,q) != 0)
+		write_log(fp,"the batch reply of %d is dropped: the threadpool is shutdown\n",q->fd);
+}
+
+/**
+ * @brief 异步批量获取中一个用户的查询取出了一条记录（在数据库事件循环中）
+ * @param arg 这个用户的记录
+ * @param row 记录的字段
+ * @param lens 字段的长度
+ * @return 返回0，继续；没有内存，返回-1
+ */
+static int batch_async_row(void *arg,char **row,unsigned long *lens)
+{
+	return append_record(&((tmis_batch_item_t *)arg)->buf,row,lens);
+}
+
+/**
+ * @brief 异步批量获取中一个用户的查询结束（在数据库事件循环中）
+ * @param arg 这个用户的记录
+ * @param status 查询的结果
+ */
+static void batch_async_done(void *arg,int status)
+{
+	tmis_batch_item_t *it = (tmis_batch_item_t *)arg;
+
+	it->status = status;
+	batch_release(it->batch);
+}
+
+/**
+ * @brief 没有命中缓存的用户同时交给数据库事件循环查询（各自用连接池中的一个连接），处理线程马上返回；
+ *        全部结束以前这个连接后面的数据包不处理，保证回复的顺序
+ * @param q 请求
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0
+ */
+static int batch_query_async(tmis_batchreq_t *q,tmis_conn_t *c,FILE* fp)
+{
+	tmis_batch_item_t *it;
+	int i;
+
+	q->stype = stat_current();
+	q->t0 = stat_started();
+	q->tsubmit = stat_now();
+	/* 提交的时候先占1个，查询在提交完以前结束也不会提前回复 */
+	q->pending = 1;
+	c->dbwait = 1;
+	for(i = 0; i < q->n; i++)
+	{
+		it = &q->items[i];
+		if(it->cached) continue;
+		__sync_add_and_fetch(&q->pending,1);
+		if(store_async(it->uid,NULL,batch_async_row,batch_async_done,it) != 0)
+		{
+			write_log(fp,"the record query of %s is failed to submit\n",c->peer);
+			it->status = -1;
+			__sync_sub_and_fetch(&q->pending,1);
+		}
+	}
+	batch_release(q);
+
+	return 0;
+}
+
+/**
+ * @brief 没有命中缓存的用户用一条语句一起查询（每次最多STORE_BATCH_MAX个），结果按uid分到各个用户
+ * @param q 请求
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @note 一次查询出错的话，这次查询的用户都标记为失败，其它用户照常回复
+ */
+static void batch_fetch(tmis_batchreq_t *q,tmis_conn_t *c,FILE* fp)
+{
+	const char *uids[STORE_BATCH_MAX];
+	tmis_batch_item_t *it, *match[BATCH_MAX];
+	char *row[STORE_BATCH_FIELDS];
+	unsigned long lens[STORE_BATCH_FIELDS];
+	unsigned long long t;
+	void *cur;
+	int i, j, k, from, nu, nm, ret;
+
+	for(i = 0; i < q->n; )
+	{
+		/* 这次查询的用户：下标在[from, i)之间没有命中缓存的 */
+		for(from = i, nu = 0; i < q->n && nu < STORE_BATCH_MAX; i++)
+			if(q->items[i].cached == NULL) uids[nu++] = q->items[i].uid;
+		if(nu == 0) break;
+
+		t = stat_now();
+		cur = store_query_batch(uids,nu);
+		ret = cur ? 0 : -1;
+		nm = 0;
+		while(cur && (ret = store_next(cur,row,lens)) > 0)
+		{
+			/* 同一个用户的记录连在一起，换了用户才重新找（请求中同一个uid可能出现多次） */
+			if(nm == 0 || strcmp(match[0]->uid,row[STORE_FIELDS]) != 0)
+			{
+				for(nm = 0, j = from; j < i; j++)
+					if(q->items[j].cached == NULL && strcmp(q->items[j].uid,row[STORE_FIELDS]) == 0)
+						match[nm++] = &q->items[j];
+				if(nm == 0) continue;
+			}
+			for(k = 0; k < nm && ret > 0; k++)
+				if(append_record(&match[k]->buf,row,lens) != 0)
+				{
+					write_log(fp,"no memory for the records of the user %s\n",match[k]->uid);
+					ret = -1;
+				}
+			if(ret < 0) break;
+		}
+		if(cur) store_end(cur,ret < 0);
+		stat_add(STAGE_QUERY,t);
+		if(ret >= 0) continue;
+
+		write_log(fp,"the batch query of %d users from %s is failed\n",nu,c->peer);
+		for(j = from; j < i; j++)
+		{
+			it = &q->items[j];
+			if(it->cached) continue;
+			it->status = -1;
+			buf_free(&it->buf);
+		}
+	}
+}
+
+/**
+ * @brief 一次获得多个用户的医疗记录，回复一个数据包
+ * @param data 请求的数据：用SPLIT_PARAM分隔的uid
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+int handle_user_record_batch(char *data,tmis_conn_t *c,FILE* fp)
+{
+	if(!data || !fp) return -1;
+
+	int ret = 0;
+	tmis_batchreq_t *q = batch_open(data,c,fp);
+	if(q == NULL) return -1;
+
+	/* 存储支持异步查询的话，没有命中缓存的用户同时查询（各用一个连接），全部结束以后由handle_batch_done回复 */
+	if(q->misses > 0 && store_can_async()) return batch_query_async(q,c,fp);
+
+	/* 全部命中缓存，或者在本线程中用一条语句一起查询 */
+	if(q->misses > 0) batch_fetch(q,c,fp);
+	ret = batch_reply(q,c,fp);
+	batch_free(q);
+
+	return ret;
+}
+
+void reactor_post(tmis_reactor_t *r, int fd);
+
+/**
+ * @brief 流式回复：等待发送队列降到高水位以下（io_uring模式先通知事件循环发送）
+ * @param c  客户端连接
+ * @return 返回0，可以继续；否则，客户端太慢或者连接出错了
+ */
+static int stream_drain(tmis_conn_t *c)
+{
+	if(!conn_out_full(c)) return 0;
+	if(tmisconf.io == IO_URING) reactor_post(&reactors[c->loop], c->fd);
+
+	return conn_wait_drain(c,STREAM_SEND_TIMEOUT);
+}
+
+/**
+ * @brief 流式获得医疗记录：边从数据库逐行取出边回复，每凑够STREAM_CHUNK字节的完整记录就单独加密成一个数据包，
+ *        最后回复一个结束的数据包；服务器的内存和记录的总长度无关，客户端收到第一块就可以开始显示
+ * @param user_id 客户端的用户名
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ * @note 记录按时间从新到旧取出。发送队列超过高水位（客户端读得慢）的时候先结束查询，把连接还给连接池，
+ *       不拿着数据库连接等客户端；发送队列降下来以后按分页的游标（最后一条的时间，同一时间已经取出的条数）接着查询
+ */
+int handle_user_record_stream(char *user_id,tmis_conn_t *c,FILE* fp)
+{
+	if(!user_id || !fp) return -1;
+
+	int ret = 0, count = 0, paused, n;
+	char *row[STORE_FIELDS];
+	unsigned long lens[STORE_FIELDS];
+	size_t need, i;
+	tmis_buf_t *chunk;
+	tmis_store_page_t pg;
+	char last[STORE_RTIME_LEN + 1] = "";
+	unsigned int ties = 0;
+	char str_end[32];
+	void *cur;
+
+	/* 本线程的缓存，每个请求清空重用 */
+	chunk = buf_thread();
+	if(chunk == NULL)
+	{
+		write_log(fp,"no memory for the record request from %s\n",c->peer);
+		conn_reply(c,FLAG_RECORD_END,"-1",2);
+		return -1;
+	}
+
+	// 1. 全部的记录按时间倒序，暂停以后从游标接着查（MySQL的结果不在客户端缓存，逐行从服务器取）
+	strcpy(pg.from,STORE_RTIME_MIN);
+	strcpy(pg.to,STORE_RTIME_MAX);
+	pg.skip = 0;
+	pg.limit = UINT_MAX;
+	do
+	{
+		cur = store_query(user_id,&pg);
+		if(cur == NULL)
+		{
+			write_log(fp,"the record request from %s is failed\n",c->peer);
+			ret = -1;
+			break;
+		}
+
+		// 2. 逐行取出，凑够一块就加密回复
+		paused = 0;
+		while((ret = store_next(cur,row,lens)) > 0)
+		{
+			need = 3 * len_split_char_communication_in + len_split_char_communication;
+			for(i = 0; i < STORE_FIELDS; i++) need += lens[i];
+
+			if(chunk->len > 0 && chunk->len + need > STREAM_CHUNK)
+			{
+				if(reply_encrypted(c,FLAG_RECORD_CHUNK,chunk->data,chunk->len,fp) != 0)
+				{
+					ret = -2;
+					break;
+				}
+				buf_reset(chunk);
+				paused = conn_out_full(c);
+			}
+
+			/* 一条记录比STREAM_CHUNK还长的时候单独一块 */
+			if(append_record(chunk,row,lens) != 0)
+			{
+				write_log(fp,"no memory for the records of the user %s\n",user_id);
+				ret = -2;
+				break;
+			}
+			count++;
+
+			/* 游标：最后一条记录的时间，和这个时间的记录一共取出了几条 */
+			if(ties > 0 && strcmp(last,row[0]) == 0) ties++;
+			else
+			{
+				snprintf(last,sizeof(last),"%s",row[0]);
+				ties = 1;
+			}
+			if(paused) break;
+		}
+
+		/* -2：回复出错，存储本身没有问题 */
+		store_end(cur,ret == -1);
+		if(ret < 0)
+		{
+			ret = -1;
+			break;
+		}
+		if(!paused) break;
+
+		// 3. 已经不拿着数据库连接了，等发送队列降下来，再从游标接着查
+		if(stream_drain(c) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		strcpy(pg.to,last);
+		pg.skip = ties;
+	}while(1);
+
+	// 4. 最后一块
+	if(ret == 0 && chunk->len > 0)
+		ret = reply_encrypted(c,FLAG_RECORD_CHUNK,chunk->data,chunk->len,fp);
+
+	// 5. 结束：记录的条数，出错的时候为-1（客户端丢弃已经收到的块）
+	if(ret != 0) count = -1;
+	n = snprintf(str_end,sizeof(str_end),"%d",count);
+	conn_reply(c,FLAG_RECORD_END,str_end,n);
+
+	if(!tmisconf.quiet)
+		write_log(fp,"stream %d records to the client %s\n",count,c->peer);
+
+	return ret;
+}
+
+/**
+ * @brief 密钥协商过程中服务器端的步骤
+ * @param constr 客户端发送的参数
+ * @param c  客户端连接
+ * @param fp  输出日志句柄
+ * @return 返回0，成功；否则，失败
+ */
+int key_agreement_server_do(char *constr,tmis_conn_t *c,FILE* fp)
+{
+	if(!constr) return -1;
+
+	//// 分割字符串
+	char str_constr_Hi[2048]={0};
+	char str_constr_Rc[2048]={0};
+	/* 多个处理线程同时做密钥协商，不能用strtok（静态的状态） */
+	char *save = NULL;
+	char *split = strtok_r(constr,split_char_key_agreement,&save);
+	if(split) strcpy(str_constr_Hi,split);
+	split = strtok_r(NULL,split_char_key_agreement,&save);
+	if(split) strcpy(str_constr_Rc,split);
+	//// 转化成数组
+	unsigned char bytes_Hi[4096]={0};
+	unsigned char bytes_Rc[4096]={0};
+//	int hex2bytes(const char* in, int len,unsigned char* out);
+	hex2bytes(str_constr_Hi,strlen(str_constr_Hi),bytes_Hi);
+	hex2bytes(str_constr_Rc,strlen(str_constr_Rc),bytes_Rc);
+
+	pairing_t pairing;
+	char s[16384];
+	unsigned long long t = stat_now();
+	FILE *fp2 = stdin;
+	fp2 = fopen(TMIS_PARAM_FILE, "r");
+//	if (!fp) pbc_die("error opening a.param");
+	if (!fp2) { write_log(fp,"error opening a.param\n"); return -1;}
+
+	size_t count = fread(s, 1, 16384, fp2);
+//	if (!count) pbc_die("input error");
+	if (!count) { write_log(fp,"error opening a.param\n"); fclose(fp2);return -1;}
+
+	fclose(fp2);
+//	if (pairing_init_set_buf(pairing, s, count)) pbc_die("pairing init failed");
+	if (pairing_init_set_buf(pairing, s, count)) { write_log(fp,"pairing init failed\n"); fclose(fp2); return -1;}
+	// ======> pairing 初始化完成
+	t = stat_add(STAGE_PAIRING,t);
+	element_t element_P,elemetn_secret_key,element_public_key,element_rs;  // 这些要定义成全局的
+	element_t element_Rs,element_Rc,element_k2,element_Ji;
+
+	element_init_G1(element_P,pairing);
+	element_init_G1(elemetn_secret_key,pairing);
+	element_init_G1(element_public_key,pairing);
+	element_init_G1(element_Rs,pairing);
+	element_init_G1(element_Rc,pairing);
+	element_init_G1(element_rs,pairing);
+	element_init_G1(element_k2,pairing);
+	element_init_G1(element_Ji,pairing);
+
+	// 参数初始化
+	char hash_str[30] = TMIS_HASH_P;
+    element_from_hash(element_P, hash_str, strlen(hash_str));
+//    element_printf("element_P = %B\n", element_P);  // 赋值：element_P
+
+	element_random(element_rs);    // element_rs
+	element_set_str(element_public_key,public_key,10); // element_public_key
+	element_set_str(elemetn_secret_key,secret_key,10);// elemetn_secret_key
+
+//// 1.计算k2
+	element_from_bytes(element_Rc,bytes_Rc);
+	element_mul(element_k2,elemetn_secret_key,element_Rc);
+
+//// 2.解密Hi
+	char str_k2[1024]={0};
+	element_snprint(str_k2,sizeof(str_k2),element_k2);
+	unsigned char bytes_md5_k2[50]={0};
+	md5((unsigned char *)str_k2,bytes_md5_k2); // 得到解密密钥 bytes_k2
+
+	char str_md5_k2[50]={0};
+	char str_temp[50]={0};
+//	int bytes2hex(const unsigned char* in, const int len, char *out);
+	bytes2hex(bytes_md5_k2,strlen((char *)bytes_md5_k2),str_temp);
+	strncpy(str_md5_k2,str_temp,16);
+
+	char str_Hi[4096]={0};
+//	int aes_decrypt(const unsigned char* in, const unsigned char* key, unsigned char* out);
+	aes_decrypt(bytes_Hi,(unsigned char *)str_md5_k2,(unsigned char *)str_Hi);
+//	printf("str_Hi = %s\n",str_Hi);
+
+
+//// 3.分割字符串
+	char str_IDi[1024]={0}; // 和注册的时候str_id一样
+	char str_Ai[1024]={0};
+	char str_t1[1024]={0};
+
+	char *p = strtok_r(str_Hi,split_char_key_agreement,&save);
+	if(p) strcpy(str_IDi,p);
+	p=strtok_r(NULL,split_char_key_agreement,&save);
+	if(p) strcpy(str_Ai,p);
+	p=strtok_r(NULL,split_char_key_agreement,&save);
+	if(p) strcpy(str_t1,p);
+
+//	printf("str_IDi = %s\n",str_IDi);
+//	printf("str_Ai = %s\n",str_Ai);
+//	printf("str_t1 = %s\n",str_t1);
+
+///// 4.比较时间是否超时
+	time_t t1;
+	time_t t1_2 = time(NULL);
+	string2time(str_t1, &t1);
+	/*
+	if(t1_2-t1>120)
+	{
+		printf("超时了。。。\n");
+		return -1;
+	}
+	else printf("没有超时。。。\n");
+	*/
+
+///// 5.计算Ai2
+	int len1 = strlen(str_IDi);
+	int len2 = strlen(secret_key);
+	char *CONSTR1 =(char *)malloc(sizeof(char) * (len1+len2)+1); // ID || KS
+	memset(CONSTR1,0,len1+len2+1);
+	strncpy(CONSTR1,str_IDi,len1);
 	strncpy(CONSTR1+len1,secret_key,len2);
 //	printf("CONSTR1 = %s\n",CONSTR1);
 	unsigned char bytes_Ai[100]={0};
@@ -453,218 +1671,822 @@ int key_agreement_server_do(char *constr,int fd,FILE* fp)
 	strncpy(CONSTR2+len1+3*len_split_char_key_agreement+len2+len3+len4,split_char_key_agreement,len_split_char_key_agreement);
 //	printf("str_Li = %s\n",CONSTR2);
 
-//// 10.计算Li
-	unsigned char bytes_Li[4096]={0};
-	aes_encrypt((unsigned char *)CONSTR2,(unsigned char *)str_md5_k2,bytes_Li);
-//	printf("key_agreement：服务器端计算成功。。。。\n");
-	char str_Li[4096]={0};
-	len1 = get_length(bytes_Li);
-//	int bytes2hex(const unsigned char* in, const int len, char *out);
-	bytes2hex(bytes_Li,len1,str_Li);
+//// 10.计算Li
+	unsigned char bytes_Li[4096]={0};
+	t = stat_add(STAGE_ECC,t);
+	aes_encrypt((unsigned char *)CONSTR2,(unsigned char *)str_md5_k2,bytes_Li);
+//	printf("key_agreement：服务器端计算成功。。。。\n");
+	char str_Li[4096]={0};
+	len1 = get_length(bytes_Li);
+	t = stat_add(STAGE_ENCRYPT,t);
+//	int bytes2hex(const unsigned char* in, const int len, char *out);
+	bytes2hex(bytes_Li,len1,str_Li);
+	stat_add(STAGE_HEX,t);
+
+///// 将数据发送给客户端
+	/* 3.回复客户端，和同一批的其它回复一起发送 */
+	int pktlen = strlen(str_Li);
+	conn_reply(c,FLAG_KEY_AGREEMENT,str_Li,pktlen);
+//	write_log(fp,"write data to %s at PORT %u\n",str,port);
+
+
+///// 4.计算sk
+	len1=strlen(str_Ji);
+	len2=strlen(str_t1);
+	len3=strlen(str_t2);
+	char *CONSTR4 = (char *)malloc(sizeof(char)*(len1+len2+len3+1));
+	memset(CONSTR4,0,len1+len2+len3+1);
+	strncpy(CONSTR4,str_Ji,len1);
+	strncpy(CONSTR4+len1,str_t1,len2);
+	strncpy(CONSTR4+len1+len2,str_t2,len3);
+
+	unsigned char bytes_sk[50] = {0};
+	md5((unsigned char*)CONSTR4, bytes_sk);
+//	printhex(bytes_sk,16);
+	char str_sk[50]={0};
+	len1 = get_length(bytes_sk);
+	bytes2hex(bytes_sk, len1, str_sk);
+	char session_key[20] = {0};
+	strncpy(session_key,str_sk,16);
+//	printf("%s\n",session_key);
+	memset(c->skey,0,sizeof(c->skey));
+	strcpy(c->skey,session_key);
+//	printf("%s\n",c->skey);
+
+	c->keyed = 1;
+	write_log(fp,"share the session key %s with %s\n",session_key,c->peer);
+
+
+//////// 释放内存
+	element_clear(element_P);
+	element_clear(elemetn_secret_key);
+	element_clear(element_public_key);
+	element_clear(element_Rs);
+	element_clear(element_Rc);
+	element_clear(element_rs);
+	element_clear(element_k2);
+	element_clear(element_Ji);
+	free(CONSTR1);
+	free(CONSTR2);
+	free(CONSTR4);
+	mpz_clear(mpz_Ai2);
+
+	return 0;
+}
+
+/**
+ * @brief 处理一个数据包：服务器根据flag解析数据
+ * @param c 客户端连接
+ * @param pkt 数据包
+ */
+void handle_packet(tmis_conn_t *c, tmis_packet_t *pkt)
+{
+	/* 之后各个阶段的耗时记在这种请求下面 */
+	unsigned long long t = stat_begin(pkt->flag);
+
+	write_log(fp,"the data:%s\n",pkt->buf);
+
+	if(pkt->flag==FLAG_KEY_AGREEMENT)  // 密钥协商
+	{
+		/* 密钥协商的各个参数都放在固定大小的数组中 */
+		if(pkt->len >= BUFLEN)
+		{
+			write_log(fp,"ERROR: the key agreement packet from %s is too long\n",c->peer);
+			return;
+		}
+		//int key_agreement_server_do(char *constr,tmis_conn_t *c,FILE* fp)
+		key_agreement_server_do(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_RECORD)
+	{
+		handle_user_record_requset(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_RECORD_PAGE)
+	{
+		handle_user_record_page(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_RECORD_SINCE)
+	{
+		handle_user_record_since(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_RECORD_BATCH)
+	{
+		handle_user_record_batch(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_RECORD_STREAM)
+	{
+		handle_user_record_stream(pkt->buf,c,fp);
+	}
+	else if(pkt->flag==FLAG_INVALIDATE)
+	{
+		/* 只有同一台机器上的前端（本地套接字）可以删除缓存 */
+		if(!c->local)
+		{
+			write_log(fp,"ERROR: the invalidate packet from %s is refused\n",c->peer);
+			return;
+		}
+		cache_invalidate(pkt->len ? pkt->buf : NULL);
+		conn_reply(c,FLAG_INVALIDATE,"",0);
+	}
+
+	/* 交给数据库事件循环的请求在回复的时候统计 */
+	if(!c->dbwait) stat_add(STAGE_TOTAL,t);
+
+	return;
+}
+
+/**
+ * @brief 处理数据的线程
+ * @param arg 客户端socket
+ * @note 客户端可以连续发送多个数据包：这里读出所有已经到达的数据，按顺序处理其中每一个完整的数据包，
+ *       回复放入连接的发送队列，最后合并成一次writev发送；不完整的数据包留在接收缓存中，等下一次数据到达。
+ *       发送队列超过高水位（客户端读得太慢）时暂停处理，等事件循环把发送队列发下去以后再继续
+ */
+void *handle_data(void *arg)
+{
+	int fd = (int)(long)arg;
+	tmis_conn_t *c = conn_get(fd);
+	if(c==NULL) return NULL;
+
+	tmis_packet_t recvdata;
+	ssize_t nread;
+	int ret, full, closed = 0;
+	unsigned long long t;
+//	write_log(fp,"===在handle_data里面  fd = %d\n",fd);
+
+	/* 在线程池的队列中等待的时间，算在这次处理的第一个数据包上 */
+	stat_queued(c->queued ? stat_now() - c->queued : 0);
+	c->queued = 0;
+
+	/* 对方的地址和端口号在accept的时候已经取得了 */
+	if(!tmisconf.quiet)
+		write_log(fp,"receive data from %s at PORT %u\n",c->peer,c->port);
+
+	/* 1.读取数据，直到暂时没有数据为止 */
+	while(!closed)
+	{
+		/* 2.处理接收缓存中所有完整的数据包 */
+		ret = 0;
+		while(!c->dbwait && !(full = conn_out_full(c)) && (ret = conn_frame(c,&recvdata)) == 1)
+		{
+			handle_packet(c,&recvdata);
+			pool_free(recvdata.buf);
+		}
+		if(ret < 0)
+		{
+			write_log(fp,"ERROR: the packet from %s is too long\n",c->peer);
+			closed = 1;
+			break;
+		}
+
+		/* 先把回复发出去；还是超过高水位的话，不再处理新的请求 */
+		t = c->ohead ? stat_now() : 0;
+		if(conn_flush(c) != 0)
+		{
+			write_log(fp,"ERROR: send data to %s at PORT %u\n",c->peer,c->port);
+			closed = 1;
+			break;
+		}
+		if(t) stat_add(STAGE_SEND,t);
+		if(c->dbwait) break;
+		if(full)
+		{
+			if(conn_out_full(c)) break;
+			continue;     // 发送队列降下来了，先处理接收缓存中剩下的数据包
+		}
+
+		nread = conn_read(c);
+		if(nread == 0)
+		{
+			write_log(fp,"client %s is closed\n",c->peer);
+			closed = 1;
+		}
+		else if(nread < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			write_log(fp,"ERROR: receive data from %s at PORT %u\n",c->peer,c->port);
+			closed = 1;
+		}
+	}
+
+	/* 等待异步查询的连接既不注册事件也不关闭，查询完成以后handle_record_done接着处理（出错的话那时再关闭） */
+	if(c->dbwait) return NULL;
+
+	/* 3.重新注册事件：还有回复没有发送完的，由事件循环在可写的时候继续发送 */
+	if(closed || conn_rearm(c) != 0) conn_close(c);
+
+	return NULL;
+}
+
+/**
+ * @brief 连接超时：只shutdown，连接由正常的流程（读到EOF或者发送出错）关闭
+ * @param c 连接（调用者持有c->lock）
+ * @param kind 超时的种类
+ */
+void reap_conn(tmis_conn_t *c, int kind)
+{
+	if(!tmisconf.quiet)
+		write_log(fp,"close %s at PORT %u: %s timeout\n",c->peer,c->port,timer_kind_name(kind));
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+/**
+ * @brief 每秒一次：转动事件循环的时间轮，关闭超时的连接，处理推迟关闭的套接字；第0个事件循环还负责输出耗时统计
+ * @param r 事件循环
+ */
+void reactor_timer(tmis_reactor_t *r)
+{
+	int n = wheel_tick(&r->wheel, reap_conn);
+
+	if(n > 0)
+		write_log(fp,"reactor %d closed %d timeout connections (total idle %lu, handshake %lu, read %lu)\n",
+				r->id,n,timer_reaped[TIMEOUT_IDLE],timer_reaped[TIMEOUT_HANDSHAKE],timer_reaped[TIMEOUT_READ]);
+
+	/* 关闭的时候MSG_ZEROCOPY发送还没有完成的套接字 */
+	n = conn_zc_linger(r->id);
+	if(n > 0)
+		write_log(fp,"reactor %d gave up waiting zerocopy completions of %d closed connections\n",r->id,n);
+
+	/* 收到SIGUSR1以后由第0个事件循环输出耗时统计 */
+	if(r->id == 0 && stat_pending()) stat_dump(fp);
+
+	/* 收到SIGTERM、SIGINT：exit调用atexit注册的log_async_stop，缓冲区中的日志都写到文件以后再退出 */
+	if(r->id == 0 && tmis_stopping)
+	{
+		write_log(fp,"TMIS服务器退出（收到信号）\n");
+		exit(0);
+	}
+}
+
+/**
+ * @brief SIGTERM、SIGINT：只设置标志，由第0个事件循环在下一次定时器到期（1秒以内）的时候退出
+ * @param sig 信号
+ */
+void handle_stop_signal(int sig)
+{
+	(void)sig;
+	tmis_stopping = 1;
+}
+
+/**
+ * @brief 通知事件循环：连接处理完了，发送队列中有新的回复或者连接需要关闭
+ * @param r 事件循环
+ * @param fd 客户端
+ */
+void reactor_post(tmis_reactor_t *r, int fd)
+{
+	unsigned long long one = 1;
+
+	pthread_mutex_lock(&r->mlock);
+	if(r->mcnt == r->mcap)
+	{
+		int cap = r->mcap ? r->mcap * 2 : 256;
+		int *p = (int *)realloc(r->mbox, sizeof(int) * cap);
+		if(p == NULL)
+		{
+			pthread_mutex_unlock(&r->mlock);
+			write_log(fp,"the reactor mailbox is full!\n");
+			return;
+		}
+		r->mbox = p;
+		r->mcap = cap;
+	}
+	r->mbox[r->mcnt++] = fd;
+	pthread_mutex_unlock(&r->mlock);
+
+	/* 多次通知会合并成一次 */
+	if(write(r->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		write_log(fp,"function write eventfd is err:%s\n",strerror(errno));
+}
+
+/**
+ * @brief io_uring模式处理数据的线程：数据已经由事件循环接收到接收缓存中了，
+ *        这里按顺序处理其中每一个完整的数据包，回复放入发送队列，由事件循环批量提交发送
+ * @param arg 客户端socket
+ */
+void *handle_data_uring(void *arg)
+{
+	int fd = (int)(long)arg;
+	tmis_conn_t *c = conn_get(fd);
+	if(c==NULL) return NULL;
+
+	tmis_packet_t recvdata;
+	int ret = 0;
+
+	stat_queued(c->queued ? stat_now() - c->queued : 0);
+	c->queued = 0;
+
+	if(!tmisconf.quiet)
+		write_log(fp,"receive data from %s at PORT %u\n",c->peer,c->port);
+
+	/* 等待异步查询的时候停下（busy不清除），查询完成以后handle_record_done接着处理 */
+	while(!c->dbwait && (ret = conn_next_frame(c,&recvdata)) == 1)
+	{
+		handle_packet(c,&recvdata);
+		pool_free(recvdata.buf);
+	}
+	if(ret < 0)
+		write_log(fp,"ERROR: the packet from %s is too long\n",c->peer);
+
+	reactor_post(&reactors[c->loop], fd);
+
+	return NULL;
+}
+
+/**
+ * @brief 服务器处理客户端发送来的数据
+ * @param fd 客户端
+ */
+void handle_clientdata(int fd)
+{
+	// 将任务添加到线程池中
+//	int *p = (int *)malloc(sizeof(int));
+//	*p = fd;
+	tmis_conn_t *c = conn_get(fd);
+	if(c) c->queued = stat_now();
+	if(tmisconf.io == IO_URING) threadpool_add_task(tmispool, handle_data_uring, (void *)(long)fd);
+	else threadpool_add_task(tmispool, handle_data, (void *)(long)fd);
+//	write_log(fp,"====== 添加任务到队列\n");
+
+	return ;
+}
 
-///// 将数据发送给客户端
-	tmis_packet_t sendata;
-	/* 3.回复客户端 */
-	memset(&sendata,0,sizeof(sendata));
-	sendata.flag = 1;
-	int pktlen = strlen(str_Li);
-	sendata.len = htonl(pktlen);
-	strcpy(sendata.buf,str_Li);
-	writen(fd,&sendata,pktlen+5);
-//	write_log(fp,"write data to %s at PORT %u\n",str,port);
-//	printf("发送数据到客户端：%s\n",sendata.buf);
+/**
+ * @brief 客户端可写：在事件循环中继续发送发送队列中的数据
+ * @param fd 客户端
+ */
+void handle_writable(int fd)
+{
+	tmis_conn_t *c = conn_get(fd);
+	if(c==NULL) return;
 
+	if(conn_flush(c) != 0)
+	{
+		write_log(fp,"ERROR: send data to %s at PORT %u\n",c->peer,c->port);
+		conn_close(c);
+		return;
+	}
 
-///// 4.计算sk
-	len1=strlen(str_Ji);
-	len2=strlen(str_t1);
-	len3=strlen(str_t2);
-	char *CONSTR4 = (char *)malloc(sizeof(char)*(len1+len2+len3+1));
-	memset(CONSTR4,0,len1+len2+len3+1);
-	strncpy(CONSTR4,str_Ji,len1);
-	strncpy(CONSTR4+len1,str_t1,len2);
-	strncpy(CONSTR4+len1+len2,str_t2,len3);
+	/* 因为高水位暂停处理的请求还在接收缓存中，发送队列降下来以后交给线程池继续处理 */
+	if(!conn_out_full(c) && conn_has_input(c))
+	{
+		handle_clientdata(fd);
+		return;
+	}
 
-	unsigned char bytes_sk[50] = {0};
-	md5((unsigned char*)CONSTR4, bytes_sk);
-//	printhex(bytes_sk,16);
-	char str_sk[50]={0};
-	len1 = get_length(bytes_sk);
-	bytes2hex(bytes_sk, len1, str_sk);
-	char session_key[20] = {0};
-	strncpy(session_key,str_sk,16);
-//	printf("%s\n",session_key);
-	memset(session_keys[fd],0,sizeof(session_keys[fd]));
-	strcpy(session_keys[fd],session_key);
-//	printf("%s\n",session_keys[fd]);
+	if(conn_rearm(c) != 0) conn_close(c);
 
-	char str[30];
-	struct sockaddr_in cliaddr;
-	socklen_t clilen = sizeof(cliaddr);
-	getpeername(fd, (struct sockaddr *)&cliaddr, &clilen);
-	write_log(fp,"share the session key %s with %s\n",session_key,inet_ntop(AF_INET, &cliaddr.sin_addr, str, sizeof(str)));
+	return;
+}
 
+/**
+ * @brief io_uring模式：提交多次accept（一次提交，每来一个连接产生一个完成事件）
+ * @param r 事件循环
+ * @param lfd 监听套接字（TCP或者本地）
+ */
+void uring_submit_accept(tmis_reactor_t *r, int lfd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = lfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = UD_MAKE(UD_ACCEPT, 0, lfd);
+}
 
-//////// 释放内存
-	element_clear(element_P);
-	element_clear(elemetn_secret_key);
-	element_clear(element_public_key);
-	element_clear(element_Rs);
-	element_clear(element_Rc);
-	element_clear(element_rs);
-	element_clear(element_k2);
-	element_clear(element_Ji);
-	free(CONSTR1);
-	free(CONSTR2);
-	free(CONSTR4);
-	mpz_clear(mpz_Ai2);
+/**
+ * @brief io_uring模式：提交多次接收，内核从缓存环中挑选缓存放数据
+ * @param r 事件循环
+ * @param c 连接
+ */
+void uring_submit_recv(tmis_reactor_t *r, tmis_conn_t *c)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = r->ring.bgid;
+	sqe->user_data = UD_MAKE(UD_RECV, c->gen, c->fd);
+	c->recving = 1;
+}
 
-	return 0;
+/**
+ * @brief io_uring模式：取消连接的多次接收（接收缓存太多的时候）
+ * @param r 事件循环
+ * @param c 连接
+ */
+void uring_cancel_recv(tmis_reactor_t *r, tmis_conn_t *c)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = UD_MAKE(UD_RECV, c->gen, c->fd);
+	sqe->user_data = UD_MAKE(UD_CANCEL, c->gen, c->fd);
+	c->rpaused = 1;
 }
 
 /**
- * @brief 处理数据的线程
- * @param arg 客户端socket
+ * @brief io_uring模式：把发送队列中的回复作为一个writev提交，和其它连接的发送一起由一次io_uring_enter提交
+ * @param r 事件循环
+ * @param c 连接
  */
-void *handle_data(void *arg)
+void uring_submit_send(tmis_reactor_t *r, tmis_conn_t *c)
 {
-	int fd = (int)arg;
+	struct iovec *iov;
+	int cnt = conn_send_prepare(c, &iov);
+	if(cnt <= 0) return;
 
-	char str[30];
-	struct sockaddr_in cliaddr;
-	socklen_t clilen = sizeof(cliaddr);
-	unsigned short port = SERV_PORT;
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL)
+	{
+		conn_send_done(c, 0);
+		return;
+	}
 
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = c->fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = cnt;
+	sqe->user_data = UD_MAKE(UD_SEND, c->gen, c->fd);
+}
 
-	tmis_packet_t recvdata;
-//	write_log(fp,"===在handle_data里面  fd = %d\n",fd);
+/**
+ * @brief io_uring模式：读eventfd，等待处理线程的通知
+ * @param r 事件循环
+ */
+void uring_submit_wake(tmis_reactor_t *r)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->evfd;
+	sqe->addr = (unsigned long)&r->evval;
+	sqe->len = sizeof(r->evval);
+	sqe->user_data = UD_MAKE(UD_WAKE, 0, r->evfd);
+}
+
+/**
+ * @brief io_uring模式：读timerfd，每秒转动一次时间轮
+ * @param r 事件循环
+ */
+void uring_submit_timer(tmis_reactor_t *r)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	if(sqe == NULL) return;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->wheel.tfd;
+	sqe->addr = (unsigned long)&r->tval;
+	sqe->len = sizeof(r->tval);
+	sqe->user_data = UD_MAKE(UD_TIMER, 0, r->wheel.tfd);
+}
 
-	/* 获取对方的地址和端口号，出于性能考虑，可以省略 */
-//	int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
-	getpeername(fd, (struct sockaddr *)&cliaddr, &clilen);
-	write_log(fp,"receive data from %s at PORT %u\n",
-					inet_ntop(AF_INET, &cliaddr.sin_addr, str, sizeof(str)),
-					ntohs(cliaddr.sin_port));
+/**
+ * @brief io_uring模式：关闭连接。先shutdown让还在进行的接收结束，旧连接之后的完成事件按代数忽略
+ * @param r 事件循环
+ * @param c 连接
+ */
+void uring_close(tmis_reactor_t *r, tmis_conn_t *c)
+{
+	if(!tmisconf.quiet)
+		write_log(fp,"client %s is closed\n",c->peer);
+	shutdown(c->fd, SHUT_RDWR);
+	conn_close(c);
+}
 
-	/* 1.读取数据，并且解析 */
-	memset(&recvdata,0,sizeof(recvdata));
-	size_t ret = readn(fd,&recvdata,5);
-	if (ret == -1)
+/**
+ * @brief io_uring模式：处理一个连接的完成事件（接收、发送、取消接收）
+ * @param r 事件循环
+ * @param cqe 完成事件
+ */
+void uring_handle_conn(tmis_reactor_t *r, struct io_uring_cqe *cqe)
+{
+	int type = UD_TYPE(cqe->user_data);
+	int fd = UD_FD(cqe->user_data);
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	tmis_conn_t *c = conn_get(fd);
+	int stale = (c == NULL || c->fd != fd || (c->gen & 0xffffff) != UD_GEN(cqe->user_data));
+
+	if(type == UD_RECV)
 	{
-		write_log(fp,"ERROR: receive data from %s at PORT %u\n",str,
-				ntohs(cliaddr.sin_port));
-		close(fd);
-		fclose(fp);
-//		exit(-1);  				//这样整个进程都结束了，我们不要这样的结果
-//		pthread_exit(NULL);    //这样这个线程就结束了，我们应该把这个线程再次放到线程池中
-		return NULL;
+		/* 数据从缓存环中的缓存拷贝到接收缓存，缓存马上还给内核 */
+		if(cqe->flags & IORING_CQE_F_BUFFER)
+		{
+			unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if(!stale && cqe->res > 0)
+			{
+				int ret = conn_append(c, uring_buf(&r->ring, bid), cqe->res);
+				if(ret < 0) c->closing = 1;
+				else if(ret == 1) handle_clientdata(fd);
+			}
+			uring_buf_recycle(&r->ring, bid);
+		}
+		if(stale) return;
+
+		if(!more)
+		{
+			c->recving = 0;
+			/* 缓存环暂时用完了，或者是暂停以后重新开始接收 */
+			if(cqe->res == -ENOBUFS) uring_submit_recv(r, c);
+			else if(cqe->res != -ECANCELED || !c->rpaused) c->closing = 1;
+		}
+		/* 接收缓存太多，暂停接收，处理线程处理完以后再继续 */
+		else if(!c->rpaused && conn_in_full(c)) uring_cancel_recv(r, c);
 	}
-	else if (ret < 5)
+	else if(type == UD_SEND)
 	{
-		write_log(fp,"client %s is closed\n",str);
-		close(fd);
-		return NULL;
+		if(stale) return;
+		if(cqe->res < 0)
+		{
+			write_log(fp,"ERROR: send data to %s at PORT %u\n",c->peer,c->port);
+			/* 先标记关闭再结束发送，等待发送完成的处理线程（流式回复）马上醒来；
+			   处理线程还在处理这个连接的时候不能关闭，它处理完通知事件循环以后再关闭 */
+			c->closing = 1;
+			conn_send_done(c, 0);
+			if(!c->busy) uring_close(r, c);
+			return;
+		}
+		if(conn_send_done(c, cqe->res)) handle_clientdata(fd);
+		uring_submit_send(r, c);
 	}
+	/* UD_CANCEL：取消的结果在接收的完成事件中处理 */
+	else return;
 
-	// 读取此次客户端发送数据的长度
-	size_t n = ntohl(recvdata.len);
-	// 读取此次客户端发送数据的标记
-	char flag = recvdata.flag;
-//	printf("flag = %d\n",flag);
+	if(conn_can_close(c)) uring_close(r, c);
+}
 
-	ret = readn(fd,recvdata.buf,n);
-	if (ret == -1)
-	{
-		write_log(fp,"ERROR: receive data from %s at PORT %u\n",str,
-				ntohs(cliaddr.sin_port));
-		close(fd);
-		fclose(fp);
-		return NULL;
-	}
-	else if (ret < n)
+/**
+ * @brief io_uring模式：处理处理线程的通知：提交发送、恢复接收、关闭连接
+ * @param r 事件循环
+ */
+void uring_handle_wake(tmis_reactor_t *r)
+{
+	int *mbox, mcnt, i;
+
+	pthread_mutex_lock(&r->mlock);
+	mbox = r->mbox;
+	mcnt = r->mcnt;
+	r->mbox = NULL;
+	r->mcnt = 0;
+	r->mcap = 0;
+	pthread_mutex_unlock(&r->mlock);
+
+	for(i=0;i<mcnt;i++)
 	{
-		write_log(fp,"client %s is closed\n",str);
-		close(fd);
-		return NULL;
+		tmis_conn_t *c = conn_get(mbox[i]);
+		if(c == NULL || c->fd < 0) continue;
+
+		uring_submit_send(r, c);
+		if(c->rpaused && !c->recving && !c->closing && !conn_in_full(c))
+		{
+			c->rpaused = 0;
+			uring_submit_recv(r, c);
+		}
+		if(conn_can_close(c)) uring_close(r, c);
 	}
-	write_log(fp,"the data:%s\n",recvdata.buf);
+	free(mbox);
+
+	uring_submit_wake(r);
+}
+
+/**
+ * @brief 启动前检查io_uring能不能用：用一个测试的io_uring注册和事件循环一样大的缓存环，
+ *        探测用到的操作，再真的提交一次多次接收
+ * @return 可以用，返回0；否则（已经记录了日志），返回-1
+ */
+int uring_supported(void)
+{
+	static const unsigned char ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITEV, IORING_OP_READ, IORING_OP_ASYNC_CANCEL};
+	tmis_uring_t probe;
+	const char *what = NULL;
 
-	/* 2.服务器根据flag解析数据 */
-	if(flag==1)  // 密钥协商
+	if(uring_init(&probe, 8) != 0)
 	{
-		//int key_agreement_server_do(char *constr,int fd)
-		key_agreement_server_do(recvdata.buf,fd,fp);
+		write_log(fp,"io_uring is not supported(%s), use epoll\n",strerror(errno));
+		return -1;
 	}
-	else if(flag==2)
+
+	if(uring_setup_buffers(&probe, 0, URING_NBUFS, URING_BUFSZ) != 0) what = "provided buffer ring";
+	else if(uring_probe_ops(&probe, ops, (int)sizeof(ops)) != 0) what = "accept/recv/writev/read/cancel";
+	else if(uring_probe_recv_multishot(&probe) != 0) what = "multishot recv";
+	if(what) write_log(fp,"io_uring %s is not supported(%s), use epoll\n",what,strerror(errno));
+	uring_exit(&probe);
+
+	return what ? -1 : 0;
+}
+
+/**
+ * @brief 初始化一个事件循环的io_uring：缓存环、多次accept、eventfd
+ * @param r 事件循环
+ * @return 成功，返回0；失败，返回-1
+ */
+int reactor_init_uring(tmis_reactor_t *r)
+{
+	if(uring_init(&r->ring, URING_ENTRIES) != 0) return -1;
+	if(uring_setup_buffers(&r->ring, 0, URING_NBUFS, URING_BUFSZ) != 0)
 	{
-		handle_user_record_requset(recvdata.buf,fd,fp);
+		uring_exit(&r->ring);
+		return -1;
 	}
 
-	return NULL;
+	r->evfd = eventfd(0, EFD_CLOEXEC);
+	if(r->evfd < 0) return -1;
+	pthread_mutex_init(&r->mlock, NULL);
 
-//	tmis_packet_t sendata;
-//	/* 3.回复客户端 */
-//	memset(&sendata,0,sizeof(sendata));
-//	sendata.flag = flag;
-//	sendata.len = htonl(n);
-//	strncpy(sendata.buf,recvdata.buf,n);
-//	writen(fd,&sendata,n+5);
-//	write_log(fp,"write data to %s at PORT %u\n",str,port);
-//
-//	return NULL;
+	uring_submit_accept(r, r->lfd);
+	if(r->ufd >= 0) uring_submit_accept(r, r->ufd);
+	uring_submit_wake(r);
+	uring_submit_timer(r);
+
+	return 0;
 }
 
 /**
- * @brief 服务器处理客户端发送来的数据
- * @param fd 客户端
+ * @brief io_uring模式的事件循环线程：一次io_uring_enter提交所有的接收、发送，并等待完成事件
+ * @param arg 事件循环
+ * @return NULL值
  */
-void handle_clientdata(int fd)
+void *reactor_run_uring(void *arg)
 {
-	// 将任务添加到线程池中
-//	int *p = (int *)malloc(sizeof(int));
-//	*p = fd;
-	threadpool_add_task(tmispool, handle_data, (void *)fd);
-//	write_log(fp,"====== 添加任务到队列\n");
+	tmis_reactor_t *r = (tmis_reactor_t *)arg;
+	struct io_uring_cqe *cqe;
+	struct sockaddr_storage cliaddr;
+	socklen_t len;
+	tmis_conn_t *c;
+	int fd;
 
-	return ;
+	while(1)
+	{
+		if(uring_submit_and_wait(&r->ring, 1) < 0)
+		{
+			if(errno==EINTR) continue;
+			write_log(fp,"function io_uring_enter is err:%s\n",strerror(errno));
+			exit(-1);
+		}
+
+		while((cqe = uring_peek_cqe(&r->ring)) != NULL)
+		{
+			switch(UD_TYPE(cqe->user_data))
+			{
+			case UD_ACCEPT:
+				fd = cqe->res;
+				if(fd >= 0 && conn_count() >= tmisconf.max_conns)
+					refuse_connection(r, fd, "too many connections");
+				else if(fd == -EMFILE || fd == -ENFILE)
+					accept_with_reserve(r, UD_FD(cqe->user_data));
+				else if(fd >= 0)
+				{
+					/* 多次accept不能传出客户端地址，每个连接取一次 */
+					len = sizeof(cliaddr);
+					if(getpeername(fd, (struct sockaddr *)&cliaddr, &len) != 0) cliaddr.ss_family = AF_UNSPEC;
+					c = conn_open(fd, r->id, -1, (struct sockaddr *)&cliaddr);
+					if(c == NULL)
+					{
+						write_log(fp,"the fd %d is out of the connection table\n",fd);
+						close(fd);
+					}
+					else
+					{
+						wheel_add(&r->wheel, c);
+						uring_submit_recv(r, c);
+						if(!tmisconf.quiet)
+							write_log(fp,"connection from %s at PORT %u\n",c->peer,c->port);
+					}
+				}
+				else write_log(fp,"function accept is err:%s\n",strerror(-fd));
+				if(!(cqe->flags & IORING_CQE_F_MORE)) uring_submit_accept(r, UD_FD(cqe->user_data));
+				break;
+			case UD_WAKE:
+				uring_handle_wake(r);
+				break;
+			case UD_TIMER:
+				reactor_timer(r);
+				uring_submit_timer(r);
+				break;
+			default:
+				uring_handle_conn(r, cqe);
+				break;
+			}
+			uring_cqe_seen(&r->ring);
+		}
+	}// end for: while(1)
+
+	return NULL;
 }
 
 /**
- * @brief 服务器端epoll的实现
+ * @brief 初始化一个事件循环：监听套接字 + epoll
+ * @param r 事件循环
+ * @param id 事件循环的编号
  */
-void do_service()
+void reactor_init(tmis_reactor_t *r, int id)
 {
 	struct epoll_event tep;
-	int ret,nready,i,fd;
+	int ret;
 
+	r->id = id;
 
 	/* socket,bind,listen */
-	int lfd = 0;
-	initlistensocket(&lfd);
+	initlistensocket(&r->lfd, nreactors > 1);
+
+	/* 本地套接字不能端口复用，只由第0个事件循环监听 */
+	r->ufd = -1;
+	if(id == 0 && tmisconf.unix_path != NULL) initunixsocket(&r->ufd, tmisconf.unix_path);
+
+	if(wheel_init(&r->wheel) != 0)
+	{
+		write_log(fp,"function timerfd_create is err:%s\n",strerror(errno));
+		exit(-1);
+	}
+
+	/* 预留一个文件描述符，用完的时候用 */
+	r->rfd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(r->rfd == -1)
+	{
+		write_log(fp,"function open /dev/null is err:%s\n",strerror(errno));
+		exit(-1);
+	}
+
+	if(tmisconf.io == IO_URING)
+	{
+		if(reactor_init_uring(r) != 0)
+		{
+			write_log(fp,"the io_uring of reactor %d is create failed:%s\n",id,strerror(errno));
+			exit(-1);
+		}
+		return;
+	}
 
 	/* epoll_create */
-	efd = epoll_create(OPEN_MAX);
-	if (efd == -1)
+	r->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->efd == -1)
 	{
 		write_log(fp,"function epoll_create is err:%s\n",strerror(errno));
 		exit(-1);
 	}
+	r->ep = (struct epoll_event *)malloc(sizeof(struct epoll_event) * tmisconf.events);
+	if (r->ep == NULL)
+	{
+		write_log(fp,"the epoll events of reactor %d is create failed!\n",id);
+		exit(-1);
+	}
 
 //	int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
-	tep.events = EPOLLIN | EPOLLET;  // 边沿触发模式
-	tep.data.fd = lfd;
-	ret = epoll_ctl(efd,EPOLL_CTL_ADD,lfd,&tep);
+	tep.events = EPOLLIN;  // 监听套接字水平触发，每次只accept一批，见handle_connection
+	tep.data.fd = r->lfd;
+	ret = epoll_ctl(r->efd,EPOLL_CTL_ADD,r->lfd,&tep);
+	if (ret == -1)
+	{
+		write_log(fp,"function epoll_ctl is err:%s\n",strerror(errno));
+		exit(-1);
+	}
+	if(r->ufd >= 0)
+	{
+		tep.events = EPOLLIN;
+		tep.data.fd = r->ufd;
+		ret = epoll_ctl(r->efd,EPOLL_CTL_ADD,r->ufd,&tep);
+		if (ret == -1)
+		{
+			write_log(fp,"function epoll_ctl is err:%s\n",strerror(errno));
+			exit(-1);
+		}
+	}
+
+	/* 每秒可读一次的timerfd（没有配置超时也要有：退出信号、耗时统计都在定时器中处理） */
+	tep.events = EPOLLIN;
+	tep.data.fd = r->wheel.tfd;
+	ret = epoll_ctl(r->efd,EPOLL_CTL_ADD,r->wheel.tfd,&tep);
 	if (ret == -1)
 	{
 		write_log(fp,"function epoll_ctl is err:%s\n",strerror(errno));
 		exit(-1);
 	}
 
+	return;
+}
+
+/**
+ * @brief 事件循环线程：epoll_wait，处理本循环的连接请求和客户端数据
+ * @param arg 事件循环
+ * @return NULL值
+ */
+void *reactor_run(void *arg)
+{
+	tmis_reactor_t *r = (tmis_reactor_t *)arg;
+	int nready,i,fd;
 
 	while(1)
 	{
 // int epoll_wait(int epfd, struct epoll_event *events,int maxevents, int timeout);
-		nready = epoll_wait(efd,ep,OPEN_MAX,-1);
+		nready = epoll_wait(r->efd,r->ep,tmisconf.events,-1);
 		if(nready == -1)
 		{
 			if(errno==EINTR) continue;
@@ -675,25 +2497,129 @@ void do_service()
 		// 处理epoll_wait传出的事件
 		for(i=0;i<nready;i++)
 		{
-			/* 如果不是"读"事件, 继续循环 */
-			if (!(ep[i].events & EPOLLIN))   continue;
-
-			fd = ep[i].data.fd;
+			fd = r->ep[i].data.fd;
 			/* 处理客户端连接请求 */
-			if(fd==lfd) handle_connection(lfd);
-			else handle_clientdata(fd);
+			if(fd==r->lfd || fd==r->ufd)
+			{
+				if(r->ep[i].events & EPOLLIN) handle_connection(r, fd);
+			}
+			/* 每秒一次，检查连接超时 */
+			else if(fd==r->wheel.tfd)
+			{
+				if(read(fd,&r->tval,sizeof(r->tval)) == sizeof(r->tval)) reactor_timer(r);
+			}
+			/* 可读（或者出错、对方挂断）交给线程池；只是可写的话，在这里继续发送 */
+			else if(r->ep[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) handle_clientdata(fd);
+			else if(r->ep[i].events & EPOLLOUT) handle_writable(fd);
 		}
 	}// end for: while(1)
 
+	return NULL;
+}
+
+/**
+ * @brief 按tmisconf.max_conns提高进程能打开的文件数量（RLIMIT_NOFILE），提不上去的话减小max_conns
+ * @return 进程能打开的文件数量
+ */
+int raise_nofile()
+{
+	struct rlimit rl, nl;
+	rlim_t want = (rlim_t)tmisconf.max_conns + RESERVED_FDS + (rlim_t)nreactors * REACTOR_FDS;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0)
+	{
+		write_log(fp,"function getrlimit is err:%s\n",strerror(errno));
+		exit(-1);
+	}
+
+	if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= want) return (int)want;
+
+	/* 先试着连硬限制一起提高（需要root），不行就提高到硬限制 */
+	nl.rlim_cur = want;
+	nl.rlim_max = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ? want : rl.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &nl) != 0)
+	{
+		nl.rlim_cur = rl.rlim_max;
+		nl.rlim_max = rl.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &nl) != 0) nl.rlim_cur = rl.rlim_cur;
+	}
+
+	if(nl.rlim_cur < want)
+	{
+		int max_conns = (int)nl.rlim_cur - RESERVED_FDS - nreactors * REACTOR_FDS;
+		if(max_conns < 1) max_conns = 1;
+		write_log(fp,"RLIMIT_NOFILE can only be raised to %lu, max connections %d -> %d\n",
+				(unsigned long)nl.rlim_cur,tmisconf.max_conns,max_conns);
+		tmisconf.max_conns = max_conns;
+	}
+
+	return (int)nl.rlim_cur;
+}
+
+/**
+ * @brief 服务器端epoll的实现：tmisconf.loops个事件循环，每个循环一个线程
+ */
+void do_service()
+{
+	int i,ret;
+
+	nreactors = tmisconf.loops;
+	reactors = (tmis_reactor_t *)calloc(nreactors, sizeof(tmis_reactor_t));
+	if(reactors == NULL)
+	{
+		write_log(fp,"the reactors is create failed!\n");
+		exit(-1);
+	}
+
+	/* 连接表的大小就是进程能打开的文件数量 */
+	int nfiles = raise_nofile();
+	if(conn_table_init(nfiles) != 0)
+	{
+		write_log(fp,"the connection table is create failed!\n");
+		exit(-1);
+	}
+
+	/* 内核不支持io_uring（或者不支持要用到的缓存环、多次接收）的时候使用epoll */
+	if(tmisconf.io == IO_URING && uring_supported() != 0) tmisconf.io = IO_EPOLL;
+	void *(*run)(void *) = (tmisconf.io == IO_URING) ? reactor_run_uring : reactor_run;
+
+	for(i=0;i<nreactors;i++) reactor_init(&reactors[i], i);
+	write_log(fp,"TMIS服务器启动成功，%d个事件循环(%s)在%d端口监听客户端的连接.....\n",
+			nreactors,(tmisconf.io == IO_URING) ? "io_uring" : "epoll",SERV_PORT);
+	if(tmisconf.unix_path != NULL)
+		write_log(fp,"同时在本地套接字%s监听客户端的连接\n",tmisconf.unix_path);
+
+	/* 第0个事件循环在当前线程中运行，其余的各开一个线程 */
+	for(i=1;i<nreactors;i++)
+	{
+		ret = pthread_create(&reactors[i].tid, NULL, run, (void *)&reactors[i]);
+		if(ret != 0)
+		{
+			write_log(fp,"function pthread_create is err:%s\n",strerror(ret));
+			exit(-1);
+		}
+		pthread_detach(reactors[i].tid);
+	}
+	reactors[0].tid = pthread_self();
+	run(&reactors[0]);
+
 	return;
 }
 
 #if 1
 
 // 以守护进程的方式
-int main()
+int main(int argc, char **argv)
 {
+	/* 0.解析命令行参数 */
+	if(conf_parse(argc, argv) != 0)
+	{
+		conf_usage(argv[0]);
+		exit(-1);
+	}
+
 	/* 1.打开输入输出的日志文件 */
+	log_set_precision(tmisconf.log_precision);
 	fp=open_log("./tmis.log");
 
 	if(fp==NULL)
@@ -722,6 +2648,13 @@ int main()
 	}
 
 	umask(0);
+
+	/* 日志交给写日志的线程（fork以后启动，线程不会被fork复制）；exit的时候先写完缓冲区中的日志 */
+	if(tmisconf.log_ring > 0)
+	{
+		if(log_async_start(fp,tmisconf.log_ring,tmisconf.log_block) == 0) atexit(log_async_stop);
+		else write_log(fp,"the async log is start failed, write the log synchronously\n");
+	}
 	//close(STDIN_FILENO);
 	//close(STDOUT_FILENO);
 	//close(STDERR_FILENO);
@@ -735,12 +2668,33 @@ int main()
 		exit(-1);
 	}
 
+	/* 医疗记录缓存，在数据库前面 */
+	if(cache_init((size_t)tmisconf.cache_mem,tmisconf.cache_ttl,fp) != 0)
+	{
+		write_log(fp,"the record cache is create failed!\n");
+		exit(-1);
+	}
+
+	/* 打开医疗记录的存储：MySQL的连接池（连接数量和线程池无关），或者SQLite数据库文件 */
+	if(store_open(tmisconf.store,fp) != 0)
+	{
+		write_log(fp,"the %s store is open failed!\n",store_name());
+		exit(-1);
+	}
+
+
+	/* kill -USR1：把各种请求各个阶段的耗时统计写到日志中 */
+	signal(SIGUSR1, stat_signal);
+	/* kill（tmisd.sh stop）：写完日志再退出 */
+	signal(SIGTERM, handle_stop_signal);
+	signal(SIGINT, handle_stop_signal);
 
 	/* 4. 服务器端接受连接 ，处理数据 */
 	write_log(fp,"TMIS服务器启动开始！\n");
 	do_service();
 
 	threadpool_destroy(&tmispool);; // 销毁线程池
+	store_close();
 	return 0;
 }
 
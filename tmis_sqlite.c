@@ -0,0 +1,288 @@
+/**
+* @file       tmis_sqlite.c
+* @brief      tmis服务器的SQLite医疗记录存储
+* @details    医疗记录放在本机的SQLite数据库文件中（表结构和MySQL的tmis_record一样），不需要数据库服务；
+*             每个处理线程第一次查询的时候打开一个只读的连接、准备好查询语句，之后一直使用；
+*             数据库文件用内存映射读取，查询不经过read系统调用
+* @author     项斌
+* @date       2018/08/28
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "log.h"
+#include "tmis_conf.h"
+#include "tmis_store.h"
+
+/** 表和(uid,rtime)上的索引，数据库文件不存在的时候创建（之后用sqlite3命令行导入记录）；
+ *  按uid查询和按时间倒序分页都用这个索引，原来只有uid的索引多余了 */
+#define SQLITE_SQL_SCHEMA "create table if not exists tmis_record(uid text not null,rtime text,rdoctor text,rsymptom text,rfeedback text);" \
+	"create index if not exists tmis_record_uid_rtime on tmis_record(uid,rtime);" \
+	"drop index if exists tmis_record_uid;"
+
+/** 查询一个用户的医疗记录，每个线程的连接准备一次 */
+#define SQLITE_SQL_RECORD "select rtime,rdoctor,rsymptom,rfeedback from tmis_record where uid=?"
+
+/** 按时间倒序分页查询一个用户的医疗记录（和MySQL的DB_SQL_RECORD_PAGE一样） */
+#define SQLITE_SQL_RECORD_PAGE "select rtime,rdoctor,rsymptom,rfeedback from tmis_record " \
+	"where uid=?1 and rtime>=?2 and rtime<=?3 order by rtime desc limit ?5 offset ?4"
+
+/** 一条语句查询多个用户的医疗记录（in中STORE_BATCH_MAX个参数，用户不够的时候用第一个uid补齐），
+ *  每条记录后面多取出uid，按uid、记录时间排序，同一个用户的记录连在一起 */
+#define SQLITE_SQL_RECORD_BATCH_HEAD "select rtime,rdoctor,rsymptom,rfeedback,uid from tmis_record where uid in ("
+#define SQLITE_SQL_RECORD_BATCH_TAIL ") order by uid,rtime"
+
+/** 内存映射的大小，数据库文件比它小的话整个映射 */
+#define SQLITE_MMAP_SIZE (256 * 1024 * 1024)
+
+/** 一个处理线程的连接 */
+typedef struct tmis_sqlite
+{
+	sqlite3 *db;                        ///< 只读的连接
+	sqlite3_stmt *rec_stmt;             ///< 查询医疗记录的语句
+	sqlite3_stmt *page_stmt;            ///< 分页查询医疗记录的语句
+	sqlite3_stmt *batch_stmt;           ///< 一次查询多个用户的医疗记录的语句
+	sqlite3_stmt *cur;                  ///< 当前查询执行的语句
+}tmis_sqlite_t;
+
+static FILE *sqlog;                    ///< 日志文件句柄
+static pthread_key_t sqkey;            ///< 每个线程的连接，线程退出的时候关闭
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 关闭一个线程的连接
+ * @param arg 连接
+ */
+static void sqlite_thread_close(void *arg)
+{
+	tmis_sqlite_t *h = (tmis_sqlite_t *)arg;
+
+	if(h == NULL) return;
+	sqlite3_finalize(h->rec_stmt);
+	sqlite3_finalize(h->page_stmt);
+	sqlite3_finalize(h->batch_stmt);
+	sqlite3_close(h->db);
+	free(h);
+}
+
+/**
+ * @brief 取得本线程的连接，第一次使用的时候打开
+ * @return 成功，返回连接；失败，返回NULL
+ */
+static tmis_sqlite_t *sqlite_thread(void)
+{
+	tmis_sqlite_t *h = (tmis_sqlite_t *)pthread_getspecific(sqkey);
+	char mmap_sql[64];
+	char batch_sql[sizeof(SQLITE_SQL_RECORD_BATCH_HEAD) + sizeof(SQLITE_SQL_RECORD_BATCH_TAIL) + 2 * STORE_BATCH_MAX];
+	int i, n;
+
+	if(h != NULL) return h;
+
+	h = (tmis_sqlite_t *)calloc(1, sizeof(tmis_sqlite_t));
+	if(h == NULL) return NULL;
+
+	do
+	{
+		/* 每个线程自己的连接，不需要SQLite再加锁 */
+		if(sqlite3_open_v2(tmisconf.store_path, &h->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+		{
+			write_log(sqlog,"func sqlite3_open_v2 %s error:%s\n",tmisconf.store_path,sqlite3_errmsg(h->db));
+			break;
+		}
+		/* 导入记录的时候写锁最多等待db_wait毫秒；db_wait为0表示一直等待，SQLite的0却是不等待 */
+		sqlite3_busy_timeout(h->db, tmisconf.db_wait > 0 ? tmisconf.db_wait : INT_MAX);
+		snprintf(mmap_sql, sizeof(mmap_sql), "pragma mmap_size=%d", SQLITE_MMAP_SIZE);
+		sqlite3_exec(h->db, mmap_sql, NULL, NULL, NULL);
+
+		n = snprintf(batch_sql, sizeof(batch_sql), "%s", SQLITE_SQL_RECORD_BATCH_HEAD);
+		for(i = 0; i < STORE_BATCH_MAX; i++) n += snprintf(batch_sql + n, sizeof(batch_sql) - n, i ? ",?" : "?");
+		snprintf(batch_sql + n, sizeof(batch_sql) - n, "%s", SQLITE_SQL_RECORD_BATCH_TAIL);
+
+		if(sqlite3_prepare_v2(h->db, SQLITE_SQL_RECORD, -1, &h->rec_stmt, NULL) != SQLITE_OK ||
+				sqlite3_prepare_v2(h->db, SQLITE_SQL_RECORD_PAGE, -1, &h->page_stmt, NULL) != SQLITE_OK ||
+				sqlite3_prepare_v2(h->db, batch_sql, -1, &h->batch_stmt, NULL) != SQLITE_OK)
+		{
+			write_log(sqlog,"func sqlite3_prepare_v2 error:%s\n",sqlite3_errmsg(h->db));
+			break;
+		}
+
+		pthread_setspecific(sqkey, h);
+		return h;
+	}while(0);
+
+	sqlite_thread_close(h);
+	return NULL;
+}
+
+/**
+ * @brief 打开SQLite存储：数据库文件不存在的时候创建表和索引
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+static int sqlite_store_open(FILE *log)
+{
+	sqlite3 *db = NULL;
+	char *err = NULL;
+	int ret = -1;
+
+	sqlog = log;
+	if(pthread_key_create(&sqkey, sqlite_thread_close) != 0) return -1;
+
+	do
+	{
+		if(sqlite3_open_v2(tmisconf.store_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+		{
+			write_log(sqlog,"func sqlite3_open_v2 %s error:%s\n",tmisconf.store_path,sqlite3_errmsg(db));
+			break;
+		}
+		/* WAL：导入记录的时候处理线程照样可以读 */
+		sqlite3_exec(db, "pragma journal_mode=wal", NULL, NULL, NULL);
+		if(sqlite3_exec(db, SQLITE_SQL_SCHEMA, NULL, NULL, &err) != SQLITE_OK)
+		{
+			write_log(sqlog,"create the table tmis_record error:%s\n",err);
+			sqlite3_free(err);
+			break;
+		}
+		ret = 0;
+	}while(0);
+
+	sqlite3_close(db);
+	if(ret == 0) write_log(sqlog,"sqlite store: %s (sqlite %s)\n",tmisconf.store_path,sqlite3_libversion());
+
+	return ret;
+}
+
+/**
+ * @brief SQLite存储：开始查询一个用户的医疗记录
+ * @param uid 用户id
+ * @param page 分页查询的条件，NULL表示全部
+ * @return 成功，返回本线程的连接；失败，返回NULL
+ */
+static void *sqlite_store_query(const char *uid, const tmis_store_page_t *page)
+{
+	tmis_sqlite_t *h = sqlite_thread();
+	int rc;
+
+	if(h == NULL) return NULL;
+
+	h->cur = page ? h->page_stmt : h->rec_stmt;
+	rc = sqlite3_bind_text(h->cur, 1, uid, -1, SQLITE_TRANSIENT);
+	if(rc == SQLITE_OK && page)
+	{
+		/* 时间按文本比较，"YYYY-MM-DD HH:MM:SS"的字典序就是时间顺序 */
+		rc = sqlite3_bind_text(h->cur, 2, page->from, -1, SQLITE_TRANSIENT);
+		if(rc == SQLITE_OK) rc = sqlite3_bind_text(h->cur, 3, page->to, -1, SQLITE_TRANSIENT);
+		if(rc == SQLITE_OK) rc = sqlite3_bind_int64(h->cur, 4, page->skip);
+		if(rc == SQLITE_OK) rc = sqlite3_bind_int64(h->cur, 5, page->limit);
+	}
+	if(rc != SQLITE_OK)
+	{
+		write_log(sqlog,"func sqlite3_bind error:%s\n",sqlite3_errmsg(h->db));
+		sqlite3_clear_bindings(h->cur);
+		return NULL;
+	}
+
+	return h;
+}
+
+/**
+ * @brief SQLite存储：一条语句开始查询多个用户的医疗记录
+ * @param uids 各个用户id
+ * @param n 用户的数量
+ * @return 成功，返回本线程的连接；失败，返回NULL
+ */
+static void *sqlite_store_batch(const char **uids, int n)
+{
+	tmis_sqlite_t *h = sqlite_thread();
+	int i, rc = SQLITE_OK;
+
+	if(h == NULL) return NULL;
+
+	h->cur = h->batch_stmt;
+	for(i = 0; i < STORE_BATCH_MAX && rc == SQLITE_OK; i++)
+		rc = sqlite3_bind_text(h->cur, i + 1, uids[i < n ? i : 0], -1, SQLITE_TRANSIENT);
+	if(rc != SQLITE_OK)
+	{
+		write_log(sqlog,"func sqlite3_bind error:%s\n",sqlite3_errmsg(h->db));
+		sqlite3_clear_bindings(h->cur);
+		return NULL;
+	}
+
+	return h;
+}
+
+/**
+ * @brief SQLite存储：取出下一条医疗记录（字段直接指向SQLite的结果，不拷贝）
+ * @param cur 本线程的连接
+ * @param fields 传出参数，每个字段
+ * @param lens 传出参数，每个字段的长度
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+static int sqlite_store_next(void *cur, char **fields, unsigned long *lens)
+{
+	tmis_sqlite_t *h = (tmis_sqlite_t *)cur;
+	const unsigned char *p;
+	int i, rc, nf = sqlite3_column_count(h->cur);
+
+	rc = sqlite3_step(h->cur);
+	if(rc == SQLITE_DONE) return 0;
+	if(rc != SQLITE_ROW)
+	{
+		write_log(sqlog,"func sqlite3_step error:%s\n",sqlite3_errmsg(h->db));
+		return -1;
+	}
+
+	for(i = 0; i < nf; i++)
+	{
+		/* 先取内容再取长度（SQLite的要求），NULL为空字符串 */
+		p = sqlite3_column_text(h->cur, i);
+		fields[i] = p ? (char *)p : (char *)"";
+		lens[i] = p ? (unsigned long)sqlite3_column_bytes(h->cur, i) : 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief SQLite存储：结束查询，语句留给本线程的下一次查询；出错的连接关闭，下一次重新打开
+ * @param cur 本线程的连接
+ * @param error 查询出错了
+ */
+static void sqlite_store_end(void *cur, int error)
+{
+	tmis_sqlite_t *h = (tmis_sqlite_t *)cur;
+
+	sqlite3_reset(h->cur);
+	sqlite3_clear_bindings(h->cur);
+	if(error)
+	{
+		pthread_setspecific(sqkey, NULL);
+		sqlite_thread_close(h);
+	}
+}
+
+/**
+ * @brief 关闭SQLite存储（各个线程的连接在线程退出的时候关闭）
+ */
+static void sqlite_store_close(void)
+{
+}
+
+/** SQLite存储 */
+const tmis_store_ops_t store_sqlite =
+{
+	.name = "sqlite",
+	.open = sqlite_store_open,
+	.query = sqlite_store_query,
+	.batch = sqlite_store_batch,
+	.next = sqlite_store_next,
+	.end = sqlite_store_end,
+	.async = NULL,
+	.close = sqlite_store_close,
+};
@@ -0,0 +1,356 @@
+/**
+* @file       tmis_stat.c
+* @brief      tmis服务器处理请求的各个阶段的耗时统计
+* @details    每种请求（按数据包类型）的每个阶段一个对数分段的直方图（HDR的做法：每个2的幂次再等分成几段，
+*             相对误差固定），单位是纳秒（单调时钟）；每个线程记在自己的直方图里，不用锁也没有原子操作，
+*             输出的时候把所有线程的加起来；收到SIGUSR1的时候由第0个事件循环把统计结果写到日志中，服务器不用停
+* @author     项斌
+* @date       2018/08/30
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+#include "tmis_proto.h"
+#include "tmis_stat.h"
+
+/** 一个线程的统计 */
+typedef struct tmis_stat_thread
+{
+	struct tmis_stat_thread *next;      ///< 下一个线程的统计
+	int type;                           ///< 当前处理的请求的种类
+	unsigned long long started;         ///< 当前请求开始处理的时间
+	unsigned long long queued;          ///< 接着处理的数据在线程池的队列中等待的时间，0表示没有
+	tmis_hist_t h[STAT_TYPES][STAT_STAGES];       ///< 每种请求的每个阶段
+}tmis_stat_thread_t;
+
+static __thread tmis_stat_thread_t *self;        ///< 本线程的统计
+static tmis_stat_thread_t *threads;              ///< 所有线程的统计（在stlock保护下）
+static tmis_stat_thread_t *gone;                 ///< 已经退出的线程的统计加在这里
+static pthread_mutex_t stlock = PTHREAD_MUTEX_INITIALIZER;   ///< 线程链表的锁
+static pthread_key_t stkey;                      ///< 线程退出的时候把统计加到gone中
+static pthread_once_t stonce = PTHREAD_ONCE_INIT;
+static volatile sig_atomic_t stdump;             ///< 收到了SIGUSR1
+
+/** 请求的种类、阶段的名字，输出用 */
+static const char *type_names[STAT_TYPES] = {"key", "record", "page", "since", "batch", "stream", "other"};
+static const char *stage_names[STAT_STAGES] = {"queue", "pairing", "ecc", "cache", "dbwait", "query", "encrypt", "hex", "send", "total"};
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 一个值所在的段：小于2*STAT_SUB的每个值一段，之后每个2的幂次STAT_SUB段
+ * @param v 值
+ * @return 段的下标
+ */
+static int hist_index(unsigned long long v)
+{
+	int e;
+
+	if(v < 2 * STAT_SUB) return (int)v;
+
+	e = 63 - __builtin_clzll(v);
+	if(e > STAT_MAX_EXP) return STAT_BUCKETS - 1;
+
+	return (e - STAT_SUB_BITS + 1) * STAT_SUB + (int)((v >> (e - STAT_SUB_BITS)) & (STAT_SUB - 1));
+}
+
+/**
+ * @brief 一段代表的值：这一段的中间
+ * @param i 段的下标
+ * @return 值
+ */
+static unsigned long long hist_value(int i)
+{
+	int e;
+
+	if(i < 2 * STAT_SUB) return (unsigned long long)i;
+
+	e = i / STAT_SUB + STAT_SUB_BITS - 1;
+
+	return ((unsigned long long)(STAT_SUB + i % STAT_SUB) << (e - STAT_SUB_BITS)) + ((1ULL << (e - STAT_SUB_BITS)) >> 1);
+}
+
+/**
+ * @brief 记录一个值
+ * @param h 直方图
+ * @param v 值
+ */
+static void hist_add(tmis_hist_t *h, unsigned long long v)
+{
+	h->count++;
+	h->sum += v;
+	if(v > h->max) h->max = v;
+	h->b[hist_index(v)]++;
+}
+
+/**
+ * @brief 把一个直方图加到另一个上
+ * @param to 加到这个直方图上
+ * @param from 被加的直方图
+ */
+static void hist_merge(tmis_hist_t *to, const tmis_hist_t *from)
+{
+	int i;
+
+	if(from->count == 0) return;
+	to->count += from->count;
+	to->sum += from->sum;
+	if(from->max > to->max) to->max = from->max;
+	for(i = 0; i < STAT_BUCKETS; i++) to->b[i] += from->b[i];
+}
+
+/**
+ * @brief 百分位数
+ * @param h 直方图
+ * @param p 百分之多少（0到100）
+ * @return 值（不超过记录到的最大值）
+ */
+static unsigned long long hist_percentile(const tmis_hist_t *h, double p)
+{
+	unsigned long long want = (unsigned long long)(h->count * p / 100.0 + 0.5), seen = 0, v;
+	int i;
+
+	if(want == 0) want = 1;
+	for(i = 0; i < STAT_BUCKETS; i++)
+	{
+		seen += h->b[i];
+		if(seen >= want)
+		{
+			v = hist_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/**
+ * @brief 线程退出的时候把它的统计加到gone中
+ * @param arg 线程的统计
+ */
+static void stat_thread_exit(void *arg)
+{
+	tmis_stat_thread_t *t = (tmis_stat_thread_t *)arg, **pp;
+	int i, j;
+
+	pthread_mutex_lock(&stlock);
+	for(pp = &threads; *pp; pp = &(*pp)->next)
+	{
+		if(*pp != t) continue;
+		*pp = t->next;
+		break;
+	}
+	if(gone)
+	{
+		for(i = 0; i < STAT_TYPES; i++)
+			for(j = 0; j < STAT_STAGES; j++) hist_merge(&gone->h[i][j], &t->h[i][j]);
+		free(t);
+	}
+	else gone = t;
+	pthread_mutex_unlock(&stlock);
+	self = NULL;
+}
+
+/**
+ * @brief 创建stkey
+ */
+static void stat_key_create(void)
+{
+	pthread_key_create(&stkey, stat_thread_exit);
+}
+
+/**
+ * @brief 取得本线程的统计，第一次使用的时候分配
+ * @return 本线程的统计；没有内存，返回NULL（不统计）
+ */
+static tmis_stat_thread_t *stat_thread(void)
+{
+	if(self) return self;
+
+	pthread_once(&stonce, stat_key_create);
+	self = (tmis_stat_thread_t *)calloc(1, sizeof(tmis_stat_thread_t));
+	if(self == NULL) return NULL;
+	self->type = STAT_OTHER;
+
+	pthread_mutex_lock(&stlock);
+	self->next = threads;
+	threads = self;
+	pthread_mutex_unlock(&stlock);
+	pthread_setspecific(stkey, self);
+
+	return self;
+}
+
+/**
+ * @brief 数据包类型对应的请求的种类
+ * @param flag 数据包类型
+ * @return 请求的种类
+ */
+static int stat_type(char flag)
+{
+	switch(flag)
+	{
+	case FLAG_KEY_AGREEMENT: return STAT_KEY_AGREEMENT;
+	case FLAG_RECORD: return STAT_RECORD;
+	case FLAG_RECORD_PAGE: return STAT_PAGE;
+	case FLAG_RECORD_SINCE: return STAT_SINCE;
+	case FLAG_RECORD_BATCH: return STAT_BATCH;
+	case FLAG_RECORD_STREAM: return STAT_STREAM;
+	default: return STAT_OTHER;
+	}
+}
+
+/**
+ * @brief 当前时间（单调时钟，纳秒）
+ * @return 当前时间
+ */
+unsigned long long stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * @brief 本线程开始处理一个数据包：之后的stat_add记在这种请求下面；线程池排队的时间也在这里记下
+ * @param flag 数据包类型
+ * @return 开始处理的时间
+ */
+unsigned long long stat_begin(char flag)
+{
+	tmis_stat_thread_t *t = stat_thread();
+	unsigned long long now = stat_now();
+
+	if(t == NULL) return now;
+
+	t->type = stat_type(flag);
+	t->started = now;
+	/* 排队的时候还不知道是什么请求，算在这次读到的第一个数据包上 */
+	if(t->queued)
+	{
+		hist_add(&t->h[t->type][STAGE_QUEUE], t->queued);
+		t->queued = 0;
+	}
+
+	return now;
+}
+
+/**
+ * @brief 本线程接着处理一个已经开始了的请求（异步查询完成以后在另一个线程中回复）
+ * @param type 请求的种类（stat_current的返回值）
+ */
+void stat_resume(int type)
+{
+	tmis_stat_thread_t *t = stat_thread();
+
+	if(t && type >= 0 && type < STAT_TYPES) t->type = type;
+}
+
+/**
+ * @brief 本线程当前处理的请求的种类
+ * @return 请求的种类
+ */
+int stat_current(void)
+{
+	return self ? self->type : STAT_OTHER;
+}
+
+/**
+ * @brief 本线程当前处理的请求开始处理的时间
+ * @return stat_begin返回的时间
+ */
+unsigned long long stat_started(void)
+{
+	return self ? self->started : stat_now();
+}
+
+/**
+ * @brief 记下这个线程接着处理的数据在线程池的队列中等了多久，下一次stat_begin的时候算在那种请求下面
+ * @param ns 等待的时间（纳秒），0表示没有排队
+ */
+void stat_queued(unsigned long long ns)
+{
+	tmis_stat_thread_t *t = stat_thread();
+
+	if(t) t->queued = ns;
+}
+
+/**
+ * @brief 记录当前请求的一个阶段
+ * @param stage 阶段
+ * @param start 这个阶段开始的时间（stat_now）
+ * @return 当前时间，可以作为下一个阶段开始的时间
+ */
+unsigned long long stat_add(int stage, unsigned long long start)
+{
+	tmis_stat_thread_t *t = stat_thread();
+	unsigned long long now = stat_now();
+
+	if(t && now >= start) hist_add(&t->h[t->type][stage], now - start);
+
+	return now;
+}
+
+/**
+ * @brief 收到SIGUSR1：请求输出统计结果（信号处理函数中只设置标志）
+ * @param sig 信号
+ */
+void stat_signal(int sig)
+{
+	(void)sig;
+	stdump = 1;
+}
+
+/**
+ * @brief 有没有请求输出统计结果（清除请求）
+ * @return 有，返回1；否则，返回0
+ */
+int stat_pending(void)
+{
+	if(!stdump) return 0;
+
+	stdump = 0;
+	return 1;
+}
+
+/**
+ * @brief 把所有线程的统计结果加起来，每种请求的每个阶段输出一行：次数、平均值、各个百分位数、最大值（微秒）
+ * @param log 日志文件句柄
+ * @note 其它线程一边在记录，读到的是差不多同一时刻的值（计数只增加，64位的读写是完整的）
+ */
+void stat_dump(FILE *log)
+{
+	tmis_hist_t *h = (tmis_hist_t *)malloc(sizeof(tmis_hist_t));
+	tmis_stat_thread_t *t;
+	int i, j;
+
+	if(h == NULL) return;
+
+	write_log(log,"latency of each stage since the server started (us):\n");
+	for(i = 0; i < STAT_TYPES; i++)
+	{
+		for(j = 0; j < STAT_STAGES; j++)
+		{
+			memset(h, 0, sizeof(tmis_hist_t));
+			pthread_mutex_lock(&stlock);
+			for(t = threads; t; t = t->next) hist_merge(h, &t->h[i][j]);
+			if(gone) hist_merge(h, &gone->h[i][j]);
+			pthread_mutex_unlock(&stlock);
+			if(h->count == 0) continue;
+
+			write_log(log,"stat %-6s %-7s count %llu avg %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+					type_names[i],stage_names[j],h->count,h->sum / 1000.0 / h->count,
+					hist_percentile(h,50) / 1000.0,hist_percentile(h,90) / 1000.0,
+					hist_percentile(h,99) / 1000.0,hist_percentile(h,99.9) / 1000.0,h->max / 1000.0);
+		}
+	}
+
+	free(h);
+}
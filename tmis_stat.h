@@ -0,0 +1,132 @@
+/**
+* @file       tmis_stat.h
+* @brief      tmis服务器处理请求的各个阶段的耗时统计
+* @details    每种请求（按数据包类型）的每个阶段一个对数分段的直方图（HDR的做法：每个2的幂次再等分成几段，
+*             相对误差固定），单位是纳秒（单调时钟）；每个线程记在自己的直方图里，不用锁也没有原子操作，
+*             输出的时候把所有线程的加起来；收到SIGUSR1的时候由第0个事件循环把统计结果写到日志中，服务器不用停
+* @author     项斌
+* @date       2018/08/30
+* @version    1.0
+*/
+
+#ifndef __TMIS_STAT_H__
+#define __TMIS_STAT_H__
+
+#include <stdio.h>
+
+/** 直方图每个2的幂次等分的段数（2的STAT_SUB_BITS次方），相对误差不超过1/8 */
+#define STAT_SUB_BITS 3
+#define STAT_SUB (1 << STAT_SUB_BITS)
+
+/** 直方图能区分的最大值是2的STAT_MAX_EXP次方纳秒（约68秒），更大的都算在最后一段 */
+#define STAT_MAX_EXP 36
+
+/** 直方图的段数：小于2*STAT_SUB的每个值一段，之后每个2的幂次STAT_SUB段 */
+#define STAT_BUCKETS ((STAT_MAX_EXP - STAT_SUB_BITS + 2) * STAT_SUB)
+
+/** 请求的种类 */
+enum stat_type
+{
+	STAT_KEY_AGREEMENT,                 ///< 密钥协商（FLAG_KEY_AGREEMENT）
+	STAT_RECORD,                        ///< 获取医疗记录（FLAG_RECORD）
+	STAT_PAGE,                          ///< 分页获取（FLAG_RECORD_PAGE）
+	STAT_SINCE,                         ///< 增量获取（FLAG_RECORD_SINCE）
+	STAT_BATCH,                         ///< 批量获取（FLAG_RECORD_BATCH）
+	STAT_STREAM,                        ///< 流式获取（FLAG_RECORD_STREAM）
+	STAT_OTHER,                         ///< 其它
+	STAT_TYPES
+};
+
+/** 处理请求的阶段 */
+enum stat_stage
+{
+	STAGE_QUEUE,                        ///< 在线程池的队列中等待
+	STAGE_PAIRING,                      ///< 密钥协商：读a.param、初始化pairing
+	STAGE_ECC,                          ///< 密钥协商：椭圆曲线的计算、解密、校验用户
+	STAGE_CACHE,                        ///< 查医疗记录缓存
+	STAGE_DBWAIT,                       ///< 等待连接池的连接（包括检查、重新连接）
+	STAGE_QUERY,                        ///< 查询存储、取出记录（异步查询是从提交到查询结束）
+	STAGE_ENCRYPT,                      ///< AES加密
+	STAGE_HEX,                          ///< 转换成十六进制
+	STAGE_SEND,                         ///< 发送回复（epoll模式的writev，io_uring模式由事件循环发送，不统计）
+	STAGE_TOTAL,                        ///< 整个请求：从开始处理到回复加入发送队列
+	STAT_STAGES
+};
+
+/** 一个直方图 */
+typedef struct tmis_hist
+{
+	unsigned long long count;           ///< 记录的次数
+	unsigned long long sum;             ///< 总耗时（纳秒）
+	unsigned long long max;             ///< 最长的一次
+	unsigned long long b[STAT_BUCKETS]; ///< 每一段的次数
+}tmis_hist_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 当前时间（单调时钟，纳秒）
+ * @return 当前时间
+ */
+unsigned long long stat_now(void);
+
+/**
+ * @brief 本线程开始处理一个数据包：之后的stat_add记在这种请求下面；线程池排队的时间也在这里记下
+ * @param flag 数据包类型
+ * @return 开始处理的时间
+ */
+unsigned long long stat_begin(char flag);
+
+/**
+ * @brief 本线程接着处理一个已经开始了的请求（异步查询完成以后在另一个线程中回复）
+ * @param type 请求的种类（stat_current的返回值）
+ */
+void stat_resume(int type);
+
+/**
+ * @brief 本线程当前处理的请求的种类
+ * @return 请求的种类
+ */
+int stat_current(void);
+
+/**
+ * @brief 本线程当前处理的请求开始处理的时间
+ * @return stat_begin返回的时间
+ */
+unsigned long long stat_started(void);
+
+/**
+ * @brief 记下这个线程接着处理的数据在线程池的队列中等了多久，下一次stat_begin的时候算在那种请求下面
+ * @param ns 等待的时间（纳秒），0表示没有排队
+ */
+void stat_queued(unsigned long long ns);
+
+/**
+ * @brief 记录当前请求的一个阶段
+ * @param stage 阶段
+ * @param start 这个阶段开始的时间（stat_now）
+ * @return 当前时间，可以作为下一个阶段开始的时间
+ */
+unsigned long long stat_add(int stage, unsigned long long start);
+
+/**
+ * @brief 收到SIGUSR1：请求输出统计结果（信号处理函数中只设置标志）
+ * @param sig 信号
+ */
+void stat_signal(int sig);
+
+/**
+ * @brief 有没有请求输出统计结果（清除请求）
+ * @return 有，返回1；否则，返回0
+ */
+int stat_pending(void);
+
+/**
+ * @brief 把所有线程的统计结果加起来，每种请求的每个阶段输出一行：次数、平均值、各个百分位数、最大值（微秒）
+ * @param log 日志文件句柄
+ */
+void stat_dump(FILE *log);
+
+
+#endif
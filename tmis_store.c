@@ -0,0 +1,287 @@
+/**
+* @file       tmis_store.c
+* @brief      tmis服务器的医疗记录存储
+* @details    按uid取出医疗记录的接口，启动时选择一种存储：MySQL（连接池，见tmis_db.h），
+*             或者嵌入的SQLite数据库文件（不需要数据库服务，边缘部署、压力测试用）；
+*             处理线程只通过这里的函数取记录，不关心记录存在哪里
+* @author     项斌
+* @date       2018/08/28
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "tmis_conf.h"
+#include "tmis_db.h"
+#include "tmis_store.h"
+#include "tmis_stat.h"
+
+static FILE *stlog;                    ///< 日志文件句柄
+
+/////////////////////////////////    MySQL存储     ///////////////////////////////
+
+/**
+ * @brief MySQL存储：建立连接池（异步模式同时启动数据库事件循环）
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+static int mysql_store_open(FILE *log)
+{
+	if(db_pool_init(tmisconf.db_pool,tmisconf.db_wait,log) != 0) return -1;
+#ifdef TMIS_DB_ASYNC
+	/* 医疗记录的查询由数据库事件循环执行，不占用处理线程 */
+	if(db_async_init() != 0) return -1;
+#endif
+
+	return 0;
+}
+
+/**
+ * @brief MySQL存储：从连接池取一个连接，执行预处理语句
+ * @param uid 用户id
+ * @param page 分页查询的条件，NULL表示全部
+ * @return 成功，返回连接；失败，返回NULL
+ */
+static void *mysql_store_query(const char *uid, const tmis_store_page_t *page)
+{
+	int ret;
+	unsigned long long t = stat_now();
+	tmis_dbconn_t *db = db_get();
+	stat_add(STAGE_DBWAIT,t);
+	if(db == NULL)
+	{
+		write_log(stlog,"no database connection for the records of the user %s\n",uid);
+		return NULL;
+	}
+
+	ret = page ? db_record_page(db,uid,page->from,page->to,page->skip,page->limit) : db_record_query(db,uid);
+	if(ret != 0)
+	{
+		write_log(stlog,"func db_record_query error:%d\n",ret);
+		db_record_end(db);
+		db_put(db,1);
+		return NULL;
+	}
+
+	return db;
+}
+
+/**
+ * @brief MySQL存储：从连接池取一个连接，一条语句查询多个用户
+ * @param uids 各个用户id
+ * @param n 用户的数量
+ * @return 成功，返回连接；失败，返回NULL
+ */
+static void *mysql_store_batch(const char **uids, int n)
+{
+	int ret;
+	unsigned long long t = stat_now();
+	tmis_dbconn_t *db = db_get();
+	stat_add(STAGE_DBWAIT,t);
+	if(db == NULL)
+	{
+		write_log(stlog,"no database connection for the records of %d users\n",n);
+		return NULL;
+	}
+	ret = db_record_batch(db,uids,n);
+	if(ret != 0)
+	{
+		write_log(stlog,"func db_record_batch error:%d\n",ret);
+		db_record_end(db);
+		db_put(db,1);
+		return NULL;
+	}
+
+	return db;
+}
+
+/**
+ * @brief MySQL存储：取出下一条医疗记录
+ * @param cur 连接
+ * @param fields 传出参数，每个字段
+ * @param lens 传出参数，每个字段的长度
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+static int mysql_store_next(void *cur, char **fields, unsigned long *lens)
+{
+	return db_record_next((tmis_dbconn_t *)cur,fields,lens);
+}
+
+/**
+ * @brief MySQL存储：丢弃没有取出的结果，连接还给连接池
+ * @param cur 连接
+ * @param error 连接出错了
+ */
+static void mysql_store_end(void *cur, int error)
+{
+	db_record_end((tmis_dbconn_t *)cur);
+	db_put((tmis_dbconn_t *)cur,error);
+}
+
+#ifdef TMIS_DB_ASYNC
+/**
+ * @brief MySQL存储：交给数据库事件循环异步查询
+ * @param uid 用户id
+ * @param page 分页查询的条件，NULL表示全部
+ * @param row 取出一条记录的回调
+ * @param done 查询结束的回调
+ * @param arg 回调的参数
+ * @return 提交成功，返回0；失败，返回-1
+ */
+static int mysql_store_async(const char *uid, const tmis_store_page_t *page, store_row_cb row, store_done_cb done, void *arg)
+{
+	if(page == NULL) return db_async_record(uid,NULL,NULL,0,0,row,done,arg);
+
+	return db_async_record(uid,page->from,page->to,page->skip,page->limit,row,done,arg);
+}
+#endif
+
+/** MySQL存储 */
+static const tmis_store_ops_t store_mysql =
+{
+	.name = "mysql",
+	.open = mysql_store_open,
+	.query = mysql_store_query,
+	.batch = mysql_store_batch,
+	.next = mysql_store_next,
+	.end = mysql_store_end,
+#ifdef TMIS_DB_ASYNC
+	.async = mysql_store_async,
+#else
+	.async = NULL,
+#endif
+	.close = db_pool_destroy,
+};
+
+/** 所有的存储，下标是存储的种类 */
+static const tmis_store_ops_t *stores[] =
+{
+	[STORE_MYSQL] = &store_mysql,
+	[STORE_SQLITE] = &store_sqlite,
+};
+
+static const tmis_store_ops_t *store = &store_mysql;   ///< 当前使用的存储
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 根据名字取得存储的种类
+ * @param name 名字：mysql，sqlite
+ * @return 存储的种类；没有这种存储，返回-1
+ */
+int store_type(const char *name)
+{
+	int i;
+
+	for(i = 0; i < (int)(sizeof(stores) / sizeof(stores[0])); i++)
+		if(strcmp(stores[i]->name,name) == 0) return i;
+
+	return -1;
+}
+
+/**
+ * @brief 打开存储（启动时调用一次）
+ * @param type 存储的种类
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+int store_open(int type, FILE *log)
+{
+	if(type < 0 || type >= (int)(sizeof(stores) / sizeof(stores[0]))) return -1;
+
+	stlog = log;
+	store = stores[type];
+	if(store->open(log) != 0) return -1;
+
+	write_log(log,"the records are stored in %s\n",store->name);
+
+	return 0;
+}
+
+/**
+ * @brief 当前使用的存储的名字
+ * @return 名字
+ */
+const char *store_name(void)
+{
+	return store->name;
+}
+
+/**
+ * @brief 开始查询一个用户的医疗记录，之后用store_next逐条取出，最后store_end
+ * @param uid 用户id
+ * @param page 分页查询的条件（按记录时间从新到旧）；NULL表示取出全部的记录（不排序）
+ * @return 成功，返回游标；失败（已经记录了日志），返回NULL
+ */
+void *store_query(const char *uid, const tmis_store_page_t *page)
+{
+	return store->query(uid,page);
+}
+
+/**
+ * @brief 一条语句开始查询多个用户的医疗记录，之后同样用store_next逐条取出（每条记录后面多一个字段uid），最后store_end
+ * @param uids 各个用户id
+ * @param n 用户的数量，1到STORE_BATCH_MAX
+ * @return 成功，返回游标；失败（已经记录了日志），返回NULL
+ */
+void *store_query_batch(const char **uids, int n)
+{
+	if(n <= 0 || n > STORE_BATCH_MAX) return NULL;
+	return store->batch(uids,n);
+}
+
+/**
+ * @brief 取出下一条医疗记录
+ * @param cur store_query、store_query_batch返回的游标
+ * @param fields 传出参数，每个字段（STORE_FIELDS个，批量查询STORE_BATCH_FIELDS个；以'\0'结尾，下一次调用以前有效）
+ * @param lens 传出参数，每个字段的长度
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+int store_next(void *cur, char **fields, unsigned long *lens)
+{
+	return store->next(cur,fields,lens);
+}
+
+/**
+ * @brief 结束查询，释放游标
+ * @param cur store_query返回的游标
+ * @param error 查询的过程中存储出错了
+ */
+void store_end(void *cur, int error)
+{
+	store->end(cur,error);
+}
+
+/**
+ * @brief 当前使用的存储是否支持异步查询
+ * @return 支持，返回1；否则，返回0
+ */
+int store_can_async(void)
+{
+	return store->async != NULL;
+}
+
+/**
+ * @brief 异步查询一个用户的医疗记录（store_can_async返回1的时候才能用）
+ * @param uid 用户id（复制一份，调用者不用保留）
+ * @param page 分页查询的条件（复制一份）；NULL表示取出全部的记录
+ * @param row 取出一条记录的回调
+ * @param done 查询结束的回调，提交成功以后一定会调用一次
+ * @param arg 回调的参数
+ * @return 提交成功，返回0；失败（不会调用回调），返回-1
+ */
+int store_async(const char *uid, const tmis_store_page_t *page, store_row_cb row, store_done_cb done, void *arg)
+{
+	if(store->async == NULL) return -1;
+
+	return store->async(uid,page,row,done,arg);
+}
+
+/**
+ * @brief 关闭存储
+ */
+void store_close(void)
+{
+	store->close();
+}
@@ -0,0 +1,158 @@
+/**
+* @file       tmis_store.h
+* @brief      tmis服务器的医疗记录存储
+* @details    按uid取出医疗记录的接口，启动时选择一种存储：MySQL（连接池，见tmis_db.h），
+*             或者嵌入的SQLite数据库文件（不需要数据库服务，边缘部署、压力测试用）；
+*             处理线程只通过这里的函数取记录，不关心记录存在哪里
+* @author     项斌
+* @date       2018/08/28
+* @version    1.0
+*/
+
+#ifndef __TMIS_STORE_H__
+#define __TMIS_STORE_H__
+
+#include <stdio.h>
+
+/** 存储的种类 */
+#define STORE_MYSQL  0
+#define STORE_SQLITE 1
+
+/** 医疗记录的字段数：rtime,rdoctor,rsymptom,rfeedback（各种存储一样） */
+#define STORE_FIELDS 4
+
+/** 一次查询多个用户的时候每条记录的字段数：后面多一个uid */
+#define STORE_BATCH_FIELDS (STORE_FIELDS + 1)
+
+/** 一次查询最多的用户数量 */
+#define STORE_BATCH_MAX 64
+
+/** 记录时间的长度："YYYY-MM-DD HH:MM:SS" */
+#define STORE_RTIME_LEN 19
+
+/** 分页查询没有给出时间范围时的边界 */
+#define STORE_RTIME_MIN "1000-01-01 00:00:00"
+#define STORE_RTIME_MAX "9999-12-31 23:59:59"
+
+/** 分页查询：按记录时间从新到旧，取出时间范围[from,to]内跳过最新的skip条以后的limit条 */
+typedef struct tmis_store_page
+{
+	char from[STORE_RTIME_LEN + 1];     ///< 最早的记录时间（包括）
+	char to[STORE_RTIME_LEN + 1];       ///< 最晚的记录时间（包括）
+	unsigned int skip;                  ///< 跳过最新的多少条
+	unsigned int limit;                 ///< 最多取出多少条
+}tmis_store_page_t;
+
+/**
+ * @brief 异步查询取出一条记录的回调
+ * @param arg store_async的参数
+ * @param fields 每个字段（以'\0'结尾，下一次调用以前有效）
+ * @param lens 每个字段的长度
+ * @return 返回0，继续；否则，结束这次查询（查询的结果为失败）
+ */
+typedef int (*store_row_cb)(void *arg, char **fields, unsigned long *lens);
+
+/**
+ * @brief 异步查询结束的回调（不能阻塞，耗时的处理交给线程池）
+ * @param arg store_async的参数
+ * @param status 返回0，成功；否则，失败
+ */
+typedef void (*store_done_cb)(void *arg, int status);
+
+/** 一种存储的实现 */
+typedef struct tmis_store_ops
+{
+	const char *name;                                                 ///< 名字（--store的值）
+	int (*open)(FILE *log);                                           ///< 启动时打开，配置从tmisconf取
+	void *(*query)(const char *uid, const tmis_store_page_t *page);   ///< 开始查询一个用户的记录（page为NULL表示全部），返回游标
+	void *(*batch)(const char **uids, int n);                         ///< 一条语句查询多个用户的记录，返回游标
+	int (*next)(void *cur, char **fields, unsigned long *lens);       ///< 取出下一条记录
+	void (*end)(void *cur, int error);                                ///< 结束查询
+	int (*async)(const char *uid, const tmis_store_page_t *page, store_row_cb row, store_done_cb done, void *arg);  ///< 异步查询，NULL表示不支持
+	void (*close)(void);                                              ///< 关闭
+}tmis_store_ops_t;
+
+/** SQLite存储，见tmis_sqlite.c */
+extern const tmis_store_ops_t store_sqlite;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 根据名字取得存储的种类
+ * @param name 名字：mysql，sqlite
+ * @return 存储的种类；没有这种存储，返回-1
+ */
+int store_type(const char *name);
+
+/**
+ * @brief 打开存储（启动时调用一次）
+ * @param type 存储的种类
+ * @param log 日志文件句柄
+ * @return 成功，返回0；失败，返回-1
+ */
+int store_open(int type, FILE *log);
+
+/**
+ * @brief 当前使用的存储的名字
+ * @return 名字
+ */
+const char *store_name(void);
+
+/**
+ * @brief 开始查询一个用户的医疗记录，之后用store_next逐条取出，最后store_end
+ * @param uid 用户id
+ * @param page 分页查询的条件（按记录时间从新到旧）；NULL表示取出全部的记录（不排序）
+ * @return 成功，返回游标；失败（已经记录了日志），返回NULL
+ */
+void *store_query(const char *uid, const tmis_store_page_t *page);
+
+/**
+ * @brief 一条语句开始查询多个用户的医疗记录，之后同样用store_next逐条取出（每条记录后面多一个字段uid），最后store_end
+ * @param uids 各个用户id
+ * @param n 用户的数量，1到STORE_BATCH_MAX
+ * @return 成功，返回游标；失败（已经记录了日志），返回NULL
+ * @note 同一个用户的记录连在一起（按uid、记录时间排序），用户之间的顺序不一定和uids一样
+ */
+void *store_query_batch(const char **uids, int n);
+
+/**
+ * @brief 取出下一条医疗记录
+ * @param cur store_query、store_query_batch返回的游标
+ * @param fields 传出参数，每个字段（STORE_FIELDS个，批量查询STORE_BATCH_FIELDS个；以'\0'结尾，下一次调用以前有效）
+ * @param lens 传出参数，每个字段的长度
+ * @return 1，取出了一条记录；0，没有了；-1，出错
+ */
+int store_next(void *cur, char **fields, unsigned long *lens);
+
+/**
+ * @brief 结束查询，释放游标
+ * @param cur store_query返回的游标
+ * @param error 查询的过程中存储出错了
+ */
+void store_end(void *cur, int error);
+
+/**
+ * @brief 当前使用的存储是否支持异步查询
+ * @return 支持，返回1；否则，返回0
+ */
+int store_can_async(void);
+
+/**
+ * @brief 异步查询一个用户的医疗记录（store_can_async返回1的时候才能用）
+ * @param uid 用户id（复制一份，调用者不用保留）
+ * @param page 分页查询的条件（复制一份）；NULL表示取出全部的记录
+ * @param row 取出一条记录的回调
+ * @param done 查询结束的回调，提交成功以后一定会调用一次
+ * @param arg 回调的参数
+ * @return 提交成功，返回0；失败（不会调用回调），返回-1
+ */
+int store_async(const char *uid, const tmis_store_page_t *page, store_row_cb row, store_done_cb done, void *arg);
+
+/**
+ * @brief 关闭存储
+ */
+void store_close(void);
+
+
+#endif
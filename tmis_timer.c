@@ -0,0 +1,261 @@
+/**
+* @file       tmis_timer.c
+* @brief      tmis服务器的连接超时
+* @details    每个事件循环一个哈希时间轮，由timerfd每秒驱动一次：空闲超时、密钥协商超时、数据包接收超时；
+*             连接有数据的时候只更新连接中的时间戳（O(1)），时间轮转到的时候再按时间戳重新计算到期时间
+* @author     项斌
+* @date       2018/08/25
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "tmis_conf.h"
+#include "tmis_conn.h"
+#include "tmis_timer.h"
+
+/** 全局变量，每种超时关闭的连接数量 */
+unsigned long timer_reaped[TIMEOUT_KINDS];
+
+/** 由时间轮的节点得到连接 */
+#define timer_conn(t) ((tmis_conn_t *)((char *)(t) - offsetof(tmis_conn_t, timer)))
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 当前时间（单调时钟，秒）
+ * @return 当前时间
+ */
+long timer_now(void)
+{
+	struct timespec ts;
+
+	/* 粗精度的时钟不用进内核，精度对秒级的超时足够了 */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (long)ts.tv_sec;
+}
+
+/**
+ * @brief 超时种类的名字
+ * @param kind 超时的种类
+ * @return 名字
+ */
+const char *timer_kind_name(int kind)
+{
+	static const char *names[TIMEOUT_KINDS] = {"idle", "handshake", "read"};
+
+	if(kind < 0 || kind >= TIMEOUT_KINDS) return "unknown";
+	return names[kind];
+}
+
+/**
+ * @brief 按连接中的时间戳计算最早的到期时间（调用者持有c->lock）
+ * @param c 连接
+ * @param kind 传出参数，最早到期的超时种类
+ * @return 到期时间；没有任何超时，返回-1
+ */
+static long conn_deadline(tmis_conn_t *c, int *kind)
+{
+	long deadline = -1, t;
+
+	if(tmisconf.idle_timeout > 0)
+	{
+		deadline = c->active + tmisconf.idle_timeout;
+		*kind = TIMEOUT_IDLE;
+	}
+	if(tmisconf.handshake_timeout > 0 && !c->keyed)
+	{
+		t = c->opened + tmisconf.handshake_timeout;
+		if(deadline < 0 || t < deadline)
+		{
+			deadline = t;
+			*kind = TIMEOUT_HANDSHAKE;
+		}
+	}
+	if(tmisconf.read_timeout > 0 && c->rstart > 0)
+	{
+		t = c->rstart + tmisconf.read_timeout;
+		if(deadline < 0 || t < deadline)
+		{
+			deadline = t;
+			*kind = TIMEOUT_READ;
+		}
+	}
+
+	return deadline;
+}
+
+/**
+ * @brief 下一次检查连接的时间（调用者持有c->lock）
+ * @param c 连接
+ * @param deadline conn_deadline计算的到期时间，-1表示没有
+ * @param now 当前时间
+ * @return 下一次检查的时间；不需要再检查，返回-1
+ * @note 不完整的数据包随时可能开始等待，它的到期时间会比现在的早，所以没有在等待的时候
+ *       至少每隔一个接收超时检查一次
+ */
+static long conn_next_check(tmis_conn_t *c, long deadline, long now)
+{
+	if(tmisconf.read_timeout > 0 && c->rstart == 0)
+	{
+		long t = now + tmisconf.read_timeout;
+		if(deadline < 0 || t < deadline) return t;
+	}
+
+	return deadline;
+}
+
+/**
+ * @brief 节点放入到期时间对应的槽（调用者持有w->lock）
+ * @param w 时间轮
+ * @param t 节点
+ */
+static void slot_insert(tmis_wheel_t *w, tmis_timer_t *t)
+{
+	tmis_timer_t **head = &w->slots[t->expire & (TW_SLOTS - 1)];
+
+	t->prev = NULL;
+	t->next = *head;
+	if(*head) (*head)->prev = t;
+	*head = t;
+	t->wheel = w;
+}
+
+/**
+ * @brief 节点从槽中取出（调用者持有w->lock）
+ * @param w 时间轮
+ * @param t 节点
+ */
+static void slot_remove(tmis_wheel_t *w, tmis_timer_t *t)
+{
+	if(t->prev) t->prev->next = t->next;
+	else w->slots[t->expire & (TW_SLOTS - 1)] = t->next;
+	if(t->next) t->next->prev = t->prev;
+	t->prev = NULL;
+	t->next = NULL;
+	t->wheel = NULL;
+}
+
+/**
+ * @brief 初始化时间轮，创建每秒触发一次的timerfd
+ * @note 没有配置任何超时的时候连接不加入时间轮，timerfd照样创建：
+ *       退出信号、耗时统计、推迟关闭的套接字都由事件循环每秒一次处理
+ * @param w 时间轮
+ * @return 成功，返回0；失败，返回-1
+ */
+int wheel_init(tmis_wheel_t *w)
+{
+	struct itimerspec its;
+
+	memset(w, 0, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	w->cur = timer_now();
+	w->tfd = -1;
+	w->on = (tmisconf.idle_timeout > 0 || tmisconf.handshake_timeout > 0 || tmisconf.read_timeout > 0);
+
+	w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(w->tfd < 0) return -1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = 1;
+	its.it_interval.tv_sec = 1;
+	if(timerfd_settime(w->tfd, 0, &its, NULL) != 0)
+	{
+		close(w->tfd);
+		w->tfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 新的连接加入时间轮
+ * @param w 时间轮
+ * @param c 连接
+ */
+void wheel_add(tmis_wheel_t *w, tmis_conn_t *c)
+{
+	int kind;
+
+	if(!w->on) return;
+
+	pthread_mutex_lock(&w->lock);
+	pthread_mutex_lock(&c->lock);
+	c->timer.expire = conn_next_check(c, conn_deadline(c, &kind), c->opened);
+	pthread_mutex_unlock(&c->lock);
+	if(c->timer.expire >= 0) slot_insert(w, &c->timer);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @brief 连接关闭的时候从时间轮中删除
+ * @param c 连接
+ * @note 不能持有c->lock调用（加锁的顺序是先时间轮、后连接）
+ */
+void wheel_del(tmis_conn_t *c)
+{
+	tmis_wheel_t *w = c->timer.wheel;
+	if(NULL==w) return;
+
+	pthread_mutex_lock(&w->lock);
+	if(c->timer.wheel == w) slot_remove(w, &c->timer);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @brief timerfd触发以后转动时间轮：到期的连接重新计算到期时间，真的超时了就调用reap
+ * @param w 时间轮
+ * @param reap 超时的处理函数（持有连接的锁时调用，只能做shutdown之类的操作，不能关闭连接）
+ * @return 超时的连接数量
+ */
+int wheel_tick(tmis_wheel_t *w, void (*reap)(tmis_conn_t *c, int kind))
+{
+	long now = timer_now(), deadline, n;
+	tmis_timer_t *t, *next;
+	tmis_conn_t *c;
+	int kind = TIMEOUT_IDLE, reaped = 0;
+
+	pthread_mutex_lock(&w->lock);
+
+	/* 事件循环被耽误了很久的话，所有的槽都检查一遍就够了 */
+	n = now - w->cur;
+	if(n > TW_SLOTS) n = TW_SLOTS;
+	for(; n > 0; n--)
+	{
+		w->cur++;
+		for(t = w->slots[w->cur & (TW_SLOTS - 1)]; t; t = next)
+		{
+			next = t->next;
+			/* 同一个槽中还没有到期的（下一圈的） */
+			if(t->expire > now) continue;
+
+			/* 没有超时的连接（期间有数据），按新的时间戳放到后面的槽中 */
+			c = timer_conn(t);
+			pthread_mutex_lock(&c->lock);
+			deadline = conn_deadline(c, &kind);
+			slot_remove(w, t);
+			if(deadline >= 0 && deadline <= now)
+			{
+				__sync_fetch_and_add(&timer_reaped[kind], 1);
+				reaped++;
+				reap(c, kind);
+			}
+			else
+			{
+				t->expire = conn_next_check(c, deadline, now);
+				if(t->expire >= 0) slot_insert(w, t);
+			}
+			pthread_mutex_unlock(&c->lock);
+		}
+	}
+	w->cur = now;
+
+	pthread_mutex_unlock(&w->lock);
+
+	return reaped;
+}
@@ -0,0 +1,101 @@
+/**
+* @file       tmis_timer.h
+* @brief      tmis服务器的连接超时
+* @details    每个事件循环一个哈希时间轮，由timerfd每秒驱动一次：空闲超时、密钥协商超时、数据包接收超时；
+*             连接有数据的时候只更新连接中的时间戳（O(1)），时间轮转到的时候再按时间戳重新计算到期时间
+* @author     项斌
+* @date       2018/08/25
+* @version    1.0
+*/
+
+#ifndef __TMIS_TIMER_H__
+#define __TMIS_TIMER_H__
+
+#include <pthread.h>
+
+/** 时间轮的槽数（2的幂），每个槽1秒 */
+#define TW_SLOTS 512
+
+/** 超时的种类：空闲（没有收发数据） */
+#define TIMEOUT_IDLE 0
+
+/** 超时的种类：连接以后没有完成密钥协商 */
+#define TIMEOUT_HANDSHAKE 1
+
+/** 超时的种类：一个数据包接收了一部分以后没有收完 */
+#define TIMEOUT_READ 2
+
+/** 超时的种类数 */
+#define TIMEOUT_KINDS 3
+
+struct tmis_conn;
+struct tmis_wheel;
+
+/** 连接在时间轮中的节点，放在连接中 */
+typedef struct tmis_timer
+{
+	struct tmis_timer *prev;            ///< 槽中的上一个节点
+	struct tmis_timer *next;            ///< 槽中的下一个节点
+	struct tmis_wheel *wheel;           ///< 所在的时间轮，NULL表示不在时间轮中
+	long expire;                        ///< 到期时间（秒）
+}tmis_timer_t;
+
+/** 时间轮，属于一个事件循环 */
+typedef struct tmis_wheel
+{
+	pthread_mutex_t lock;               ///< 时间轮的锁（连接可能在处理线程中关闭）
+	tmis_timer_t *slots[TW_SLOTS];      ///< 槽，到期时间对TW_SLOTS取余
+	long cur;                           ///< 已经处理到的时间（秒）
+	int tfd;                            ///< 每秒触发一次的timerfd，没有配置超时也有（事件循环的定时工作都靠它）
+	int on;                             ///< 配置了超时，连接才加入时间轮
+}tmis_wheel_t;
+
+/** 全局变量，每种超时关闭的连接数量 */
+extern unsigned long timer_reaped[TIMEOUT_KINDS];
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 当前时间（单调时钟，秒）
+ * @return 当前时间
+ */
+long timer_now(void);
+
+/**
+ * @brief 超时种类的名字
+ * @param kind 超时的种类
+ * @return 名字
+ */
+const char *timer_kind_name(int kind);
+
+/**
+ * @brief 初始化时间轮，配置了超时的时候创建每秒触发一次的timerfd
+ * @param w 时间轮
+ * @return 成功，返回0；失败，返回-1
+ */
+int wheel_init(tmis_wheel_t *w);
+
+/**
+ * @brief 新的连接加入时间轮
+ * @param w 时间轮
+ * @param c 连接
+ */
+void wheel_add(tmis_wheel_t *w, struct tmis_conn *c);
+
+/**
+ * @brief 连接关闭的时候从时间轮中删除
+ * @param c 连接
+ */
+void wheel_del(struct tmis_conn *c);
+
+/**
+ * @brief timerfd触发以后转动时间轮：到期的连接重新计算到期时间，真的超时了就调用reap
+ * @param w 时间轮
+ * @param reap 超时的处理函数（持有连接的锁时调用，只能做shutdown之类的操作，不能关闭连接）
+ * @return 超时的连接数量
+ */
+int wheel_tick(tmis_wheel_t *w, void (*reap)(struct tmis_conn *c, int kind));
+
+
+#endif
@@ -0,0 +1,345 @@
+/**
+* @file       tmis_uring.c
+* @brief      io_uring的简单封装
+* @details    不依赖liburing，直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用：
+*             提交队列、完成队列以及接收数据用的provided buffer ring
+* @author     项斌
+* @date       2018/08/23
+* @version    1.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "tmis_uring.h"
+
+/** 用户态和内核共享的队列指针，读写的时候需要内存屏障 */
+#define load_acquire(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/////////////////////////////////    函数实现     ///////////////////////////////
+
+/**
+ * @brief 创建io_uring
+ * @param u io_uring
+ * @param entries 提交队列的长度
+ * @return 成功，返回0；失败（例如内核不支持），返回-1，errno为错误原因
+ */
+int uring_init(tmis_uring_t *u, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = -1;
+
+	/* 完成队列大一些，多次接收、多个连接的完成事件不会溢出 */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+
+	u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(u->fd < 0) return -1;
+
+	/* 需要单次mmap同时映射提交队列和完成队列的内核（5.4以后都支持） */
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(u->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+	u->cq_size = u->sq_size;
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ptr == MAP_FAILED)
+	{
+		close(u->fd);
+		return -1;
+	}
+	u->cq_ptr = u->sq_ptr;
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED)
+	{
+		munmap(u->sq_ptr, u->sq_size);
+		close(u->fd);
+		return -1;
+	}
+
+	sq = (char *)u->sq_ptr;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_local_tail = *u->sq_tail;
+
+	cq = (char *)u->cq_ptr;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+/**
+ * @brief 销毁io_uring
+ * @param u io_uring
+ */
+void uring_exit(tmis_uring_t *u)
+{
+	if(u->fd < 0) return;
+
+	if(u->br) munmap(u->br, u->nbufs * sizeof(struct io_uring_buf));
+	free(u->bufs);
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+/**
+ * @brief 注册接收数据用的缓存环
+ * @param u io_uring
+ * @param bgid 缓存组的编号
+ * @param nbufs 缓存的块数（2的幂）
+ * @param buf_size 每一块缓存的大小
+ * @return 成功，返回0；失败，返回-1
+ */
+int uring_setup_buffers(tmis_uring_t *u, unsigned short bgid, unsigned nbufs, unsigned buf_size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+	int err;
+
+	/* 缓存环必须按页对齐 */
+	u->br = (struct io_uring_buf_ring *)mmap(NULL, nbufs * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(u->br == MAP_FAILED)
+	{
+		u->br = NULL;
+		return -1;
+	}
+
+	do
+	{
+		u->bufs = (char *)malloc((size_t)nbufs * buf_size);
+		if(NULL==u->bufs) break;
+		u->nbufs = nbufs;
+		u->buf_size = buf_size;
+		u->bgid = bgid;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (unsigned long)u->br;
+		reg.ring_entries = nbufs;
+		reg.bgid = bgid;
+		/* 5.19以前的内核不支持缓存环 */
+		if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) break;
+
+		/* 所有的缓存都交给内核 */
+		for(i=0;i<nbufs;i++)
+		{
+			struct io_uring_buf *b = &u->br->bufs[i];
+			b->addr = (unsigned long)(u->bufs + (size_t)i * buf_size);
+			b->len = buf_size;
+			b->bid = (unsigned short)i;
+		}
+		store_release(&u->br->tail, (unsigned short)nbufs);
+
+		return 0;
+	}while(0);
+
+	/* 失败：释放缓存环和缓存，uring_exit不会再释放一次 */
+	err = errno;
+	munmap(u->br, nbufs * sizeof(struct io_uring_buf));
+	u->br = NULL;
+	free(u->bufs);
+	u->bufs = NULL;
+	u->nbufs = 0;
+	errno = err;
+
+	return -1;
+}
+
+/**
+ * @brief 检查内核是否支持这些操作（IORING_REGISTER_PROBE）
+ * @param u io_uring
+ * @param ops 操作码
+ * @param nops 操作码的个数
+ * @return 都支持，返回0；有不支持的（或者内核不支持探测），返回-1，errno为ENOSYS
+ */
+int uring_probe_ops(tmis_uring_t *u, const unsigned char *ops, int nops)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	int i, ret = 0;
+
+	probe = (struct io_uring_probe *)calloc(1, len);
+	if(probe == NULL) return -1;
+
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) < 0) ret = -1;
+	for(i = 0; i < nops && ret == 0; i++)
+	{
+		if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) ret = -1;
+	}
+	free(probe);
+	if(ret != 0) errno = ENOSYS;
+
+	return ret;
+}
+
+/**
+ * @brief 检查内核是否支持从缓存环多次接收（IORING_RECV_MULTISHOT，6.0以后）：
+ *        在一对本地套接字上真的提交一次，需要先uring_setup_buffers；
+ *        结束的完成事件留在完成队列中，测试用的io_uring用完以后直接销毁
+ * @param u io_uring
+ * @return 支持，返回0；不支持，返回-1，errno为原因
+ */
+int uring_probe_recv_multishot(tmis_uring_t *u)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2], ret = -1, err = ENOSYS;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) != 0) return -1;
+
+	do
+	{
+		sqe = uring_get_sqe(u);
+		if(sqe == NULL) break;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sv[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = u->bgid;
+		sqe->user_data = 1;
+
+		if(write(sv[1], "x", 1) != 1 || uring_submit_and_wait(u, 1) < 0)
+		{
+			err = errno;
+			break;
+		}
+		cqe = uring_peek_cqe(u);
+		if(cqe == NULL) break;
+
+		/* 不支持的内核马上返回-EINVAL；支持的话收到数据并且还会继续接收 */
+		if(cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)) ret = 0;
+		else if(cqe->res < 0) err = -cqe->res;
+		if(cqe->flags & IORING_CQE_F_BUFFER) uring_buf_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		uring_cqe_seen(u);
+	}while(0);
+
+	close(sv[0]);
+	close(sv[1]);
+	if(ret != 0) errno = err;
+
+	return ret;
+}
+
+/**
+ * @brief 取得缓存环中的一块缓存
+ * @param u io_uring
+ * @param bid 缓存的编号（完成队列元素的flags >> IORING_CQE_BUFFER_SHIFT）
+ * @return 缓存的地址
+ */
+char *uring_buf(tmis_uring_t *u, unsigned bid)
+{
+	return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/**
+ * @brief 数据取走以后，把缓存还给缓存环
+ * @param u io_uring
+ * @param bid 缓存的编号
+ */
+void uring_buf_recycle(tmis_uring_t *u, unsigned bid)
+{
+	unsigned short tail = u->br->tail;
+	struct io_uring_buf *b = &u->br->bufs[tail & (u->nbufs - 1)];
+
+	b->addr = (unsigned long)uring_buf(u, bid);
+	b->len = u->buf_size;
+	b->bid = (unsigned short)bid;
+	store_release(&u->br->tail, (unsigned short)(tail + 1));
+}
+
+/**
+ * @brief 取得一个空闲的提交队列元素，提交队列满了就先提交
+ * @param u io_uring
+ * @return 提交队列元素（已经清零）；失败，返回NULL
+ */
+struct io_uring_sqe *uring_get_sqe(tmis_uring_t *u)
+{
+	unsigned head = load_acquire(u->sq_head);
+	struct io_uring_sqe *sqe;
+
+	if(u->sq_local_tail - head >= u->sq_entries)
+	{
+		if(uring_submit_and_wait(u, 0) < 0) return NULL;
+		head = load_acquire(u->sq_head);
+		if(u->sq_local_tail - head >= u->sq_entries) return NULL;
+	}
+
+	sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+	u->sq_array[u->sq_local_tail & u->sq_mask] = u->sq_local_tail & u->sq_mask;
+	u->sq_local_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/**
+ * @brief 把所有准备好的提交队列元素一次提交给内核，并等待至少wait_nr个完成事件
+ * @param u io_uring
+ * @param wait_nr 等待的完成事件数量，0表示不等待
+ * @return 成功，返回提交的数量；失败，返回-1
+ */
+int uring_submit_and_wait(tmis_uring_t *u, unsigned wait_nr)
+{
+	unsigned submit = u->sq_local_tail - *u->sq_tail;
+	int ret;
+
+	store_release(u->sq_tail, u->sq_local_tail);
+	if(submit == 0 && wait_nr == 0) return 0;
+
+	do
+	{
+		ret = (int)syscall(__NR_io_uring_enter, u->fd, submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}while(ret < 0 && errno == EINTR && wait_nr == 0);
+
+	return ret;
+}
+
+/**
+ * @brief 取得完成队列的下一个元素
+ * @param u io_uring
+ * @return 完成队列元素；没有，返回NULL
+ */
+struct io_uring_cqe *uring_peek_cqe(tmis_uring_t *u)
+{
+	unsigned head = *u->cq_head;
+
+	if(head == load_acquire(u->cq_tail)) return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+/**
+ * @brief 处理完一个完成队列元素以后，把它还给内核
+ * @param u io_uring
+ */
+void uring_cqe_seen(tmis_uring_t *u)
+{
+	store_release(u->cq_head, *u->cq_head + 1);
+}
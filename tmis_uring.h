@@ -0,0 +1,139 @@
+/**
+* @file       tmis_uring.h
+* @brief      io_uring的简单封装
+* @details    不依赖liburing，直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用：
+*             提交队列、完成队列以及接收数据用的provided buffer ring
+* @author     项斌
+* @date       2018/08/23
+* @version    1.0
+*/
+
+#ifndef __TMIS_URING_H__
+#define __TMIS_URING_H__
+
+#include <linux/io_uring.h>
+
+/** 一个io_uring实例 */
+typedef struct tmis_uring
+{
+	int fd;                             ///< io_uring的文件描述符
+
+	/* 提交队列 */
+	unsigned *sq_head;                  ///< 提交队列的队首（内核修改）
+	unsigned *sq_tail;                  ///< 提交队列的队尾（用户修改）
+	unsigned *sq_array;                 ///< 提交队列的下标数组
+	unsigned sq_mask;                   ///< 提交队列的掩码
+	unsigned sq_entries;                ///< 提交队列的长度
+	unsigned sq_local_tail;             ///< 还没有提交给内核的队尾
+	struct io_uring_sqe *sqes;          ///< 提交队列的元素数组
+
+	/* 完成队列 */
+	unsigned *cq_head;                  ///< 完成队列的队首（用户修改）
+	unsigned *cq_tail;                  ///< 完成队列的队尾（内核修改）
+	unsigned cq_mask;                   ///< 完成队列的掩码
+	struct io_uring_cqe *cqes;          ///< 完成队列的元素数组
+
+	void *sq_ptr;                       ///< 提交队列mmap的地址
+	void *cq_ptr;                       ///< 完成队列mmap的地址
+	size_t sq_size;                     ///< 提交队列mmap的大小
+	size_t cq_size;                     ///< 完成队列mmap的大小
+	size_t sqes_size;                   ///< 提交队列元素数组mmap的大小
+
+	/* 接收数据的缓存（provided buffer ring），内核接收数据的时候自己挑选一块 */
+	struct io_uring_buf_ring *br;       ///< 缓存环
+	char *bufs;                         ///< 缓存
+	unsigned nbufs;                     ///< 缓存的块数（2的幂）
+	unsigned buf_size;                  ///< 每一块缓存的大小
+	unsigned short bgid;                ///< 缓存组的编号
+}tmis_uring_t;
+
+
+/////////////////////////////////  函数相关定义         //////////////////////////////////////
+
+/**
+ * @brief 创建io_uring
+ * @param u io_uring
+ * @param entries 提交队列的长度
+ * @return 成功，返回0；失败（例如内核不支持），返回-1，errno为错误原因
+ */
+int uring_init(tmis_uring_t *u, unsigned entries);
+
+/**
+ * @brief 销毁io_uring
+ * @param u io_uring
+ */
+void uring_exit(tmis_uring_t *u);
+
+/**
+ * @brief 注册接收数据用的缓存环
+ * @param u io_uring
+ * @param bgid 缓存组的编号
+ * @param nbufs 缓存的块数（2的幂）
+ * @param buf_size 每一块缓存的大小
+ * @return 成功，返回0；失败，返回-1
+ */
+int uring_setup_buffers(tmis_uring_t *u, unsigned short bgid, unsigned nbufs, unsigned buf_size);
+
+/**
+ * @brief 检查内核是否支持这些操作（IORING_REGISTER_PROBE）
+ * @param u io_uring
+ * @param ops 操作码
+ * @param nops 操作码的个数
+ * @return 都支持，返回0；有不支持的（或者内核不支持探测），返回-1，errno为ENOSYS
+ */
+int uring_probe_ops(tmis_uring_t *u, const unsigned char *ops, int nops);
+
+/**
+ * @brief 检查内核是否支持从缓存环多次接收（IORING_RECV_MULTISHOT，6.0以后）：
+ *        在一对本地套接字上真的提交一次，需要先uring_setup_buffers；
+ *        结束的完成事件留在完成队列中，测试用的io_uring用完以后直接销毁
+ * @param u io_uring
+ * @return 支持，返回0；不支持，返回-1，errno为原因
+ */
+int uring_probe_recv_multishot(tmis_uring_t *u);
+
+/**
+ * @brief 取得缓存环中的一块缓存
+ * @param u io_uring
+ * @param bid 缓存的编号（完成队列元素的flags >> IORING_CQE_BUFFER_SHIFT）
+ * @return 缓存的地址
+ */
+char *uring_buf(tmis_uring_t *u, unsigned bid);
+
+/**
+ * @brief 数据取走以后，把缓存还给缓存环
+ * @param u io_uring
+ * @param bid 缓存的编号
+ */
+void uring_buf_recycle(tmis_uring_t *u, unsigned bid);
+
+/**
+ * @brief 取得一个空闲的提交队列元素，提交队列满了就先提交
+ * @param u io_uring
+ * @return 提交队列元素（已经清零）；失败，返回NULL
+ */
+struct io_uring_sqe *uring_get_sqe(tmis_uring_t *u);
+
+/**
+ * @brief 把所有准备好的提交队列元素一次提交给内核，并等待至少wait_nr个完成事件
+ * @param u io_uring
+ * @param wait_nr 等待的完成事件数量，0表示不等待
+ * @return 成功，返回提交的数量；失败，返回-1
+ */
+int uring_submit_and_wait(tmis_uring_t *u, unsigned wait_nr);
+
+/**
+ * @brief 取得完成队列的下一个元素
+ * @param u io_uring
+ * @return 完成队列元素；没有，返回NULL
+ */
+struct io_uring_cqe *uring_peek_cqe(tmis_uring_t *u);
+
+/**
+ * @brief 处理完一个完成队列元素以后，把它还给内核
+ * @param u io_uring
+ */
+void uring_cqe_seen(tmis_uring_t *u);
+
+
+#endif
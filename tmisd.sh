@@ -9,6 +9,7 @@
 #		stop, 	关闭tmis服务器 ok
 #		state,	查看tmis服务器状态 ok
 #		log,	查看tmis服务器生成的日志  ok
+#		stats,	查看tmis服务器各种请求各个阶段的耗时统计 ok
 #		clear,	清除tmis服务器生成的日志 ok
 #       help,	查看帮助 ok
 #
@@ -17,7 +18,7 @@
 # 以下是各个功能的实现 ok
 #### 检查参数   ####
 if [ "$#" != "1" ]; then
-	echo -e "\033[32m使用方法：$0 start|stop|state|log|clear|help\033[0m"
+	echo -e "\033[32m使用方法：$0 start|stop|state|log|stats|clear|help\033[0m"
 	exit -1
 fi
 
@@ -38,6 +39,7 @@ if [ "$1" = "help" ]; then
 	echo -e "stop\t关闭tmis服务器" 
 	echo -e "state\t查看tmis服务器状态" 
 	echo -e "log\t查看tmis服务器生成的日志 " 
+	echo -e "stats\t查看tmis服务器各种请求各个阶段的耗时统计（微秒）" 
 	echo -e "clear\t清除tmis服务器生成的日志" 
 	echo -e "help\t查看帮助" 
 	echo -e "\033[32m===========================================================================\033[0m"
@@ -45,6 +47,29 @@ if [ "$1" = "help" ]; then
 fi
 
 
+### 查看耗时统计：SIGUSR1让服务器把统计结果写到日志中（1秒以内），再显示最后一次的结果
+if [ "$1" = "stats" ]; then
+	echo -e "\033[32m===========================================================================\033[1m"
+
+	line=`ps -ajx | grep "./tmis_server" | sed -n "/?/="`   # 获得行号
+	if [ -z "$line" ]; then
+		echo "tmis服务器没有启动..."
+	else
+		pid=`ps -ajx | grep "./tmis_server" | sed -n ${line}p | awk '{print $2}'`  # 获得pid
+		kill -USR1 ${pid}
+		sleep 2
+		# 最后一次输出的统计结果
+		start=`grep -n "latency of each stage" tmis.log | tail -1 | cut -d: -f1`
+		if [ -n "$start" ]; then
+			tail -n +${start} tmis.log | grep "latency of each stage\|stat "
+		fi
+	fi
+
+	echo -e "\033[32m===========================================================================\033[0m"
+	exit 1
+fi
+
+
 ### 清除tmis服务器生成的日志
 if [ "$1" = "clear" ]; then
 	echo -e "\033[32m===========================================================================\033[1m"
@@ -90,10 +115,20 @@ if [ "$1" = "stop" ]; then
 	# echo $line
 	pid=`ps -ajx | grep "./tmis_server" | sed -n ${line}p | awk '{print $2}'`  # 获得pid
 	# echo $pid
-	`kill -9 ${pid}`
+	# 先用SIGTERM让服务器把缓冲区中的日志写完再退出，5秒以后还没有退出的话再kill -9
+	kill ${pid}
+	ret=$?
+	for i in 1 2 3 4 5; do
+		kill -0 ${pid} 2>/dev/null || break
+		sleep 1
+	done
+	if kill -0 ${pid} 2>/dev/null; then
+		kill -9 ${pid}
+		ret=$?
+	fi
 	
 	# 错误判断
-	if [ "$?" != "0" ]; then
+	if [ "$ret" != "0" ]; then
 		echo "关闭tmis服务器出错!"
 	else
 		echo "关闭tmis服务器成功"
@@ -115,7 +150,7 @@ if [ "$1" = "start" ]; then
 	if [ -z "$line" ]; then
 		echo "tmis服务器没有启动..."
 		process_path="./tmis_server"
-		$process_path &
+		$process_path $TMIS_OPTS &
 		echo "tmis服务器正在启动..."
 		
 		line2=`ps -ajx | grep "./tmis_server" | sed -n "/?/="`   # 再次获得行号
@@ -134,5 +169,5 @@ fi
 
 ### 处理输入一个参数，但是这个参数不是正常使用的参数情况
 ### 也就是处理输入1个错误参数的情况
-echo -e "\033[32m使用方法：$0 start|stop|state|log|clear|help\033[0m"
+echo -e "\033[32m使用方法：$0 start|stop|state|log|stats|clear|help\033[0m"
 exit -1